@@ -781,6 +781,20 @@ file.
 
 I<val_global_opt> field:  I<gopt.retry>
 
+=item I<cache_max_size>
+
+This field is equivalent to the I<cache-max-size> option in a
+B<dnsval.conf> file.  
+
+I<val_global_opt> field:  I<gopt.cache_max_size>
+
+=item I<verify_threads>
+
+This field is equivalent to the I<verify-threads> option in a
+B<dnsval.conf> file.  
+
+I<val_global_opt> field:  I<gopt.verify_threads>
+
 
 =back
 
@@ -617,6 +617,12 @@ pval_create_context_ex(optref)
     gopt.timeout = (SvOK(*timeout_svp) ? SvIV(*timeout_svp) : VAL_POL_GOPT_UNSET);
     SV **retry_svp = hv_fetch((HV*)SvRV(optref), "retry", 5, 1);
     gopt.retry = (SvOK(*retry_svp) ? SvIV(*retry_svp) : VAL_POL_GOPT_UNSET);
+    SV **cache_max_size_svp = hv_fetch((HV*)SvRV(optref), "cache_max_size", 14, 1);
+    gopt.cache_max_size = (SvOK(*cache_max_size_svp) ?
+            (long)SvIV(*cache_max_size_svp) : VAL_POL_GOPT_UNSET);
+    SV **verify_threads_svp = hv_fetch((HV*)SvRV(optref), "verify_threads", 14, 1);
+    gopt.verify_threads = (SvOK(*verify_threads_svp) ?
+            SvIV(*verify_threads_svp) : VAL_POL_GOPT_UNSET);
 
     opt.vc_gopt = &gopt;
 
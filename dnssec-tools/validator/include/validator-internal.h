@@ -29,6 +29,9 @@ extern          "C" {
 #define VAL_LOG_TARGET "VAL_LOG_TARGET"
 #define QUERY_BAD_CACHE_THRESHOLD 5
 #define QUERY_BAD_CACHE_TTL 60
+#define QUERY_HASH_INIT_SIZE 256        /* initial query cache buckets */
+#define QUERY_REAP_INTERVAL 60          /* recheck period for live queries */
+#define QUERY_EVICT_MAX_SKIP 64         /* busy queries passed over per eviction */
 #define MAX_ALIAS_CHAIN_LENGTH 10       /* max length of cname/dname chain */
 #define MAX_GLUE_FETCH_DEPTH 10         /* max length of glue dependency chain */
 #define IPADDR_STRING_MAX 128
@@ -44,6 +47,24 @@ extern          "C" {
 #define LOG_DEBUG VAL_LOG_DEBUG 
 #endif
 
+/*
+ * Cheap test for whether a message at the given level could reach any log
+ * target; use it to skip formatting arguments that only feed val_log().
+ */
+extern int      val_log_max_level;
+#define VAL_LOG_WOULD_LOG(level) ((level) <= val_log_max_level)
+
+/*
+ * Convert name_n to presentation format in name_p, but only if it
+ * is going to be logged at the given level.
+ */
+#define VAL_LOG_NTOP(level, name_n, name_p, len) do {               \
+    if (!VAL_LOG_WOULD_LOG(level))                                  \
+        (name_p)[0] = '\0';                                         \
+    else if (ns_name_ntop((name_n), (name_p), (len)) == -1)         \
+        snprintf((name_p), (len), "unknown/error");                 \
+} while (0)
+
 /*
  * Query states 
  *
@@ -263,7 +284,19 @@ extern          "C" {
 
         struct val_digested_auth_chain *qc_ans;
         struct val_digested_auth_chain *qc_proof;
+
+        /* 
+         * Linkage within the context query cache: the full list,
+         * the hash bucket, and the position in the expiry heap 
+         */
+        u_int32_t       qc_hash;
+        u_int32_t       qc_exp_key;
+        size_t          qc_exp_index;
+        struct val_query_chain *qc_hnext;
+        struct val_query_chain *qc_prev;
         struct val_query_chain *qc_next;
+        /* bytes charged against the cache budget */
+        size_t          qc_bytes;
     };
 
     typedef struct policy_entry {
@@ -273,6 +306,25 @@ extern          "C" {
         struct policy_entry *next;
     } policy_entry_t;
 
+    /*
+     * Reverse-label index over the policy entries of one kind.
+     * Each node is one label of a zone name, counting from the
+     * root, and holds what the entries for that zone say in
+     * the order in which they appear in the policy list.
+     */
+    struct policy_index_val {
+        long            exp_ttl;
+        int             value;
+        struct policy_index_val *next;
+    };
+
+    struct policy_index {
+        u_char         *label;  /* lower case, with its length byte */
+        struct policy_index **children; /* sorted by label */
+        size_t          nchildren;
+        struct policy_index_val *vals;
+    };
+
     typedef struct libval_policy_definition{
         char *keyword;
         char *zone;
@@ -404,15 +456,28 @@ extern          "C" {
         char   *base_dnsval_conf;
         struct dnsval_list *dnsval_l;
         policy_entry_t **e_pol;
+        struct policy_index **e_pol_idx;
         val_global_opt_t *g_opt;
         struct val_log *val_log_targets;
         
-        /* Query cache */
+        /* Query cache, most recently used first */
         struct val_query_chain *q_list;
+        struct val_query_chain *q_tail;
+        /* hash index over q_list, keyed on {name, type, class} */
+        struct val_query_chain **q_hash;
+        size_t q_hash_size;
+        size_t q_count;
+        /* min-heap of q_list elements ordered by qc_exp_key */
+        struct val_query_chain **q_exp;
+        size_t q_exp_size;
 
 #ifndef VAL_NO_ASYNC
         /* in flight async queries */
         val_async_status       *as_list;
+#ifndef VAL_NO_THREADS
+        /* resolver thread, see val_async_thread_start() */
+        struct val_async_thread_s *as_thread;
+#endif
 #endif
 
         /* default flags that the context applies automatically */
@@ -458,8 +523,44 @@ extern          "C" {
         val_async_event_cb             val_as_result_cb;
         void                          *val_as_cb_user_ctx;
 
+#ifndef VAL_NO_THREADS
+        /* for requests handed to the resolver thread */
+        unsigned int                  val_as_submit_flags;
+        int                           val_as_event;
+#endif
+
         struct val_async_status_s     *val_as_next;
     };
+
+#ifndef VAL_NO_THREADS
+    /*
+     * cancel one (vac_as != NULL) or all of the requests of a
+     * resolver thread
+     */
+    struct val_async_cancel_s {
+        val_async_status              *vac_as;
+        unsigned int                  vac_flags;
+        struct val_async_cancel_s     *vac_next;
+    };
+
+    /*
+     * The submitted, cancelled and completed lists are pushed to by
+     * any thread without taking a lock, and are only ever taken as a
+     * whole by the thread that consumes them.
+     */
+    struct val_async_thread_s {
+        pthread_t                     at_tid;
+        unsigned int                  at_flags;
+        volatile int                  at_stop;
+
+        val_async_status * volatile   at_submitted;
+        struct val_async_cancel_s * volatile at_cancelled;
+        val_async_status * volatile   at_completed;
+
+        int                           at_wake[2];   /* wakes the thread */
+        int                           at_notify[2]; /* at_completed set */
+    };
+#endif
 #endif
 
     struct val_rrset_digested {
@@ -490,6 +591,7 @@ extern          "C" {
         u_char *rrs_zonecut_n;
         u_char rrs_cred;       /* SR_CRED_... */
         u_char rrs_ans_kind;   /* SR_ANS_... */
+        u_char rrs_ref;        /* recently used, for cache eviction */
         struct rrset_rec *rrs_next;
     };
 
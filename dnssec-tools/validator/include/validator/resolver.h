@@ -182,6 +182,14 @@ struct expected_arrival {
     struct timeval  ea_next_try;
     struct timeval  ea_cancel_time;
     struct expected_arrival *ea_next;
+    void           *ea_waiter;  /* epoll set watching ea_socket, if any */
+    time_t          ea_socket_birth; /* creation of reusable UDP socket */
+    int             ea_socket_uses;  /* queries sent over that socket */
+    struct res_io_tcp_conn *ea_tcp_conn; /* shared TCP connection, if any */
+    struct res_io_tcp_read *ea_tcp_read; /* partly read TCP response */
+    struct timeval  ea_sent;    /* last send to the current address */
+    int             ea_sends;   /* sends to the current address */
+    long            ea_rto;     /* ms to wait after the last send */
 };
 
 /*
@@ -207,6 +215,7 @@ void            res_cancel(int *transaction_id);
 int             res_nsfallback(int transaction_id,
                                struct timeval *closest_event,
                                struct name_server *server);
+void            res_infra_lame_server(struct name_server *server);
 
 void            wait_for_res_data(fd_set * pending_desc,
                                   struct timeval *closest_event);
@@ -246,6 +255,7 @@ int             label_bytes_cmp(const u_char * field1, size_t length1,
 int             labelcmp(const u_char * name1, const u_char * name2, 
                         size_t label_cnt);
 int             namecmp(const u_char * name1, const u_char * name2);
+u_int32_t       wire_name_hash(const u_char * field);
 
     int             res_map_srio_to_sr(int val);
 
@@ -314,6 +324,13 @@ res_async_ea_is_using_stream(struct expected_arrival *ea);
 int
 res_async_ea_isset(struct expected_arrival *ea, fd_set *fds);
 
+int
+res_async_ea_ready(struct expected_arrival *ea);
+
+int             res_io_get_pollfd(void);
+void            res_io_clear_pollfd(void);
+void            res_io_rearm_pollfd(void);
+
 void res_switch_all_to_tcp_tid(int trans_id);
 
 /*
@@ -135,8 +135,17 @@ typedef struct val_global_opt {
     int proto;
     int timeout;
     int retry;
+    long cache_max_size;
+    int verify_threads;
 } val_global_opt_t;
 
+/* cache memory usage, see val_cache_get_stats() */
+typedef struct val_cache_stats {
+    size_t        vcs_resident;   /* bytes currently held in the caches */
+    size_t        vcs_budget;     /* upper limit, 0 if unlimited */
+    unsigned long vcs_evictions;  /* entries dropped to stay within budget */
+} val_cache_stats_t;
+
 /*
  * Dynamic policy can be configured with the following flags
  * in vc_polflags
@@ -145,6 +154,7 @@ typedef struct val_global_opt {
 #define CTX_DYN_POL_RES_OVR  0x00000002
 #define CTX_DYN_POL_GLO_OVR  0x00000004
 #define CTX_DYN_POL_RES_NRD  0x00000008
+#define CTX_DYN_POL_PRIVATE  0x00000010
 
 typedef struct val_context_opt {
     unsigned int vc_qflags;
@@ -178,6 +188,8 @@ typedef struct val_context_opt {
 #define GOPT_PROTO "proto"
 #define GOPT_TIMEOUT "timeout"
 #define GOPT_RETRY "retry"
+#define GOPT_CACHE_MAX_SIZE_STR "cache-max-size"
+#define GOPT_VERIFY_THREADS_STR "verify-threads"
 /* 
  * The following policies are deprecated. 
  * They are defined here for backwards compatibility
@@ -432,6 +444,12 @@ typedef struct val_context_opt {
                                     fd_set *fds,
                                     int *num_fds,
                                     struct timeval *timeout);
+    int             val_async_getfd(val_context_t *context);
+
+    /*
+     * check flags
+     */
+#define VAL_AS_CHECK_POLLFD            0x00000001 /* val_async_getfd() fired */
 
     /*
      * cancellation flags
@@ -445,6 +463,18 @@ typedef struct val_context_opt {
     int             val_async_cancel_all(val_context_t *context, unsigned int flags);
     unsigned int    val_async_getflags(val_async_status *as);
 
+    /*
+     * resolver thread flags
+     */
+#define VAL_AS_THREAD_QUEUE_COMPLETIONS 0x00000001 /* callbacks are made by
+                                                     val_async_thread_complete */
+
+    int             val_async_thread_start(val_context_t *context,
+                                           unsigned int flags);
+    int             val_async_thread_stop(val_context_t *context);
+    int             val_async_thread_complete(val_context_t *context);
+    int             val_async_thread_getfd(val_context_t *context);
+
     /*
      * backwards compatibility
      */
@@ -517,6 +547,11 @@ typedef struct val_context_opt {
     int             val_remove_valpolicy(val_context_t *context, 
                                       val_policy_handle_t *pol);
     struct name_server *val_get_nameservers(val_context_t *ctx);
+    /*
+     * from val_cache.c 
+     */
+    int             val_cache_set_budget(size_t max_bytes);
+    int             val_cache_get_stats(val_cache_stats_t *stats);
     /*
      * from val_x_query.c 
      */
@@ -0,0 +1,614 @@
+/*
+ * Copyright 2013 SPARTA, Inc.  All rights reserved.
+ * See the COPYING file distributed with this software for details.
+ */
+/*
+ * Infrastructure cache: what we have learned about the name server
+ * addresses that we send queries to.
+ *
+ * For each address a smoothed round trip time (SRTT) and its variance
+ * (RTTVAR) are kept as in RFC 6298, from responses to queries that
+ * were sent only once. A timeout doubles the SRTT of the address.
+ * The SRTT is used to decide which server (and which address of a
+ * server) to try first, and SRTT + 4 * RTTVAR is how long to wait
+ * for a response before trying again.
+ *
+ * An address that has not been heard from for a while drifts back
+ * towards RES_INFRA_INIT_SRTT, so that a server that once timed out
+ * is tried again eventually, and what we know of an address is
+ * forgotten altogether after RES_INFRA_LIFETIME seconds.
+ *
+ * We also remember, for a limited time, the largest EDNS0 buffer size
+ * that got through to an address after a larger one went unanswered,
+ * whether its UDP responses keep coming back truncated (in which case
+ * queries go straight to TCP), and whether it turned out to be lame
+ * or could not be reached at all (in which case it is tried last).
+ */
+#include "validator-internal.h"
+
+#include "res_support.h"
+#include "res_infra.h"
+
+#define RES_INFRA_BUCKETS       256
+
+struct res_infra_entry {
+    struct sockaddr_storage ri_addr;
+    long            ri_srtt;
+    long            ri_rttvar;      /* -1 until the first sample */
+    time_t          ri_updated;     /* of the SRTT */
+    time_t          ri_used;        /* of anything in the entry */
+    long            ri_edns0_size;  /* largest size that worked, or -1 */
+    long            ri_edns0_failed;        /* smallest size that didn't */
+    time_t          ri_edns0_until;
+    int             ri_tc_count;
+    time_t          ri_tcp_until;
+    time_t          ri_lame_until;
+    time_t          ri_unreach_until;
+    struct res_infra_entry *ri_next;
+};
+
+static struct res_infra_entry *infra_table[RES_INFRA_BUCKETS];
+static int      infra_count = 0;
+#ifdef VAL_NO_THREADS
+#define pthread_mutex_lock(x)
+#define pthread_mutex_unlock(x)
+#else
+static pthread_mutex_t infra_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static u_int32_t
+res_infra_hash(struct sockaddr_storage *addr)
+{
+    const u_char   *p;
+    size_t          len, i;
+    u_int32_t       h;
+
+    if (addr->ss_family == AF_INET) {
+        struct sockaddr_in *sa = (struct sockaddr_in *) addr;
+        p = (const u_char *) &sa->sin_addr;
+        len = sizeof(sa->sin_addr);
+        h = sa->sin_port;
+#ifdef VAL_IPV6
+    } else if (addr->ss_family == AF_INET6) {
+        struct sockaddr_in6 *sa = (struct sockaddr_in6 *) addr;
+        p = (const u_char *) &sa->sin6_addr;
+        len = sizeof(sa->sin6_addr);
+        h = sa->sin6_port;
+#endif
+    } else
+        return 0;
+
+    for (i = 0; i < len; i++)
+        h = h * 31 + p[i];
+    return h % RES_INFRA_BUCKETS;
+}
+
+static int
+res_infra_addr_match(struct sockaddr_storage *a, struct sockaddr_storage *b)
+{
+    if (a->ss_family != b->ss_family)
+        return 0;
+
+    if (a->ss_family == AF_INET) {
+        struct sockaddr_in *sa = (struct sockaddr_in *) a;
+        struct sockaddr_in *sb = (struct sockaddr_in *) b;
+        return (sa->sin_port == sb->sin_port &&
+                !memcmp(&sa->sin_addr, &sb->sin_addr, sizeof(sa->sin_addr)));
+#ifdef VAL_IPV6
+    } else if (a->ss_family == AF_INET6) {
+        struct sockaddr_in6 *sa = (struct sockaddr_in6 *) a;
+        struct sockaddr_in6 *sb = (struct sockaddr_in6 *) b;
+        return (sa->sin6_port == sb->sin6_port &&
+                !memcmp(&sa->sin6_addr, &sb->sin6_addr,
+                        sizeof(sa->sin6_addr)));
+#endif
+    }
+    return 0;
+}
+
+/*
+ * Drop all entries that have outlived RES_INFRA_LIFETIME.
+ * Must be called with infra_mutex held.
+ */
+static void
+res_infra_purge(time_t now)
+{
+    struct res_infra_entry **rip, *ri;
+    int             i;
+
+    for (i = 0; i < RES_INFRA_BUCKETS; i++) {
+        rip = &infra_table[i];
+        while ((ri = *rip) != NULL) {
+            if (now - ri->ri_used > RES_INFRA_LIFETIME) {
+                *rip = ri->ri_next;
+                FREE(ri);
+                --infra_count;
+            } else
+                rip = &ri->ri_next;
+        }
+    }
+}
+
+/*
+ * Find the entry for addr, optionally creating it. Expired entries
+ * in the same bucket are dropped along the way. Must be called with
+ * infra_mutex held.
+ */
+static struct res_infra_entry *
+res_infra_find(struct sockaddr_storage *addr, time_t now, int create)
+{
+    struct res_infra_entry **rip, *ri;
+    u_int32_t       h = res_infra_hash(addr);
+
+    rip = &infra_table[h];
+    while ((ri = *rip) != NULL) {
+        if (now - ri->ri_used > RES_INFRA_LIFETIME) {
+            *rip = ri->ri_next;
+            FREE(ri);
+            --infra_count;
+            continue;
+        }
+        if (res_infra_addr_match(&ri->ri_addr, addr))
+            return ri;
+        rip = &ri->ri_next;
+    }
+
+    if (!create)
+        return NULL;
+
+    if (infra_count >= RES_INFRA_MAX_ENTRIES) {
+        res_infra_purge(now);
+        if (infra_count >= RES_INFRA_MAX_ENTRIES)
+            return NULL;
+    }
+
+    ri = (struct res_infra_entry *) MALLOC(sizeof(struct res_infra_entry));
+    if (ri == NULL)
+        return NULL;
+    memcpy(&ri->ri_addr, addr, sizeof(ri->ri_addr));
+    ri->ri_srtt = RES_INFRA_INIT_SRTT;
+    ri->ri_rttvar = -1;
+    ri->ri_updated = now;
+    ri->ri_used = now;
+    ri->ri_edns0_size = -1;
+    ri->ri_edns0_failed = -1;
+    ri->ri_edns0_until = 0;
+    ri->ri_tc_count = 0;
+    ri->ri_tcp_until = 0;
+    ri->ri_lame_until = 0;
+    ri->ri_unreach_until = 0;
+    ri->ri_next = infra_table[h];
+    infra_table[h] = ri;
+    ++infra_count;
+
+    return ri;
+}
+
+/*
+ * The SRTT of an entry, moved halfway back to RES_INFRA_INIT_SRTT
+ * for every RES_INFRA_DECAY seconds that it has not been updated.
+ */
+static long
+res_infra_decayed_srtt(struct res_infra_entry *ri, time_t now)
+{
+    long            halvings = (now - ri->ri_updated) / RES_INFRA_DECAY;
+
+    if (halvings <= 0)
+        return ri->ri_srtt;
+    if (halvings >= 16)
+        return RES_INFRA_INIT_SRTT;
+    return RES_INFRA_INIT_SRTT +
+        (ri->ri_srtt - RES_INFRA_INIT_SRTT) / (1L << halvings);
+}
+
+static long
+res_infra_srtt_locked(struct sockaddr_storage *addr, time_t now)
+{
+    struct res_infra_entry *ri = res_infra_find(addr, now, 0);
+
+    return ri ? res_infra_decayed_srtt(ri, now) : RES_INFRA_INIT_SRTT;
+}
+
+/*
+ * What to order addresses by: the SRTT, pushed past that of every
+ * working address if the address is lame or unreachable
+ */
+static long
+res_infra_order_key(struct sockaddr_storage *addr, time_t now)
+{
+    struct res_infra_entry *ri = res_infra_find(addr, now, 0);
+    long            key;
+
+    if (ri == NULL)
+        return RES_INFRA_INIT_SRTT;
+    key = res_infra_decayed_srtt(ri, now);
+    if (ri->ri_lame_until > now || ri->ri_unreach_until > now)
+        key += RES_INFRA_MAX_SRTT;
+    return key;
+}
+
+/* a name server is as good as its best address */
+static long
+res_infra_ns_key(struct name_server *ns, time_t now)
+{
+    if (ns->ns_number_of_addresses < 1)
+        return RES_INFRA_INIT_SRTT;
+    return res_infra_order_key(ns->ns_address[0], now);
+}
+
+/*
+ * Forget a reduced EDNS0 size once it is RES_INFRA_EDNS0_TTL old
+ */
+static void
+res_infra_edns0_expire(struct res_infra_entry *ri, time_t now)
+{
+    if (ri->ri_edns0_until > now)
+        return;
+    ri->ri_edns0_size = -1;
+    ri->ri_edns0_failed = -1;
+}
+
+/*
+ * The SRTT for addr, in milliseconds
+ */
+long
+res_infra_srtt(struct sockaddr_storage *addr)
+{
+    struct timeval  now;
+    long            srtt;
+
+    if (addr == NULL)
+        return RES_INFRA_INIT_SRTT;
+
+    gettimeofday(&now, NULL);
+    pthread_mutex_lock(&infra_mutex);
+    srtt = res_infra_srtt_locked(addr, now.tv_sec);
+    pthread_mutex_unlock(&infra_mutex);
+
+    return srtt;
+}
+
+/*
+ * How long (in milliseconds) to wait for a response from addr before
+ * trying again. This is never more than rto_max, which is also what
+ * is returned for an address that we have no round trip times for.
+ */
+long
+res_infra_rto(struct sockaddr_storage *addr, long rto_max)
+{
+    struct res_infra_entry *ri;
+    struct timeval  now;
+    long            rto = rto_max;
+
+    if (addr == NULL)
+        return rto_max;
+
+    gettimeofday(&now, NULL);
+    pthread_mutex_lock(&infra_mutex);
+    ri = res_infra_find(addr, now.tv_sec, 0);
+    if (ri != NULL && ri->ri_rttvar >= 0)
+        rto = res_infra_decayed_srtt(ri, now.tv_sec) + 4 * ri->ri_rttvar;
+    pthread_mutex_unlock(&infra_mutex);
+
+    if (rto < RES_INFRA_MIN_RTO)
+        rto = RES_INFRA_MIN_RTO;
+    if (rto > rto_max)
+        rto = rto_max;
+    return rto;
+}
+
+/*
+ * Fold a measured round trip time (in milliseconds) into the
+ * estimates for addr
+ */
+void
+res_infra_rtt_sample(struct sockaddr_storage *addr, long rtt)
+{
+    struct res_infra_entry *ri;
+    struct timeval  now;
+    long            srtt, delta;
+
+    if (addr == NULL)
+        return;
+    if (rtt < 1)
+        rtt = 1;
+
+    gettimeofday(&now, NULL);
+    pthread_mutex_lock(&infra_mutex);
+    ri = res_infra_find(addr, now.tv_sec, 1);
+    if (ri != NULL) {
+        if (ri->ri_rttvar < 0) {
+            ri->ri_srtt = rtt;
+            ri->ri_rttvar = rtt / 2;
+        } else {
+            srtt = res_infra_decayed_srtt(ri, now.tv_sec);
+            delta = (srtt > rtt) ? srtt - rtt : rtt - srtt;
+            ri->ri_rttvar = (3 * ri->ri_rttvar + delta) / 4;
+            ri->ri_srtt = (7 * srtt + rtt) / 8;
+        }
+        ri->ri_updated = now.tv_sec;
+        ri->ri_used = now.tv_sec;
+        res_log(NULL, LOG_DEBUG, "libsres: ""rtt %ld ms, srtt %ld rttvar %ld",
+                rtt, ri->ri_srtt, ri->ri_rttvar);
+    }
+    pthread_mutex_unlock(&infra_mutex);
+}
+
+/*
+ * Note that addr did not respond within waited milliseconds
+ */
+void
+res_infra_rtt_timeout(struct sockaddr_storage *addr, long waited)
+{
+    struct res_infra_entry *ri;
+    struct timeval  now;
+    long            srtt;
+
+    if (addr == NULL)
+        return;
+
+    gettimeofday(&now, NULL);
+    pthread_mutex_lock(&infra_mutex);
+    ri = res_infra_find(addr, now.tv_sec, 1);
+    if (ri != NULL) {
+        srtt = 2 * res_infra_decayed_srtt(ri, now.tv_sec);
+        if (srtt < waited)
+            srtt = waited;
+        if (srtt > RES_INFRA_MAX_SRTT)
+            srtt = RES_INFRA_MAX_SRTT;
+        ri->ri_srtt = srtt;
+        ri->ri_updated = now.tv_sec;
+        ri->ri_used = now.tv_sec;
+        res_log(NULL, LOG_DEBUG, "libsres: ""timeout after %ld ms, srtt %ld",
+                waited, ri->ri_srtt);
+    }
+    pthread_mutex_unlock(&infra_mutex);
+}
+
+/*
+ * The EDNS0 buffer size to use for a query to addr, given that we
+ * would like to use edns0_size
+ */
+long
+res_infra_edns0_size(struct sockaddr_storage *addr, long edns0_size)
+{
+    struct res_infra_entry *ri;
+    struct timeval  now;
+
+    if (addr == NULL)
+        return edns0_size;
+
+    gettimeofday(&now, NULL);
+    pthread_mutex_lock(&infra_mutex);
+    ri = res_infra_find(addr, now.tv_sec, 0);
+    if (ri != NULL) {
+        res_infra_edns0_expire(ri, now.tv_sec);
+        if (ri->ri_edns0_size >= 0 && ri->ri_edns0_size < edns0_size)
+            edns0_size = ri->ri_edns0_size;
+    }
+    pthread_mutex_unlock(&infra_mutex);
+
+    return edns0_size;
+}
+
+/*
+ * Note that a query to addr with an EDNS0 size of edns0_size went
+ * unanswered. This only counts for something once a smaller size
+ * is seen to work; until then the server may simply have been down.
+ */
+void
+res_infra_edns0_failed(struct sockaddr_storage *addr, long edns0_size)
+{
+    struct res_infra_entry *ri;
+    struct timeval  now;
+
+    if (addr == NULL)
+        return;
+
+    gettimeofday(&now, NULL);
+    pthread_mutex_lock(&infra_mutex);
+    ri = res_infra_find(addr, now.tv_sec, 1);
+    if (ri != NULL) {
+        res_infra_edns0_expire(ri, now.tv_sec);
+        if (ri->ri_edns0_failed < 0 || edns0_size < ri->ri_edns0_failed) {
+            ri->ri_edns0_failed = edns0_size;
+            if (ri->ri_edns0_size >= edns0_size)
+                ri->ri_edns0_size = -1;
+        }
+        ri->ri_edns0_until = now.tv_sec + RES_INFRA_EDNS0_TTL;
+        ri->ri_used = now.tv_sec;
+    }
+    pthread_mutex_unlock(&infra_mutex);
+}
+
+/*
+ * Note a response from addr to a query that was sent over TCP if
+ * stream is set, or else over UDP with an EDNS0 size of edns0_size
+ * (-1 if the query did not use EDNS0).
+ */
+void
+res_infra_response(struct sockaddr_storage *addr, long edns0_size,
+                   int truncated, int stream)
+{
+    struct res_infra_entry *ri;
+    struct timeval  now;
+
+    if (addr == NULL)
+        return;
+
+    gettimeofday(&now, NULL);
+    pthread_mutex_lock(&infra_mutex);
+    ri = res_infra_find(addr, now.tv_sec, !stream && truncated);
+    if (ri == NULL) {
+        pthread_mutex_unlock(&infra_mutex);
+        return;
+    }
+
+    ri->ri_unreach_until = 0;
+
+    if (!stream && truncated) {
+        if (++ri->ri_tc_count >= RES_INFRA_TC_LIMIT) {
+            res_log(NULL, LOG_INFO, "libsres: ""%d truncated responses "
+                    "in a row, using TCP", ri->ri_tc_count);
+            ri->ri_tcp_until = now.tv_sec + RES_INFRA_TCP_TTL;
+            ri->ri_tc_count = 0;
+        }
+        ri->ri_used = now.tv_sec;
+    } else if (!stream) {
+        ri->ri_tc_count = 0;
+        res_infra_edns0_expire(ri, now.tv_sec);
+        if (edns0_size >= 0 && ri->ri_edns0_failed >= 0) {
+            if (edns0_size >= ri->ri_edns0_failed) {
+                /* the earlier failure was not down to the size */
+                ri->ri_edns0_failed = -1;
+                ri->ri_edns0_size = -1;
+            } else if (edns0_size > ri->ri_edns0_size) {
+                res_log(NULL, LOG_INFO, "libsres: ""edns0 size %ld works "
+                        "where %ld did not", edns0_size,
+                        ri->ri_edns0_failed);
+                ri->ri_edns0_size = edns0_size;
+                ri->ri_edns0_until = now.tv_sec + RES_INFRA_EDNS0_TTL;
+            }
+            ri->ri_used = now.tv_sec;
+        }
+    }
+
+    pthread_mutex_unlock(&infra_mutex);
+}
+
+/*
+ * Returns 1 if queries to addr should go straight to TCP
+ */
+int
+res_infra_tcp_only(struct sockaddr_storage *addr)
+{
+    struct res_infra_entry *ri;
+    struct timeval  now;
+    int             tcp_only = 0;
+
+    if (addr == NULL)
+        return 0;
+
+    gettimeofday(&now, NULL);
+    pthread_mutex_lock(&infra_mutex);
+    ri = res_infra_find(addr, now.tv_sec, 0);
+    if (ri != NULL && ri->ri_tcp_until > now.tv_sec)
+        tcp_only = 1;
+    pthread_mutex_unlock(&infra_mutex);
+
+    return tcp_only;
+}
+
+/*
+ * Note that addr could not be reached, or never responded
+ */
+void
+res_infra_unreachable(struct sockaddr_storage *addr)
+{
+    struct res_infra_entry *ri;
+    struct timeval  now;
+
+    if (addr == NULL)
+        return;
+
+    gettimeofday(&now, NULL);
+    pthread_mutex_lock(&infra_mutex);
+    ri = res_infra_find(addr, now.tv_sec, 1);
+    if (ri != NULL) {
+        ri->ri_unreach_until = now.tv_sec + RES_INFRA_UNREACH_TTL;
+        ri->ri_used = now.tv_sec;
+    }
+    pthread_mutex_unlock(&infra_mutex);
+}
+
+/*
+ * Note that the (first) address of server is lame for the zone we
+ * asked it about
+ */
+void
+res_infra_lame_server(struct name_server *server)
+{
+    struct res_infra_entry *ri;
+    struct timeval  now;
+
+    if (server == NULL || server->ns_number_of_addresses < 1)
+        return;
+
+    gettimeofday(&now, NULL);
+    pthread_mutex_lock(&infra_mutex);
+    ri = res_infra_find(server->ns_address[0], now.tv_sec, 1);
+    if (ri != NULL) {
+        ri->ri_lame_until = now.tv_sec + RES_INFRA_LAME_TTL;
+        ri->ri_used = now.tv_sec;
+    }
+    pthread_mutex_unlock(&infra_mutex);
+}
+
+/*
+ * Order the addresses of each name server in ns_list, and then the
+ * name servers themselves, by increasing SRTT, with lame and
+ * unreachable addresses last. Servers and addresses that compare
+ * equal (such as those we know nothing about) keep the order they
+ * were given in.
+ */
+void
+res_infra_order(struct name_server **ns_list)
+{
+    struct name_server *ns, *sorted = NULL, **nsp;
+    struct sockaddr_storage *addr;
+    struct timeval  now;
+    long            key;
+    int             i, j;
+
+    if (ns_list == NULL)
+        return;
+
+    gettimeofday(&now, NULL);
+    pthread_mutex_lock(&infra_mutex);
+
+    for (ns = *ns_list; ns; ns = ns->ns_next) {
+        for (i = 1; i < ns->ns_number_of_addresses; i++) {
+            addr = ns->ns_address[i];
+            key = res_infra_order_key(addr, now.tv_sec);
+            for (j = i; j > 0 &&
+                 res_infra_order_key(ns->ns_address[j - 1],
+                                     now.tv_sec) > key; j--)
+                ns->ns_address[j] = ns->ns_address[j - 1];
+            ns->ns_address[j] = addr;
+        }
+    }
+
+    while ((ns = *ns_list) != NULL) {
+        *ns_list = ns->ns_next;
+        key = res_infra_ns_key(ns, now.tv_sec);
+        for (nsp = &sorted; *nsp; nsp = &(*nsp)->ns_next) {
+            if (res_infra_ns_key(*nsp, now.tv_sec) > key)
+                break;
+        }
+        ns->ns_next = *nsp;
+        *nsp = ns;
+    }
+    *ns_list = sorted;
+
+    pthread_mutex_unlock(&infra_mutex);
+}
+
+/*
+ * Forget everything
+ */
+void
+res_infra_flush(void)
+{
+    struct res_infra_entry *ri;
+    int             i;
+
+    pthread_mutex_lock(&infra_mutex);
+    for (i = 0; i < RES_INFRA_BUCKETS; i++) {
+        while ((ri = infra_table[i]) != NULL) {
+            infra_table[i] = ri->ri_next;
+            FREE(ri);
+        }
+    }
+    infra_count = 0;
+    pthread_mutex_unlock(&infra_mutex);
+}
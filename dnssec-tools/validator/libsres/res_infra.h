@@ -0,0 +1,48 @@
+/*
+ * Copyright 2013 SPARTA, Inc.  All rights reserved.
+ * See the COPYING file distributed with this software for details.
+ */
+#ifndef RES_INFRA_H
+#define RES_INFRA_H
+
+/*
+ * Round trip times (in milliseconds) for the name server addresses
+ * we have talked to
+ */
+#define RES_INFRA_INIT_SRTT     300     /* for addresses we know nothing of */
+#define RES_INFRA_MIN_RTO       50
+#define RES_INFRA_MAX_SRTT      120000
+#define RES_INFRA_DECAY         60      /* seconds for SRTT to halve its
+                                           distance to RES_INFRA_INIT_SRTT */
+#define RES_INFRA_LIFETIME      900     /* seconds an entry is kept unused */
+#define RES_INFRA_MAX_ENTRIES   1024
+
+/*
+ * How long (in seconds) other things we learn about an address are
+ * remembered for
+ */
+#define RES_INFRA_EDNS0_TTL     600     /* a reduced EDNS0 size */
+#define RES_INFRA_TCP_TTL       600     /* going straight to TCP */
+#define RES_INFRA_LAME_TTL      600
+#define RES_INFRA_UNREACH_TTL   60
+#define RES_INFRA_TC_LIMIT      3       /* truncated UDP responses in a
+                                           row before going to TCP */
+
+long            res_infra_srtt(struct sockaddr_storage *addr);
+long            res_infra_rto(struct sockaddr_storage *addr, long rto_max);
+void            res_infra_rtt_sample(struct sockaddr_storage *addr, long rtt);
+void            res_infra_rtt_timeout(struct sockaddr_storage *addr,
+                                      long waited);
+long            res_infra_edns0_size(struct sockaddr_storage *addr,
+                                     long edns0_size);
+void            res_infra_edns0_failed(struct sockaddr_storage *addr,
+                                       long edns0_size);
+void            res_infra_response(struct sockaddr_storage *addr,
+                                   long edns0_size, int truncated,
+                                   int stream);
+int             res_infra_tcp_only(struct sockaddr_storage *addr);
+void            res_infra_unreachable(struct sockaddr_storage *addr);
+void            res_infra_order(struct name_server **ns_list);
+void            res_infra_flush(void);
+
+#endif                          /* RES_INFRA_H */
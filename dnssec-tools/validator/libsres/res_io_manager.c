@@ -20,6 +20,21 @@
 #include "res_support.h"
 #include "res_mkquery.h"
 #include "res_io_manager.h"
+#include "res_infra.h"
+
+/*
+ * Use epoll(7) to wait for responses where it is available; this
+ * does not limit the number of sockets we can wait on to FD_SETSIZE.
+ * The fd_set based interfaces remain available, but only ever
+ * carry descriptors below FD_SETSIZE.
+ */
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_POLL_H)
+#define RES_IO_EPOLL
+#include <sys/epoll.h>
+#endif
 
 #ifndef TRUE
 #define TRUE 1
@@ -76,6 +91,293 @@ static int      next_transaction = 0;
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
+/* don't let a connection closed by the server raise SIGPIPE */
+#ifdef MSG_NOSIGNAL
+#define RES_IO_SEND_FLAGS   MSG_NOSIGNAL
+#else
+#define RES_IO_SEND_FLAGS   0
+#endif
+
+/* only descriptors below FD_SETSIZE can be carried in an fd_set */
+#ifdef WIN32
+#define RES_IO_IN_FDSET(s)  1
+#else
+#define RES_IO_IN_FDSET(s)  ((s) >= 0 && (s) < FD_SETSIZE)
+#endif
+
+#ifdef RES_IO_EPOLL
+/*
+ * Each thread that waits for responses has its own epoll instance.
+ * Sockets are added to the instance of the thread that waits on them
+ * (see res_io_watch()) and removed from it as soon as no query of that
+ * thread waits on them any more (see res_io_unwatch()), which may
+ * happen in another thread, e.g. when a UDP socket goes back to the
+ * pool. Sockets are registered edge-triggered; res_io_accept() always
+ * looks for pending data before a thread blocks, so no data is left
+ * unnoticed.
+ */
+#define RES_IO_MAX_EVENTS   64
+
+struct res_io_fdlist {
+    int            *fl_fds;
+    int             fl_count;
+    int             fl_size;
+};
+
+struct res_io_waiter {
+    int             rw_fd;
+    int             rw_refs;    /* the thread, and each ea it watches */
+    int             rw_kicked;  /* don't block in the next wait */
+    /* sockets that queries of this thread are waiting on */
+    struct res_io_fdlist rw_watched;
+    /* sockets whose events were taken by res_io_clear_pollfd() */
+    struct res_io_fdlist rw_cleared;
+};
+
+#ifndef VAL_NO_THREADS
+static pthread_key_t  waiter_key;
+static pthread_once_t waiter_once = PTHREAD_ONCE_INIT;
+/*
+ * protects rw_refs and rw_watched of all waiters; callers may already
+ * hold mutex, so these have their own lock
+ */
+static pthread_mutex_t waiter_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*
+ * Drop a reference to w, freeing it with the last one. Caller holds
+ * waiter_mutex, which is released.
+ */
+static void
+res_io_release_waiter(struct res_io_waiter *w)
+{
+    int             last = (--w->rw_refs == 0);
+
+    pthread_mutex_unlock(&waiter_mutex);
+    if (last) {
+        close(w->rw_fd);
+        if (w->rw_watched.fl_fds)
+            FREE(w->rw_watched.fl_fds);
+        if (w->rw_cleared.fl_fds)
+            FREE(w->rw_cleared.fl_fds);
+        FREE(w);
+    }
+}
+
+#ifndef VAL_NO_THREADS
+/*
+ * The thread is gone, but queries that it watched may still be around
+ */
+static void
+res_io_free_waiter(void *arg)
+{
+    struct res_io_waiter *w = (struct res_io_waiter *) arg;
+
+    if (w) {
+        pthread_mutex_lock(&waiter_mutex);
+        res_io_release_waiter(w);
+    }
+}
+
+static void
+res_io_init_waiter_key(void)
+{
+    pthread_key_create(&waiter_key, res_io_free_waiter);
+}
+#else
+static struct res_io_waiter *_waiter = NULL;
+#endif
+
+/*
+ * Return the epoll instance of the calling thread, creating it
+ * the first time around
+ */
+static struct res_io_waiter *
+res_io_get_waiter(void)
+{
+    struct res_io_waiter *w;
+
+#ifndef VAL_NO_THREADS
+    pthread_once(&waiter_once, res_io_init_waiter_key);
+    w = (struct res_io_waiter *) pthread_getspecific(waiter_key);
+#else
+    w = _waiter;
+#endif
+    if (w != NULL)
+        return w;
+
+    w = (struct res_io_waiter *) MALLOC(sizeof(struct res_io_waiter));
+    if (w == NULL)
+        return NULL;
+    memset(w, 0, sizeof(struct res_io_waiter));
+    w->rw_fd = epoll_create(RES_IO_MAX_EVENTS);
+    if (w->rw_fd < 0) {
+        res_log(NULL, LOG_ERR, "libsres: ""epoll_create() failed, errno = %d %s",
+                errno, strerror(errno));
+        FREE(w);
+        return NULL;
+    }
+    fcntl(w->rw_fd, F_SETFD, FD_CLOEXEC);
+    w->rw_refs = 1;
+
+#ifndef VAL_NO_THREADS
+    pthread_setspecific(waiter_key, w);
+#else
+    _waiter = w;
+#endif
+    return w;
+}
+
+static int
+res_io_fdlist_add(struct res_io_fdlist *fl, int fd)
+{
+    int            *fds;
+
+    if (fl->fl_count == fl->fl_size) {
+        fds = (int *) realloc(fl->fl_fds,
+                              (fl->fl_size + 16) * sizeof(int));
+        if (fds == NULL)
+            return -1;
+        fl->fl_fds = fds;
+        fl->fl_size += 16;
+    }
+    fl->fl_fds[fl->fl_count++] = fd;
+    return 0;
+}
+
+/* returns 1 if (one instance of) fd was on the list */
+static int
+res_io_fdlist_remove(struct res_io_fdlist *fl, int fd)
+{
+    int             i;
+
+    for (i = fl->fl_count - 1; i >= 0; i--) {
+        if (fl->fl_fds[i] == fd) {
+            fl->fl_fds[i] = fl->fl_fds[--fl->fl_count];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int
+res_io_fdlist_has(struct res_io_fdlist *fl, int fd)
+{
+    int             i;
+
+    for (i = 0; i < fl->fl_count; i++) {
+        if (fl->fl_fds[i] == fd)
+            return 1;
+    }
+    return 0;
+}
+
+static void res_io_unwatch(struct expected_arrival *ea);
+
+/*
+ * Make sure that the socket used by ea is registered with the 
+ * calling thread's epoll instance
+ */
+static void
+res_io_watch(struct expected_arrival *ea)
+{
+    struct res_io_waiter *w;
+    struct epoll_event ev;
+
+    if (ea->ea_socket == INVALID_SOCKET || 
+        (w = res_io_get_waiter()) == NULL ||
+        ea->ea_waiter == w)
+        return;
+
+    /* some other thread waited on it before */
+    res_io_unwatch(ea);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = ea->ea_socket;
+
+    pthread_mutex_lock(&waiter_mutex);
+    /* a TCP connection may already be watched for another query */
+    if (!res_io_fdlist_has(&w->rw_watched, ea->ea_socket) &&
+        0 != epoll_ctl(w->rw_fd, EPOLL_CTL_ADD, ea->ea_socket, &ev) &&
+        errno != EEXIST) {
+        pthread_mutex_unlock(&waiter_mutex);
+        return;
+    }
+    if (0 == res_io_fdlist_add(&w->rw_watched, ea->ea_socket)) {
+        w->rw_refs++;
+        ea->ea_waiter = w;
+    } else if (!res_io_fdlist_has(&w->rw_watched, ea->ea_socket)) {
+        epoll_ctl(w->rw_fd, EPOLL_CTL_DEL, ea->ea_socket, &ev);
+    }
+    pthread_mutex_unlock(&waiter_mutex);
+}
+
+/*
+ * ea no longer waits on its socket; once no other query of the
+ * watching thread does, the socket leaves that thread's epoll
+ * instance. Called before the socket is closed or pooled, from
+ * whichever thread lets go of it.
+ */
+static void
+res_io_unwatch(struct expected_arrival *ea)
+{
+    struct res_io_waiter *w = (struct res_io_waiter *) ea->ea_waiter;
+    struct epoll_event ev;
+
+    if (w == NULL)
+        return;
+    ea->ea_waiter = NULL;
+
+    pthread_mutex_lock(&waiter_mutex);
+    if (ea->ea_socket != INVALID_SOCKET &&
+        res_io_fdlist_remove(&w->rw_watched, ea->ea_socket) &&
+        !res_io_fdlist_has(&w->rw_watched, ea->ea_socket)) {
+        memset(&ev, 0, sizeof(ev));
+        epoll_ctl(w->rw_fd, EPOLL_CTL_DEL, ea->ea_socket, &ev);
+    }
+    res_io_release_waiter(w);
+}
+#else
+#define res_io_unwatch(ea)
+static int      _kicked = 0;
+#endif /* RES_IO_EPOLL */
+
+/*
+ * Queries may become ready to be sent while the calling thread is
+ * looking at something else (see res_io_tcp_close_conn()). Make sure 
+ * that the thread doesn't block in its next wait for data, so that
+ * these queries go out right away.
+ */
+static void
+res_io_kick(void)
+{
+#ifdef RES_IO_EPOLL
+    struct res_io_waiter *w = res_io_get_waiter();
+    if (w)
+        w->rw_kicked = 1;
+#else
+    _kicked = 1;
+#endif
+}
+
+static int
+res_io_take_kick(void)
+{
+    int             kicked;
+#ifdef RES_IO_EPOLL
+    struct res_io_waiter *w = res_io_get_waiter();
+    if (w == NULL)
+        return 0;
+    kicked = w->rw_kicked;
+    w->rw_kicked = 0;
+#else
+    kicked = _kicked;
+    _kicked = 0;
+#endif
+    return kicked;
+}
+
 /*
  * Find a port in the range 1024 - 65535 
  */
@@ -138,6 +440,503 @@ bind_to_random_source(int af, SOCKET s)
     return 1; /* failure */
 }
 
+/*
+ * Idle UDP sockets are kept in a small pool for each address family
+ * and handed to later queries, which saves creating, binding and
+ * closing a socket for every query. A pooled socket is simply
+ * connect()ed to the next server, so the kernel still only lets
+ * through datagrams from that server and port; the query id and 
+ * question are checked against the query in res_io_read_ea(). Any 
+ * stale datagrams are discarded before the socket is used again.
+ *
+ * To keep the source ports unpredictable, a socket is used for at
+ * most RES_IO_UDP_MAX_USES queries or RES_IO_UDP_MAX_AGE seconds,
+ * after which it is closed and a new socket with a fresh random
+ * port takes its place.
+ */
+#ifdef MSG_DONTWAIT
+#define RES_IO_UDP_POOL
+#define RES_IO_UDP_POOL_SIZE    32
+#define RES_IO_UDP_MAX_USES     100
+#define RES_IO_UDP_MAX_AGE      60
+
+struct res_io_udp_sock {
+    SOCKET          us_fd;
+    time_t          us_birth;
+    int             us_uses;
+};
+
+struct res_io_udp_pool {
+    struct res_io_udp_sock up_socks[RES_IO_UDP_POOL_SIZE];
+    int             up_head;
+    int             up_count;
+};
+
+#ifdef VAL_IPV6
+#define RES_IO_UDP_POOLS    2
+#else
+#define RES_IO_UDP_POOLS    1
+#endif
+static struct res_io_udp_pool udp_pools[RES_IO_UDP_POOLS];
+#ifndef VAL_NO_THREADS
+static pthread_mutex_t udp_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static struct res_io_udp_pool *
+res_io_udp_pool_for(int af)
+{
+    if (af == AF_INET)
+        return &udp_pools[0];
+#ifdef VAL_IPV6
+    if (af == AF_INET6)
+        return &udp_pools[1];
+#endif
+    return NULL;
+}
+
+static int
+res_io_udp_sock_expired(time_t birth, int uses, time_t now)
+{
+    return (uses >= RES_IO_UDP_MAX_USES ||
+            now - birth >= RES_IO_UDP_MAX_AGE);
+}
+
+/*
+ * Hand out an idle socket for address family af. Returns 0 and sets
+ * ea_socket on success, -1 if no suitable socket is available.
+ */
+static int
+res_io_udp_pool_get(struct expected_arrival *ea, int af)
+{
+    struct res_io_udp_pool *pool = res_io_udp_pool_for(af);
+    struct res_io_udp_sock us;
+    struct timeval  now;
+    int             found = 0;
+
+    if (pool == NULL)
+        return -1;
+
+    gettimeofday(&now, NULL);
+
+    pthread_mutex_lock(&udp_pool_mutex);
+    while (!found && pool->up_count > 0) {
+        us = pool->up_socks[pool->up_head];
+        pool->up_head = (pool->up_head + 1) % RES_IO_UDP_POOL_SIZE;
+        pool->up_count--;
+        if (res_io_udp_sock_expired(us.us_birth, us.us_uses, now.tv_sec)) {
+            CLOSESOCK(us.us_fd);
+            continue;
+        }
+        found = 1;
+    }
+    pthread_mutex_unlock(&udp_pool_mutex);
+
+    if (!found)
+        return -1;
+
+    ea->ea_socket = us.us_fd;
+    ea->ea_socket_birth = us.us_birth;
+    ea->ea_socket_uses = us.us_uses;
+    return 0;
+}
+
+/*
+ * Give the UDP socket of ea back to the pool. Returns 0 if the pool
+ * took the socket, -1 if the caller must close it.
+ */
+static int
+res_io_udp_pool_put(struct expected_arrival *ea)
+{
+    struct res_io_udp_pool *pool;
+    struct sockaddr_storage ss;
+    socklen_t       ss_len = sizeof(ss);
+    struct timeval  now;
+    int             tail, rc = -1;
+
+    if (ea->ea_socket_birth == 0)
+        return -1;
+
+    gettimeofday(&now, NULL);
+    if (res_io_udp_sock_expired(ea->ea_socket_birth, ea->ea_socket_uses,
+                                now.tv_sec))
+        return -1;
+
+    if (getsockname(ea->ea_socket, (struct sockaddr *) &ss, &ss_len) != 0 ||
+        (pool = res_io_udp_pool_for(ss.ss_family)) == NULL)
+        return -1;
+
+    pthread_mutex_lock(&udp_pool_mutex);
+    if (pool->up_count < RES_IO_UDP_POOL_SIZE) {
+        tail = (pool->up_head + pool->up_count) % RES_IO_UDP_POOL_SIZE;
+        pool->up_socks[tail].us_fd = ea->ea_socket;
+        pool->up_socks[tail].us_birth = ea->ea_socket_birth;
+        pool->up_socks[tail].us_uses = ea->ea_socket_uses;
+        pool->up_count++;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&udp_pool_mutex);
+
+    return rc;
+}
+
+/*
+ * Close all idle sockets
+ */
+static void
+res_io_udp_pool_flush(void)
+{
+    struct res_io_udp_pool *pool;
+    int             i;
+
+    pthread_mutex_lock(&udp_pool_mutex);
+    for (i = 0; i < RES_IO_UDP_POOLS; i++) {
+        pool = &udp_pools[i];
+        while (pool->up_count > 0) {
+            CLOSESOCK(pool->up_socks[pool->up_head].us_fd);
+            pool->up_head = (pool->up_head + 1) % RES_IO_UDP_POOL_SIZE;
+            pool->up_count--;
+        }
+    }
+    pthread_mutex_unlock(&udp_pool_mutex);
+}
+
+/*
+ * Discard any datagrams queued on a reused socket
+ */
+static void
+res_io_udp_drain(SOCKET s)
+{
+    u_char          buf[512];
+
+    while (recv(s, (char *) buf, sizeof(buf), MSG_DONTWAIT) >= 0)
+        ;
+}
+#endif /* RES_IO_UDP_POOL */
+
+/*
+ * A TCP response is read as it trickles in, never blocking for the
+ * rest of it; res_io_tcp_read keeps what has been read of the length
+ * prefix and the message so far. A connection that is shared between
+ * queries has one of these; a private connection hangs it off its
+ * query.
+ */
+struct res_io_tcp_read {
+    u_char          tr_len_n[2];    /* length prefix, network order */
+    size_t          tr_have;        /* bytes read, including prefix */
+    u_char         *tr_msg;         /* message, once length is known */
+    size_t          tr_msg_len;
+};
+
+#ifdef MSG_DONTWAIT
+#define RES_IO_RECV_FLAGS MSG_DONTWAIT
+#else
+#define RES_IO_RECV_FLAGS 0
+#endif
+
+/*
+ * TCP connections to the upstream servers are kept open and shared
+ * by the queries sent to the same server address (RFC 7766). Up to
+ * RES_IO_TCP_MAX_PIPELINE queries may be outstanding on a connection
+ * at any time; responses can come back in any order and are matched
+ * to their queries using the query id and question. A response that
+ * is read on behalf of another query is parked with the connection
+ * until that query looks for it. 
+ *
+ * Connections are only shared among queries sent by the same thread,
+ * and are closed once they have been idle for RES_IO_TCP_IDLE_TIMEOUT
+ * seconds. tcp_mutex protects the connection list and everything
+ * hanging off it.
+ */
+#ifdef HAVE_POLL_H
+#define RES_IO_TCP_SHARE
+#define RES_IO_TCP_MAX_PIPELINE 8
+#define RES_IO_TCP_IDLE_TIMEOUT 10
+
+struct res_io_tcp_pending {
+    struct expected_arrival *tp_ea;
+    u_char         *tp_response;
+    size_t          tp_response_length;
+    struct res_io_tcp_pending *tp_next;
+};
+
+struct res_io_tcp_conn {
+    SOCKET          tc_fd;
+    struct sockaddr_storage tc_addr;
+    size_t          tc_addr_len;
+#ifndef VAL_NO_THREADS
+    pthread_t       tc_owner;
+#endif
+    int             tc_npending;
+    int             tc_answered;
+    struct res_io_tcp_pending *tc_pending;
+    time_t          tc_last_used;
+    struct res_io_tcp_read tc_read;
+    struct res_io_tcp_conn *tc_next;
+};
+
+static struct res_io_tcp_conn *tcp_conns = NULL;
+#ifndef VAL_NO_THREADS
+static pthread_mutex_t tcp_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*
+ * Close a connection. Responses that were already parked are handed
+ * to their queries; other queries that were waiting on the connection
+ * are set up to be sent again right away. If the connection has been
+ * working, the server most likely just decided to close it; in that 
+ * case the try is not counted against the queries. Must be called 
+ * with tcp_mutex held.
+ */
+static void
+res_io_tcp_close_conn(struct res_io_tcp_conn *tc)
+{
+    struct res_io_tcp_conn **tcp;
+    struct res_io_tcp_pending *tp;
+
+    for (tcp = &tcp_conns; *tcp; tcp = &(*tcp)->tc_next) {
+        if (*tcp == tc) {
+            *tcp = tc->tc_next;
+            break;
+        }
+    }
+
+    res_log(NULL, LOG_DEBUG, "libsres: ""closing tcp connection fd %d, "
+            "%d queries pending", tc->tc_fd, tc->tc_npending);
+
+    while ((tp = tc->tc_pending) != NULL) {
+        tc->tc_pending = tp->tp_next;
+        res_io_unwatch(tp->tp_ea);
+        tp->tp_ea->ea_socket = INVALID_SOCKET;
+        tp->tp_ea->ea_tcp_conn = NULL;
+        if (tp->tp_response && tp->tp_ea->ea_response == NULL) {
+            tp->tp_ea->ea_response = tp->tp_response;
+            tp->tp_ea->ea_response_length = tp->tp_response_length;
+        } else {
+            if (tp->tp_response)
+                FREE(tp->tp_response);
+            gettimeofday(&tp->tp_ea->ea_next_try, NULL);
+            res_io_kick();
+            if (tc->tc_answered > 0 && tp->tp_ea->ea_remaining_attempts >= 0)
+                tp->tp_ea->ea_remaining_attempts++;
+        }
+        FREE(tp);
+    }
+
+    CLOSESOCK(tc->tc_fd);
+    --_open_sockets;
+    if (tc->tc_read.tr_msg)
+        FREE(tc->tc_read.tr_msg);
+    FREE(tc);
+}
+
+/*
+ * Add ea to the queries that are waiting on tc
+ */
+static int
+res_io_tcp_add_pending(struct res_io_tcp_conn *tc, 
+                       struct expected_arrival *ea)
+{
+    struct res_io_tcp_pending *tp;
+
+    tp = (struct res_io_tcp_pending *) 
+        MALLOC(sizeof(struct res_io_tcp_pending));
+    if (tp == NULL)
+        return -1;
+    tp->tp_ea = ea;
+    tp->tp_response = NULL;
+    tp->tp_response_length = 0;
+    tp->tp_next = tc->tc_pending;
+    tc->tc_pending = tp;
+    tc->tc_npending++;
+
+    ea->ea_socket = tc->tc_fd;
+    ea->ea_tcp_conn = tc;
+    ea->ea_waiter = NULL;
+    return 0;
+}
+
+/*
+ * Look for an open connection to the current address of ea which can
+ * take one more query, and attach ea to it. Idle connections that
+ * have timed out (or were closed by the server) are dropped along
+ * the way.
+ */
+static void
+res_io_tcp_attach(struct expected_arrival *ea)
+{
+    struct sockaddr_storage *addr = 
+        ea->ea_ns->ns_address[ea->ea_which_address];
+    struct res_io_tcp_conn *tc, *next;
+    struct timeval  now;
+
+    gettimeofday(&now, NULL);
+
+    pthread_mutex_lock(&tcp_mutex);
+    for (tc = tcp_conns; tc; tc = next) {
+        next = tc->tc_next;
+        if (tc->tc_npending == 0) {
+            struct pollfd pfd;
+
+            /* 
+             * Nothing is expected on an idle connection, so if it is 
+             * readable the server has most likely closed it.
+             */
+            pfd.fd = tc->tc_fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            if (now.tv_sec - tc->tc_last_used >= RES_IO_TCP_IDLE_TIMEOUT ||
+                poll(&pfd, 1, 0) != 0) {
+                res_io_tcp_close_conn(tc);
+                continue;
+            }
+        }
+        if (ea->ea_socket != INVALID_SOCKET ||
+            tc->tc_npending >= RES_IO_TCP_MAX_PIPELINE ||
+#ifndef VAL_NO_THREADS
+            !pthread_equal(tc->tc_owner, pthread_self()) ||
+#endif
+            tc->tc_addr.ss_family != addr->ss_family ||
+            memcmp(&tc->tc_addr, addr, tc->tc_addr_len))
+            continue;
+        if (0 == res_io_tcp_add_pending(tc, ea))
+            res_log(NULL, LOG_DEBUG, "libsres: ""ea %p reusing tcp fd %d",
+                    ea, tc->tc_fd);
+    }
+    pthread_mutex_unlock(&tcp_mutex);
+}
+
+/*
+ * Turn the freshly connected TCP socket of ea into a connection that
+ * later queries can share. If that fails, the socket simply stays 
+ * private to ea.
+ */
+static void
+res_io_tcp_new_conn(struct expected_arrival *ea, size_t addr_len)
+{
+    struct res_io_tcp_conn *tc;
+    struct timeval  now;
+
+    tc = (struct res_io_tcp_conn *) MALLOC(sizeof(struct res_io_tcp_conn));
+    if (tc == NULL)
+        return;
+    memset(tc, 0, sizeof(struct res_io_tcp_conn));
+    tc->tc_fd = ea->ea_socket;
+    memcpy(&tc->tc_addr, ea->ea_ns->ns_address[ea->ea_which_address],
+           addr_len);
+    tc->tc_addr_len = addr_len;
+#ifndef VAL_NO_THREADS
+    tc->tc_owner = pthread_self();
+#endif
+    gettimeofday(&now, NULL);
+    tc->tc_last_used = now.tv_sec;
+
+    pthread_mutex_lock(&tcp_mutex);
+    if (0 != res_io_tcp_add_pending(tc, ea)) {
+        pthread_mutex_unlock(&tcp_mutex);
+        FREE(tc);
+        return;
+    }
+    tc->tc_next = tcp_conns;
+    tcp_conns = tc;
+    pthread_mutex_unlock(&tcp_mutex);
+}
+
+/*
+ * Detach ea from its connection. If keep is not set, the connection
+ * is considered broken and is closed.
+ */
+static void
+res_io_tcp_detach(struct expected_arrival *ea, int keep)
+{
+    struct res_io_tcp_conn *tc;
+    struct res_io_tcp_pending **tpp, *tp;
+    struct timeval  now;
+
+    pthread_mutex_lock(&tcp_mutex);
+    tc = ea->ea_tcp_conn;
+    if (tc != NULL) {
+        for (tpp = &tc->tc_pending; *tpp; tpp = &(*tpp)->tp_next) {
+            if ((*tpp)->tp_ea == ea) {
+                tp = *tpp;
+                *tpp = tp->tp_next;
+                if (tp->tp_response)
+                    FREE(tp->tp_response);
+                FREE(tp);
+                tc->tc_npending--;
+                break;
+            }
+        }
+        gettimeofday(&now, NULL);
+        tc->tc_last_used = now.tv_sec;
+        if (!keep)
+            res_io_tcp_close_conn(tc);
+    }
+    pthread_mutex_unlock(&tcp_mutex);
+
+    ea->ea_socket = INVALID_SOCKET;
+    ea->ea_tcp_conn = NULL;
+}
+
+/*
+ * Close all connections that have no outstanding queries
+ */
+static void
+res_io_tcp_flush(void)
+{
+    struct res_io_tcp_conn *tc, *next;
+
+    pthread_mutex_lock(&tcp_mutex);
+    for (tc = tcp_conns; tc; tc = next) {
+        next = tc->tc_next;
+        if (tc->tc_npending == 0)
+            res_io_tcp_close_conn(tc);
+    }
+    pthread_mutex_unlock(&tcp_mutex);
+}
+#else
+#define res_io_tcp_attach(ea)
+#define res_io_tcp_new_conn(ea, addr_len)
+#define res_io_tcp_detach(ea, keep)
+#define res_io_tcp_flush()
+#define res_io_tcp_pull(ea_list)    0
+#endif /* RES_IO_TCP_SHARE */
+
+/*
+ * Let go of the socket used by ea. If reuse is set, an intact UDP
+ * socket may be kept for a later query, and a TCP connection stays
+ * open for other queries; otherwise (e.g. after an error, or to force 
+ * the next try to use a different port) the socket is closed.
+ */
+static void
+res_io_close_socket(struct expected_arrival *ea, int reuse)
+{
+    res_io_unwatch(ea);
+
+    /* a partly read response is of no use without its socket */
+    if (ea->ea_tcp_read != NULL) {
+        if (ea->ea_tcp_read->tr_msg)
+            FREE(ea->ea_tcp_read->tr_msg);
+        FREE(ea->ea_tcp_read);
+        ea->ea_tcp_read = NULL;
+    }
+
+    if (ea->ea_tcp_conn != NULL) {
+        res_io_tcp_detach(ea, reuse);
+        return;
+    }
+
+    if (ea->ea_socket == INVALID_SOCKET)
+        return;
+
+#ifdef RES_IO_UDP_POOL
+    if (!reuse || res_io_udp_pool_put(ea) != 0)
+#endif
+        CLOSESOCK(ea->ea_socket);
+    --_open_sockets;
+    ea->ea_socket = INVALID_SOCKET;
+    ea->ea_socket_birth = 0;
+}
+
 /*
  * find the max number of file descriptors for this process
  */
@@ -166,6 +965,15 @@ static int _init_max_fd(void) {
 #endif /* HAVE_GETRLIMIT */
 #endif /* HAVE_GETRLIMIT */
     lim = info.rlim_cur - SR_IO_NOFILE_RESERVED;
+#if !defined(RES_IO_EPOLL) && !defined(WIN32)
+    /* select() cannot look at descriptors beyond FD_SETSIZE */
+    if (lim > FD_SETSIZE - SR_IO_NOFILE_RESERVED)
+        lim = FD_SETSIZE - SR_IO_NOFILE_RESERVED;
+#endif
+#ifdef RES_IO_UDP_POOL
+    /* idle pooled sockets are not counted in _open_sockets */
+    lim -= RES_IO_UDP_POOLS * RES_IO_UDP_POOL_SIZE;
+#endif
     if (lim <= 0)
         lim = 1;
     return lim;
@@ -214,10 +1022,7 @@ res_sq_free_expected_arrival(struct expected_arrival **ea)
         free_name_server(&((*ea)->ea_ns));
     if ((*ea)->ea_name != NULL)
         free((*ea)->ea_name);
-    if ((*ea)->ea_socket != INVALID_SOCKET) {
-        CLOSESOCK((*ea)->ea_socket);
-        --_open_sockets;
-    }
+    res_io_close_socket(*ea, TRUE);
     if ((*ea)->ea_signed)
         FREE((*ea)->ea_signed);
     if ((*ea)->ea_response)
@@ -266,10 +1071,24 @@ set_alarms(struct expected_arrival *ea, long next, long cancel)
     ea->ea_cancel_time.tv_usec = ea->ea_next_try.tv_usec;
 }
 
+static void
+set_alarms_ms(struct expected_arrival *ea, long next_ms, long cancel)
+{
+    gettimeofday(&ea->ea_next_try, NULL);
+    ea->ea_next_try.tv_sec += next_ms / 1000;
+    ea->ea_next_try.tv_usec += (next_ms % 1000) * 1000;
+    if (ea->ea_next_try.tv_usec >= 1000000) {
+        ea->ea_next_try.tv_sec++;
+        ea->ea_next_try.tv_usec -= 1000000;
+    }
+    ea->ea_cancel_time.tv_sec = ea->ea_next_try.tv_sec + cancel;
+    ea->ea_cancel_time.tv_usec = ea->ea_next_try.tv_usec;
+}
+
 static struct expected_arrival *
 res_ea_init(const char *name, const u_int16_t type_h, const u_int16_t class_h,
             u_char * signed_query, size_t signed_length,
-            struct name_server *ns, long delay)
+            struct name_server *ns, long delay_ms)
 {
     struct expected_arrival *temp;
 
@@ -297,7 +1116,7 @@ res_ea_init(const char *name, const u_int16_t type_h, const u_int16_t class_h,
     temp->ea_response = NULL;
     temp->ea_response_length = 0;
     temp->ea_remaining_attempts = ns->ns_retry+1;
-    set_alarms(temp, delay, res_get_timeout(ns));
+    set_alarms_ms(temp, delay_ms, res_get_timeout(ns));
     temp->ea_next = NULL;
 
     return temp;
@@ -313,12 +1132,8 @@ res_io_retry_source(struct expected_arrival *ea)
     res_log(NULL, LOG_DEBUG, "libsres: ""retry source ea %p", ea);
     res_print_ea(ea);
 
-    /* close socket */
-    if (ea->ea_socket != INVALID_SOCKET) {
-        CLOSESOCK(ea->ea_socket);
-        --_open_sockets;
-        ea->ea_socket = INVALID_SOCKET;
-    }
+    /* release socket */
+    res_io_close_socket(ea, TRUE);
 
     /* bump retry time to current time */
     gettimeofday(&ea->ea_next_try, NULL);
@@ -335,11 +1150,7 @@ res_io_reset_source(struct expected_arrival *ea)
     res_print_ea(ea);
 
     /* close socket */
-    if (ea->ea_socket != INVALID_SOCKET) {
-        CLOSESOCK(ea->ea_socket);
-        --_open_sockets;
-        ea->ea_socket = INVALID_SOCKET;
-    }
+    res_io_close_socket(ea, FALSE);
 
     /* bump cancel time to current time */
     gettimeofday(&ea->ea_cancel_time, NULL);
@@ -355,12 +1166,8 @@ res_io_cancel_source(struct expected_arrival *ea)
     res_log(NULL, LOG_DEBUG, "libsres: ""canceling source ea %p", ea);
     res_print_ea(ea);
 
-    /* close socket */
-    if (ea->ea_socket != INVALID_SOCKET) {
-        CLOSESOCK(ea->ea_socket);
-        --_open_sockets;
-        ea->ea_socket = INVALID_SOCKET;
-    }
+    /* release socket */
+    res_io_close_socket(ea, TRUE);
 
     /* bump cancel time to current time */
     gettimeofday(&ea->ea_cancel_time, NULL);
@@ -402,8 +1209,10 @@ res_io_send(struct expected_arrival *shipit)
     int             socket_proto;
     size_t          socket_size;
     size_t          bytes_sent;
-    long            delay;
+    long            delay, max_delay;
     struct timeval  timeout;
+    int             shared = 0;
+    int             i;
 
     if (shipit == NULL)
         return SR_IO_INTERNAL_ERROR;
@@ -422,6 +1231,12 @@ res_io_send(struct expected_arrival *shipit)
             shipit->ea_using_stream ? "stream" : "dgram",
             (socket_proto == IPPROTO_TCP) ? "tcp" : "udp");
 
+    /* share an open connection to the server if there is one */
+    if (shipit->ea_socket == INVALID_SOCKET && shipit->ea_using_stream) {
+        res_io_tcp_attach(shipit);
+        shared = (shipit->ea_socket != INVALID_SOCKET);
+    }
+
     /* don't send too many packets at once. */
     if (shipit->ea_socket == INVALID_SOCKET && _open_sockets >= _max_fd) {
         res_log(NULL, LOG_DEBUG, "libsres: ""ea %p too many packets in flight",
@@ -435,19 +1250,31 @@ res_io_send(struct expected_arrival *shipit)
      * which causes the source to be cancelled next go-round.
      */
     if (shipit->ea_socket == INVALID_SOCKET) {
-        int i = shipit->ea_which_address;
-        int af =  shipit->ea_ns->ns_address[i]->ss_family;
+        int af;
+        int reused = 0;
 
-        shipit->ea_socket = socket(af, socket_type, 0);
-        if (shipit->ea_socket == INVALID_SOCKET) {
-            res_log(NULL,LOG_ERR,"libsres: ""socket() failed, errno = %d %s",
-                    errno, strerror(errno));
-            return SR_IO_SOCKET_ERROR;
+        i = shipit->ea_which_address;
+        af = shipit->ea_ns->ns_address[i]->ss_family;
+
+#ifdef RES_IO_UDP_POOL
+        if (socket_type == SOCK_DGRAM &&
+            0 == res_io_udp_pool_get(shipit, af))
+            reused = 1;
+#endif
+        if (!reused) {
+            shipit->ea_socket = socket(af, socket_type, 0);
+            if (shipit->ea_socket == INVALID_SOCKET) {
+                res_log(NULL,LOG_ERR,"libsres: ""socket() failed, errno = %d %s",
+                        errno, strerror(errno));
+                return SR_IO_SOCKET_ERROR;
+            }
         }
         ++_open_sockets;
+        /* the socket is not yet being watched by this query */
+        shipit->ea_waiter = NULL;
 
         /* Set the source port */
-        if (0 != bind_to_random_source(af, shipit->ea_socket)) {
+        if (!reused && 0 != bind_to_random_source(af, shipit->ea_socket)) {
             /* error */
             res_io_retry_source(shipit);
             return SR_IO_SOCKET_ERROR;
@@ -490,6 +1317,22 @@ res_io_send(struct expected_arrival *shipit)
             res_io_reset_source(shipit);
             return SR_IO_SOCKET_ERROR;
         }
+
+        if (socket_type == SOCK_STREAM)
+            res_io_tcp_new_conn(shipit, socket_size);
+
+#ifdef RES_IO_UDP_POOL
+        if (socket_type == SOCK_DGRAM) {
+            if (reused) {
+                res_io_udp_drain(shipit->ea_socket);
+            } else {
+                gettimeofday(&timeout, NULL);
+                shipit->ea_socket_birth = timeout.tv_sec;
+                shipit->ea_socket_uses = 0;
+            }
+            shipit->ea_socket_uses++;
+        }
+#endif
     }
 
     /*
@@ -504,38 +1347,68 @@ res_io_send(struct expected_arrival *shipit)
 
 
         if ((bytes_sent =
-             send(shipit->ea_socket, (const char *)&length_n, sizeof(length_n), 0))
+             send(shipit->ea_socket, (const char *)&length_n, sizeof(length_n),
+                  RES_IO_SEND_FLAGS))
             == SOCKET_ERROR) {
-            res_io_reset_source(shipit);
-            return SR_IO_SOCKET_ERROR;
+            goto send_error;
         }
 
 
         if (bytes_sent != sizeof(length_n)) {
-            res_io_reset_source(shipit);
-            return SR_IO_SOCKET_ERROR;
+            goto send_error;
         }
     }
 
     bytes_sent = send(shipit->ea_socket, (const char*)shipit->ea_signed,
-                      shipit->ea_signed_length, 0);
+                      shipit->ea_signed_length, RES_IO_SEND_FLAGS);
     if (bytes_sent != shipit->ea_signed_length) {
         res_log(NULL, LOG_ERR, "libsres: "
                 "Closing socket %d, sending %d bytes failed (rc %d)",
                 shipit->ea_socket, shipit->ea_signed_length, bytes_sent);
-        res_io_reset_source(shipit);
-        return SR_IO_SOCKET_ERROR;
+        goto send_error;
     }
 
-    //delay = shipit->ea_ns->ns_retrans
-    //    << (shipit->ea_ns->ns_retry + 1 - shipit->ea_remaining_attempts--);
-    delay = shipit->ea_ns->ns_retrans;
+    /*
+     * Wait for a response as long as the round trip times seen from
+     * this address suggest, doubling that for every retransmission.
+     * The last attempt on an address always gets the full ns_retrans.
+     */
+    max_delay = shipit->ea_ns->ns_retrans * 1000L;
     shipit->ea_remaining_attempts--;
-    res_log(NULL, LOG_DEBUG, "libsres: ""next try delay %d", delay);
-    set_alarms(shipit, delay, res_get_timeout(shipit->ea_ns));
+    if (shipit->ea_remaining_attempts > 0) {
+        delay = res_infra_rto(
+                    shipit->ea_ns->ns_address[shipit->ea_which_address],
+                    max_delay);
+        for (i = 0; i < shipit->ea_sends && delay < max_delay; i++)
+            delay *= 2;
+        if (delay > max_delay)
+            delay = max_delay;
+    } else
+        delay = max_delay;
+    shipit->ea_sends++;
+    gettimeofday(&shipit->ea_sent, NULL);
+    shipit->ea_rto = delay;
+    res_log(NULL, LOG_DEBUG, "libsres: ""next try delay %ld ms", delay);
+    set_alarms_ms(shipit, delay, res_get_timeout(shipit->ea_ns));
     res_print_ea(shipit);
+#ifdef RES_IO_EPOLL
+    /* the response will wake up the thread that sent the query */
+    res_io_watch(shipit);
+#endif
 
     return SR_IO_UNSET;
+
+  send_error:
+    if (shared) {
+        /*
+         * The server may have closed the connection that we tried
+         * to share; try again over a new one
+         */
+        res_io_close_socket(shipit, FALSE);
+        return res_io_send(shipit);
+    }
+    res_io_reset_source(shipit);
+    return SR_IO_SOCKET_ERROR;
 }
 
 /*
@@ -639,6 +1512,10 @@ res_nsfallback_ea(struct expected_arrival *ea, struct timeval *closest_event,
         (temp->ea_ns->ns_edns0_size > 0)) {
         for (i = 0; i < fallback_max_index; i++) {
             if (temp->ea_ns->ns_edns0_size > edns0_fallback[i]) {
+                /* remember this for later queries to the same address */
+                res_infra_edns0_failed(
+                    temp->ea_ns->ns_address[temp->ea_which_address],
+                    old_size);
                 /* try using a lower edns0 value */
                 temp->ea_ns->ns_edns0_size = edns0_fallback[i];
                 if (edns0_fallback[i] == 0) {
@@ -692,11 +1569,7 @@ res_nsfallback_ea(struct expected_arrival *ea, struct timeval *closest_event,
     }
 
     /** close socket so retry uses different port */
-    if (temp->ea_socket != INVALID_SOCKET) {
-        CLOSESOCK(temp->ea_socket);
-        --_open_sockets;
-    }
-    temp->ea_socket = INVALID_SOCKET;
+    res_io_close_socket(temp, FALSE);
 
     res_log(NULL, LOG_INFO, "libsres: "
             "ns fallback for {%s %s(%d) %s(%d)}, edns0 size %d > %d",
@@ -711,6 +1584,9 @@ static void
 res_io_next_address(struct expected_arrival *ea,
                     const char *more_prefix, const char *no_more_str)
 {
+    if (ea->ea_response == NULL)
+        res_infra_unreachable(ea->ea_ns->ns_address[ea->ea_which_address]);
+
     /*
      * If there is another address, move to it else cancel it 
      */
@@ -718,12 +1594,9 @@ res_io_next_address(struct expected_arrival *ea,
         /*
          * Start over with new address 
          */
-        if (ea->ea_socket != INVALID_SOCKET) {
-            CLOSESOCK (ea->ea_socket);
-            --_open_sockets;
-            ea->ea_socket = INVALID_SOCKET;
-        }
+        res_io_close_socket(ea, TRUE);
         ea->ea_which_address++;
+        ea->ea_sends = 0;
         ea->ea_remaining_attempts = ea->ea_ns->ns_retry+1;
         set_alarms(ea, 0, res_get_timeout(ea->ea_ns));
         res_log(NULL, LOG_INFO,
@@ -746,6 +1619,29 @@ res_io_next_address(struct expected_arrival *ea,
     }
     res_print_ea(ea);
 }
+/*
+ * If the last query sent by ea has gone unanswered for as long as we
+ * meant to wait for it, count that against the address it was sent to
+ */
+static void
+res_io_note_timeout(struct expected_arrival *ea, struct timeval *now)
+{
+    struct timeval  elapsed;
+    long            waited;
+
+    if (ea->ea_sends == 0 || ea->ea_rto < 0 || ea->ea_response != NULL)
+        return;
+
+    timersub(now, &ea->ea_sent, &elapsed);
+    waited = elapsed.tv_sec * 1000 + elapsed.tv_usec / 1000;
+    if (waited < ea->ea_rto)
+        return; /* tried again early for some other reason */
+
+    res_infra_rtt_timeout(ea->ea_ns->ns_address[ea->ea_which_address],
+                          waited);
+    ea->ea_rto = -1; /* only count it once */
+}
+
 /*
  * net_change : optional pointer for returning the net change in the
  *              number of open/active sockets.
@@ -798,6 +1694,7 @@ res_io_check_ea_list(struct expected_arrival *ea, struct timeval *next_evt,
              ((0 == ea->ea_remaining_attempts) && LTEQ(ea->ea_next_try, (*now)))) {
             if (net_change && ea->ea_socket != INVALID_SOCKET)
                 --(*net_change);
+            res_io_note_timeout(ea, now);
             if (1 != res_nsfallback_ea(ea, next_evt, NULL))
                 res_io_next_address(ea, "TIMEOUTS", "TIMEOUT - CANCELING");
         }
@@ -808,6 +1705,7 @@ res_io_check_ea_list(struct expected_arrival *ea, struct timeval *next_evt,
         else if (LTEQ(ea->ea_next_try, (*now))) {
             int needed_new_socket = (ea->ea_socket == INVALID_SOCKET);
             res_log(NULL, LOG_DEBUG, "libsres: "" retry");
+            res_io_note_timeout(ea, now);
             while (ea->ea_remaining_attempts != -1) {
                 if (res_io_send(ea) == SR_IO_SOCKET_ERROR) {
                     res_io_next_address(ea, "ERROR",
@@ -1085,7 +1983,12 @@ res_io_select_info(struct expected_arrival *ea_list, int *nfds,
             continue;
         }
 
-        if (read_descriptors &&
+#ifdef RES_IO_EPOLL
+        if (read_descriptors)
+            res_io_watch(ea_list);
+#endif
+
+        if (read_descriptors && RES_IO_IN_FDSET(ea_list->ea_socket) &&
             FD_ISSET(ea_list->ea_socket, read_descriptors)) {
             ++skipped;
             res_log(NULL,LOG_DEBUG+1, "libsres:""   fd %d already set",
@@ -1096,9 +1999,10 @@ res_io_select_info(struct expected_arrival *ea_list, int *nfds,
         ++count;
         res_log(NULL,LOG_DEBUG, "libsres:""   fd %d added, rem %d",
                 ea_list->ea_socket, ea_list->ea_remaining_attempts);
-        if (read_descriptors)
+        if (read_descriptors && RES_IO_IN_FDSET(ea_list->ea_socket))
             FD_SET(ea_list->ea_socket, read_descriptors);
-        if (nfds && (ea_list->ea_socket >= *nfds))
+        if (nfds && RES_IO_IN_FDSET(ea_list->ea_socket) &&
+            (ea_list->ea_socket >= *nfds))
             *nfds = ea_list->ea_socket + 1;
 
         if (timeout) {
@@ -1172,6 +2076,108 @@ res_io_select_sockets(fd_set * read_descriptors, struct timeval *timeout)
     return ready;
 }
 
+#ifdef RES_IO_EPOLL
+/*
+ * Wait for data on the sockets registered with the calling thread's
+ * epoll instance. For compatibility, read_descriptors is rewritten to
+ * hold the ready descriptors (those below FD_SETSIZE), as select()
+ * would.
+ */
+static int
+res_io_wait_sockets(fd_set * read_descriptors, struct timeval *timeout)
+{
+    struct epoll_event events[RES_IO_MAX_EVENTS];
+    struct res_io_waiter *w;
+    long            msec;
+    int             i, ready;
+
+    if ((w = res_io_get_waiter()) == NULL)
+        return res_io_select_sockets(read_descriptors, timeout);
+
+    /* epoll_wait() takes an int; a far-off deadline just means waiting long */
+    if (timeout->tv_sec < 0)
+        msec = 0;
+    else if (timeout->tv_sec >= INT_MAX / 1000)
+        msec = INT_MAX;
+    else
+        msec = timeout->tv_sec * 1000L + (timeout->tv_usec + 999) / 1000;
+    if (msec < 0)
+        msec = 0;
+    res_log(NULL, LOG_DEBUG, "libsres: ""EPOLL wait, timeout %ld.%ld",
+            timeout->tv_sec, timeout->tv_usec);
+    ready = epoll_wait(w->rw_fd, events, RES_IO_MAX_EVENTS, (int) msec);
+    res_log(NULL, LOG_DEBUG, "libsres: "" %d ready fds", ready);
+
+    if (read_descriptors) {
+        FD_ZERO(read_descriptors);
+        for (i = 0; i < ready; i++) {
+            if (RES_IO_IN_FDSET(events[i].data.fd))
+                FD_SET(events[i].data.fd, read_descriptors);
+        }
+    }
+    return ready;
+}
+
+static void res_io_read_ea(struct expected_arrival *arrival);
+
+/*
+ * Look for data on all active sockets of ea_list without blocking,
+ * and read whatever has arrived. Returns the number of sockets that
+ * had activity, or SOCKET_ERROR.
+ */
+static int
+res_io_poll_ea(struct expected_arrival *ea_list)
+{
+    struct pollfd   pfds_buf[16];
+    struct pollfd  *pfds = pfds_buf;
+    struct expected_arrival *ea;
+    int             nfds = 0, ready, i;
+
+    for (ea = ea_list; ea; ea = ea->ea_next) {
+        if (ea->ea_remaining_attempts != -1 && 
+            ea->ea_socket != INVALID_SOCKET)
+            nfds++;
+    }
+    if (nfds == 0)
+        return 0;
+    if (nfds > (int)(sizeof(pfds_buf)/sizeof(pfds_buf[0]))) {
+        pfds = (struct pollfd *) MALLOC(nfds * sizeof(struct pollfd));
+        if (pfds == NULL)
+            return SOCKET_ERROR;
+    }
+
+    for (i = 0, ea = ea_list; ea; ea = ea->ea_next) {
+        if (ea->ea_remaining_attempts == -1 || 
+            ea->ea_socket == INVALID_SOCKET)
+            continue;
+        pfds[i].fd = ea->ea_socket;
+        pfds[i].events = POLLIN;
+        pfds[i].revents = 0;
+        i++;
+    }
+
+    ready = poll(pfds, nfds, 0);
+    res_log(NULL, LOG_DEBUG, "libsres: ""POLL on %d fds, %d ready", 
+            nfds, ready);
+
+    if (ready > 0) {
+        /* the list is not changed by reading, so the order still holds */
+        for (i = 0, ea = ea_list; ea && i < nfds; ea = ea->ea_next) {
+            if (ea->ea_remaining_attempts == -1 || 
+                ea->ea_socket == INVALID_SOCKET ||
+                ea->ea_socket != pfds[i].fd)
+                continue;
+            if (pfds[i++].revents != 0)
+                res_io_read_ea(ea);
+        }
+    }
+
+    if (pfds != pfds_buf)
+        FREE(pfds);
+    return ready;
+}
+#endif /* RES_IO_EPOLL */
+
 void
 wait_for_res_data(fd_set * pending_desc, struct timeval *closest_event)
 {
@@ -1192,7 +2198,13 @@ wait_for_res_data(fd_set * pending_desc, struct timeval *closest_event)
     res_log(NULL, LOG_DEBUG, "libsres: "" wait for closest event %ld,%ld",
             closest_event->tv_sec, closest_event->tv_usec);
     res_io_set_timeout(&timeout, closest_event);
+    if (res_io_take_kick())
+        timerclear(&timeout);
+#ifdef RES_IO_EPOLL
+    ready = res_io_wait_sockets(pending_desc, &timeout); 
+#else
     ready = res_io_select_sockets(pending_desc, &timeout); 
+#endif
     res_log(NULL, LOG_DEBUG, "libsres: ""   %d ready", ready);
 	
     // ignore return value from previous function, 
@@ -1259,11 +2271,7 @@ res_io_get_a_response(struct expected_arrival *ea_list, u_char ** answer,
             res_log(NULL, LOG_DEBUG, "libsres: "
                     "*** dropped response for ea %p rc %d", ea_list, retval);
             /** close socket so retry uses different port */
-            if (ea_list->ea_socket != INVALID_SOCKET) {
-                CLOSESOCK (ea_list->ea_socket);
-                --_open_sockets;
-                ea_list->ea_socket = INVALID_SOCKET;
-            }
+            res_io_close_socket(ea_list, FALSE);
             res_print_ea(ea_list);
             _clone_respondent(ea_list, respondent);
             set_alarms(ea_list, 0, res_get_timeout(ea_list->ea_ns));
@@ -1300,91 +2308,234 @@ res_io_get_a_response(struct expected_arrival *ea_list, u_char ** answer,
     return retval;
 }
 
-size_t
-complete_read(SOCKET sock, u_char *field, size_t length)
+/*
+ * Continue reading the length-prefixed message that tr holds the
+ * beginning of, for as long as sock has data. Returns SR_IO_UNSET and
+ * hands over the message once all of it has arrived, and 
+ * SR_IO_NO_ANSWER_YET if more is still to come. Nothing here blocks:
+ * without MSG_DONTWAIT, only the one recv() that the socket being
+ * readable allows for is made.
+ */
+static int
+res_io_tcp_read_msg(SOCKET sock, struct res_io_tcp_read *tr,
+                    u_char **msg, size_t *msg_len)
 {
-    ssize_t             bytes;
-    size_t             bytes_read = 0;
-#if 0
-#ifdef MSG_DONTWAIT
-    int                flags = MSG_DONTWAIT;
-#else
-    int                flags =0;
-#endif
-#endif
-    int                flags =0;/* XXX For now don't enable MSG_DONTWAIT */
+    ssize_t         bytes;
+    size_t          want;
+    u_char         *field;
+    int             reads = 0;
+
+    for (;;) {
+        if (tr->tr_have < sizeof(tr->tr_len_n)) {
+            field = tr->tr_len_n + tr->tr_have;
+            want = sizeof(tr->tr_len_n) - tr->tr_have;
+        } else {
+            if (tr->tr_msg == NULL) {
+                tr->tr_msg_len = (tr->tr_len_n[0] << 8) | tr->tr_len_n[1];
+                if (tr->tr_msg_len == 0) {
+                    res_log(NULL, LOG_INFO, "libsres: "
+                            "zero length message on socket %d", sock);
+                    return SR_IO_SOCKET_ERROR;
+                }
+                tr->tr_msg = (u_char *) MALLOC(tr->tr_msg_len);
+                if (tr->tr_msg == NULL)
+                    return SR_IO_MEMORY_ERROR;
+            }
+            want = tr->tr_msg_len - (tr->tr_have - sizeof(tr->tr_len_n));
+            if (want == 0) {
+                *msg = tr->tr_msg;
+                *msg_len = tr->tr_msg_len;
+                tr->tr_msg = NULL;
+                tr->tr_msg_len = 0;
+                tr->tr_have = 0;
+                return SR_IO_UNSET;
+            }
+            field = tr->tr_msg + tr->tr_msg_len - want;
+        }
 
-    memset(field, '\0', length);
+        if (reads++ > 0 && RES_IO_RECV_FLAGS == 0)
+            return SR_IO_NO_ANSWER_YET;
 
-    do {
-        bytes = recv(sock, field + bytes_read, length - bytes_read, flags);
+        bytes = recv(sock, (char *) field, want, RES_IO_RECV_FLAGS);
         if (bytes < 0) {
-            break;
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return SR_IO_NO_ANSWER_YET;
+            res_log(NULL, LOG_INFO, "libsres: ""read error on socket %d: "
+                    "errno %d %s.", sock, errno, strerror(errno));
+            return SR_IO_SOCKET_ERROR;
         }
-        bytes_read += bytes;
-    } while (bytes_read < length && bytes > 0);
+        if (bytes == 0) {
+            res_log(NULL, LOG_INFO, "libsres: ""socket %d shutdown after "
+                    "%zd bytes of message", sock, tr->tr_have);
+            return SR_IO_SOCKET_ERROR;
+        }
+        tr->tr_have += bytes;
+    }
+}
 
-    if (0 == bytes)
-        res_log(NULL, LOG_INFO, "libsres: ""socket shutdown.", socket);
-    if (bytes_read != length) {
-        res_log(NULL, LOG_INFO,
-                "libsres: ""incomplete read on socket %d; read %d of %d\n",
-                sock, bytes_read, length);
-        if (bytes == SOCKET_ERROR) {
-            res_log(NULL, LOG_INFO, "libsres: ""  errno %d %s.", errno,
-                    strerror(errno));
-            return -1;
+#ifdef RES_IO_TCP_SHARE
+/*
+ * Hand any responses that were parked for the queries in ea_list
+ * over to them. Returns the number of responses handed over.
+ */
+static int
+res_io_tcp_pull(struct expected_arrival *ea_list)
+{
+    struct res_io_tcp_pending *tp;
+    int             count = 0;
+
+    pthread_mutex_lock(&tcp_mutex);
+    for (; ea_list; ea_list = ea_list->ea_next) {
+        if (ea_list->ea_tcp_conn == NULL || ea_list->ea_response != NULL)
+            continue;
+        for (tp = ea_list->ea_tcp_conn->tc_pending; tp; tp = tp->tp_next) {
+            if (tp->tp_ea != ea_list || tp->tp_response == NULL)
+                continue;
+            ea_list->ea_response = tp->tp_response;
+            ea_list->ea_response_length = tp->tp_response_length;
+            tp->tp_response = NULL;
+            tp->tp_response_length = 0;
+            ++count;
+            break;
         }
     }
+    pthread_mutex_unlock(&tcp_mutex);
 
-    return bytes_read;
+    return count;
 }
 
+/*
+ * Read responses from the connection that arrival shares with other
+ * queries, until arrival has its response or there is nothing left
+ * to read. Responses for the other queries are parked for them.
+ */
 static int
-res_io_read_tcp(struct expected_arrival *arrival)
+res_io_read_tcp_conn(struct expected_arrival *arrival)
 {
-    u_int16_t    len_n;
-    size_t       len_h;
+    struct res_io_tcp_conn *tc;
+    struct res_io_tcp_pending *tp;
+    struct pollfd   pfd;
+    size_t          len_h;
+    u_char         *response;
+    int             answered;
+    int             rc = SR_IO_NO_ANSWER_YET;
+
+    pthread_mutex_lock(&tcp_mutex);
+    tc = arrival->ea_tcp_conn;
+
+    while (tc != NULL && rc == SR_IO_NO_ANSWER_YET) {
+
+        pfd.fd = tc->tc_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 0) <= 0)
+            break;
 
-    /*
-     * Read length 
-     */
-    if (complete_read(arrival->ea_socket, (u_char *)&len_n, sizeof(len_n))
-        != sizeof(len_n)) {
         /*
-         * reset this source
+         * Pick up the next message where the last read left off
          */
-        res_io_reset_source(arrival);
-        return SR_IO_SOCKET_ERROR;
+        rc = res_io_tcp_read_msg(tc->tc_fd, &tc->tc_read, &response, &len_h);
+        if (rc == SR_IO_NO_ANSWER_YET)
+            break;
+        if (rc != SR_IO_UNSET)
+            goto error;
+        rc = SR_IO_NO_ANSWER_YET;
+
+        /*
+         * Find the query that this is a response to
+         */
+        for (tp = tc->tc_pending; tp; tp = tp->tp_next) {
+            if (tp->tp_response == NULL && len_h > HFIXEDSZ &&
+                !memcmp(tp->tp_ea->ea_signed, response, sizeof(u_int16_t)) &&
+                !res_quecmp(tp->tp_ea->ea_signed, response))
+                break;
+        }
+        tc->tc_answered++;
+        if (tp == NULL) {
+            res_log(NULL, LOG_INFO, "libsres: "
+                    "dropping unexpected response on tcp fd %d", tc->tc_fd);
+            FREE(response);
+        } else if (tp->tp_ea == arrival) {
+            arrival->ea_response = response;
+            arrival->ea_response_length = len_h;
+            rc = SR_IO_UNSET;
+        } else {
+            res_log(NULL, LOG_DEBUG, "libsres: "
+                    "parking response on tcp fd %d for ea %p", 
+                    tc->tc_fd, tp->tp_ea);
+            tp->tp_response = response;
+            tp->tp_response_length = len_h;
+        }
     }
+    pthread_mutex_unlock(&tcp_mutex);
+    return rc;
+
+  error:
+    /* 
+     * The connection can't be trusted any more; this also sets up
+     * the queries that were waiting on it (including arrival) to be
+     * sent again. If it never worked, give up on this address.
+     */
+    answered = tc->tc_answered;
+    res_io_tcp_close_conn(tc);
+    pthread_mutex_unlock(&tcp_mutex);
+    if (!answered)
+        res_io_reset_source(arrival);
+    return (rc == SR_IO_MEMORY_ERROR) ? rc : SR_IO_SOCKET_ERROR;
+}
+#endif /* RES_IO_TCP_SHARE */
+
+static int
+res_io_read_tcp(struct expected_arrival *arrival)
+{
+    u_char      *response;
+    size_t       len_h;
+    int          rc;
 
-    len_h = ntohs(len_n);
+#ifdef RES_IO_TCP_SHARE
+    if (arrival->ea_tcp_conn != NULL)
+        return res_io_read_tcp_conn(arrival);
+#endif
+
+    if (arrival->ea_tcp_read == NULL) {
+        arrival->ea_tcp_read = (struct res_io_tcp_read *)
+            MALLOC(sizeof(struct res_io_tcp_read));
+        if (arrival->ea_tcp_read == NULL) {
+            /*
+             * retry this source 
+             */
+            res_io_retry_source(arrival);
+            return SR_IO_MEMORY_ERROR;
+        }
+        memset(arrival->ea_tcp_read, 0, sizeof(struct res_io_tcp_read));
+    }
 
     /*
-     * read() message 
+     * Read whatever has arrived of the length and message
      */
-    arrival->ea_response = (u_char *) MALLOC(len_h * sizeof(u_char));
-    if (arrival->ea_response == NULL) {
+    rc = res_io_tcp_read_msg(arrival->ea_socket, arrival->ea_tcp_read,
+                             &response, &len_h);
+    if (rc == SR_IO_NO_ANSWER_YET)
+        return rc;
+    if (rc == SR_IO_MEMORY_ERROR) {
         /*
          * retry this source 
          */
         res_io_retry_source(arrival);
-        return SR_IO_MEMORY_ERROR;
+        return rc;
     }
-
-    arrival->ea_response_length = len_h;
-
-    if (complete_read(arrival->ea_socket, (u_char *)arrival->ea_response, len_h) !=
-        len_h) {
-        FREE(arrival->ea_response);
-        arrival->ea_response = NULL;
-        arrival->ea_response_length = 0;
+    if (rc != SR_IO_UNSET) {
         /*
-         * reset this source 
+         * reset this source
          */
         res_io_reset_source(arrival);
         return SR_IO_SOCKET_ERROR;
     }
+
+    arrival->ea_response = response;
+    arrival->ea_response_length = len_h;
     return SR_IO_UNSET;
 }
 
@@ -1498,11 +2649,8 @@ res_switch_to_tcp(struct expected_arrival *ea)
      * Use the same "ea_which_address," since it already got a rise. 
      */
     ea->ea_using_stream = TRUE;
-    if (ea->ea_socket != INVALID_SOCKET) {
-        CLOSESOCK(ea->ea_socket);
-        --_open_sockets;
-        ea->ea_socket = INVALID_SOCKET;
-    }
+    res_io_close_socket(ea, TRUE);
+    ea->ea_sends = 0;
     ea->ea_remaining_attempts = ea->ea_ns->ns_retry+1;
     set_alarms(ea, 0, res_get_timeout(ea->ea_ns));
 }
@@ -1528,11 +2676,7 @@ res_switch_all_to_tcp(struct expected_arrival *ea)
         ea->ea_response_length = 0;
 
         ea->ea_using_stream = TRUE;
-        if (ea->ea_socket != INVALID_SOCKET) {
-            CLOSESOCK(ea->ea_socket);
-            --_open_sockets;
-            ea->ea_socket = INVALID_SOCKET;
-        }
+        res_io_close_socket(ea, TRUE);
     }
 }
 
@@ -1549,11 +2693,92 @@ res_switch_all_to_tcp_tid(int tid)
         res_switch_all_to_tcp(ea);
 }
 
+/*
+ * Read whatever has arrived on the socket used by arrival
+ */
+static void
+res_io_read_ea(struct expected_arrival *arrival)
+{
+    int             rc;
+
+    res_log(NULL, LOG_DEBUG, "libsres: ""ACTIVITY on %d",
+            arrival->ea_socket);
+    res_print_ea(arrival);
+
+    if (arrival->ea_using_stream) {
+        /** Use TCP */
+        rc = res_io_read_tcp(arrival);
+    } else {
+        /** Use UDP */
+        rc = res_io_read_udp(arrival);
+    }
+    res_log(NULL, LOG_DEBUG, "libsres: ""Read %zd bytes via %s",
+            arrival->ea_response_length,
+               arrival->ea_using_stream ? "TCP" : "UDP");
+    if (SR_IO_UNSET != rc)
+        return;
+
+    /*
+     * Make sure this is the query we want (buffer id's match).
+     * Check the query line to make sure it's right.
+     *
+     * I'm not sure this should be done at this level - but
+     * res_send does it.  It could be a sign of an attack,
+     * but I'll leave it to a network sniffer to figure it
+     * out for the time being.
+     */
+    if (memcmp
+        (arrival->ea_signed, arrival->ea_response,
+         sizeof(u_int16_t))
+        || res_quecmp(arrival->ea_signed, arrival->ea_response)) {
+        /*
+         * The the query and response ID's/query lines don't match 
+         */
+        res_log(NULL, LOG_WARNING, 
+                "libsres: ""dropping response with rcode=%x : " 
+                "query and response ID's or query names don't match",
+                ((HEADER *) arrival->ea_response)->rcode);
+        FREE(arrival->ea_response);
+        arrival->ea_response = NULL;
+        arrival->ea_response_length = 0;
+        return;
+    }
+
+    /*
+     * A response to a query that was only sent once tells us the
+     * round trip time to the server; if the query was sent again,
+     * we can't tell which one this answers.
+     */
+    if (!arrival->ea_using_stream && arrival->ea_sends == 1) {
+        struct timeval now, elapsed;
+
+        gettimeofday(&now, NULL);
+        timersub(&now, &arrival->ea_sent, &elapsed);
+        res_infra_rtt_sample(
+            arrival->ea_ns->ns_address[arrival->ea_which_address],
+            elapsed.tv_sec * 1000 + elapsed.tv_usec / 1000);
+    }
+
+    res_infra_response(arrival->ea_ns->ns_address[arrival->ea_which_address],
+                       (arrival->ea_ns->ns_options & SR_QUERY_SET_DO) ?
+                       arrival->ea_ns->ns_edns0_size : -1,
+                       ((HEADER *) arrival->ea_response)->tc,
+                       arrival->ea_using_stream);
+
+    /*
+     * See if the message was truncated
+     * switch to TCP
+     * reinitialize source (just like we're beginning UDP)
+     */
+    if (!arrival->ea_using_stream
+        && ((HEADER *) arrival->ea_response)->tc)
+        res_switch_to_tcp(arrival);
+}
+
 int
 res_io_read(fd_set * read_descriptors, struct expected_arrival *ea_list)
 {
-    int             handled = 0, rc;
-    struct expected_arrival *arrival;
+    int             handled = 0;
 
     res_log(NULL,LOG_DEBUG,"libsres: "" res_io_read ea %p", ea_list);
 
@@ -1563,67 +2788,13 @@ res_io_read(fd_set * read_descriptors, struct expected_arrival *ea_list)
          */
         if ((ea_list->ea_remaining_attempts == -1) ||
             (ea_list->ea_socket == INVALID_SOCKET) ||
+            !RES_IO_IN_FDSET(ea_list->ea_socket) ||
             ! FD_ISSET(ea_list->ea_socket, read_descriptors))
             continue;
 
-        { /* dummy block to preserve indentation; remove later */
-
-            res_log(NULL, LOG_DEBUG, "libsres: ""ACTIVITY on %d",
-                    ea_list->ea_socket);
-            ++handled;
-            FD_CLR(ea_list->ea_socket, read_descriptors);
-
-            arrival = ea_list;
-            res_print_ea(arrival);
-
-            if (arrival->ea_using_stream) {
-                /** Use TCP */
-                rc = res_io_read_tcp(arrival);
-            } else {
-                /** Use UDP */
-                rc = res_io_read_udp(arrival);
-            }
-            res_log(NULL, LOG_DEBUG, "libsres: ""Read %zd bytes via %s",
-                    arrival->ea_response_length,
-                       arrival->ea_using_stream ? "TCP" : "UDP");
-            if (SR_IO_UNSET != rc)
-                continue;
-
-            /*
-             * Make sure this is the query we want (buffer id's match).
-             * Check the query line to make sure it's right.
-             *
-             * I'm not sure this should be done at this level - but
-             * res_send does it.  It could be a sign of an attack,
-             * but I'll leave it to a network sniffer to figure it
-             * out for the time being.
-             */
-            if (memcmp
-                (arrival->ea_signed, arrival->ea_response,
-                 sizeof(u_int16_t))
-                || res_quecmp(arrival->ea_signed, arrival->ea_response)) {
-                /*
-                 * The the query and response ID's/query lines don't match 
-                 */
-                res_log(NULL, LOG_WARNING, 
-                        "libsres: ""dropping response with rcode=%x : " 
-                        "query and response ID's or query names don't match",
-                        ((HEADER *) arrival->ea_response)->rcode);
-                FREE(arrival->ea_response);
-                arrival->ea_response = NULL;
-                arrival->ea_response_length = 0;
-                continue;
-            }
-
-            /*
-             * See if the message was truncated
-             * switch to TCP
-             * reinitialize source (just like we're beginning UDP)
-             */
-            if (!arrival->ea_using_stream
-                && ((HEADER *) arrival->ea_response)->tc)
-                res_switch_to_tcp(arrival);
-        }
+        ++handled;
+        FD_CLR(ea_list->ea_socket, read_descriptors);
+        res_io_read_ea(ea_list);
     }
     res_log(NULL,LOG_DEBUG,"libsres: ""   handled %d", handled);
     return handled;
@@ -1638,12 +2809,14 @@ res_io_accept(int transaction_id, fd_set *pending_desc,
 {
     int             ret_val;
     struct timeval  next_event;
+#ifndef RES_IO_EPOLL
     struct timeval zero_time;
     fd_set read_descriptors;
 
     timerclear(&zero_time);
 
     FD_ZERO(&read_descriptors);
+#endif
 
     res_log(NULL, LOG_DEBUG, "libsres: ""Calling io_accept");
 
@@ -1670,12 +2843,35 @@ res_io_accept(int transaction_id, fd_set *pending_desc,
         return SR_IO_GOT_ANSWER;
     }
 
+    /*
+     * Responses may have been read for us while looking for those
+     * of other queries that share our TCP connections.
+     */
+    if (res_io_tcp_pull(transactions[transaction_id]) > 0 &&
+        res_io_get_a_response(transactions[transaction_id],
+                              answer, answer_length,
+                              respondent) == SR_IO_GOT_ANSWER) {
+        pthread_mutex_unlock(&mutex);
+        return SR_IO_GOT_ANSWER;
+    }
+
     /*
      * Decision time: does this call only look at the sockets used by
      * its transaction id, or does it look at all?
      * 
      * Answer for now -> just the sockets we are interested in.
      */
+#ifdef RES_IO_EPOLL
+    /*
+     * The poll is non-blocking, so there is no need to let go
+     * of the lock here. Whatever is ready is read right away.
+     */
+    ret_val = res_io_poll_ea(transactions[transaction_id]);
+    if (ret_val == SOCKET_ERROR) {
+        pthread_mutex_unlock(&mutex);
+        return SR_IO_SOCKET_ERROR;
+    }
+#else
     res_io_collect_sockets(&read_descriptors, 
                            transactions[transaction_id]);
     pthread_mutex_unlock(&mutex);
@@ -1693,6 +2889,7 @@ res_io_accept(int transaction_id, fd_set *pending_desc,
         pthread_mutex_unlock(&mutex);
         return SR_IO_NO_ANSWER;
     }
+#endif
 
     if (ret_val == 0) { 
         /** There are sources, but none are talking (yet) */
@@ -1708,10 +2905,12 @@ res_io_accept(int transaction_id, fd_set *pending_desc,
         return SR_IO_NO_ANSWER_YET;
     }
 
+#ifndef RES_IO_EPOLL
     /*
      * React to the active desciptors.
      */
     res_io_read(&read_descriptors, transactions[transaction_id]);
+#endif
 
     /*
      * Pluck the answer and return it to the caller.
@@ -1756,6 +2955,11 @@ res_io_cancel_all(void)
         j = i;
         res_cancel(&j);
     }
+#ifdef RES_IO_UDP_POOL
+    res_io_udp_pool_flush();
+#endif
+    res_io_tcp_flush();
+    res_infra_flush();
 }
 
 void
@@ -1766,6 +2970,10 @@ res_print_server(struct name_server *ea_ns, int i)
     char            buf[INET6_ADDRSTRLEN + 1];
     const char     *addr = NULL;
     size_t	    buflen = sizeof(buf);
+
+    if (!RES_LOG_WOULD_LOG(LOG_DEBUG))
+        return;
+
     if (AF_INET == ea_ns->ns_address[i]->ss_family)
         INET_NTOP(AF_INET, (struct sockaddr *)s, sizeof(s), buf, buflen,
                   addr);
@@ -1787,6 +2995,12 @@ res_print_ea(struct expected_arrival *ea)
 #ifdef VAL_IPV6
         struct sockaddr_in6 *s6 =
             (struct sockaddr_in6 *) ((ea->ea_ns->ns_address[i]));
+#endif
+
+        if (!RES_LOG_WOULD_LOG(LOG_DEBUG))
+            return;
+
+#ifdef VAL_IPV6
         if (AF_INET6 == ea->ea_ns->ns_address[i]->ss_family) {
 	        INET_NTOP(AF_INET6, (struct sockaddr *)s6, sizeof(s6), buf, buflen, addr);
             port = s6->sin6_port;
@@ -1928,7 +3142,7 @@ res_async_query_create(const char *name, const u_int16_t type_h,
     struct name_server *ns_list = NULL;
     struct name_server *ns;
     struct expected_arrival *head = NULL, *new_ea, *temp_ea;
-    long                delay = 0;
+    long                delay_ms = 0;
 
     if ((name == NULL) || (pref_ns == NULL))
         return NULL;
@@ -1939,6 +3153,11 @@ res_async_query_create(const char *name, const u_int16_t type_h,
     if ((ret_val = clone_ns_list(&ns_list, pref_ns)) != SR_UNSET)
         return NULL;
 
+    /*
+     * try the servers (and addresses) that have been quickest first 
+     */
+    res_infra_order(&ns_list);
+
     /*
      * Loop through the list of destinations, form the query and send it
      */
@@ -1955,13 +3174,18 @@ res_async_query_create(const char *name, const u_int16_t type_h,
 
         /** create expected arrival struct */
         new_ea = res_ea_init(name, type_h, class_h,
-                             signed_query, signed_length, ns, delay);
+                             signed_query, signed_length, ns, delay_ms);
         if (NULL == new_ea) {
             FREE(signed_query);
             ret_val = SR_IO_MEMORY_ERROR;
             break; /* fatal, bail */
         }
 
+        /** skip UDP for servers that keep truncating their responses */
+        if (ns->ns_number_of_addresses > 0 &&
+            res_infra_tcp_only(ns->ns_address[0]))
+            new_ea->ea_using_stream = TRUE;
+
         /** add to list */
         if (NULL != head) {
             temp_ea = head;
@@ -1971,7 +3195,13 @@ res_async_query_create(const char *name, const u_int16_t type_h,
         } else
             head = new_ea;
 
-        delay += LIBSRES_NS_STAGGER;
+        /*
+         * bring in the next server once this one should have answered,
+         * but no later than LIBSRES_NS_STAGGER seconds
+         */
+        delay_ms += res_infra_rto((ns->ns_number_of_addresses > 0) ?
+                                  ns->ns_address[0] : NULL,
+                                  LIBSRES_NS_STAGGER * 1000L);
     }
 
     /** if bad ret_val, clear list, else send query */
@@ -1993,19 +3223,25 @@ res_async_query_select_info(struct expected_arrival *ea, int *nfds,
     res_io_select_info(ea, nfds, fds, timeout);
 }
 
+/*
+ * fds may be NULL if the sockets of ea have already been read
+ * (see res_async_ea_ready())
+ */
 int
 res_async_query_handle(struct expected_arrival *ea, int *handled, fd_set *fds)
 {
     int ret_val = SR_NO_ANSWER;
 
-    if (!ea || !handled || !fds)
+    if (!ea || !handled)
         return SR_INTERNAL_ERROR;
 
     /*
      * React to any active desciptors and see if we got a response, or
      * if we at least still have an open socket (i.e. potential response).
      */
-    *handled = res_io_read(fds, ea);
+    *handled = res_io_tcp_pull(ea);
+    if (fds)
+        *handled += res_io_read(fds, ea);
     for( ; ea; ea = ea->ea_next) {
         if (ea->ea_remaining_attempts == -1)
             continue;
@@ -2056,6 +3292,116 @@ res_async_ea_isset(struct expected_arrival *ea, fd_set *fds)
     return 0;
 }
 
+/*
+ * Read whatever has arrived on the sockets of ea, without blocking.
+ * Returns 1 if one of the queries in ea now has a response.
+ */
+int
+res_async_ea_ready(struct expected_arrival *ea)
+{
+#ifndef RES_IO_EPOLL
+    fd_set          fds;
+    struct timeval  zero;
+#endif
+
+    if (NULL == ea)
+        return 0;
+
+    res_io_tcp_pull(ea);
+#ifdef RES_IO_EPOLL
+    res_io_poll_ea(ea);
+#else
+    FD_ZERO(&fds);
+    res_io_select_info(ea, NULL, &fds, NULL);
+    timerclear(&zero);
+    if (res_io_select_sockets(&fds, &zero) > 0)
+        res_io_read(&fds, ea);
+#endif
+
+    for (; ea; ea = ea->ea_next) {
+        if (ea->ea_remaining_attempts != -1 && ea->ea_response != NULL)
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Return the descriptor that becomes readable when a response arrives
+ * for any query sent by the calling thread, or -1 if there is none.
+ * The descriptor stays the same for the lifetime of the thread.
+ */
+int
+res_io_get_pollfd(void)
+{
+#ifdef RES_IO_EPOLL
+    struct res_io_waiter *w = res_io_get_waiter();
+
+    if (w != NULL)
+        return w->rw_fd;
+#endif
+    return -1;
+}
+
+/*
+ * Consume the notifications pending on the descriptor returned by
+ * res_io_get_pollfd(), so that it only becomes readable again once
+ * more data arrives. The sockets themselves must be read after this,
+ * and res_io_rearm_pollfd() called once they have been.
+ */
+void
+res_io_clear_pollfd(void)
+{
+#ifdef RES_IO_EPOLL
+    struct epoll_event events[RES_IO_MAX_EVENTS];
+    struct res_io_waiter *w = res_io_get_waiter();
+    int             i, ready;
+
+    if (w == NULL)
+        return;
+    do {
+        ready = epoll_wait(w->rw_fd, events, RES_IO_MAX_EVENTS, 0);
+        for (i = 0; i < ready; i++) {
+            if (!res_io_fdlist_has(&w->rw_cleared, events[i].data.fd))
+                res_io_fdlist_add(&w->rw_cleared, events[i].data.fd);
+        }
+    } while (ready == RES_IO_MAX_EVENTS);
+#endif
+}
+
+/*
+ * The caller of res_io_clear_pollfd() only reads the sockets of its
+ * own queries, but the events it took may have been for queries that
+ * the thread made elsewhere (e.g. with another validator context). 
+ * Sockets that such queries still wait on are registered again, so
+ * that the descriptor becomes readable again if they have data.
+ */
+void
+res_io_rearm_pollfd(void)
+{
+#ifdef RES_IO_EPOLL
+    struct res_io_waiter *w = res_io_get_waiter();
+    struct epoll_event ev;
+    int             i, fd;
+
+    if (w == NULL)
+        return;
+    pthread_mutex_lock(&waiter_mutex);
+    for (i = 0; i < w->rw_cleared.fl_count; i++) {
+        fd = w->rw_cleared.fl_fds[i];
+        if (!res_io_fdlist_has(&w->rw_watched, fd))
+            continue;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = fd;
+        /* an edge-triggered socket with data pending fires again */
+        epoll_ctl(w->rw_fd, EPOLL_CTL_MOD, fd, &ev);
+    }
+    pthread_mutex_unlock(&waiter_mutex);
+    w->rw_cleared.fl_count = 0;
+#endif
+}
+
 int
 res_async_tid_isset(int tid, fd_set *fds)
 {
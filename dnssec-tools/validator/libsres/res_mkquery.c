@@ -73,6 +73,7 @@
 #include "res_tsig.h"
 #include "res_support.h"
 #include "res_comp.h"
+#include "res_infra.h"
 
 /*
  * Uncomment the following line to turn on debugging for this file 
@@ -217,6 +218,12 @@ res_create_query_payload(struct name_server *ns,
     if (ret_val==  -1)
         return SR_MKQUERY_INTERNAL_ERROR;
 
+    if ((ns->ns_options & SR_QUERY_SET_DO) &&
+        ns->ns_number_of_addresses > 0) {
+        /** use no more than what has been found to work for this server */
+        ns->ns_edns0_size = res_infra_edns0_size(ns->ns_address[0],
+                                                 ns->ns_edns0_size);
+    }
     if (ns->ns_options & SR_QUERY_SET_DO) {
         /** Enable EDNS0 and set the DO flag */
         ret_val = res_val_nopt(ns, query, query_limit,
@@ -428,13 +428,68 @@ u_int16_t libsres_random(void)
     return rnd;
 }
 
+/*
+ * Canonical (RFC 4034, section 6.2) lower case for each byte value;
+ * only the US-ASCII upper case letters are changed, whatever the
+ * locale
+ */
+static const u_char res_lower_table[256] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
+    0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f,
+    0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f,
+    0x40, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
+    0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x5b, 0x5c, 0x5d, 0x5e, 0x5f,
+    0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
+    0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x7b, 0x7c, 0x7d, 0x7e, 0x7f,
+    0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x8b, 0x8c, 0x8d, 0x8e, 0x8f,
+    0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0x9b, 0x9c, 0x9d, 0x9e, 0x9f,
+    0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xab, 0xac, 0xad, 0xae, 0xaf,
+    0xb0, 0xb1, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xbb, 0xbc, 0xbd, 0xbe, 0xbf,
+    0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xcb, 0xcc, 0xcd, 0xce, 0xcf,
+    0xd0, 0xd1, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xdb, 0xdc, 0xdd, 0xde, 0xdf,
+    0xe0, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xeb, 0xec, 0xed, 0xee, 0xef,
+    0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
+};
+
+#define RES_LOWER(c)    res_lower_table[(u_char)(c)]
+
+/*
+ * Compare len bytes of two labels without regard to case. Runs of
+ * identical bytes are skipped a word at a time; only where the bytes
+ * differ are they looked up in res_lower_table.
+ */
+static int
+res_label_fold_cmp(const u_char * p1, const u_char * p2, size_t len)
+{
+    unsigned long   w1, w2;
+    size_t          i = 0;
+    int             c1, c2;
+
+    while (i < len) {
+        if (len - i >= sizeof(w1)) {
+            memcpy(&w1, &p1[i], sizeof(w1));
+            memcpy(&w2, &p2[i], sizeof(w2));
+            if (w1 == w2) {
+                i += sizeof(w1);
+                continue;
+            }
+        }
+        if (p1[i] != p2[i]) {
+            c1 = RES_LOWER(p1[i]);
+            c2 = RES_LOWER(p2[i]);
+            if (c1 != c2)
+                return c1 - c2;
+        }
+        i++;
+    }
+    return 0;
+}
+
 int
 label_bytes_cmp(const u_char * field1, size_t length1, 
                 const u_char * field2, size_t length2)
 {
-    u_char        buffer1[NS_MAXCDNAME];
-    u_char        buffer2[NS_MAXCDNAME];
-    size_t        i;
     size_t        min_len;
     int           ret_val;
 
@@ -448,22 +503,9 @@ label_bytes_cmp(const u_char * field1, size_t length1,
     min_len = (length1 < length2) ? length1 : length2;
 
     /*
-     * Compare this label's first min_len bytes 
-     */
-    /*
-     * Convert to lower case first 
+     * Compare this label's first min_len bytes, ignoring case
      */
-    memcpy(buffer1, field1, min_len);
-    for (i = 0; i < min_len; i++)
-        if (isupper(buffer1[i]))
-            buffer1[i] = tolower(buffer1[i]);
-
-    memcpy(buffer2, field2, min_len);
-    for (i = 0; i < min_len; i++)
-        if (isupper(buffer2[i]))
-            buffer2[i] = tolower(buffer2[i]);
-
-    ret_val = memcmp(buffer1, buffer2, min_len);
+    ret_val = res_label_fold_cmp(field1, field2, min_len);
 
     /*
      * If they differ, propgate that 
@@ -477,6 +519,52 @@ label_bytes_cmp(const u_char * field1, size_t length1,
     return length1 - length2;
 }
 
+/*
+ * Note the offset of each of the first max_labels labels in name.
+ * Returns the number of labels (including the root label) found.
+ */
+static size_t
+res_label_offsets(const u_char * name, u_int16_t * offsets,
+                  size_t max_labels)
+{
+    size_t          n = 0, offset = 0;
+
+    while (n < max_labels) {
+        offsets[n++] = offset;
+        if (name[offset] == 0)
+            break;
+        offset += name[offset] + 1;
+    }
+    return n;
+}
+
+/*
+ * Compare the last label_cnt labels of two names whose labels start
+ * at the given offsets, rightmost label first
+ */
+static int
+res_labels_cmp(const u_char * name1, const u_int16_t * offsets1,
+               size_t labels1, const u_char * name2,
+               const u_int16_t * offsets2, size_t labels2,
+               size_t label_cnt)
+{
+    const u_char   *label1, *label2;
+    size_t          i;
+    int             retval;
+
+    for (i = 1; i <= label_cnt; i++) {
+        label1 = &name1[offsets1[labels1 - i]];
+        label2 = &name2[offsets2[labels2 - i]];
+        retval = label_bytes_cmp(&label1[1], label1[0],
+                                 &label2[1], label2[0]);
+        if (retval != 0)
+            return retval;
+    }
+
+    /* all labels are identical */
+    return 0;
+}
+
 int
 labelcmp(const u_char * name1, const u_char * name2, size_t label_cnt)
 {
@@ -485,11 +573,8 @@ labelcmp(const u_char * name1, const u_char * name2, size_t label_cnt)
      */
     size_t             length1;
     size_t             length2;
-    const u_char  *ptr1[256];
-    const u_char  *ptr2[256];
-    size_t offset1 = 0;
-    size_t offset2 = 0;
-    size_t i;
+    u_int16_t          offsets1[256];
+    u_int16_t          offsets2[256];
     
     length1 = (int) (name1 ? name1[0] : 0);
     length2 = (int) (name2 ? name2[0] : 0);
@@ -502,37 +587,12 @@ labelcmp(const u_char * name1, const u_char * name2, size_t label_cnt)
     }
     
     /* mark all the label start points */
-    for(i=0; i<label_cnt; i++) {
-        ptr1[i] = &name1[offset1];
-        ptr2[i] = &name2[offset2];
-        offset1 += name1[offset1]+1;
-        offset2 += name2[offset2]+1; 
-    }
+    res_label_offsets(name1, offsets1, label_cnt);
+    res_label_offsets(name2, offsets2, label_cnt);
     
     /* start from the last label, work upwards */
-    while (label_cnt > 0) {
-        int retval;
-
-        length1 = *ptr1[label_cnt-1];
-        length2 = *ptr2[label_cnt-1]; 
-
-        if (length1 == 0 || length2 == 0) {
-            retval = length1 - length2;
-        } else {
-            retval = label_bytes_cmp(&ptr1[label_cnt-1][1], 
-                                     length1,
-                                     &ptr2[label_cnt-1][1],
-                                     length2);
-        }
-
-        if (retval != 0)
-            return retval;
-
-        label_cnt--; 
-    }
-
-    /* all labels are identical */
-    return 0;
+    return res_labels_cmp(name1, offsets1, label_cnt,
+                          name2, offsets2, label_cnt, label_cnt);
 }
 
 /*
@@ -546,14 +606,13 @@ labelcmp(const u_char * name1, const u_char * name2, size_t label_cnt)
 int
 namecmp(const u_char * name1, const u_char * name2)
 {
-    size_t             labels1 = 1;
-    size_t             labels2 = 1;
-    size_t             index1 = 0;
-    size_t             index2 = 0;
-    size_t             i;
-    size_t             label_cnt;
-    size_t             ldiff;
-    int             ret_val;
+    u_int16_t          offsets1[NS_MAXCDNAME / 2 + 1];
+    u_int16_t          offsets2[NS_MAXCDNAME / 2 + 1];
+    size_t             labels1;
+    size_t             labels2;
+    size_t             index = 0;
+    size_t             len;
+    int                ret_val;
 
     /*
      * deal w/any null ptrs 
@@ -569,36 +628,29 @@ namecmp(const u_char * name1, const u_char * name2)
     }
 
     /*
-     * count labels 
-     */
-    for (; name1[index1]; index1 += (int) name1[index1] + 1)
-        labels1++;
-    for (; name2[index2]; index2 += (int) name2[index2] + 1)
-        labels2++;
-
-    index1 = 0;
-    index2 = 0;
-
-    /*
-     * find index in longer name where the number of labels is equal 
+     * Most of the names we compare turn out to be equal, which can be
+     * told in one pass from the left
      */
-    if (labels1 > labels2) {
-        label_cnt = labels2;
-        ldiff = labels1 - labels2;
-        for (i = 0; i < ldiff; i++)
-            index1 += name1[index1] + 1;
-    }
-    else {
-        label_cnt = labels1;
-        ldiff = labels2 - labels1;
-        for (i = 0; i < ldiff; i++)
-            index2 += name2[index2] + 1;
+    while (index < NS_MAXCDNAME && (len = name1[index]) == name2[index]) {
+        if (len == 0)
+            return 0;
+        if (res_label_fold_cmp(&name1[index + 1], &name2[index + 1], len))
+            break;
+        index += len + 1;
     }
 
     /*
-     * compare last N labels 
+     * Otherwise find where the labels start, and compare the labels
+     * the names have in common from the right
      */
-    ret_val = labelcmp(&name1[index1], &name2[index2], label_cnt);
+    labels1 = res_label_offsets(name1, offsets1,
+                                sizeof(offsets1) / sizeof(offsets1[0]));
+    labels2 = res_label_offsets(name2, offsets2,
+                                sizeof(offsets2) / sizeof(offsets2[0]));
+
+    ret_val = res_labels_cmp(name1, offsets1, labels1,
+                             name2, offsets2, labels2,
+                             (labels1 < labels2) ? labels1 : labels2);
 
     if (ret_val != 0)
         return ret_val;
@@ -610,6 +662,29 @@ namecmp(const u_char * name1, const u_char * name2)
     return labels1 - labels2;
 }
 
+/*
+ * Compute a case-insensitive hash over a DNS wire format name.
+ * Names that compare equal under namecmp() hash to the same value,
+ * since both fold case through res_lower_table.
+ */
+u_int32_t
+wire_name_hash(const u_char * field)
+{
+    u_int32_t h = 2166136261U;
+    size_t   j;
+    size_t   len;
+
+    if (field == NULL)
+        return 0;
+
+    len = wire_name_length(field);
+    for (j = 0; j < len; j++) {
+        h ^= (u_int32_t) RES_LOWER(field[j]);
+        h *= 16777619U;
+    }
+    return h;
+}
+
 int
 res_map_srio_to_sr(int val)
 {
@@ -94,6 +94,12 @@ void            dump_response(const u_char * ans, size_t resplen);
 u_int16_t       libsres_random(void);
 int             libsres_msg_getflag(ns_msg han, int flag);
 
+/*
+ * True if a message at the given level would be logged; use it to skip
+ * formatting arguments that only feed res_log()
+ */
+#define RES_LOG_WOULD_LOG(level) ((level) <= res_get_debug_level())
+
 void            res_log(void *dont_care, int level, const char *template, ...);
 void            res_log_ap(void *dont_care, int level, const char *template,
                            va_list ap);
@@ -14,6 +14,10 @@
 #include "val_assertion.h"
 #include "val_parse.h"
 
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
 extern void res_print_ea(struct expected_arrival *ea);
 extern const char *p_query_status(int err);
 
@@ -121,54 +125,6 @@ _free_w_results(struct val_internal_result *w_results)
     }
 }
 
-/*
- * Identify if the type is present in the bitmap
- * The encoding of the bitmap is a sequence of <block#, len, bitmap> tuples
- */
-static int
-is_type_set(u_char * field, size_t field_len, u_int16_t type)
-{
-    int             block, blen;
-
-    /** The type will be present in the following block */
-    int             t_block = type/256;
-    /** within the bitmap, the type will be present in the following byte */
-    int             t_byte_offset = type/8;
-    /** within the bitmap, the type will be present in the following bit */
-    int             t_bm_offset = type%8;
-
-    int             cnt = 0;
-
-    if (type < 1)
-        return 0;
-
-    block = 0;
-
-    /*
-     * ensure that we have at least two bytes and we've not gone past our block 
-     */
-    while ((field_len > cnt + 2) && (block <= t_block)) {
-
-        block = field[cnt];
-        blen = field[cnt + 1];
-        cnt += 2;
-
-        if (block == t_block) {
-            if (blen > t_byte_offset &&  
-                field_len > (cnt + t_byte_offset)) {
-                /*
-                 * see if the bit is set 
-                 */
-                if (field[cnt + t_byte_offset] & (1 << (7 - t_bm_offset)))
-                    return 1;
-            }
-            return 0;
-        }
-        cnt += blen;
-    }
-    return 0;
-}
-
 static void
 free_val_rrset(struct val_rrset_rec *r)
 {
@@ -379,6 +335,345 @@ clear_query_chain_structure(struct val_query_chain *query)
 }
 
 
+#define QUERY_CHAIN_HASH(name_n, type_h, class_h) \
+    ((((wire_name_hash(name_n) ^ (type_h)) * 16777619U) ^ (class_h)) * 16777619U)
+
+/*
+ * Helper routines for the expiry heap. The heap contains every
+ * element in the context query cache and is ordered by qc_exp_key,
+ * which is the earliest time at which the element should be looked
+ * at again for possible removal.
+ */
+static void
+_qc_heap_swap(val_context_t *context, size_t i, size_t j)
+{
+    struct val_query_chain *tmp = context->q_exp[i];
+    context->q_exp[i] = context->q_exp[j];
+    context->q_exp[j] = tmp;
+    context->q_exp[i]->qc_exp_index = i;
+    context->q_exp[j]->qc_exp_index = j;
+}
+
+static void
+_qc_heap_fix(val_context_t *context, size_t i)
+{
+    size_t parent, child;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (context->q_exp[parent]->qc_exp_key <= 
+                context->q_exp[i]->qc_exp_key)
+            break;
+        _qc_heap_swap(context, i, parent);
+        i = parent;
+    }
+
+    for (;;) {
+        child = 2 * i + 1;
+        if (child >= context->q_count)
+            break;
+        if (child + 1 < context->q_count &&
+            context->q_exp[child + 1]->qc_exp_key <
+                context->q_exp[child]->qc_exp_key)
+            child++;
+        if (context->q_exp[i]->qc_exp_key <= 
+                context->q_exp[child]->qc_exp_key)
+            break;
+        _qc_heap_swap(context, i, child);
+        i = child;
+    }
+}
+
+static void
+_qc_set_exp_key(val_context_t *context, struct val_query_chain *q, 
+                u_int32_t exp_key)
+{
+    q->qc_exp_key = exp_key;
+    _qc_heap_fix(context, q->qc_exp_index);
+}
+
+/*
+ * Bytes held by an authentication chain
+ */
+static size_t
+_auth_chain_size(struct val_digested_auth_chain *as)
+{
+    struct rrset_rec *r;
+    size_t size = 0;
+
+    for (; as; as = as->val_ac_rrset.val_ac_next) {
+        size += sizeof(struct val_digested_auth_chain);
+        for (r = as->val_ac_rrset.ac_data; r; r = r->rrs_next)
+            size += rrset_rec_size(r);
+    }
+    return size;
+}
+
+/*
+ * Recompute the number of bytes that a query cache element charges 
+ * against the cache budget
+ */
+static void
+_qc_account(struct val_query_chain *q)
+{
+    size_t bytes;
+
+    bytes = sizeof(struct val_query_chain) +
+        _auth_chain_size(q->qc_ans) + _auth_chain_size(q->qc_proof);
+    account_cache_memory((long) bytes - (long) q->qc_bytes);
+    q->qc_bytes = bytes;
+}
+
+/*
+ * Grow the hash index when the load factor gets too high
+ */
+static int
+_qc_hash_grow(val_context_t *context)
+{
+    struct val_query_chain **new_hash;
+    struct val_query_chain *q;
+    size_t new_size;
+
+    new_size = context->q_hash_size ? 
+                    2 * context->q_hash_size : QUERY_HASH_INIT_SIZE;
+    new_hash = (struct val_query_chain **) 
+                    MALLOC(new_size * sizeof(struct val_query_chain *));
+    if (new_hash == NULL)
+        return VAL_OUT_OF_MEMORY;
+    memset(new_hash, 0, new_size * sizeof(struct val_query_chain *));
+
+    /* re-bucket in list order so that newer elements stay in front */
+    for (q = context->q_tail; q; q = q->qc_prev) {
+        q->qc_hnext = new_hash[q->qc_hash & (new_size - 1)];
+        new_hash[q->qc_hash & (new_size - 1)] = q;
+    }
+
+    if (context->q_hash)
+        FREE(context->q_hash);
+    context->q_hash = new_hash;
+    context->q_hash_size = new_size;
+    return VAL_NO_ERROR;
+}
+
+/*
+ * Link a new element into the context query cache
+ */
+static int
+_qc_link(val_context_t *context, struct val_query_chain *q, u_int32_t exp_key)
+{
+    size_t b;
+
+    if (context->q_count >= 2 * context->q_hash_size &&
+        VAL_NO_ERROR != _qc_hash_grow(context) &&
+        context->q_hash == NULL)
+        return VAL_OUT_OF_MEMORY;
+
+    if (context->q_count >= context->q_exp_size) {
+        struct val_query_chain **new_exp;
+        size_t new_size = context->q_exp_size ? 
+                    2 * context->q_exp_size : QUERY_HASH_INIT_SIZE;
+        new_exp = (struct val_query_chain **) 
+                    MALLOC(new_size * sizeof(struct val_query_chain *));
+        if (new_exp == NULL)
+            return VAL_OUT_OF_MEMORY;
+        if (context->q_exp) {
+            memcpy(new_exp, context->q_exp, 
+                   context->q_count * sizeof(struct val_query_chain *));
+            FREE(context->q_exp);
+        }
+        context->q_exp = new_exp;
+        context->q_exp_size = new_size;
+    }
+
+    b = q->qc_hash & (context->q_hash_size - 1);
+    q->qc_hnext = context->q_hash[b];
+    context->q_hash[b] = q;
+
+    q->qc_prev = NULL;
+    q->qc_next = context->q_list;
+    if (context->q_list)
+        context->q_list->qc_prev = q;
+    else
+        context->q_tail = q;
+    context->q_list = q;
+
+    q->qc_exp_key = exp_key;
+    q->qc_exp_index = context->q_count;
+    context->q_exp[context->q_count++] = q;
+    _qc_heap_fix(context, q->qc_exp_index);
+
+    q->qc_bytes = 0;
+    _qc_account(q);
+
+    return VAL_NO_ERROR;
+}
+
+/*
+ * Move an element to the front of the context query cache, 
+ * marking it as most recently used
+ */
+static void
+_qc_touch(val_context_t *context, struct val_query_chain *q)
+{
+    if (q->qc_prev == NULL)
+        return;
+
+    q->qc_prev->qc_next = q->qc_next;
+    if (q->qc_next)
+        q->qc_next->qc_prev = q->qc_prev;
+    else
+        context->q_tail = q->qc_prev;
+
+    q->qc_prev = NULL;
+    q->qc_next = context->q_list;
+    context->q_list->qc_prev = q;
+    context->q_list = q;
+}
+
+/*
+ * Unlink an element from the context query cache
+ */
+static void
+_qc_unlink(val_context_t *context, struct val_query_chain *q)
+{
+    struct val_query_chain **hp;
+    size_t i;
+
+    hp = &context->q_hash[q->qc_hash & (context->q_hash_size - 1)];
+    while (*hp && *hp != q)
+        hp = &(*hp)->qc_hnext;
+    if (*hp)
+        *hp = q->qc_hnext;
+    q->qc_hnext = NULL;
+
+    if (q->qc_prev)
+        q->qc_prev->qc_next = q->qc_next;
+    else
+        context->q_list = q->qc_next;
+    if (q->qc_next)
+        q->qc_next->qc_prev = q->qc_prev;
+    else
+        context->q_tail = q->qc_prev;
+    q->qc_next = NULL;
+    q->qc_prev = NULL;
+
+    account_cache_memory(-(long) q->qc_bytes);
+    q->qc_bytes = 0;
+
+    i = q->qc_exp_index;
+    context->q_count--;
+    if (i != context->q_count) {
+        context->q_exp[i] = context->q_exp[context->q_count];
+        context->q_exp[i]->qc_exp_index = i;
+        _qc_heap_fix(context, i);
+    }
+}
+
+/*
+ * Remove all cached elements whose expiry key has passed and that
+ * are not being used by anyone. Elements that are still referenced
+ * or have not yet expired are rescheduled.
+ * If the cache is over its memory budget, also drop the least 
+ * recently used elements that are not being used by anyone.
+ */
+static void
+_qc_reap(val_context_t *context, time_t now)
+{
+    struct val_query_chain *q, *prev;
+    unsigned long evicted = 0;
+    int skipped = 0;
+    char name_p[NS_MAXDNAME];
+
+    while (context->q_count > 0 && 
+           context->q_exp[0]->qc_exp_key <= (u_int32_t)now) {
+
+        q = context->q_exp[0];
+
+        if (q->qc_refcount == 0 &&
+            ((q->qc_flags & VAL_QUERY_MARK_FOR_DELETION) ||
+             (q->qc_state >= Q_ANSWERED && q->qc_ttl_x <= now))) {
+
+            VAL_LOG_NTOP(LOG_INFO, q->qc_original_name,
+                         name_p, sizeof(name_p));
+            val_log(context, LOG_INFO, "add_to_qfq_chain(): Deleting expired cache data: {%s %s(%d) %s(%d)}", 
+                    name_p, p_class(q->qc_class_h),
+                    q->qc_class_h, p_type(q->qc_type_h),
+                    q->qc_type_h);
+
+            _qc_unlink(context, q);
+            free_query_chain_structure(q);
+            continue;
+        }
+
+        if (!(q->qc_flags & VAL_QUERY_MARK_FOR_DELETION) &&
+            q->qc_state >= Q_ANSWERED && q->qc_ttl_x > now)
+            _qc_set_exp_key(context, q, q->qc_ttl_x);
+        else
+            _qc_set_exp_key(context, q, now + QUERY_REAP_INTERVAL);
+    }
+
+    for (q = context->q_tail; 
+            q && skipped < QUERY_EVICT_MAX_SKIP && cache_over_budget(); 
+            q = prev) {
+        prev = q->qc_prev;
+        if (q->qc_refcount != 0) {
+            skipped++;
+            continue;
+        }
+        _qc_unlink(context, q);
+        free_query_chain_structure(q);
+        evicted++;
+    }
+    if (evicted) {
+        count_cache_evictions(evicted);
+        val_log(context, LOG_DEBUG, 
+                "_qc_reap(): Evicted %lu query cache elements", evicted);
+    }
+}
+
+/*
+ * Flag an element in the context query cache for removal at the
+ * next safe opportunity
+ */
+void
+mark_query_chain_for_deletion(val_context_t *context, 
+                              struct val_query_chain *q)
+{
+    if (context == NULL || q == NULL)
+        return;
+
+    q->qc_flags |= VAL_QUERY_MARK_FOR_DELETION;
+    _qc_set_exp_key(context, q, 0);
+}
+
+/*
+ * Release all elements in the context query cache
+ */
+void
+free_query_chain(val_context_t *context)
+{
+    struct val_query_chain *q;
+
+    if (context == NULL)
+        return;
+
+    while (NULL != (q = context->q_list)) {
+        context->q_list = q->qc_next;
+        account_cache_memory(-(long) q->qc_bytes);
+        free_query_chain_structure(q);
+    }
+    context->q_tail = NULL;
+    if (context->q_hash)
+        FREE(context->q_hash);
+    if (context->q_exp)
+        FREE(context->q_exp);
+    context->q_hash = NULL;
+    context->q_hash_size = 0;
+    context->q_exp = NULL;
+    context->q_exp_size = 0;
+    context->q_count = 0;
+}
+
 /*
  * Add {domain_name, type, class} to the list of queries currently active
  * for validating a response. 
@@ -393,10 +688,11 @@ add_to_query_chain(val_context_t *context, u_char * name_n,
                    const u_int16_t type_h, const u_int16_t class_h, 
                    const u_int32_t flags, struct val_query_chain **added_q)
 {
-    struct val_query_chain *temp, *prev, *old;
+    struct val_query_chain *temp;
     struct timeval  tv;
     char name_p[NS_MAXDNAME];
     u_int32_t sticky_flags = 0;
+    u_int32_t hash;
     
     /*
      * sanity checks 
@@ -413,41 +709,26 @@ add_to_query_chain(val_context_t *context, u_char * name_n,
 
     ASSERT_HAVE_AC_LOCK(context);
 
+    gettimeofday(&tv, NULL);
+
     /*
-     * Check if query already exists 
+     * Remove queries that have expired and are not being used
      */
-    temp = context->q_list;
-    prev = NULL;
-    gettimeofday(&tv, NULL);
-    while (temp) {
+    _qc_reap(context, tv.tv_sec);
 
-        /*
-         * Remove this query if it has expired and is not being used
-         */
-        if (temp->qc_flags & VAL_QUERY_MARK_FOR_DELETION) {
-            if (temp->qc_refcount == 0) {
-                if (-1 == ns_name_ntop(temp->qc_original_name, name_p, sizeof(name_p)))
-                    snprintf(name_p, sizeof(name_p), "unknown/error");
-                val_log(context, LOG_INFO, "add_to_qfq_chain(): Deleting expired cache data: {%s %s(%d) %s(%d)}", 
-                        name_p, p_class(temp->qc_class_h),
-                        temp->qc_class_h, p_type(temp->qc_type_h),
-                        temp->qc_type_h);
+    /*
+     * Check if query already exists 
+     */
+    hash = QUERY_CHAIN_HASH(name_n, type_h, class_h);
+    temp = context->q_hash ? 
+        context->q_hash[hash & (context->q_hash_size - 1)] : NULL;
+    for (; temp; temp = temp->qc_hnext) {
 
-                if (prev == NULL) {
-                    context->q_list = temp->qc_next;
-                } else {
-                    prev->qc_next = temp->qc_next;
-                }
-                old = temp;
-                temp = temp->qc_next;
-                old->qc_next = NULL;
-                free_query_chain_structure(old);
-            } else
-                temp = temp->qc_next;
+        if (temp->qc_flags & VAL_QUERY_MARK_FOR_DELETION)
             continue;
-        }
 
-        if ((temp->qc_type_h == type_h)
+        if ((temp->qc_hash == hash)
+            && (temp->qc_type_h == type_h)
             && (temp->qc_class_h == class_h)
             && (QUERY_FLAGS_MATCHING(temp->qc_flags, flags))
             && (namecmp(temp->qc_original_name, name_n) == 0)) {
@@ -471,8 +752,8 @@ add_to_query_chain(val_context_t *context, u_char * name_n,
                 } 
             }
 
-            if (-1 == ns_name_ntop(temp->qc_original_name, name_p, sizeof(name_p)))
-                snprintf(name_p, sizeof(name_p), "unknown/error");
+            VAL_LOG_NTOP(LOG_DEBUG, temp->qc_original_name,
+                         name_p, sizeof(name_p));
 
             if (temp->qc_state >= Q_ANSWERED && 
                 /* either record has actually timed out */
@@ -498,7 +779,7 @@ add_to_query_chain(val_context_t *context, u_char * name_n,
                 /* Save flags since they might convey useful information */
                 sticky_flags = temp->qc_flags;
 
-                temp->qc_flags |= VAL_QUERY_MARK_FOR_DELETION;
+                mark_query_chain_for_deletion(context, temp);
 
             } else {
                 val_log(context, LOG_DEBUG, 
@@ -508,12 +789,11 @@ add_to_query_chain(val_context_t *context, u_char * name_n,
                         temp->qc_type_h, temp->qc_state, temp->qc_flags,
                         temp->qc_ttl_x > tv.tv_sec ? (temp->qc_ttl_x - tv.tv_sec) : -1);
                 /* return this cached record */
+                _qc_touch(context, temp);
                 *added_q = temp;
                 return VAL_NO_ERROR;
             }
         } 
-        prev = temp;
-        temp = temp->qc_next;
     }
 
     temp =
@@ -527,11 +807,15 @@ add_to_query_chain(val_context_t *context, u_char * name_n,
     temp->qc_class_h = class_h;
     temp->qc_flags = flags | sticky_flags;
     temp->qc_last_sent = -1;
+    temp->qc_hash = hash;
 
     init_query_chain_node(temp);
-    
-    temp->qc_next = context->q_list;
-    context->q_list = temp;
+
+    if (VAL_NO_ERROR != _qc_link(context, temp, 
+                                 tv.tv_sec + QUERY_REAP_INTERVAL)) {
+        FREE(temp);
+        return VAL_OUT_OF_MEMORY;
+    }
     *added_q = temp;
 
     return VAL_NO_ERROR;
@@ -617,8 +901,7 @@ check_in_qfq_chain(val_context_t *context, struct queries_for_query **queries,
                     matches) {
 
                     char name_p[NS_MAXDNAME];
-                    if (-1 == ns_name_ntop(name_n, name_p, sizeof(name_p)))
-                        snprintf(name_p, sizeof(name_p), "unknown/error");
+                    VAL_LOG_NTOP(LOG_DEBUG, name_n, name_p, sizeof(name_p));
                     val_log(context, LOG_DEBUG, 
                             "add_to_query_chain(): Found matching proof of non-existence for {%s %s(%d) %s(%d)} through ANC",
                             name_p, p_class(class_h), class_h, p_type(type_h),
@@ -888,10 +1171,7 @@ int
 get_zse(val_context_t * ctx, u_char * name_n, u_int32_t flags, 
         u_int16_t *status, u_char ** match_ptr, u_int32_t *ttl_x)
 {
-    policy_entry_t *zse_pol, *zse_cur;
-    size_t          name_len;
-    u_char         *p;
-    int             retval;
+    struct policy_index_val *zse;
 
     /*
      * sanity checks 
@@ -899,89 +1179,39 @@ get_zse(val_context_t * ctx, u_char * name_n, u_int32_t flags,
     if (NULL == name_n)
         return VAL_BAD_ARGUMENT;
 
-    if (match_ptr) {
-        *match_ptr = NULL; 
-    }
-
-    retval = VAL_NO_ERROR;
-
-    name_len = wire_name_length(name_n);
-
     /*
-     * Check if the zone is trusted 
+     * Check if the zone is trusted; the index gives us the
+     * policy of the longest matching zone
      */
-    
-    RETRIEVE_POLICY(ctx, P_ZONE_SECURITY_EXPECTATION, zse_pol);
-    if (zse_pol != NULL) {
-        for (zse_cur = zse_pol;
-             zse_cur && (wire_name_length(zse_cur->zone_n) > name_len);
-             zse_cur = zse_cur->next);
-
-        /*
-         * for all zones which are shorter or as long, do a strstr 
-         */
-        /*
-         * Because of the ordering, the longest match is found first 
-         */
-        for (; zse_cur; zse_cur = zse_cur->next) {
-            int             root_zone = 0;
-            if (!namecmp(zse_cur->zone_n, (const u_char *) ""))
-                root_zone = 1;
-            else {
-                /*
-                 * Find the last occurrence of zse_cur->zone_n in name_n 
-                 */
-                p = name_n;
-                while (p && (*p != '\0')) {
-                    if (!namecmp(p, zse_cur->zone_n))
-                        break;
-                    p = p + *p + 1;
-                }
-            }
-
-            if ((root_zone || (!namecmp(p, zse_cur->zone_n))) && zse_cur->pol) {
-                struct zone_se_policy *pol = 
-                    (struct zone_se_policy *)(zse_cur->pol);
-    
-                if (match_ptr) {
-                    *match_ptr = namename(name_n, zse_cur->zone_n);
-                }
+    zse = lookup_policy_index(ctx, P_ZONE_SECURITY_EXPECTATION,
+                              name_n, match_ptr);
+    if (zse == NULL) {
+        *status = VAL_AC_WAIT_FOR_TRUST;
+        return VAL_NO_ERROR;
+    }
 
-                if (zse_cur->exp_ttl > 0)
-                    *ttl_x = zse_cur->exp_ttl;
+    if (zse->exp_ttl > 0)
+        *ttl_x = zse->exp_ttl;
                 
-                if (pol->trusted == ZONE_SE_UNTRUSTED) {
-                    *status = VAL_AC_UNTRUSTED_ZONE;
-                    goto done;
-                } else if (pol->trusted == ZONE_SE_DO_VAL) {
-                    *status = VAL_AC_WAIT_FOR_TRUST;
-                    goto done;
-                } else {
-                    /** ZONE_SE_IGNORE */
-                    *status = VAL_AC_IGNORE_VALIDATION;
-                    goto done;
-                }
-            }
-        }
+    if (zse->value == ZONE_SE_UNTRUSTED) {
+        *status = VAL_AC_UNTRUSTED_ZONE;
+    } else if (zse->value == ZONE_SE_DO_VAL) {
+        *status = VAL_AC_WAIT_FOR_TRUST;
+    } else {
+        /** ZONE_SE_IGNORE */
+        *status = VAL_AC_IGNORE_VALIDATION;
     }
 
-    *status = VAL_AC_WAIT_FOR_TRUST;
-    retval = VAL_NO_ERROR;
-
-done:
-
-    return retval;
+    return VAL_NO_ERROR;
 }
 
 int
 find_trust_point(val_context_t * ctx, u_char * zone_n, 
                  u_char ** matched_zone, u_int32_t *ttl_x)
 {
-
-    policy_entry_t *ta_pol, *ta_cur, *ta_tmphead;
-    size_t       name_len;
-    u_char       *zp = zone_n;
-    u_char       *ep;
+    struct policy_index_val *ta;
+    u_char       *zp;
+    size_t       len;
 
     /*
      * This function should never be called with a NULL zone_n, but still... 
@@ -992,55 +1222,22 @@ find_trust_point(val_context_t * ctx, u_char * zone_n,
     *matched_zone = NULL;
     *ttl_x = 0;
 
-    name_len = wire_name_length(zp);
-    ep = zp + name_len;
-    
-    RETRIEVE_POLICY(ctx, P_TRUST_ANCHOR, ta_pol);
-    
-    if (ta_pol == NULL) {
+    ta = lookup_policy_index(ctx, P_TRUST_ANCHOR, zone_n, &zp);
+    if (ta == NULL) {
         return VAL_NO_ERROR;
     }
 
-    /*
-     * skip longer names 
-     */
-    for (ta_cur = ta_pol;
-         ta_cur && (wire_name_length(ta_cur->zone_n) > name_len);
-         ta_cur = ta_cur->next);
+    len = wire_name_length(zp);
+    *matched_zone = (u_char *) MALLOC( len * sizeof(u_char));
+    if (*matched_zone == NULL) {
+        return VAL_OUT_OF_MEMORY;
+    }
+    memcpy(*matched_zone, zp, len);
+    if (ta->exp_ttl > 0)
+        *ttl_x = ta->exp_ttl;
 
-    /*
-     * for the remaining nodes, see if there is any hope 
-     */
-    ta_tmphead = ta_cur;
-    while (zp < ep) {
-        for (ta_cur = ta_tmphead; ta_cur; ta_cur = ta_cur->next) {
-            if (wire_name_length(zp) < wire_name_length(ta_cur->zone_n))
-                /** next time look from this point */
-                ta_tmphead = ta_cur->next;
-
-            if (namecmp(ta_cur->zone_n, zp) == 0) {
-                size_t len;
-                len = wire_name_length(zp);
-                /** We have hope */
-                *matched_zone =
-                   (u_char *) MALLOC( len * sizeof(u_char));
-                if (*matched_zone == NULL) {
-                    return VAL_OUT_OF_MEMORY;
-                }
-                memcpy(*matched_zone, zp, len);
-                if (ta_cur->exp_ttl > 0)
-                    *ttl_x = ta_cur->exp_ttl;
-                return VAL_NO_ERROR;
-            }
-        }
-        /*
-         * trim the top label from our candidate zone 
-         */
-        zp += (int) zp[0] + 1;
-    }
-
-    return VAL_NO_ERROR;
-}
+    return VAL_NO_ERROR;
+}
 
 static int
 is_trusted_key(val_context_t * ctx, u_char * zone_n, struct rrset_rr *key, 
@@ -1122,8 +1319,7 @@ is_trusted_key(val_context_t * ctx, u_char * zone_n, struct rrset_rr *key,
                                                zp, curkey, &tmp_status))) {
 
                         char            name_p[NS_MAXDNAME];
-                        if (-1 == ns_name_ntop(zp, name_p, sizeof(name_p)))
-                            snprintf(name_p, sizeof(name_p), "unknown/error");
+                        VAL_LOG_NTOP(LOG_DEBUG, zp, name_p, sizeof(name_p));
                         curkey->rr_status = VAL_AC_TRUST_POINT;
                         if (ta_cur->exp_ttl > 0)
                             *ttl_x = ta_cur->exp_ttl;
@@ -1850,6 +2046,7 @@ assimilate_answers(val_context_t * context,
          * Link the assertion to the query
          */
         matched_q->qc_ans = assertions;
+        _qc_account(matched_q);
         if (VAL_NO_ERROR != (retval =
                              try_build_chain(context,
                                              assertions,
@@ -1873,6 +2070,7 @@ assimilate_answers(val_context_t * context,
          * Link the assertion to the query
          */
         matched_q->qc_proof = assertions;
+        _qc_account(matched_q);
         if (VAL_NO_ERROR != (retval =
                              try_build_chain(context,
                                              assertions,
@@ -2649,7 +2847,6 @@ compute_nsec3_hash(val_context_t * ctx, u_char * qname_n,
     int             name_len;
     policy_entry_t *pol, *cur;
     u_char         *p;
-    char            name_p[NS_MAXDNAME];
     size_t          hashlen;
     u_char         *hash;
 
@@ -2693,9 +2890,6 @@ compute_nsec3_hash(val_context_t * ctx, u_char * qname_n,
                 }
     
                 if (root_zone || !namecmp(p, cur->zone_n)) {
-                    if (-1 == ns_name_ntop(soa_name_n, name_p, sizeof(name_p)))
-                        snprintf(name_p, sizeof(name_p), "unknown/error");
-    
                     if (cur->pol != NULL) {
                         int nsec3_pol_iter;
 
@@ -3327,8 +3521,7 @@ prove_nonexistence(val_context_t * ctx,
         *soa_ttl_x = 0;
     }
 
-    if (-1 == ns_name_ntop(qname_n, name_p, sizeof(name_p)))
-        snprintf(name_p, sizeof(name_p), "unknown/error");
+    VAL_LOG_NTOP(LOG_DEBUG, qname_n, name_p, sizeof(name_p));
     val_log(ctx, LOG_DEBUG, "prove_nonexistence(): proving non-existence for {%s, %s(%d), %s(%d)}",
             name_p, p_class(qc_class_h), qc_class_h, p_type(qtype_h), qtype_h);
 
@@ -3868,8 +4061,7 @@ verify_provably_insecure(val_context_t * context,
     *done = 1;
     retval = VAL_NO_ERROR;
     
-    if (-1 == ns_name_ntop(q_name_n, name_p, sizeof(name_p)))
-        snprintf(name_p, sizeof(name_p), "unknown/error");
+    VAL_LOG_NTOP(LOG_INFO, q_name_n, name_p, sizeof(name_p));
 
     /*
      * If we've already tried checking for PI status for this node,
@@ -3948,8 +4140,7 @@ verify_provably_insecure(val_context_t * context,
         q = namename(q_labels, curzone_n);
     }
 
-    if (-1 == ns_name_ntop(curzone_n, tempname_p, sizeof(tempname_p))) 
-            snprintf(tempname_p, sizeof(tempname_p), "unknown/error");
+    VAL_LOG_NTOP(LOG_INFO, curzone_n, tempname_p, sizeof(tempname_p));
 
     if (!q) {
         /* 
@@ -4018,10 +4209,10 @@ verify_provably_insecure(val_context_t * context,
             goto err;
         }
 
-        if ((curzone_n == NULL) ||
-                (-1 == ns_name_ntop(nxt_qname, tempname_p, sizeof(tempname_p)))) {
+        if (curzone_n == NULL)
             snprintf(tempname_p, sizeof(tempname_p), "unknown/error");
-        } 
+        else
+            VAL_LOG_NTOP(LOG_INFO, nxt_qname, tempname_p, sizeof(tempname_p));
     
         if (namecmp(q_name_n, nxt_qname)) {
 
@@ -4069,8 +4260,7 @@ verify_provably_insecure(val_context_t * context,
             continue;
         }
 
-        if (-1 == ns_name_ntop(zonecut_n, tempname_p, sizeof(tempname_p))) 
-            snprintf(tempname_p, sizeof(tempname_p), "unknown/error");
+        VAL_LOG_NTOP(LOG_NOTICE, zonecut_n, tempname_p, sizeof(tempname_p));
 
         /* if older zonecut is more specific than the new one bail out */
         if (namename(curzone_n, zonecut_n) != NULL) {
@@ -4282,8 +4472,7 @@ is_pu_trusted(val_context_t *ctx, u_char *name_n, u_int32_t *ttl_x)
             if ((root_zone || (!namecmp(p, pu_cur->zone_n))) && pu_cur->pol) {
                 struct prov_insecure_policy *pol =
                     (struct prov_insecure_policy *)(pu_cur->pol);
-                if (-1 == ns_name_ntop(name_n, name_p, sizeof(name_p)))
-                    snprintf(name_p, sizeof(name_p), "unknown/error");
+                VAL_LOG_NTOP(LOG_INFO, name_n, name_p, sizeof(name_p));
                 if (pu_cur->exp_ttl > 0)
                     *ttl_x = pu_cur->exp_ttl;
 
@@ -4476,9 +4665,8 @@ try_verify_assertion(val_context_t * context,
             next_as->val_ac_status == VAL_AC_TRUST_NOCHK) {
         char name_p[NS_MAXDNAME];
         
-        if (-1 == ns_name_ntop(next_as->val_ac_rrset.ac_data->rrs_name_n, 
-                               name_p, sizeof(name_p)))
-            snprintf(name_p, sizeof(name_p), "unknown/error");
+        VAL_LOG_NTOP(LOG_INFO, next_as->val_ac_rrset.ac_data->rrs_name_n,
+                     name_p, sizeof(name_p));
         val_log(context, LOG_INFO, 
                 "try_verify_assertion(): verifying next assertion: {%s, %s(%d), %s(%d)}",
                 name_p, 
@@ -4631,9 +4819,7 @@ set_dlv_branchoff(val_context_t *context,
         goto done;
     }
 
-    if (-1 == ns_name_ntop(name_n, name_p, 
-                           sizeof(name_p)))
-        snprintf(name_p, sizeof(name_p), "unknown/error");
+    VAL_LOG_NTOP(LOG_INFO, name_n, name_p, sizeof(name_p));
    
     if (VAL_NO_ERROR != (retval = 
                 find_dlv_record(context, 
@@ -4723,6 +4909,7 @@ set_dlv_branchoff(val_context_t *context,
                copyfrm->qc_proof->val_ac_rrset.ac_data->rrs_ans_kind; 
             q->qc_proof->val_ac_status = copyfrm->qc_proof->val_ac_status;
         }
+        _qc_account(q);
     }
     
     *do_dlv = 1;
@@ -4768,10 +4955,7 @@ int switch_to_root(val_context_t * context,
         return VAL_NO_ERROR;
     }
 
-    if (-1 == ns_name_ntop(matched_q->qc_name_n,
-                           name_p, sizeof(name_p))) {
-        snprintf(name_p, sizeof(name_p), "unknown/error");
-    }
+    VAL_LOG_NTOP(LOG_INFO, matched_q->qc_name_n, name_p, sizeof(name_p));
 
     if ((matched_q->qc_flags & VAL_QUERY_ITERATE) ||
         (matched_q->qc_fallback == 1) ||
@@ -4920,10 +5104,8 @@ restart_query:
          */
         next_as = as_more;
         while (next_as) {
-            if (-1 == ns_name_ntop(next_as->val_ac_rrset.ac_data->rrs_name_n, 
-                                       name_p, sizeof(name_p))) {
-                snprintf(name_p, sizeof(name_p), "unknown/error");
-            }
+            VAL_LOG_NTOP(LOG_INFO, next_as->val_ac_rrset.ac_data->rrs_name_n,
+                         name_p, sizeof(name_p));
             
             if (next_as->val_ac_status <= VAL_AC_INIT) {
                 /*
@@ -5405,8 +5587,8 @@ _ask_cache_one(val_context_t * context, struct queries_for_query **queries,
     if (next_q->qfq_query->qc_state != Q_INIT)
         return VAL_NO_ERROR;
 
-    if (-1 == ns_name_ntop(next_q->qfq_query->qc_name_n, name_p, sizeof(name_p)))
-        snprintf(name_p, sizeof(name_p), "unknown/error");
+    VAL_LOG_NTOP(LOG_INFO, next_q->qfq_query->qc_name_n,
+                 name_p, sizeof(name_p));
 
     if ((next_q->qfq_query->qc_flags & VAL_QUERY_SKIP_ANS_CACHE)||
         (next_q->qfq_query->qc_flags & VAL_QUERY_SKIP_CACHE)||
@@ -5433,6 +5615,18 @@ _ask_cache_one(val_context_t * context, struct queries_for_query **queries,
         (retval = get_cached_rrset(next_q->qfq_query, &response)))
         return retval;
 
+    /* Look for a previously proven non-existence result */
+    if (!response &&
+        VAL_NO_ERROR !=
+        (retval = get_cached_negative(next_q->qfq_query, &response)))
+        return retval;
+
+    /* See if the name falls within a span we have already validated */
+    if (!response &&
+        VAL_NO_ERROR !=
+        (retval = get_synthesized_negative(context, next_q->qfq_query, &response)))
+        return retval;
+
     if (!response) {
         if (next_q->qfq_query->qc_state > Q_SENT)
             *data_received = 1;
@@ -5557,9 +5751,8 @@ _resolver_submit_one(val_context_t * context, struct queries_for_query **queries
 
     val_log(NULL, LOG_DEBUG, __FUNCTION__);
 
-    if (-1 == ns_name_ntop(query->qfq_query->qc_name_n, name_p,
-                           sizeof(name_p)))
-        snprintf(name_p, sizeof(name_p), "unknown/error");
+    VAL_LOG_NTOP(LOG_INFO, query->qfq_query->qc_name_n,
+                 name_p, sizeof(name_p));
 
     if (query->qfq_query->qc_flags & VAL_QUERY_SKIP_RESOLVER) {
         val_log(context, LOG_INFO,
@@ -5675,9 +5868,8 @@ _resolver_rcv_one(val_context_t * context, struct queries_for_query **queries,
         return retval;
 
     if ((next_q->qfq_query->qc_state == Q_ANSWERED) && (response != NULL)) {
-        if (-1 == ns_name_ntop(next_q->qfq_query->qc_name_n, name_p,
-                               sizeof(name_p)))
-            snprintf(name_p, sizeof(name_p), "unknown/error");
+        VAL_LOG_NTOP(LOG_INFO, next_q->qfq_query->qc_name_n,
+                     name_p, sizeof(name_p));
         val_log(context, LOG_INFO,
                 "_resolver_rcv_one(): found matching ack/nack response for {%s %s(%d) %s(%d)}, flags=%x",
                 name_p, p_class(next_q->qfq_query->qc_class_h),
@@ -5692,9 +5884,8 @@ _resolver_rcv_one(val_context_t * context, struct queries_for_query **queries,
             return retval;
         }
     } else if (next_q->qfq_query->qc_state > Q_ERROR_BASE) {
-        if (-1 == ns_name_ntop(next_q->qfq_query->qc_name_n, name_p,
-                               sizeof(name_p)))
-            snprintf(name_p, sizeof(name_p), "unknown/error");
+        VAL_LOG_NTOP(LOG_INFO, next_q->qfq_query->qc_name_n,
+                     name_p, sizeof(name_p));
         val_log(context, LOG_INFO,
                 "_resolver_rcv_one(): received error response for {%s %s(%d) %s(%d)}, flags=%x: %d",
                 name_p, p_class(next_q->qfq_query->qc_class_h),
@@ -5770,6 +5961,13 @@ check_proof_sanity(val_context_t * context,
         proof_res->val_rc_status = status;
         if (val_istrusted(status)) {
             SET_MIN_TTL(top_q->qc_ttl_x, soa_ttl_x);
+            /* remember this result for subsequent queries */
+            if (VAL_NO_ERROR != 
+                    (retval = stow_negative_answer(top_q, status, top_q->qc_ttl_x)))
+                return retval;
+            if (VAL_NO_ERROR !=
+                    (retval = stow_nsec_spans(top_q, status)))
+                return retval;
         }
     }
 
@@ -6229,7 +6427,6 @@ construct_authentication_chain(val_context_t * context,
     int             retval;
     struct val_query_chain *top_q;
     int switched = 0;
-    char   name_p[NS_MAXDNAME];
     struct val_result_chain *res;
     struct val_result_chain *prev = NULL;
     
@@ -6246,10 +6443,6 @@ construct_authentication_chain(val_context_t * context,
          * For error conditions Try getting this answer iteratively from 
          * root if we aren't doing so already
          */
-        if (-1 == ns_name_ntop(top_q->qc_name_n, 
-                               name_p, sizeof(name_p))) {
-            snprintf(name_p, sizeof(name_p), "unknown/error");
-        }
         if (VAL_NO_ERROR != (retval = switch_to_root(context, top_qfq, &switched))) {
             return retval;
         }
@@ -6800,6 +6993,173 @@ _call_callbacks(int event, val_async_status *as)
     return callit;
 }
 
+#ifndef VAL_NO_THREADS
+/*
+ * The lists shared with a resolver thread are stacks that any thread
+ * may push to and that are only ever taken whole, so swapping the head
+ * with a compare-and-swap is all they need (taking the whole list
+ * leaves no room for the ABA problem). Where the compiler has no
+ * compare-and-swap for pointers a mutex stands in for it.
+ */
+#if (defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_8) && __SIZEOF_POINTER__ == 8) || \
+    (defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_4) && __SIZEOF_POINTER__ == 4)
+#define AT_CAS(head, old, new) __sync_bool_compare_and_swap((head), (old), (new))
+#else
+static pthread_mutex_t at_cas_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+_at_cas(void * volatile *head, void *old, void *new)
+{
+    int swapped = 0;
+
+    pthread_mutex_lock(&at_cas_lock);
+    if (*head == old) {
+        *head = new;
+        swapped = 1;
+    }
+    pthread_mutex_unlock(&at_cas_lock);
+    return swapped;
+}
+#define AT_CAS(head, old, new) \
+    _at_cas((void * volatile *)(head), (void *)(old), (void *)(new))
+#endif
+
+/** push as onto a list; returns 1 if the list was empty */
+static int
+_at_push_as(val_async_status * volatile *head, val_async_status *as)
+{
+    val_async_status *old;
+
+    do {
+        old = *head;
+        as->val_as_next = old;
+    } while (!AT_CAS(head, old, as));
+
+    return (NULL == old);
+}
+
+/** take a whole list, oldest entry first */
+static val_async_status *
+_at_take_as(val_async_status * volatile *head)
+{
+    val_async_status *as, *next, *list = NULL;
+
+    do {
+        as = *head;
+    } while (as && !AT_CAS(head, as, NULL));
+
+    for (; as; as = next) {
+        next = as->val_as_next;
+        as->val_as_next = list;
+        list = as;
+    }
+    return list;
+}
+
+static int
+_at_push_cancel(struct val_async_cancel_s * volatile *head,
+                struct val_async_cancel_s *vac)
+{
+    struct val_async_cancel_s *old;
+
+    do {
+        old = *head;
+        vac->vac_next = old;
+    } while (!AT_CAS(head, old, vac));
+
+    return (NULL == old);
+}
+
+static struct val_async_cancel_s *
+_at_take_cancel(struct val_async_cancel_s * volatile *head)
+{
+    struct val_async_cancel_s *vac, *next, *list = NULL;
+
+    do {
+        vac = *head;
+    } while (vac && !AT_CAS(head, vac, NULL));
+
+    for (; vac; vac = next) {
+        next = vac->vac_next;
+        vac->vac_next = list;
+        list = vac;
+    }
+    return list;
+}
+
+/*
+ * A list going from empty to non-empty writes a byte to the pipe of
+ * whoever takes it, who empties the pipe before taking the list.
+ */
+static void
+_at_signal(int fd)
+{
+    char c = 0;
+
+    if (write(fd, &c, 1) < 0) {
+        /* a full pipe is readable anyway */
+    }
+}
+
+static void
+_at_drain(int fd)
+{
+    char buf[64];
+
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+}
+
+/*
+ * the resolver thread of context, if it is not the calling thread
+ */
+static struct val_async_thread_s *
+_async_thread_other(val_context_t *context)
+{
+    struct val_async_thread_s *at;
+
+    CTX_LOCK_ACACHE(context);
+    at = context->as_thread;
+    CTX_UNLOCK_ACACHE(context);
+
+    if ((NULL == at) || pthread_equal(pthread_self(), at->at_tid))
+        return NULL;
+    return at;
+}
+
+/*
+ * is the caller a resolver thread whose callbacks are made by
+ * val_async_thread_complete()?
+ */
+static int
+_async_thread_queues(val_context_t *context)
+{
+    struct val_async_thread_s *at = context->as_thread;
+
+    return ((NULL != at) && (at->at_flags & VAL_AS_THREAD_QUEUE_COMPLETIONS) &&
+            pthread_equal(pthread_self(), at->at_tid));
+}
+
+/*
+ * Hand a completed or cancelled request, already off the context list,
+ * to val_async_thread_complete(). Caller is the resolver thread.
+ */
+static void
+_async_thread_queue(val_context_t *context, val_async_status *as, int event)
+{
+    struct val_async_thread_s *at = context->as_thread;
+
+    /** the query chain is part of the cache; let go of it here */
+    free_qfq_chain(context, as->val_as_queries);
+    as->val_as_queries = NULL;
+
+    as->val_as_event = event;
+    as->val_as_ctx = context;
+    if (_at_push_as(&at->at_completed, as))
+        _at_signal(at->at_notify[1]);
+}
+#endif /* VAL_NO_THREADS */
+
 static void
 _handle_completed(val_context_t *context)
 
@@ -6849,6 +7209,13 @@ _handle_completed(val_context_t *context)
     while (completed) {
         as = completed;
         completed = completed->val_as_next;
+#ifndef VAL_NO_THREADS
+        if (_async_thread_queues(context)) {
+            _async_thread_queue(context, as, VAL_AS_EVENT_COMPLETED);
+            CTX_UNLOCK_POL(context);
+            continue;
+        }
+#endif
         _call_callbacks(VAL_AS_EVENT_COMPLETED, as);
         as->val_as_ctx = NULL; /* we've already removed ourselves */
         _async_status_free(&as); /* no ctx, so no lock needed */
@@ -6857,75 +7224,26 @@ _handle_completed(val_context_t *context)
 }
 
 /*
- * Look inside the cache, ask the resolver for missing data.
+ * Look inside the cache, ask the resolver for missing data, and put the
+ * request on the context's list. Caller has CTX_LOCK_POL_SH, which the
+ * request keeps until it completes.
+ *
+ * On error the request is not on the list and must be released by the
+ * caller.
  */
-int
-val_async_submit(val_context_t * ctx,  const char * domain_name, int class_h,
-                 int type_h, u_int32_t flags, val_async_event_cb callback,
-                 void *cb_data, val_async_status **async_status)
+static int
+_async_submit_one(val_context_t *context, val_async_status *as,
+                  u_int32_t flags)
 {
-
     int             retval;
     struct queries_for_query *added_q = NULL;
-    val_async_status         *as;
-    val_context_t            *context;
     int data_received = 0;
     int data_missing = 1, more_data;
     u_char domain_name_n[NS_MAXCDNAME];
     u_int32_t tflags = 0;
 
-    if ((domain_name == NULL) || (async_status == NULL))
-        return VAL_BAD_ARGUMENT;
-
-    val_log(NULL, LOG_DEBUG, __FUNCTION__);
-
-    /*
-     * Sanity check the values of class and type
-     * Should not be larger than sizeof u_int16_t
-     */
-    if (class_h < 0 || type_h < 0 ||
-        type_h > ns_t_max || class_h > ns_c_max) {
-        return VAL_BAD_ARGUMENT;
-    }
-
-    if ((retval = ns_name_pton(domain_name, domain_name_n,
-                               NS_MAXCDNAME)) == -1) {
-        val_log(ctx, LOG_INFO, "val_resolve_and_check(): Cannot parse name %s",
-                domain_name);
+    if (ns_name_pton(as->val_as_name, domain_name_n, NS_MAXCDNAME) == -1)
         return VAL_BAD_ARGUMENT;
-    }
-
-    as = (val_async_status *)calloc(1, sizeof(val_async_status));
-    if (NULL == as)
-        return VAL_OUT_OF_MEMORY;
-
-    val_log(NULL, LOG_DEBUG, "as %p allocated for {%s %s(%d) %s(%d)}", as,
-            domain_name, p_class(class_h), class_h, p_type(type_h), type_h);
-
-    as->val_as_name = strdup(domain_name);
-    if (as->val_as_name == NULL) {
-        FREE(as);
-        return VAL_OUT_OF_MEMORY;
-    }
-
-#ifndef VAL_NO_THREADS
-    as->val_as_tid = pthread_self();
-#endif
-    as->val_as_result_cb = callback;
-    as->val_as_cb_user_ctx = cb_data;
-    as->val_as_class = (u_int16_t) class_h;
-    as->val_as_type = (u_int16_t) type_h;
-
-    /*
-     * get context, if needed
-     */
-    context = val_create_or_refresh_context(ctx); /* does CTX_LOCK_POL_SH */
-    if (NULL == context) {
-        _async_status_free(&as); /* no context, so no lock needed */
-        return VAL_INTERNAL_ERROR;
-    }
-
-    as->val_as_ctx = context;
 
     tflags = VAL_QFLAGS_USERMASK & (flags | VAL_QUERY_ASYNC | 
                 context->def_cflags | context->def_uflags);
@@ -6954,7 +7272,7 @@ val_async_submit(val_context_t * ctx,  const char * domain_name, int class_h,
                 struct val_internal_result *w_results = NULL;
                 int                         done = 0;
 
-                val_log(context, LOG_WARNING, "*** ! data_missing in submit");
+                val_log(context, LOG_DEBUG, "*** ! data_missing in submit");
 #if 1
                 retval = construct_authentication_chain(context, added_q,
                                                         &as->val_as_queries,
@@ -7004,9 +7322,10 @@ val_async_submit(val_context_t * ctx,  const char * domain_name, int class_h,
         }
     }
 
-    if ((VAL_NO_ERROR != retval) && (NULL != added_q))
-        _async_status_free(&as);
-    else {
+    if (VAL_NO_ERROR != retval) {
+        free_qfq_chain(context, as->val_as_queries);
+        as->val_as_queries = NULL;
+    } else {
         ASSERT_HAVE_AC_LOCK(context);
 
         /* put in context async queries list */
@@ -7018,6 +7337,98 @@ val_async_submit(val_context_t * ctx,  const char * domain_name, int class_h,
 
     CTX_UNLOCK_ACACHE(context);
 
+    return retval;
+}
+
+/*
+ * Look inside the cache, ask the resolver for missing data.
+ */
+int
+val_async_submit(val_context_t * ctx,  const char * domain_name, int class_h,
+                 int type_h, u_int32_t flags, val_async_event_cb callback,
+                 void *cb_data, val_async_status **async_status)
+{
+
+    int             retval;
+    val_async_status         *as;
+    val_context_t            *context;
+    u_char domain_name_n[NS_MAXCDNAME];
+#ifndef VAL_NO_THREADS
+    struct val_async_thread_s *at;
+#endif
+
+    if ((domain_name == NULL) || (async_status == NULL))
+        return VAL_BAD_ARGUMENT;
+
+    val_log(NULL, LOG_DEBUG, __FUNCTION__);
+
+    /*
+     * Sanity check the values of class and type
+     * Should not be larger than sizeof u_int16_t
+     */
+    if (class_h < 0 || type_h < 0 ||
+        type_h > ns_t_max || class_h > ns_c_max) {
+        return VAL_BAD_ARGUMENT;
+    }
+
+    if ((retval = ns_name_pton(domain_name, domain_name_n,
+                               NS_MAXCDNAME)) == -1) {
+        val_log(ctx, LOG_INFO, "val_resolve_and_check(): Cannot parse name %s",
+                domain_name);
+        return VAL_BAD_ARGUMENT;
+    }
+
+    as = (val_async_status *)calloc(1, sizeof(val_async_status));
+    if (NULL == as)
+        return VAL_OUT_OF_MEMORY;
+
+    val_log(NULL, LOG_DEBUG, "as %p allocated for {%s %s(%d) %s(%d)}", as,
+            domain_name, p_class(class_h), class_h, p_type(type_h), type_h);
+
+    as->val_as_name = strdup(domain_name);
+    if (as->val_as_name == NULL) {
+        FREE(as);
+        return VAL_OUT_OF_MEMORY;
+    }
+
+#ifndef VAL_NO_THREADS
+    as->val_as_tid = pthread_self();
+#endif
+    as->val_as_result_cb = callback;
+    as->val_as_cb_user_ctx = cb_data;
+    as->val_as_class = (u_int16_t) class_h;
+    as->val_as_type = (u_int16_t) type_h;
+
+    /*
+     * get context, if needed
+     */
+    context = val_create_or_refresh_context(ctx); /* does CTX_LOCK_POL_SH */
+    if (NULL == context) {
+        _async_status_free(&as); /* no context, so no lock needed */
+        return VAL_INTERNAL_ERROR;
+    }
+
+    as->val_as_ctx = context;
+
+#ifndef VAL_NO_THREADS
+    /** the context's resolver thread takes it from here */
+    if (NULL != (at = _async_thread_other(context))) {
+        as->val_as_submit_flags = flags;
+        *async_status = as;
+        if (_at_push_as(&at->at_submitted, as))
+            _at_signal(at->at_wake[1]);
+        CTX_UNLOCK_POL(context);
+        return VAL_NO_ERROR;
+    }
+#endif
+
+    retval = _async_submit_one(context, as, flags);
+    if (VAL_NO_ERROR != retval) {
+        as->val_as_ctx = NULL;
+        _async_status_free(&as); /* not on the list, so no lock needed */
+        CTX_UNLOCK_POL(context);
+    }
+
     *async_status = as;
 
     return retval;
@@ -7036,13 +7447,15 @@ _async_check_one(val_async_status *as, fd_set *pending_desc,
     val_context_t              *context;
     struct timeval             closest_event, now;
     int retval, data_received, data_missing, done, checked = 0, as_remain;
+    int ready;
     struct expected_arrival   *ea;
 #ifndef VAL_NO_THREADS
     pthread_t                   self = pthread_self();
 #endif
 
-    if ((NULL == as) || (as->val_as_ctx == NULL) ||
-        (pending_desc == NULL) || (NULL == nfds) || (NULL == remaining))
+    if ((NULL == as) || (as->val_as_ctx == NULL) || (NULL == remaining) ||
+        (!(flags & VAL_AS_CHECK_POLLFD) &&
+         ((pending_desc == NULL) || (NULL == nfds))))
         return VAL_BAD_ARGUMENT;
 
     context = as->val_as_ctx;
@@ -7094,7 +7507,11 @@ _async_check_one(val_async_status *as, fd_set *pending_desc,
 
         ++checked;
         ea = qfq->qfq_query->qc_ea; /* save ptr for loging */
-        if (res_async_ea_isset(qfq->qfq_query->qc_ea, pending_desc))
+        if (flags & VAL_AS_CHECK_POLLFD)
+            ready = res_async_ea_ready(qfq->qfq_query->qc_ea);
+        else
+            ready = res_async_ea_isset(qfq->qfq_query->qc_ea, pending_desc);
+        if (ready)
             retval = _resolver_rcv_one(as->val_as_ctx, &as->val_as_queries, qfq,
                                        pending_desc, &closest_event,
                                        &data_received);
@@ -7256,7 +7673,10 @@ val_async_select(val_context_t *context, fd_set *pending_desc, int *nfds,
  *                   NULL, in which case a timeout will be set based on the
  *                   closest event for pending async requests.
  *             flags -- flags affecting operation of this function.
- *                      None defined yet.
+ *                      VAL_AS_CHECK_POLLFD: the descriptor returned by
+ *                      val_async_getfd() is readable or the timeout from
+ *                      val_async_select_info() expired. pending_desc, nfds
+ *                      and tv are ignored and this function does not block.
  *
  * Returns:  < 0  : VAL_* error
  *             0  : no pending requests found
@@ -7313,8 +7733,17 @@ val_async_check_wait(val_context_t *ctx, fd_set *pending_desc,
         goto done;
     }
 
+    if (flags & VAL_AS_CHECK_POLLFD) {
+        /*
+         * the caller waited on val_async_getfd(); each request reads 
+         * its own sockets below
+         */
+        res_io_clear_pollfd();
+        pending_desc = NULL;
+        nfds = NULL;
+    }
     /** if caller didn't call select, do it for them */
-    if ((pending_desc == NULL) || (NULL == nfds)) {
+    else if ((pending_desc == NULL) || (NULL == nfds)) {
         int    local_nfds = 0;
         int    waiting;
 
@@ -7353,6 +7782,10 @@ val_async_check_wait(val_context_t *ctx, fd_set *pending_desc,
 
     CTX_UNLOCK_ACACHE(context);
 
+    /** let the requests of other contexts see their events */
+    if (flags & VAL_AS_CHECK_POLLFD)
+        res_io_rearm_pollfd();
+
     if (completed)
         _handle_completed(context);
 
@@ -7387,6 +7820,17 @@ _async_cancel_one(val_context_t *context, val_async_status *as, u_int flags)
     if (flags & VAL_AS_CANCEL_NO_CALLBACKS)
         as->val_as_flags |= VAL_AS_CALLBACK_CALLED;
 
+#ifndef VAL_NO_THREADS
+    if (_async_thread_queues(context)) {
+        val_log(context, LOG_DEBUG, "as %p cancelled", as);
+        if (! (flags & VAL_AS_CANCEL_CTX_REMOVED))
+            _context_as_remove(context, as);
+        _async_thread_queue(context, as, VAL_AS_EVENT_CANCELED);
+        CTX_UNLOCK_POL(context);
+        return;
+    }
+#endif
+
     /** call callback if done */
     _call_callbacks(VAL_AS_EVENT_CANCELED, as);
 
@@ -7400,6 +7844,31 @@ _async_cancel_one(val_context_t *context, val_async_status *as, u_int flags)
     CTX_UNLOCK_POL(context);
 }
 
+#ifndef VAL_NO_THREADS
+/*
+ * Pass a cancellation on to the resolver thread, which owns the
+ * requests. It is carried out unless the request has completed by then.
+ */
+static int
+_async_thread_cancel(val_context_t *context, val_async_status *as,
+                     unsigned int flags)
+{
+    struct val_async_thread_s *at = context->as_thread;
+    struct val_async_cancel_s *vac;
+
+    vac = (struct val_async_cancel_s *) MALLOC(sizeof(*vac));
+    if (NULL == vac)
+        return VAL_OUT_OF_MEMORY;
+    vac->vac_as = as;
+    vac->vac_flags = flags;
+
+    if (_at_push_cancel(&at->at_cancelled, vac))
+        _at_signal(at->at_wake[1]);
+
+    return VAL_NO_ERROR;
+}
+#endif
+
 /*
  * Function: val_async_cancel
  *
@@ -7417,6 +7886,11 @@ val_async_cancel(val_context_t *context, val_async_status *as, unsigned int flag
 
     flags &= ~VAL_AS_CANCEL_RESERVED_MASK; /* mask off reserved bits */
 
+#ifndef VAL_NO_THREADS
+    if (NULL != _async_thread_other(context))
+        return _async_thread_cancel(context, as, flags);
+#endif
+
     CTX_LOCK_ACACHE(context);
 
     _async_cancel_one(context, as, flags);
@@ -7444,6 +7918,11 @@ val_async_cancel_all(val_context_t *context, unsigned int flags)
 
     flags &= ~VAL_AS_CANCEL_RESERVED_MASK; /* mask off reserved bits */
 
+#ifndef VAL_NO_THREADS
+    if (NULL != _async_thread_other(context))
+        return _async_thread_cancel(context, NULL, flags);
+#endif
+
     CTX_LOCK_ACACHE(context);
 
     for (as = context->as_list; as; as = next) {
@@ -7474,4 +7953,437 @@ val_async_getflags(val_async_status *as)
     return as->val_as_flags;
 }
 
+
+#ifndef VAL_NO_THREADS
+
+#define VAL_AS_THREAD_MAX_WAIT      5   /* seconds, while requests pend */
+
+/*
+ * Submit a request handed over by another thread, on behalf of the
+ * resolver thread. Errors are reported through the request's callback.
+ */
+static void
+_async_thread_submit(val_context_t *context, val_async_status *as)
+{
+    int retval, locked = 1;
+
+    as->val_as_tid = pthread_self();
+
+    /** the request keeps CTX_LOCK_POL_SH until it completes */
+    if (NULL == val_create_or_refresh_context(context)) {
+        locked = 0;
+        retval = VAL_INTERNAL_ERROR;
+    } else if (VAL_NO_ERROR ==
+               (retval = _async_submit_one(context, as,
+                                           as->val_as_submit_flags)))
+        return;
+
+    val_log(context, LOG_INFO, "as %p {%s} could not be submitted: %s",
+            as, as->val_as_name, p_val_err(retval));
+
+    as->val_as_retval = retval;
+    as->val_as_flags |= VAL_AS_DONE;
+    if (_async_thread_queues(context))
+        _async_thread_queue(context, as, VAL_AS_EVENT_COMPLETED);
+    else {
+        _call_callbacks(VAL_AS_EVENT_COMPLETED, as);
+        as->val_as_ctx = NULL;
+        _async_status_free(&as);
+    }
+
+    if (locked)
+        CTX_UNLOCK_POL(context);
+}
+
+/*
+ * Take the requests and cancellations that other threads have handed
+ * over to the resolver thread.
+ */
+static void
+_async_thread_take(val_context_t *context, struct val_async_thread_s *at)
+{
+    val_async_status *as, *next;
+    struct val_async_cancel_s *vac, *vnext;
+
+    _at_drain(at->at_wake[0]);
+
+    /*
+     * cancellations first, so that a request that was cancelled has
+     * been taken too
+     */
+    vac = _at_take_cancel(&at->at_cancelled);
+
+    for (as = _at_take_as(&at->at_submitted); as; as = next) {
+        next = as->val_as_next;
+        as->val_as_next = NULL;
+        _async_thread_submit(context, as);
+    }
+
+    for (; vac; vac = vnext) {
+        vnext = vac->vac_next;
+        if (NULL == vac->vac_as)
+            val_async_cancel_all(context, vac->vac_flags);
+        else {
+            CTX_LOCK_ACACHE(context);
+            /** unless it has completed in the meantime */
+            for (as = context->as_list; as && (as != vac->vac_as);
+                 as = as->val_as_next)
+                ;
+            if (as)
+                _async_cancel_one(context, as, vac->vac_flags);
+            CTX_UNLOCK_ACACHE(context);
+        }
+        FREE(vac);
+    }
+}
+
+static void *
+_async_thread_main(void *arg)
+{
+    val_context_t             *context = (val_context_t *) arg;
+    struct val_async_thread_s *at;
+    val_async_status          *as, *next;
+    struct timeval             tv, *tvp;
+    fd_set                     fds;
+    int                        pollfd, nfds = 0;
+
+    /** wait for val_async_thread_start() to finish */
+    CTX_LOCK_ACACHE(context);
+    at = context->as_thread;
+    CTX_UNLOCK_ACACHE(context);
+
+    val_log(context, LOG_INFO, "resolver thread started");
+
+    /** descriptor for all of this thread's sockets, if there is one */
+    pollfd = val_async_getfd(context);
+    FD_ZERO(&fds);
+
+    for (;;) {
+
+        _async_thread_take(context, at);
+        if (at->at_stop)
+            break;
+
+        if (pollfd >= 0)
+            val_async_check_wait(context, NULL, NULL, NULL,
+                                 VAL_AS_CHECK_POLLFD);
+        else
+            val_async_check_wait(context, &fds, &nfds, NULL, 0);
+
+        /** sleep until something arrives, times out or is handed over */
+        tvp = NULL;
+        if (NULL != context->as_list) {
+            tv.tv_sec = VAL_AS_THREAD_MAX_WAIT;
+            tv.tv_usec = 0;
+            tvp = &tv;
+        }
+#ifdef HAVE_POLL_H
+        if (pollfd >= 0) {
+            struct pollfd pfd[2];
+
+            if (tvp)
+                val_async_select_info(context, NULL, NULL, tvp);
+            pfd[0].fd = at->at_wake[0];
+            pfd[0].events = POLLIN;
+            pfd[1].fd = pollfd;
+            pfd[1].events = POLLIN;
+            poll(pfd, 2, tvp ? (int)(tv.tv_sec * 1000 +
+                                     (tv.tv_usec + 999) / 1000) : -1);
+            continue;
+        }
+#endif
+        FD_ZERO(&fds);
+        nfds = 0;
+        if (at->at_wake[0] < FD_SETSIZE) {
+            FD_SET(at->at_wake[0], &fds);
+            nfds = at->at_wake[0] + 1;
+        } else if (NULL == tvp) {
+            /** can't select on the pipe, so look at it now and then */
+            tv.tv_sec = VAL_AS_THREAD_MAX_WAIT;
+            tv.tv_usec = 0;
+            tvp = &tv;
+        }
+        val_async_select_info(context, &fds, &nfds, tvp);
+        if (select(nfds, &fds, NULL, NULL, tvp) <= 0) {
+            FD_ZERO(&fds);
+            nfds = 0;
+        }
+    }
+
+    /** cancel whatever is left */
+    CTX_LOCK_ACACHE(context);
+    for (as = context->as_list; as; as = next) {
+        next = as->val_as_next;
+        if (pthread_equal(pthread_self(), as->val_as_tid))
+            _async_cancel_one(context, as, 0);
+    }
+    CTX_UNLOCK_ACACHE(context);
+
+    val_log(context, LOG_INFO, "resolver thread stopped");
+
+    return NULL;
+}
+
+static int
+_at_pipe(int fds[2])
+{
+    int i, fl;
+
+    if (pipe(fds) < 0)
+        return -1;
+
+    for (i = 0; i < 2; i++) {
+        if (((fl = fcntl(fds[i], F_GETFL)) < 0) ||
+            (fcntl(fds[i], F_SETFL, fl | O_NONBLOCK) < 0)) {
+            close(fds[0]);
+            close(fds[1]);
+            return -1;
+        }
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    return 0;
+}
+
+static void
+_at_free(struct val_async_thread_s *at)
+{
+    if (at->at_wake[0] >= 0) {
+        close(at->at_wake[0]);
+        close(at->at_wake[1]);
+    }
+    if (at->at_notify[0] >= 0) {
+        close(at->at_notify[0]);
+        close(at->at_notify[1]);
+    }
+    FREE(at);
+}
+
+/** make the callbacks for queued completions */
+static int
+_async_thread_complete(struct val_async_thread_s *at)
+{
+    val_async_status *as, *next;
+    int               count = 0;
+
+    _at_drain(at->at_notify[0]);
+
+    for (as = _at_take_as(&at->at_completed); as; as = next) {
+        next = as->val_as_next;
+        as->val_as_next = NULL;
+        count += _call_callbacks(as->val_as_event, as);
+        as->val_as_ctx = NULL; /* already off the context list */
+        _async_status_free(&as);
+    }
+    return count;
+}
+
+/*
+ * Function: val_async_thread_start
+ *
+ * Purpose: start a thread that does the work for the asynchronous
+ *          requests that other threads submit with the given context,
+ *          so that they never have to wait inside libval.
+ *
+ * Parameter: context -- context whose requests the thread handles
+ *            flags -- VAL_AS_THREAD_QUEUE_COMPLETIONS: callbacks are
+ *                     made by val_async_thread_complete() instead of by
+ *                     the resolver thread.
+ */
+int
+val_async_thread_start(val_context_t *ctx, unsigned int flags)
+{
+    struct val_async_thread_s *at;
+    val_context_t *context;
+    int retval = VAL_NO_ERROR;
+
+    if (NULL == ctx)
+        return VAL_BAD_ARGUMENT;
+
+    at = (struct val_async_thread_s *) MALLOC(sizeof(*at));
+    if (NULL == at)
+        return VAL_OUT_OF_MEMORY;
+    memset(at, 0, sizeof(*at));
+    at->at_flags = flags;
+    at->at_wake[0] = at->at_notify[0] = -1;
+
+    if ((_at_pipe(at->at_wake) < 0) || (_at_pipe(at->at_notify) < 0)) {
+        val_log(ctx, LOG_ERR, "val_async_thread_start: pipe: %s",
+                strerror(errno));
+        _at_free(at);
+        return VAL_INTERNAL_ERROR;
+    }
+
+    context = val_create_or_refresh_context(ctx); /* does CTX_LOCK_POL_SH */
+    if (NULL == context) {
+        _at_free(at);
+        return VAL_INTERNAL_ERROR;
+    }
+
+    CTX_LOCK_ACACHE(context);
+    if (NULL != context->as_thread) {
+        val_log(context, LOG_INFO,
+                "val_async_thread_start: context already has a thread");
+        retval = VAL_BAD_ARGUMENT;
+    } else {
+        context->as_thread = at;
+        if (0 != pthread_create(&at->at_tid, NULL, _async_thread_main,
+                                context)) {
+            context->as_thread = NULL;
+            retval = VAL_INTERNAL_ERROR;
+        }
+    }
+    CTX_UNLOCK_ACACHE(context);
+
+    CTX_UNLOCK_POL(context);
+
+    if (VAL_NO_ERROR != retval)
+        _at_free(at);
+
+    return retval;
+}
+
+/*
+ * Function: val_async_thread_stop
+ *
+ * Purpose: stop the resolver thread of a context, cancelling the
+ *          requests it still has.
+ *
+ * Parameter: context -- context whose resolver thread is to stop
+ */
+int
+val_async_thread_stop(val_context_t *context)
+{
+    struct val_async_thread_s *at;
+    struct val_async_cancel_s *vac, *vnext;
+    val_async_status          *as, *next;
+
+    if (NULL == context)
+        return VAL_BAD_ARGUMENT;
+
+    CTX_LOCK_ACACHE(context);
+    at = context->as_thread;
+    if (at && pthread_equal(pthread_self(), at->at_tid)) {
+        CTX_UNLOCK_ACACHE(context);
+        return VAL_BAD_ARGUMENT;
+    }
+    if (at && at->at_stop)
+        at = NULL; /* someone else is stopping it */
+    else if (at)
+        at->at_stop = 1;
+    CTX_UNLOCK_ACACHE(context);
+
+    if (NULL == at)
+        return VAL_NO_ERROR;
+
+    _at_signal(at->at_wake[1]);
+    pthread_join(at->at_tid, NULL);
+
+    CTX_LOCK_ACACHE(context);
+    context->as_thread = NULL;
+    CTX_UNLOCK_ACACHE(context);
+
+    /** requests handed over while the thread was stopping */
+    for (as = _at_take_as(&at->at_submitted); as; as = next) {
+        next = as->val_as_next;
+        as->val_as_next = NULL;
+        _call_callbacks(VAL_AS_EVENT_CANCELED, as);
+        as->val_as_ctx = NULL;
+        _async_status_free(&as);
+    }
+    for (vac = _at_take_cancel(&at->at_cancelled); vac; vac = vnext) {
+        vnext = vac->vac_next;
+        FREE(vac);
+    }
+
+    /** completions nobody collected */
+    _async_thread_complete(at);
+
+    _at_free(at);
+
+    return VAL_NO_ERROR;
+}
+
+/*
+ * Function: val_async_thread_complete
+ *
+ * Purpose: make the callbacks for the requests that the resolver
+ *          thread has completed or cancelled since the last call.
+ *
+ * Parameter: context -- context whose resolver thread queues completions
+ *
+ * Returns: the number of callbacks made, or a VAL_* error
+ */
+int
+val_async_thread_complete(val_context_t *context)
+{
+    struct val_async_thread_s *at;
+
+    if (NULL == context)
+        return VAL_BAD_ARGUMENT;
+
+    CTX_LOCK_ACACHE(context);
+    at = context->as_thread;
+    CTX_UNLOCK_ACACHE(context);
+    if (NULL == at)
+        return 0;
+
+    return _async_thread_complete(at);
+}
+
+/*
+ * Function: val_async_thread_getfd
+ *
+ * Purpose: return a descriptor that becomes readable when the resolver
+ *          thread has queued completions for val_async_thread_complete().
+ *
+ * Parameter: context -- context whose resolver thread queues completions
+ */
+int
+val_async_thread_getfd(val_context_t *context)
+{
+    struct val_async_thread_s *at;
+    int fd;
+
+    if (NULL == context)
+        return VAL_BAD_ARGUMENT;
+
+    CTX_LOCK_ACACHE(context);
+    at = context->as_thread;
+    if ((NULL == at) || !(at->at_flags & VAL_AS_THREAD_QUEUE_COMPLETIONS))
+        fd = VAL_BAD_ARGUMENT;
+    else
+        fd = at->at_notify[0];
+    CTX_UNLOCK_ACACHE(context);
+
+    return fd;
+}
+
+#else /* VAL_NO_THREADS */
+
+int
+val_async_thread_start(val_context_t *context, unsigned int flags)
+{
+    return VAL_NOT_IMPLEMENTED;
+}
+
+int
+val_async_thread_stop(val_context_t *context)
+{
+    return VAL_NOT_IMPLEMENTED;
+}
+
+int
+val_async_thread_complete(val_context_t *context)
+{
+    return VAL_NOT_IMPLEMENTED;
+}
+
+int
+val_async_thread_getfd(val_context_t *context)
+{
+    return VAL_NOT_IMPLEMENTED;
+}
+
+#endif /* VAL_NO_THREADS */
+
 #endif /* VAL_NO_ASYNC */
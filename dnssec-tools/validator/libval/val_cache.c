@@ -29,13 +29,110 @@
 #include "val_support.h"
 #include "val_resquery.h"
 #include "val_cache.h"
+#include "val_assertion.h"
+#include "val_parse.h"
 
 /*
  * we have caches for DNSKEY, DS, NS/glue, answers, and proofs
- * XXX negative cache functionality is currently unimplemented
+ *
+ * The NS/glue and answer caches are each split into CACHE_SHARDS
+ * independently locked shards, selected by a hash of the owner name.
+ * Within a shard, rrsets are chained through rrs_next in buckets
+ * indexed by the same hash, so all rrsets for a given owner name
+ * live in a single short chain.
  */
-static struct rrset_rec *unchecked_hints = NULL;
-static struct rrset_rec *unchecked_answers = NULL;
+#define CACHE_SHARDS        16
+#define CACHE_SHARD_BUCKETS 512
+
+struct cache_shard {
+    struct rrset_rec *cs_buckets[CACHE_SHARD_BUCKETS];
+#ifndef VAL_NO_THREADS
+    pthread_rwlock_t  cs_rwlock;
+#else
+    int               cs_rwlock;
+#endif
+};
+
+struct rrset_store {
+    const char         *st_name;
+    struct cache_shard  st_shards[CACHE_SHARDS];
+};
+
+static struct rrset_store unchecked_hints = { "Hints" };
+static struct rrset_store unchecked_answers = { "Answer" };
+
+#define CACHE_SHARD(store, h) \
+    (&(store)->st_shards[(h) % CACHE_SHARDS])
+#define CACHE_BUCKET(shard, h) \
+    (&(shard)->cs_buckets[((h) / CACHE_SHARDS) % CACHE_SHARD_BUCKETS])
+
+/*
+ * The negative cache holds proofs of non-existence (RFC 2308) that
+ * were found to be trusted, keyed on {name, class, type}. 
+ * Proofs are handed back to the validator exactly as if they had
+ * been received from the network, so they are still checked against
+ * the policy of the requesting context; the status they had when
+ * they were stored is not kept.
+ */
+#define NEG_CACHE_BUCKETS 1024
+
+struct neg_cache_rec {
+    u_char           *nc_name_n;
+    u_int16_t         nc_class_h;
+    u_int16_t         nc_type_h;
+    u_int32_t         nc_ttl_x;
+    unsigned long     nc_ns_options;
+    struct rrset_rec *nc_proofs;
+    size_t            nc_bytes;
+    u_char            nc_ref;
+    struct neg_cache_rec *nc_next;
+};
+
+static struct neg_cache_rec *negative_answers[NEG_CACHE_BUCKETS];
+
+/*
+ * Aggressive use of the validated cache (RFC 8198).
+ * NSEC and NSEC3 RRsets that were part of a validated proof of
+ * non-existence are indexed per zone, sorted in canonical name order
+ * (NSEC) or hash order (NSEC3). A query for some other name that
+ * falls within one of these spans is answered from the index with a
+ * synthesized NXDOMAIN or NODATA response. The synthesized proofs
+ * are run through the validator like any other response.
+ */
+#define SPAN_ZONE_BUCKETS 256
+#define SPAN_INIT_SIZE    16
+
+struct nsec_span {
+    u_char           *ns_start;     /* owner name, or owner hash for NSEC3 */
+    size_t            ns_startlen;
+    u_char           *ns_end;       /* next name, or next hash for NSEC3 */
+    size_t            ns_endlen;
+    u_char           *ns_bitmap;
+    size_t            ns_bitmaplen;
+    u_char            ns_flags;     /* NSEC3 flags */
+    struct rrset_rec *ns_rrset;
+};
+
+struct nsec_span_zone {
+    u_char           *sz_zone_n;
+    u_int16_t         sz_class_h;
+    u_int16_t         sz_type_h;    /* ns_t_nsec or ns_t_nsec3 */
+    struct rrset_rec *sz_soa;
+#ifdef LIBVAL_NSEC3
+    u_char            sz_alg;
+    u_int16_t         sz_iter;
+    u_char            sz_saltlen;
+    u_char            sz_salt[256];
+#endif
+    struct nsec_span *sz_spans;     /* sorted on ns_start */
+    size_t            sz_count;
+    size_t            sz_size;
+    size_t            sz_bytes;
+    u_char            sz_ref;
+    struct nsec_span_zone *sz_next;
+};
+
+static struct nsec_span_zone *nsec_span_zones[SPAN_ZONE_BUCKETS];
 
 #ifndef VAL_NO_THREADS
 
@@ -43,14 +140,27 @@ static struct rrset_rec *unchecked_answers = NULL;
  * provide thread-safe access to each of the
  * various caches
  */
-static pthread_rwlock_t ns_rwlock;
-static int ns_rwlock_init = 0;
-static pthread_rwlock_t ans_rwlock;
-static int ans_rwlock_init = 0;
+static pthread_rwlock_t neg_rwlock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t span_rwlock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+/*
+ * the shard locks are not static, so they are set up
+ * exactly once, before any of them is first used
+ */
+static void
+init_cache_shards(void)
+{
+    int i;
+
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        pthread_rwlock_init(&unchecked_hints.st_shards[i].cs_rwlock, NULL);
+        pthread_rwlock_init(&unchecked_answers.st_shards[i].cs_rwlock, NULL);
+    }
+}
 
-#define VAL_CACHE_LOCK_INIT(lk, initvar) \
-    ((initvar != 0) || \
-     ((0 == pthread_rwlock_init(lk, NULL)) && ((initvar = 1))))
+#define VAL_CACHE_SHARDS_INIT() \
+    pthread_once(&shards_once, init_cache_shards)
 
 #define VAL_CACHE_LOCK_SH(lk) \
 	(0 != pthread_rwlock_rdlock(lk))
@@ -61,21 +171,141 @@ static int ans_rwlock_init = 0;
 #define VAL_CACHE_UNLOCK(lk) \
 	(0 != pthread_rwlock_unlock(lk))
 
+/*
+ * Readers holding only a shared lock mark the entries they use for
+ * the CLOCK sweep, which itself runs under the exclusive lock. Where
+ * the compiler has no atomic store a mutex stands in for it.
+ */
+#ifdef __ATOMIC_RELAXED
+#define VAL_CACHE_SET_REF(ref) \
+    __atomic_store_n(&(ref), 1, __ATOMIC_RELAXED)
+#else
+static pthread_mutex_t ref_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define VAL_CACHE_SET_REF(ref) \
+    do { \
+        pthread_mutex_lock(&ref_lock); \
+        (ref) = 1; \
+        pthread_mutex_unlock(&ref_lock); \
+    } while (0)
+#endif
+
 #else
 
 /* Define dummy values */
-static int ns_rwlock = -1;
-static int ns_rwlock_init = -1;
-static int ans_rwlock = -1;
-static int ans_rwlock_init = -1;
+static int neg_rwlock = -1;
+static int span_rwlock = -1;
 
-#define VAL_CACHE_LOCK_INIT(lk, initvar)
+#define VAL_CACHE_SHARDS_INIT()
 #define VAL_CACHE_LOCK_SH(lk)
 #define VAL_CACHE_LOCK_EX(lk)
 #define VAL_CACHE_UNLOCK(lk)
+#define VAL_CACHE_SET_REF(ref) ((ref) = 1)
+
+#endif
 
+/*
+ * Memory accounting. 
+ * Everything held in the caches above, along with the query caches
+ * of all contexts, is charged against a single byte budget. Once the
+ * budget is exceeded, cached data is evicted using the CLOCK
+ * algorithm: entries have a reference bit that is set whenever they
+ * are used and cleared as the clock hand passes over them; entries
+ * found with the bit already clear are dropped.
+ */
+#define CLOCK_STORE_POSITIONS (CACHE_SHARDS * CACHE_SHARD_BUCKETS)
+#define CLOCK_POSITIONS \
+    (2 * CLOCK_STORE_POSITIONS + NEG_CACHE_BUCKETS + SPAN_ZONE_BUCKETS)
+/* upper bound on the buckets visited in a single sweep */
+#define CLOCK_MAX_SCAN        1024
+
+static size_t cache_budget = 0;     /* 0 means no limit */
+static size_t cache_resident = 0;
+static unsigned long cache_evictions = 0;
+static size_t clock_hand = 0;
+
+#ifndef VAL_NO_THREADS
+static pthread_mutex_t acct_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t clock_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define VAL_CACHE_ACCT_LOCK(lk)     pthread_mutex_lock(lk)
+#define VAL_CACHE_ACCT_TRYLOCK(lk)  (0 == pthread_mutex_trylock(lk))
+#define VAL_CACHE_ACCT_UNLOCK(lk)   pthread_mutex_unlock(lk)
+#else
+#define VAL_CACHE_ACCT_LOCK(lk)
+#define VAL_CACHE_ACCT_TRYLOCK(lk)  1
+#define VAL_CACHE_ACCT_UNLOCK(lk)
 #endif
 
+static void enforce_cache_budget(void);
+
+/*
+ * Charge (or, for negative values, release) delta bytes against
+ * the cache budget
+ */
+void
+account_cache_memory(long delta)
+{
+    VAL_CACHE_ACCT_LOCK(&acct_lock);
+    if (delta >= 0)
+        cache_resident += (size_t) delta;
+    else if ((size_t) -delta < cache_resident)
+        cache_resident -= (size_t) -delta;
+    else
+        cache_resident = 0;
+    VAL_CACHE_ACCT_UNLOCK(&acct_lock);
+}
+
+void
+count_cache_evictions(unsigned long count)
+{
+    VAL_CACHE_ACCT_LOCK(&acct_lock);
+    cache_evictions += count;
+    VAL_CACHE_ACCT_UNLOCK(&acct_lock);
+}
+
+int
+cache_over_budget(void)
+{
+    int over;
+
+    VAL_CACHE_ACCT_LOCK(&acct_lock);
+    over = (cache_budget > 0 && cache_resident > cache_budget);
+    VAL_CACHE_ACCT_UNLOCK(&acct_lock);
+    return over;
+}
+
+/*
+ * Set an upper limit on the number of bytes held in the caches.
+ * A limit of 0 removes the limit.
+ */
+int
+val_cache_set_budget(size_t max_bytes)
+{
+    VAL_CACHE_ACCT_LOCK(&acct_lock);
+    cache_budget = max_bytes;
+    VAL_CACHE_ACCT_UNLOCK(&acct_lock);
+
+    enforce_cache_budget();
+
+    return VAL_NO_ERROR;
+}
+
+int
+val_cache_get_stats(val_cache_stats_t *stats)
+{
+    if (stats == NULL)
+        return VAL_BAD_ARGUMENT;
+
+    VAL_CACHE_ACCT_LOCK(&acct_lock);
+    stats->vcs_resident = cache_resident;
+    stats->vcs_budget = cache_budget;
+    stats->vcs_evictions = cache_evictions;
+    VAL_CACHE_ACCT_UNLOCK(&acct_lock);
+
+    return VAL_NO_ERROR;
+}
+
 #define IN_BAILIWICK(name, q) \
     ((q) &&\
      (q->qc_zonecut_n? (NULL != namename(name, q->qc_zonecut_n)) :\
@@ -83,28 +313,40 @@ static int ans_rwlock_init = -1;
 
 /*
  * Common routine to store data to a specific cache
- * NOTE: This assumes a read lock is alread held by the caller.
  */
 static int
-stow_info(struct rrset_rec **unchecked_info, struct rrset_rec **new_info, struct val_query_chain *matched_q)
+stow_info(struct rrset_store *store, struct rrset_rec **new_info, struct val_query_chain *matched_q)
 {
     struct rrset_rec *new_rr;
-    struct rrset_rec *old, *prev;
+    struct rrset_rec *old, **oldp;
+    struct rrset_rec **bucket;
+    struct cache_shard *shard;
+    struct timeval  tv;
     char name_p[NS_MAXDNAME];
-    const char *cachename;
+    u_int16_t class_h, type_h;
+    u_int32_t h;
+    long delta;
     int delete_newrr = 0;
 
-    if (new_info == NULL || unchecked_info == NULL)
+    if (new_info == NULL || store == NULL)
         return VAL_NO_ERROR;
 
-    prev = NULL;
+    gettimeofday(&tv, NULL);
+
     while (*new_info) {
         new_rr = *new_info;
+        *new_info = new_rr->rrs_next;
+        new_rr->rrs_next = NULL;
         delete_newrr = 0;
+
+        VAL_LOG_NTOP(LOG_INFO, new_rr->rrs_name_n, name_p, sizeof(name_p));
+        class_h = new_rr->rrs_class_h;
+        type_h = new_rr->rrs_type_h;
+
         if (!IN_BAILIWICK(new_rr->rrs_name_n, matched_q) ||
-            /* 
+            /*
              * no need to save any negative response
-             * meta-data other than ns_t_soa since 
+             * meta-data other than ns_t_soa since
              * we will never look for these record types in
              * our cache.
              */
@@ -114,85 +356,151 @@ stow_info(struct rrset_rec **unchecked_info, struct rrset_rec **new_info, struct
             new_rr->rrs_type_h == ns_t_nsec) {
             delete_newrr = 1;
         } else {
-          old = *unchecked_info;
-          prev = NULL;
-          while (old) {
-            if (
-                old->rrs_type_h == new_rr->rrs_type_h
-                && old->rrs_class_h == new_rr->rrs_class_h
-                && namecmp(old->rrs_name_n,
-                           new_rr->rrs_name_n) == 0) {
-
-                /*
-                 * old and new are competitors 
-                 */
-                if (old->rrs_cred >= new_rr->rrs_cred) {
+            h = wire_name_hash(new_rr->rrs_name_n);
+            shard = CACHE_SHARD(store, h);
+            bucket = CACHE_BUCKET(shard, h);
+
+            VAL_CACHE_SHARDS_INIT();
+            VAL_CACHE_LOCK_EX(&shard->cs_rwlock);
+
+            delta = 0;
+            oldp = bucket;
+            while ((old = *oldp) != NULL) {
+                /* drop expired records while we are here */
+                if (old->rrs_ttl_x <= tv.tv_sec) {
+                    *oldp = old->rrs_next;
+                    old->rrs_next = NULL;
+                    delta -= rrset_rec_size(old);
+                    res_sq_free_rrset_recs(&old);
+                    continue;
+                }
+
+                if (old->rrs_type_h == new_rr->rrs_type_h
+                    && old->rrs_class_h == new_rr->rrs_class_h
+                    && namecmp(old->rrs_name_n,
+                               new_rr->rrs_name_n) == 0) {
+
                     /*
-                     * exchange the two -
-                     * copy from new to old: cred, status, section, ans_kind
-                     * exchange: data, sig
+                     * old and new are competitors
                      */
-                    struct rrset_rr  *rr_exchange;
-
-                    old->rrs_cred = new_rr->rrs_cred;
-                    old->rrs_section = new_rr->rrs_section;
-                    old->rrs_ans_kind = new_rr->rrs_ans_kind;
-                    rr_exchange = old->rrs_data;
-                    old->rrs_data = new_rr->rrs_data;
-                    new_rr->rrs_data = rr_exchange;
-                    rr_exchange = old->rrs_sig;
-                    old->rrs_sig = new_rr->rrs_sig;
-                    new_rr->rrs_sig = rr_exchange;
+                    if (old->rrs_cred >= new_rr->rrs_cred) {
+                        /*
+                         * exchange the two -
+                         * copy from new to old: cred, status, section, ans_kind
+                         * exchange: data, sig
+                         */
+                        struct rrset_rr  *rr_exchange;
+
+                        delta -= rrset_rec_size(old);
+                        old->rrs_cred = new_rr->rrs_cred;
+                        old->rrs_section = new_rr->rrs_section;
+                        old->rrs_ans_kind = new_rr->rrs_ans_kind;
+                        rr_exchange = old->rrs_data;
+                        old->rrs_data = new_rr->rrs_data;
+                        new_rr->rrs_data = rr_exchange;
+                        rr_exchange = old->rrs_sig;
+                        old->rrs_sig = new_rr->rrs_sig;
+                        new_rr->rrs_sig = rr_exchange;
+                        delta += rrset_rec_size(old);
+                    }
+                    old->rrs_ref = 1;
+
+                    delete_newrr = 1;
+                    break;
                 }
 
-                delete_newrr = 1;
-                break;
-            } 
+                /* look at the next cached record */
+                oldp = &old->rrs_next;
+            }
 
-            /* look at the next cached record */
-            prev = old;
-            old = old->rrs_next;
-          }
-        }
+            if (!delete_newrr) {
+                new_rr->rrs_ref = 1;
+                new_rr->rrs_next = *bucket;
+                *bucket = new_rr;
+                delta += rrset_rec_size(new_rr);
+            }
 
-        *new_info = new_rr->rrs_next;
-        new_rr->rrs_next = NULL;
+            VAL_CACHE_UNLOCK(&shard->cs_rwlock);
 
-        if (-1 == ns_name_ntop(new_rr->rrs_name_n, name_p, sizeof(name_p)))
-            snprintf(name_p, sizeof(name_p), "unknown/error");
-        cachename = (*unchecked_info == unchecked_hints)?  "Hints" : "Answer";
+            account_cache_memory(delta);
+        }
 
         if (delete_newrr) {
             val_log(NULL, LOG_INFO, "stow_info(): Refreshing {%s, %d, %d} in %s cache",
-                   name_p, new_rr->rrs_class_h, new_rr->rrs_type_h, cachename);
+                   name_p, class_h, type_h, store->st_name);
             res_sq_free_rrset_recs(&new_rr);
         } else {
-            /* add new data to the end of our cache */
             val_log(NULL, LOG_INFO, "stow_info(): Storing new {%s, %d, %d} in %s cache",
-                   name_p, new_rr->rrs_class_h, new_rr->rrs_type_h, cachename);
-            if (prev) {
-                prev->rrs_next = new_rr;
-            } else {
-                *unchecked_info = new_rr;
-            }
+                   name_p, class_h, type_h, store->st_name);
         }
     }
+
+    enforce_cache_budget();
+
     return VAL_NO_ERROR;
 }
 
+/*
+ * Copy an unexpired rrset of type type_h (or a CNAME if cname is set)
+ * owned by name_n from a specific cache
+ */
+static void
+copy_from_store(struct rrset_store *store, u_char *name_n,
+                u_int16_t class_h, u_int16_t type_h, int cname,
+                unsigned long ns_options, time_t now,
+                struct rrset_rec **new_answer)
+{
+    struct cache_shard *shard;
+    struct rrset_rec *next_answer;
+    u_int32_t h;
+
+    h = wire_name_hash(name_n);
+    shard = CACHE_SHARD(store, h);
+
+    VAL_CACHE_SHARDS_INIT();
+    VAL_CACHE_LOCK_SH(&shard->cs_rwlock);
+
+    for (next_answer = *CACHE_BUCKET(shard, h); next_answer;
+            next_answer = next_answer->rrs_next) {
+
+        if (now < next_answer->rrs_ttl_x &&
+            next_answer->rrs_class_h == class_h &&
+            (next_answer->rrs_type_h == type_h ||
+             (cname && next_answer->rrs_type_h == ns_t_cname)) &&
+            namecmp(next_answer->rrs_name_n, name_n) == 0) {
+
+            /*
+             * if we want to match particular options, make sure
+             * they actually match
+             */
+            if ((ns_options == 0 ||
+                 ns_options == next_answer->rrs_ns_options) &&
+                (next_answer->rrs_data != NULL)) {
+                VAL_CACHE_SET_REF(next_answer->rrs_ref);
+                *new_answer = copy_rrset_rec(next_answer);
+                if (*new_answer) {
+                    /* Adjust the TTL */
+                    (*new_answer)->rrs_ttl_h = next_answer->rrs_ttl_x - now;
+                }
+                break;
+            }
+        }
+    }
+
+    VAL_CACHE_UNLOCK(&shard->cs_rwlock);
+}
+
 /*
  * Common routine to read data from a specific cache
- * NOTE: This assumes a read lock is alread held by the caller.
  */
 static int
-lookup_store(u_char *name_n, u_int16_t class_h, u_int16_t type_h,
-             struct rrset_rec *answer_head, 
+lookup_store(struct rrset_store *store,
+             u_char *name_n, u_int16_t class_h, u_int16_t type_h,
              struct rrset_rec **new_answer,
              unsigned long ns_options)
 {
-
-    struct rrset_rec *next_answer;
     struct timeval  tv;
+    u_char *p;
 
     if (NULL == new_answer)
         return VAL_BAD_ARGUMENT;
@@ -201,44 +509,99 @@ lookup_store(u_char *name_n, u_int16_t class_h, u_int16_t type_h,
 
     gettimeofday(&tv, NULL);
 
-    next_answer = answer_head;
-    while (next_answer) {
-
-        if (tv.tv_sec < next_answer->rrs_ttl_x &&
-            next_answer->rrs_class_h == class_h) {
-
-            /* if matching type or cname indirection */
-            if (((next_answer->rrs_type_h == type_h ||
-                (next_answer->rrs_type_h == ns_t_cname &&
-                ALIAS_MATCH_TYPE(type_h))) &&
-                /* and name is an exact match */
-                (namecmp(next_answer->rrs_name_n, name_n) == 0)) ||
-                /* OR */
-                /* DNAME indirection */
-                ((next_answer->rrs_type_h == ns_t_dname &&
-                ALIAS_MATCH_TYPE(type_h)) &&
-                /* and name applies */
-                (NULL != (u_char *) namename(name_n, 
-                                    next_answer->rrs_name_n)))) {
-
-                /* 
-                 * if we want to match particular options, make sure
-                 * they actually match
-                 */
-                if((ns_options == 0 || 
-                    ns_options == next_answer->rrs_ns_options) &&
-                   (next_answer->rrs_data != NULL)) {
-                    *new_answer = copy_rrset_rec(next_answer);
-                    if (*new_answer) {
-                        /* Adjust the TTL */
-                        (*new_answer)->rrs_ttl_h = next_answer->rrs_ttl_x - tv.tv_sec; 
-                    }
-                    break;
+    /* matching type or cname indirection, and name is an exact match */
+    copy_from_store(store, name_n, class_h, type_h,
+                    ALIAS_MATCH_TYPE(type_h), ns_options, tv.tv_sec,
+                    new_answer);
+
+    /* DNAME indirection at the name or any of its ancestors */
+    if (*new_answer == NULL && ALIAS_MATCH_TYPE(type_h)) {
+        for (p = name_n; ; p += *p + 1) {
+            copy_from_store(store, p, class_h, ns_t_dname, 0,
+                            ns_options, tv.tv_sec, new_answer);
+            if (*new_answer != NULL || *p == '\0')
+                break;
+        }
+    }
+
+    return VAL_NO_ERROR;
+}
+
+/*
+ * Copy out the unexpired NS rrsets for zone_n from the hints cache,
+ * along with any unexpired glue for the name servers they list
+ */
+static int
+get_zone_info(u_char *zone_n, time_t now, struct rrset_rec **zone_info)
+{
+    struct cache_shard *shard;
+    struct rrset_rec *r, *ns_set, *glue = NULL, *copy;
+    struct rrset_rr *ns_rr;
+    u_int32_t h;
+
+    *zone_info = NULL;
+
+    h = wire_name_hash(zone_n);
+    shard = CACHE_SHARD(&unchecked_hints, h);
+
+    VAL_CACHE_SHARDS_INIT();
+    VAL_CACHE_LOCK_SH(&shard->cs_rwlock);
+    for (r = *CACHE_BUCKET(shard, h); r; r = r->rrs_next) {
+        if (now >= r->rrs_ttl_x || r->rrs_type_h != ns_t_ns ||
+            namecmp(r->rrs_name_n, zone_n) != 0)
+            continue;
+        VAL_CACHE_SET_REF(r->rrs_ref);
+        copy = copy_rrset_rec(r);
+        if (copy == NULL) {
+            VAL_CACHE_UNLOCK(&shard->cs_rwlock);
+            res_sq_free_rrset_recs(zone_info);
+            return VAL_OUT_OF_MEMORY;
+        }
+        copy->rrs_cred = r->rrs_cred;
+        copy->rrs_next = *zone_info;
+        *zone_info = copy;
+    }
+    VAL_CACHE_UNLOCK(&shard->cs_rwlock);
+
+    /* 
+     * The glue may live in other shards; only one shard lock 
+     * is ever held at a time
+     */
+    for (ns_set = *zone_info; ns_set; ns_set = ns_set->rrs_next) {
+        for (ns_rr = ns_set->rrs_data; ns_rr; ns_rr = ns_rr->rr_next) {
+            h = wire_name_hash(ns_rr->rr_rdata);
+            shard = CACHE_SHARD(&unchecked_hints, h);
+
+            VAL_CACHE_SHARDS_INIT();
+            VAL_CACHE_LOCK_SH(&shard->cs_rwlock);
+            for (r = *CACHE_BUCKET(shard, h); r; r = r->rrs_next) {
+                if (now >= r->rrs_ttl_x ||
+                    (r->rrs_type_h != ns_t_a && r->rrs_type_h != ns_t_aaaa) ||
+                    namecmp(r->rrs_name_n, ns_rr->rr_rdata) != 0)
+                    continue;
+                VAL_CACHE_SET_REF(r->rrs_ref);
+                copy = copy_rrset_rec(r);
+                if (copy == NULL) {
+                    VAL_CACHE_UNLOCK(&shard->cs_rwlock);
+                    res_sq_free_rrset_recs(&glue);
+                    res_sq_free_rrset_recs(zone_info);
+                    return VAL_OUT_OF_MEMORY;
                 }
-            } 
+                copy->rrs_cred = r->rrs_cred;
+                copy->rrs_next = glue;
+                glue = copy;
+            }
+            VAL_CACHE_UNLOCK(&shard->cs_rwlock);
         }
+    }
 
-        next_answer = next_answer->rrs_next;
+    /* append the glue after the NS rrsets */
+    if (glue) {
+        for (r = *zone_info; r && r->rrs_next; r = r->rrs_next);
+        if (r)
+            r->rrs_next = glue;
+        else
+            *zone_info = glue;
     }
 
     return VAL_NO_ERROR;
@@ -272,16 +635,9 @@ get_cached_rrset(struct val_query_chain *matched_q,
     new_answer = NULL;
     *response = NULL;
 
-    VAL_CACHE_LOCK_INIT(&ans_rwlock, ans_rwlock_init);
-    VAL_CACHE_LOCK_SH(&ans_rwlock);
-
-    if (VAL_NO_ERROR != (retval = lookup_store(name_n, class_h, type_h,
-                            unchecked_answers, &new_answer, ns_options))) {
-        VAL_CACHE_UNLOCK(&ans_rwlock);
+    if (VAL_NO_ERROR != (retval = lookup_store(&unchecked_answers,
+                            name_n, class_h, type_h, &new_answer, ns_options)))
         return retval;
-    }
-
-    VAL_CACHE_UNLOCK(&ans_rwlock);
    
     /* 
      * If we're looking for the NS and we don't care about validation
@@ -290,16 +646,9 @@ get_cached_rrset(struct val_query_chain *matched_q,
     if (!new_answer && type_h == ns_t_ns && 
         (matched_q->qc_flags & VAL_QUERY_DONT_VALIDATE)) {
 
-        VAL_CACHE_LOCK_INIT(&ns_rwlock, ns_rwlock_init);
-        VAL_CACHE_LOCK_SH(&ns_rwlock);
-
-        if (VAL_NO_ERROR != (retval = lookup_store(name_n, class_h, type_h,
-                            unchecked_hints, &new_answer, 0))) {
-            VAL_CACHE_UNLOCK(&ns_rwlock);
+        if (VAL_NO_ERROR != (retval = lookup_store(&unchecked_hints,
+                            name_n, class_h, type_h, &new_answer, 0)))
             return retval;
-        }
-
-        VAL_CACHE_UNLOCK(&ns_rwlock);
     }
 
     /* Construct the response */
@@ -399,10 +748,7 @@ stow_zone_info(struct rrset_rec **new_info, struct val_query_chain *matched_q)
         return VAL_NO_ERROR;
     }
     
-    VAL_CACHE_LOCK_INIT(&ns_rwlock, ns_rwlock_init);
-    VAL_CACHE_LOCK_EX(&ns_rwlock);
     rc = stow_info(&unchecked_hints, new_info, matched_q);
-    VAL_CACHE_UNLOCK(&ns_rwlock);
 
     return rc;
 }
@@ -415,15 +761,954 @@ stow_answers(struct rrset_rec **new_info, struct val_query_chain *matched_q)
 {
     int             rc;
 
-    VAL_CACHE_LOCK_INIT(&ans_rwlock, ans_rwlock_init);
-    VAL_CACHE_LOCK_EX(&ans_rwlock);
     rc = stow_info(&unchecked_answers, new_info, matched_q);
-    VAL_CACHE_UNLOCK(&ans_rwlock);
 
     return rc;
 }
 
 
+static void
+free_neg_cache_rec(struct neg_cache_rec *nc)
+{
+    if (nc == NULL)
+        return;
+    if (nc->nc_name_n)
+        FREE(nc->nc_name_n);
+    res_sq_free_rrset_recs(&nc->nc_proofs);
+    FREE(nc);
+}
+
+#define NEG_CACHE_BUCKET(name_n, type_h, class_h) \
+    (((wire_name_hash(name_n) ^ (type_h)) * 16777619U ^ (class_h)) % NEG_CACHE_BUCKETS)
+
+/*
+ * Find an unexpired negative cache entry 
+ * NOTE: This assumes a lock is already held by the caller.
+ */
+static struct neg_cache_rec *
+lookup_negative(u_char *name_n, u_int16_t class_h, u_int16_t type_h,
+                unsigned long ns_options, time_t now)
+{
+    struct neg_cache_rec *nc;
+
+    nc = negative_answers[NEG_CACHE_BUCKET(name_n, type_h, class_h)];
+    for (; nc; nc = nc->nc_next) {
+        if (now < nc->nc_ttl_x &&
+            nc->nc_type_h == type_h &&
+            nc->nc_class_h == class_h &&
+            (ns_options == 0 || ns_options == nc->nc_ns_options) &&
+            namecmp(nc->nc_name_n, name_n) == 0)
+            return nc;
+    }
+    return NULL;
+}
+
+/*
+ * Store a trusted proof of non-existence for matched_q in the 
+ * negative cache. The entry lives until the SOA-derived expiry time
+ * ttl_x or the expiry of any of the proof RRsets, whichever is earlier.
+ */
+int
+stow_negative_answer(struct val_query_chain *matched_q, 
+                     val_status_t status, u_int32_t ttl_x)
+{
+    struct neg_cache_rec *nc, **ncp;
+    struct val_digested_auth_chain *as;
+    struct rrset_rec *proofs = NULL, *last = NULL, *r;
+    struct timeval  tv;
+    char name_p[NS_MAXDNAME];
+    size_t b;
+    long delta;
+
+    if (matched_q == NULL)
+        return VAL_BAD_ARGUMENT;
+
+    /* Only pure negative responses are cached here */
+    if (matched_q->qc_proof == NULL || matched_q->qc_ans != NULL ||
+        matched_q->qc_referral != NULL || !val_istrusted(status))
+        return VAL_NO_ERROR;
+
+    gettimeofday(&tv, NULL);
+
+    /* Nothing to do if we already have this proof */
+    VAL_CACHE_LOCK_SH(&neg_rwlock);
+    nc = lookup_negative(matched_q->qc_name_n, matched_q->qc_class_h,
+                         matched_q->qc_type_h, 0, tv.tv_sec);
+    VAL_CACHE_UNLOCK(&neg_rwlock);
+    if (nc != NULL)
+        return VAL_NO_ERROR;
+
+    for (as = matched_q->qc_proof; as; as = as->val_ac_rrset.val_ac_rrset_next) {
+        if (as->val_ac_rrset.ac_data == NULL)
+            continue;
+        r = copy_rrset_rec(as->val_ac_rrset.ac_data);
+        if (r == NULL) {
+            res_sq_free_rrset_recs(&proofs);
+            return VAL_OUT_OF_MEMORY;
+        }
+        SET_MIN_TTL(ttl_x, r->rrs_ttl_x);
+        if (last)
+            last->rrs_next = r;
+        else
+            proofs = r;
+        last = r;
+    }
+
+    if (proofs == NULL || ttl_x <= tv.tv_sec) {
+        res_sq_free_rrset_recs(&proofs);
+        return VAL_NO_ERROR;
+    }
+
+    nc = (struct neg_cache_rec *) MALLOC(sizeof(struct neg_cache_rec));
+    if (nc == NULL) {
+        res_sq_free_rrset_recs(&proofs);
+        return VAL_OUT_OF_MEMORY;
+    }
+    nc->nc_name_n = (u_char *) MALLOC(wire_name_length(matched_q->qc_name_n) *
+                                      sizeof(u_char));
+    if (nc->nc_name_n == NULL) {
+        res_sq_free_rrset_recs(&proofs);
+        FREE(nc);
+        return VAL_OUT_OF_MEMORY;
+    }
+    memcpy(nc->nc_name_n, matched_q->qc_name_n, 
+           wire_name_length(matched_q->qc_name_n));
+    nc->nc_class_h = matched_q->qc_class_h;
+    nc->nc_type_h = matched_q->qc_type_h;
+    nc->nc_ttl_x = ttl_x;
+    nc->nc_ns_options = proofs->rrs_ns_options;
+    nc->nc_proofs = proofs;
+    nc->nc_ref = 1;
+    nc->nc_next = NULL;
+    nc->nc_bytes = sizeof(struct neg_cache_rec) + 
+        wire_name_length(nc->nc_name_n);
+    for (r = proofs; r; r = r->rrs_next)
+        nc->nc_bytes += rrset_rec_size(r);
+    delta = nc->nc_bytes;
+
+    b = NEG_CACHE_BUCKET(nc->nc_name_n, nc->nc_type_h, nc->nc_class_h);
+
+    VAL_CACHE_LOCK_EX(&neg_rwlock);
+
+    /* 
+     * Replace any previous entry for this name and type, and 
+     * drop expired entries while we are here 
+     */
+    ncp = &negative_answers[b];
+    while (*ncp) {
+        struct neg_cache_rec *old = *ncp;
+        if (old->nc_ttl_x <= tv.tv_sec ||
+            (old->nc_type_h == nc->nc_type_h &&
+             old->nc_class_h == nc->nc_class_h &&
+             old->nc_ns_options == nc->nc_ns_options &&
+             namecmp(old->nc_name_n, nc->nc_name_n) == 0)) {
+            *ncp = old->nc_next;
+            delta -= old->nc_bytes;
+            free_neg_cache_rec(old);
+            continue;
+        }
+        ncp = &old->nc_next;
+    }
+    nc->nc_next = negative_answers[b];
+    negative_answers[b] = nc;
+
+    VAL_CACHE_UNLOCK(&neg_rwlock);
+
+    account_cache_memory(delta);
+
+    VAL_LOG_NTOP(LOG_INFO, matched_q->qc_name_n, name_p, sizeof(name_p));
+    val_log(NULL, LOG_INFO, 
+            "stow_negative_answer(): Storing {%s, %d, %d} in Negative cache, status=%s, exp in %ld",
+            name_p, matched_q->qc_class_h, matched_q->qc_type_h, 
+            p_val_status(status), (long)(ttl_x - tv.tv_sec));
+
+    enforce_cache_budget();
+
+    return VAL_NO_ERROR;
+}
+
+/*
+ * Wrap a set of proofs of non-existence for matched_q into a response,
+ * as if it had been received from the network. Ownership of proofs
+ * passes to the response.
+ */
+static int
+make_negative_response(struct val_query_chain *matched_q,
+                       struct rrset_rec *proofs,
+                       struct domain_info **response)
+{
+    char *name_p;
+
+    name_p = (char *) MALLOC (NS_MAXDNAME * sizeof(char));
+    if (name_p == NULL) {
+        res_sq_free_rrset_recs(&proofs);
+        return VAL_OUT_OF_MEMORY;
+    }
+
+    *response = (struct domain_info *) MALLOC(sizeof(struct domain_info));
+    if (*response == NULL) {
+        FREE(name_p);
+        res_sq_free_rrset_recs(&proofs);
+        return VAL_OUT_OF_MEMORY;
+    }
+
+    (*response)->di_requested_name_h = name_p;
+    (*response)->di_answers = NULL;
+    (*response)->di_proofs = proofs;
+    (*response)->di_qnames = NULL;
+    (*response)->di_requested_type_h = matched_q->qc_type_h;
+    (*response)->di_requested_class_h = matched_q->qc_class_h;
+    (*response)->di_res_error = SR_UNSET;
+
+    if (VAL_NO_ERROR != add_to_qname_chain(&(*response)->di_qnames, 
+                                           matched_q->qc_name_n) ||
+        ns_name_ntop(matched_q->qc_name_n, name_p, NS_MAXDNAME) == -1) {
+        free_domain_info_ptrs(*response);
+        FREE(*response);
+        *response = NULL;
+        return VAL_OUT_OF_MEMORY;
+    }
+
+    matched_q->qc_state = Q_ANSWERED;
+
+    return VAL_NO_ERROR;
+}
+
+/*
+ * retrieve a proof of non-existence, if present, from the negative cache
+ */
+int
+get_cached_negative(struct val_query_chain *matched_q, 
+                    struct domain_info **response)
+{
+    struct neg_cache_rec *nc;
+    struct rrset_rec *proofs = NULL;
+    struct rrset_rec *r;
+    struct timeval  tv;
+    unsigned long ns_options;
+
+    if (!matched_q || !response)
+        return VAL_BAD_ARGUMENT;
+
+    *response = NULL;
+
+    ns_options = (matched_q->qc_flags & VAL_QUERY_DONT_VALIDATE) ?
+        SR_QUERY_VALIDATING_STUB_FLAGS : 0;
+
+    gettimeofday(&tv, NULL);
+
+    VAL_CACHE_LOCK_SH(&neg_rwlock);
+
+    nc = lookup_negative(matched_q->qc_name_n, matched_q->qc_class_h,
+                         matched_q->qc_type_h, ns_options, tv.tv_sec);
+    if (nc != NULL) {
+        VAL_CACHE_SET_REF(nc->nc_ref);
+        proofs = copy_rrset_rec_list(nc->nc_proofs);
+        for (r = proofs; r; r = r->rrs_next) {
+            /* Adjust the TTL */
+            r->rrs_ttl_h = r->rrs_ttl_x - tv.tv_sec;
+        }
+    }
+
+    VAL_CACHE_UNLOCK(&neg_rwlock);
+
+    if (proofs == NULL)
+        return VAL_NO_ERROR;
+
+    return make_negative_response(matched_q, proofs, response);
+}
+
+static void
+free_nsec_span(struct nsec_span_zone *sz, struct nsec_span *s)
+{
+#ifdef LIBVAL_NSEC3
+    /* the next hash is decoded separately, everything else is in the RRset */
+    if (sz->sz_type_h == ns_t_nsec3 && s->ns_end)
+        FREE(s->ns_end);
+#endif
+    res_sq_free_rrset_recs(&s->ns_rrset);
+}
+
+static void
+free_nsec_span_zone(struct nsec_span_zone *sz)
+{
+    size_t i;
+
+    if (sz == NULL)
+        return;
+    for (i = 0; i < sz->sz_count; i++)
+        free_nsec_span(sz, &sz->sz_spans[i]);
+    if (sz->sz_spans)
+        FREE(sz->sz_spans);
+    res_sq_free_rrset_recs(&sz->sz_soa);
+    if (sz->sz_zone_n)
+        FREE(sz->sz_zone_n);
+    FREE(sz);
+}
+
+#define SPAN_ZONE_BUCKET(zone_n, type_h) \
+    ((wire_name_hash(zone_n) ^ (type_h)) % SPAN_ZONE_BUCKETS)
+
+/*
+ * NSEC spans are ordered on the canonical owner name, NSEC3 spans
+ * on the base32hex encoded owner hash.
+ */
+static int
+span_cmp(struct nsec_span_zone *sz, const u_char *a, size_t alen,
+         const u_char *b, size_t blen)
+{
+    if (sz->sz_type_h == ns_t_nsec)
+        return namecmp(a, b);
+    return label_bytes_cmp(a, alen, b, blen);
+}
+
+/*
+ * Find the index of the last span that starts at or before key.
+ * Returns -1 if key sorts before all spans.
+ * NOTE: This assumes a lock is already held by the caller.
+ */
+static int
+find_span(struct nsec_span_zone *sz, const u_char *key, size_t keylen,
+          int *exact)
+{
+    size_t lo = 0;
+    size_t hi = sz->sz_count;
+    size_t mid;
+    int    cmp;
+
+    *exact = 0;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        cmp = span_cmp(sz, sz->sz_spans[mid].ns_start,
+                       sz->sz_spans[mid].ns_startlen, key, keylen);
+        if (cmp == 0) {
+            *exact = 1;
+            return (int) mid;
+        }
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (int) lo - 1;
+}
+
+/*
+ * Find the unexpired span that either matches or covers key.
+ * NOTE: This assumes a lock is already held by the caller.
+ */
+static struct nsec_span *
+lookup_span(struct nsec_span_zone *sz, const u_char *key, size_t keylen,
+            time_t now, int *exact)
+{
+    struct nsec_span *s;
+    int idx;
+    int wrap;
+
+    if (sz->sz_count == 0)
+        return NULL;
+
+    idx = find_span(sz, key, keylen, exact);
+    /* the last span wraps around to the start of the zone */
+    if (idx < 0)
+        idx = sz->sz_count - 1;
+    s = &sz->sz_spans[idx];
+
+    if (s->ns_rrset->rrs_ttl_x <= now)
+        return NULL;
+    if (*exact)
+        return s;
+
+    if (sz->sz_type_h == ns_t_nsec)
+        wrap = (namecmp(s->ns_end, sz->sz_zone_n) == 0);
+    else
+        wrap = (span_cmp(sz, s->ns_end, s->ns_endlen,
+                         s->ns_start, s->ns_startlen) <= 0);
+
+    if (wrap) {
+        if (span_cmp(sz, key, keylen, s->ns_start, s->ns_startlen) > 0 ||
+            span_cmp(sz, key, keylen, s->ns_end, s->ns_endlen) < 0)
+            return s;
+    } else {
+        if (span_cmp(sz, key, keylen, s->ns_start, s->ns_startlen) > 0 &&
+            span_cmp(sz, key, keylen, s->ns_end, s->ns_endlen) < 0)
+            return s;
+    }
+    return NULL;
+}
+
+/*
+ * Find the span index for zone_n
+ * NOTE: This assumes a lock is already held by the caller.
+ */
+static struct nsec_span_zone *
+lookup_span_zone(u_char *zone_n, u_int16_t class_h, u_int16_t type_h)
+{
+    struct nsec_span_zone *sz;
+
+    sz = nsec_span_zones[SPAN_ZONE_BUCKET(zone_n, type_h)];
+    for (; sz; sz = sz->sz_next) {
+        if (sz->sz_type_h == type_h &&
+            sz->sz_class_h == class_h &&
+            namecmp(sz->sz_zone_n, zone_n) == 0)
+            return sz;
+    }
+    return NULL;
+}
+
+/*
+ * Recompute the number of bytes held by a span index, returning 
+ * the change since it was last computed.
+ * NOTE: This assumes a lock is already held by the caller.
+ */
+static long
+update_span_zone_size(struct nsec_span_zone *sz)
+{
+    size_t bytes, i;
+    long delta;
+
+    bytes = sizeof(struct nsec_span_zone) + 
+        wire_name_length(sz->sz_zone_n) +
+        sz->sz_size * sizeof(struct nsec_span) + 
+        rrset_rec_size(sz->sz_soa);
+    for (i = 0; i < sz->sz_count; i++) {
+        bytes += rrset_rec_size(sz->sz_spans[i].ns_rrset);
+#ifdef LIBVAL_NSEC3
+        /* the decoded next hash */
+        if (sz->sz_type_h == ns_t_nsec3)
+            bytes += sz->sz_spans[i].ns_endlen;
+#endif
+    }
+    delta = (long) bytes - (long) sz->sz_bytes;
+    sz->sz_bytes = bytes;
+    return delta;
+}
+
+/*
+ * Add a single NSEC or NSEC3 RRset to the span index for zone_n.
+ */
+static int
+add_nsec_span(struct rrset_rec *the_set, struct rrset_rec *soa,
+              u_char *zone_n, u_int32_t ttl_x, time_t now)
+{
+    struct nsec_span_zone *sz;
+    struct nsec_span span, *s;
+    struct rrset_rr *rr;
+    struct rrset_rec *soa_copy = NULL;
+    size_t b, i, j, len;
+    int idx, exact;
+    long delta;
+#ifdef LIBVAL_NSEC3
+    val_nsec3_rdata_t nd;
+#endif
+
+    memset(&span, 0, sizeof(span));
+    span.ns_rrset = copy_rrset_rec(the_set);
+    if (span.ns_rrset == NULL)
+        return VAL_OUT_OF_MEMORY;
+    SET_MIN_TTL(span.ns_rrset->rrs_ttl_x, ttl_x);
+    rr = span.ns_rrset->rrs_data;
+
+    if (the_set->rrs_type_h == ns_t_nsec) {
+        len = wire_name_length(rr->rr_rdata);
+        if (len > rr->rr_rdata_length) {
+            res_sq_free_rrset_recs(&span.ns_rrset);
+            return VAL_NO_ERROR;
+        }
+        span.ns_start = span.ns_rrset->rrs_name_n;
+        span.ns_startlen = wire_name_length(span.ns_start);
+        span.ns_end = rr->rr_rdata;
+        span.ns_endlen = len;
+        span.ns_bitmap = rr->rr_rdata + len;
+        span.ns_bitmaplen = rr->rr_rdata_length - len;
+    }
+#ifdef LIBVAL_NSEC3
+    else {
+        if (NULL == val_parse_nsec3_rdata(rr->rr_rdata,
+                                          rr->rr_rdata_length, &nd)) {
+            res_sq_free_rrset_recs(&span.ns_rrset);
+            return VAL_NO_ERROR;
+        }
+        span.ns_start = span.ns_rrset->rrs_name_n + 1;
+        span.ns_startlen = span.ns_rrset->rrs_name_n[0];
+        span.ns_end = nd.nexthash;
+        span.ns_endlen = nd.nexthashlen;
+        span.ns_bitmap = rr->rr_rdata + nd.bit_field;
+        span.ns_bitmaplen = rr->rr_rdata_length - nd.bit_field;
+        span.ns_flags = nd.flags;
+    }
+#endif
+
+    VAL_CACHE_LOCK_EX(&span_rwlock);
+
+    sz = lookup_span_zone(zone_n, the_set->rrs_class_h, the_set->rrs_type_h);
+    if (sz == NULL) {
+        sz = (struct nsec_span_zone *) MALLOC(sizeof(struct nsec_span_zone));
+        if (sz == NULL)
+            goto err;
+        memset(sz, 0, sizeof(struct nsec_span_zone));
+        len = wire_name_length(zone_n);
+        sz->sz_zone_n = (u_char *) MALLOC(len * sizeof(u_char));
+        if (sz->sz_zone_n == NULL) {
+            FREE(sz);
+            sz = NULL;
+            goto err;
+        }
+        memcpy(sz->sz_zone_n, zone_n, len);
+        sz->sz_class_h = the_set->rrs_class_h;
+        sz->sz_type_h = the_set->rrs_type_h;
+        sz->sz_ref = 1;
+        b = SPAN_ZONE_BUCKET(zone_n, the_set->rrs_type_h);
+        sz->sz_next = nsec_span_zones[b];
+        nsec_span_zones[b] = sz;
+    }
+
+    /* keep the freshest copy of the zone SOA */
+    if (sz->sz_soa == NULL || sz->sz_soa->rrs_ttl_x < soa->rrs_ttl_x) {
+        soa_copy = copy_rrset_rec(soa);
+        if (soa_copy == NULL)
+            goto err;
+        res_sq_free_rrset_recs(&sz->sz_soa);
+        sz->sz_soa = soa_copy;
+    }
+
+#ifdef LIBVAL_NSEC3
+    /* spans computed with old NSEC3 parameters are no longer useful */
+    if (sz->sz_type_h == ns_t_nsec3 &&
+        (sz->sz_alg != nd.alg || sz->sz_iter != nd.iterations ||
+         sz->sz_saltlen != nd.saltlen ||
+         memcmp(sz->sz_salt, nd.salt, nd.saltlen))) {
+        for (i = 0; i < sz->sz_count; i++)
+            free_nsec_span(sz, &sz->sz_spans[i]);
+        sz->sz_count = 0;
+        sz->sz_alg = nd.alg;
+        sz->sz_iter = nd.iterations;
+        sz->sz_saltlen = nd.saltlen;
+        memcpy(sz->sz_salt, nd.salt, nd.saltlen);
+    }
+#endif
+
+    /* drop expired spans while we are here */
+    for (i = 0, j = 0; i < sz->sz_count; i++) {
+        if (sz->sz_spans[i].ns_rrset->rrs_ttl_x <= now) {
+            free_nsec_span(sz, &sz->sz_spans[i]);
+            continue;
+        }
+        if (i != j)
+            sz->sz_spans[j] = sz->sz_spans[i];
+        j++;
+    }
+    sz->sz_count = j;
+
+    idx = find_span(sz, span.ns_start, span.ns_startlen, &exact);
+    if (exact) {
+        /* replace the existing span */
+        s = &sz->sz_spans[idx];
+        free_nsec_span(sz, s);
+        *s = span;
+        delta = update_span_zone_size(sz);
+        VAL_CACHE_UNLOCK(&span_rwlock);
+        account_cache_memory(delta);
+        return VAL_NO_ERROR;
+    }
+
+    if (sz->sz_count == sz->sz_size) {
+        size_t newsize = sz->sz_size ? 2 * sz->sz_size : SPAN_INIT_SIZE;
+        s = (struct nsec_span *) MALLOC(newsize * sizeof(struct nsec_span));
+        if (s == NULL)
+            goto err;
+        if (sz->sz_spans) {
+            memcpy(s, sz->sz_spans, sz->sz_count * sizeof(struct nsec_span));
+            FREE(sz->sz_spans);
+        }
+        sz->sz_spans = s;
+        sz->sz_size = newsize;
+    }
+
+    idx++;
+    memmove(&sz->sz_spans[idx + 1], &sz->sz_spans[idx],
+            (sz->sz_count - idx) * sizeof(struct nsec_span));
+    sz->sz_spans[idx] = span;
+    sz->sz_count++;
+
+    delta = update_span_zone_size(sz);
+    VAL_CACHE_UNLOCK(&span_rwlock);
+    account_cache_memory(delta);
+    return VAL_NO_ERROR;
+
+  err:
+    delta = sz ? update_span_zone_size(sz) : 0;
+    VAL_CACHE_UNLOCK(&span_rwlock);
+    account_cache_memory(delta);
+#ifdef LIBVAL_NSEC3
+    if (the_set->rrs_type_h == ns_t_nsec3 && span.ns_end)
+        FREE(span.ns_end);
+#endif
+    res_sq_free_rrset_recs(&span.ns_rrset);
+    return VAL_OUT_OF_MEMORY;
+}
+
+/*
+ * Index the NSEC and NSEC3 records from a validated proof of
+ * non-existence so that they can be used for other names in the
+ * same zone.
+ */
+int
+stow_nsec_spans(struct val_query_chain *matched_q, val_status_t status)
+{
+    struct val_digested_auth_chain *as, *sas;
+    struct rrset_rec *the_set, *soa;
+    u_char *zone_n;
+    struct timeval  tv;
+    int retval;
+
+    if (matched_q == NULL)
+        return VAL_BAD_ARGUMENT;
+
+    /*
+     * Only spans that were actually validated can be used,
+     * and wildcard answers are not handled here
+     */
+    if (!val_isvalidated(status) ||
+        matched_q->qc_proof == NULL || matched_q->qc_ans != NULL)
+        return VAL_NO_ERROR;
+
+    gettimeofday(&tv, NULL);
+
+    for (as = matched_q->qc_proof; as; as = as->val_ac_rrset.val_ac_rrset_next) {
+        the_set = as->val_ac_rrset.ac_data;
+        if (the_set == NULL || the_set->rrs_data == NULL ||
+            the_set->rrs_data->rr_next != NULL ||
+            the_set->rrs_sig == NULL ||
+            the_set->rrs_sig->rr_rdata_length <= SIGNBY)
+            continue;
+#ifdef LIBVAL_NSEC3
+        if (the_set->rrs_type_h != ns_t_nsec &&
+            the_set->rrs_type_h != ns_t_nsec3)
+            continue;
+#else
+        if (the_set->rrs_type_h != ns_t_nsec)
+            continue;
+#endif
+
+        zone_n = &the_set->rrs_sig->rr_rdata[SIGNBY];
+        if (NULL == namename(the_set->rrs_name_n, zone_n))
+            continue;
+
+        /* We need the zone SOA to build responses */
+        soa = NULL;
+        for (sas = matched_q->qc_proof; sas;
+                sas = sas->val_ac_rrset.val_ac_rrset_next) {
+            if (sas->val_ac_rrset.ac_data &&
+                sas->val_ac_rrset.ac_data->rrs_type_h == ns_t_soa &&
+                !namecmp(sas->val_ac_rrset.ac_data->rrs_name_n, zone_n)) {
+                soa = sas->val_ac_rrset.ac_data;
+                break;
+            }
+        }
+        if (soa == NULL)
+            continue;
+
+        if (VAL_NO_ERROR !=
+                (retval = add_nsec_span(the_set, soa, zone_n,
+                                        matched_q->qc_ttl_x, tv.tv_sec)))
+            return retval;
+    }
+
+    enforce_cache_budget();
+
+    return VAL_NO_ERROR;
+}
+
+/*
+ * Check that an NSEC or NSEC3 type bitmap for a matching owner name
+ * proves that type_h does not exist there.
+ */
+static int
+span_proves_nodata(struct nsec_span *s, u_int16_t type_h)
+{
+    if (is_type_set(s->ns_bitmap, s->ns_bitmaplen, type_h) ||
+        is_type_set(s->ns_bitmap, s->ns_bitmaplen, ns_t_cname) ||
+        is_type_set(s->ns_bitmap, s->ns_bitmaplen, ns_t_dname))
+        return 0;
+    /* names at a delegation point are answered with a referral */
+    if (is_type_set(s->ns_bitmap, s->ns_bitmaplen, ns_t_ns) &&
+        !is_type_set(s->ns_bitmap, s->ns_bitmaplen, ns_t_soa))
+        return 0;
+    return 1;
+}
+
+/*
+ * A span whose owner is an ancestor of the query name can only be
+ * used if there is no zone cut or DNAME at that owner
+ */
+static int
+span_is_cut(struct nsec_span *s)
+{
+    if (is_type_set(s->ns_bitmap, s->ns_bitmaplen, ns_t_dname))
+        return 1;
+    if (is_type_set(s->ns_bitmap, s->ns_bitmaplen, ns_t_ns) &&
+        !is_type_set(s->ns_bitmap, s->ns_bitmaplen, ns_t_soa))
+        return 1;
+    return 0;
+}
+
+#define MAX_SYNTH_SPANS 3
+
+/*
+ * Prove non-existence of {qname_n, qtype_h} from a zone's NSEC spans.
+ * NOTE: This assumes a lock is already held by the caller.
+ */
+static int
+synth_from_nsec(struct nsec_span_zone *sz, u_char *qname_n,
+                u_int16_t qtype_h, time_t now,
+                struct nsec_span **used, int *rcode)
+{
+    struct nsec_span *s, *w;
+    u_char wc_n[NS_MAXCDNAME];
+    u_char *q1, *q2, *ce;
+    size_t len;
+    int exact;
+
+    s = lookup_span(sz, qname_n, wire_name_length(qname_n), now, &exact);
+    if (s == NULL)
+        return 0;
+
+    if (exact) {
+        if (!span_proves_nodata(s, qtype_h))
+            return 0;
+        used[0] = s;
+        *rcode = ns_r_noerror;
+        return 1;
+    }
+
+    /* qname is an empty non-terminal if the next name is below it */
+    if (NULL != namename(s->ns_end, qname_n))
+        return 0;
+    if (NULL != namename(qname_n, s->ns_start) && span_is_cut(s))
+        return 0;
+
+    /* find the closest encloser */
+    q1 = s->ns_start;
+    while (*q1 != '\0' && namename(qname_n, q1) == NULL)
+        q1 += *q1 + 1;
+    q2 = s->ns_end;
+    while (*q2 != '\0' && namename(qname_n, q2) == NULL)
+        q2 += *q2 + 1;
+    ce = (wire_name_length(q1) > wire_name_length(q2)) ? q1 : q2;
+    if (NULL == namename(ce, sz->sz_zone_n))
+        return 0;
+
+    /* the wildcard at the closest encloser must not exist either */
+    len = wire_name_length(ce);
+    if (len + 2 > sizeof(wc_n))
+        return 0;
+    wc_n[0] = 1;
+    wc_n[1] = '*';
+    memcpy(&wc_n[2], ce, len);
+
+    w = lookup_span(sz, wc_n, len + 2, now, &exact);
+    if (w == NULL || exact)
+        return 0;
+
+    used[0] = s;
+    used[1] = (w != s) ? w : NULL;
+    *rcode = ns_r_nxdomain;
+    return 1;
+}
+
+#ifdef LIBVAL_NSEC3
+/*
+ * Hash name_n with the zone's NSEC3 parameters and find the span
+ * that matches or covers it.
+ * NOTE: This assumes a lock is already held by the caller.
+ */
+static struct nsec_span *
+lookup_nsec3_span(val_context_t *ctx, struct nsec_span_zone *sz,
+                  u_char *name_n, time_t now, int *exact)
+{
+    struct nsec_span *s;
+    u_char *hash = NULL;
+    size_t hashlen;
+    u_int32_t ttl_x = 0;
+
+    if (NULL == compute_nsec3_hash(ctx, name_n, sz->sz_zone_n, sz->sz_alg,
+                                   sz->sz_iter, sz->sz_saltlen, sz->sz_salt,
+                                   &hashlen, &hash, &ttl_x))
+        return NULL;
+
+    s = lookup_span(sz, hash, hashlen, now, exact);
+    FREE(hash);
+    return s;
+}
+
+/*
+ * Prove non-existence of {qname_n, qtype_h} from a zone's NSEC3 spans.
+ * NOTE: This assumes a lock is already held by the caller.
+ */
+static int
+synth_from_nsec3(val_context_t *ctx, struct nsec_span_zone *sz,
+                 u_char *qname_n, u_int16_t qtype_h, time_t now,
+                 struct nsec_span **used, int *rcode)
+{
+    struct nsec_span *s, *ncn, *cpe = NULL, *w;
+    u_char wc_n[NS_MAXCDNAME];
+    u_char *cp;
+    size_t len;
+    int exact;
+
+    s = lookup_nsec3_span(ctx, sz, qname_n, now, &exact);
+    if (s == NULL)
+        return 0;
+
+    if (exact) {
+        if (!span_proves_nodata(s, qtype_h))
+            return 0;
+        used[0] = s;
+        *rcode = ns_r_noerror;
+        return 1;
+    }
+
+    /*
+     * Walk up towards the zone apex to find the closest provable
+     * encloser; the next closer name must be covered by a span
+     * that does not opt out.
+     */
+    ncn = s;
+    cp = qname_n;
+    while (namecmp(cp, sz->sz_zone_n) != 0 && *cp != '\0') {
+        if (ncn->ns_flags & NSEC3_FLAG_OPTOUT)
+            return 0;
+        cp += *cp + 1;
+        s = lookup_nsec3_span(ctx, sz, cp, now, &exact);
+        if (s == NULL)
+            return 0;
+        if (exact) {
+            cpe = s;
+            break;
+        }
+        ncn = s;
+    }
+    if (cpe == NULL || span_is_cut(cpe))
+        return 0;
+
+    len = wire_name_length(cp);
+    if (len + 2 > sizeof(wc_n))
+        return 0;
+    wc_n[0] = 1;
+    wc_n[1] = '*';
+    memcpy(&wc_n[2], cp, len);
+
+    w = lookup_nsec3_span(ctx, sz, wc_n, now, &exact);
+    if (w == NULL || exact)
+        return 0;
+
+    used[0] = cpe;
+    used[1] = ncn;
+    used[2] = (w != ncn && w != cpe) ? w : NULL;
+    *rcode = ns_r_nxdomain;
+    return 1;
+}
+#endif
+
+/*
+ * Synthesize a proof of non-existence for matched_q from the
+ * NSEC/NSEC3 spans of its closest enclosing zone, if possible.
+ */
+int
+get_synthesized_negative(val_context_t *ctx,
+                         struct val_query_chain *matched_q,
+                         struct domain_info **response)
+{
+    struct nsec_span_zone *sz = NULL;
+    struct nsec_span *used[MAX_SYNTH_SPANS];
+    struct rrset_rec *proofs = NULL, *last = NULL, *r;
+    struct timeval  tv;
+    u_char *zone_n;
+    char name_p[NS_MAXDNAME];
+    int rcode = ns_r_noerror;
+    int found = 0;
+    int i;
+
+    if (!ctx || !matched_q || !response)
+        return VAL_BAD_ARGUMENT;
+
+    *response = NULL;
+
+    /*
+     * DS non-existence is proven from the parent side of a zone cut,
+     * leave that to the network
+     */
+    if ((matched_q->qc_flags & VAL_QUERY_DONT_VALIDATE) ||
+        matched_q->qc_type_h == ns_t_ds)
+        return VAL_NO_ERROR;
+
+    memset(used, 0, sizeof(used));
+    gettimeofday(&tv, NULL);
+
+    VAL_CACHE_LOCK_SH(&span_rwlock);
+
+    /* Find the closest enclosing zone for which we have spans */
+    for (zone_n = matched_q->qc_name_n; ; zone_n += *zone_n + 1) {
+        sz = lookup_span_zone(zone_n, matched_q->qc_class_h, ns_t_nsec);
+#ifdef LIBVAL_NSEC3
+        if (sz == NULL)
+            sz = lookup_span_zone(zone_n, matched_q->qc_class_h, ns_t_nsec3);
+#endif
+        if (sz != NULL || *zone_n == '\0')
+            break;
+    }
+
+    if (sz != NULL && sz->sz_soa != NULL && sz->sz_soa->rrs_ttl_x > tv.tv_sec) {
+        if (sz->sz_type_h == ns_t_nsec)
+            found = synth_from_nsec(sz, matched_q->qc_name_n,
+                                    matched_q->qc_type_h, tv.tv_sec,
+                                    used, &rcode);
+#ifdef LIBVAL_NSEC3
+        else
+            found = synth_from_nsec3(ctx, sz, matched_q->qc_name_n,
+                                     matched_q->qc_type_h, tv.tv_sec,
+                                     used, &rcode);
+#endif
+    }
+
+    if (found) {
+        VAL_CACHE_SET_REF(sz->sz_ref);
+        proofs = copy_rrset_rec(sz->sz_soa);
+        last = proofs;
+        for (i = 0; last && i < MAX_SYNTH_SPANS; i++) {
+            if (used[i] == NULL)
+                continue;
+            last->rrs_next = copy_rrset_rec(used[i]->ns_rrset);
+            last = last->rrs_next;
+        }
+        if (last == NULL) {
+            VAL_CACHE_UNLOCK(&span_rwlock);
+            res_sq_free_rrset_recs(&proofs);
+            return VAL_OUT_OF_MEMORY;
+        }
+    }
+
+    VAL_CACHE_UNLOCK(&span_rwlock);
+
+    if (proofs == NULL)
+        return VAL_NO_ERROR;
+
+    for (r = proofs; r; r = r->rrs_next) {
+        r->rrs_rcode = rcode;
+        r->rrs_ttl_h = r->rrs_ttl_x - tv.tv_sec;
+    }
+
+    VAL_LOG_NTOP(LOG_INFO, matched_q->qc_name_n, name_p, sizeof(name_p));
+    val_log(ctx, LOG_INFO,
+            "get_synthesized_negative(): Synthesized %s for {%s %d %d} from cached %s spans",
+            (rcode == ns_r_nxdomain) ? "NXDOMAIN" : "NODATA",
+            name_p, matched_q->qc_class_h, matched_q->qc_type_h,
+            (sz->sz_type_h == ns_t_nsec) ? "NSEC" : "NSEC3");
+
+    return make_negative_response(matched_q, proofs, response);
+}
+
 /*
  * Get zone information: this could either be from 
  * the zone name to ns mapping cache or the hints cache
@@ -440,13 +1725,15 @@ get_nslist_from_cache(val_context_t *ctx,
      * find closest matching name zone_n 
      */
     struct rrset_rec *nsrrset;
+    struct rrset_rec *zone_info = NULL;
+    struct cache_shard *shard;
     u_char       *name_n = NULL;
-    u_char       *tname_n = NULL;
     u_char       *p;
     u_int16_t     qtype;
     u_char       *qname_n;
-    u_char       *tmp_zonecut_n = NULL;
+    u_int32_t     h;
     struct timeval  tv;
+    int           retval;
 
     if (matched_qfq == NULL || queries == NULL || ref_ns_list == NULL || ns_cred == NULL)
         return VAL_BAD_ARGUMENT;
@@ -461,88 +1748,246 @@ get_nslist_from_cache(val_context_t *ctx,
     *zonecut_n = NULL;
     gettimeofday(&tv, NULL);
     
-    tmp_zonecut_n = NULL;
-
-
-    /* Check in the NS store */
-
-    VAL_CACHE_LOCK_INIT(&ns_rwlock, ns_rwlock_init);
-    VAL_CACHE_LOCK_SH(&ns_rwlock);
-
-    nsrrset = unchecked_hints;
-    while (nsrrset) {
+    /*
+     * Check in the NS store, starting with the longest
+     * enclosing name. Find the closest name with the best credibility
+     */
+    for (p = qname_n; ; p += *p + 1) {
 
-        if (tv.tv_sec < nsrrset->rrs_ttl_x &&
-            nsrrset->rrs_type_h == ns_t_ns) {
+        /*
+         * If type is DS, you don't want an exact match
+         * since that will lead you to the child zone
+         */
+        if ((qtype != ns_t_ds) || (p != qname_n)) {
 
-            tname_n = nsrrset->rrs_name_n;
+            h = wire_name_hash(p);
+            shard = CACHE_SHARD(&unchecked_hints, h);
 
-            /*
-             * Find the closest name with the best credibility
-             */
-            if ((*ns_cred == SR_CRED_UNSET || nsrrset->rrs_cred <= *ns_cred) &&
-                    NULL != (p = namename(qname_n, tname_n))) {
+            VAL_CACHE_SHARDS_INIT();
+            VAL_CACHE_LOCK_SH(&shard->cs_rwlock);
 
-                if (!name_n ||
-                    nsrrset->rrs_cred < *ns_cred ||
-                    (wire_name_length(tname_n) > wire_name_length(name_n))) {
+            for (nsrrset = *CACHE_BUCKET(shard, h); nsrrset; 
+                    nsrrset = nsrrset->rrs_next) {
+                if (tv.tv_sec < nsrrset->rrs_ttl_x &&
+                    nsrrset->rrs_type_h == ns_t_ns &&
+                    (*ns_cred == SR_CRED_UNSET || nsrrset->rrs_cred < *ns_cred) &&
+                    namecmp(nsrrset->rrs_name_n, p) == 0) {
 
-                    /*
-                     * If type is DS, you don't want an exact match
-                     * since that will lead you to the child zone
-                     */
-                    if ((qtype != ns_t_ds) || (p != qname_n)) {
-                        /*
-                         * New name is longer than old name 
-                         */
-                        name_n = tname_n;
-                        *ns_cred = nsrrset->rrs_cred;
-                        tmp_zonecut_n = nsrrset->rrs_name_n;
-                    }
+                    name_n = p;
+                    *ns_cred = nsrrset->rrs_cred;
                 }
             }
+
+            VAL_CACHE_UNLOCK(&shard->cs_rwlock);
         }
-        nsrrset = nsrrset->rrs_next;
+
+        if (*p == '\0')
+            break;
     }
 
+    if (name_n) {
 
-    if (name_n && tmp_zonecut_n) {
+        if (VAL_NO_ERROR != (retval = get_zone_info(name_n, tv.tv_sec,
+                                                  &zone_info)))
+            return retval;
 
-        bootstrap_referral(ctx, name_n, unchecked_hints, matched_qfq, queries,
+        bootstrap_referral(ctx, name_n, zone_info, matched_qfq, queries,
                            ref_ns_list);
 
+        res_sq_free_rrset_recs(&zone_info);
+
         if (*ref_ns_list) {
-            *zonecut_n = (u_char *) MALLOC (wire_name_length(tmp_zonecut_n) *
+            *zonecut_n = (u_char *) MALLOC (wire_name_length(name_n) *
                     sizeof (u_char));
             if (*zonecut_n == NULL) {
-                VAL_CACHE_UNLOCK(&ns_rwlock);
                 free_name_servers(ref_ns_list);
                 *ref_ns_list = NULL;
                 return VAL_OUT_OF_MEMORY;
             } 
-            memcpy(*zonecut_n, tmp_zonecut_n, wire_name_length(tmp_zonecut_n));
+            memcpy(*zonecut_n, name_n, wire_name_length(name_n));
         }
     }
     
-    VAL_CACHE_UNLOCK(&ns_rwlock);
-
     return VAL_NO_ERROR;
 }
 
+/*
+ * Move the clock hand over the bucket at position pos, dropping 
+ * entries that have expired or have not been used since the hand 
+ * last passed. Returns the number of bytes released.
+ */
+static size_t
+clock_sweep(size_t pos, time_t now, unsigned long *evicted)
+{
+    struct rrset_store *store;
+    struct cache_shard *shard;
+    struct rrset_rec *r, **rp;
+    struct neg_cache_rec *nc, **ncp;
+    struct nsec_span_zone *sz, **szp;
+    size_t freed = 0;
+
+    if (pos < 2 * CLOCK_STORE_POSITIONS) {
+        store = (pos < CLOCK_STORE_POSITIONS) ? 
+            &unchecked_answers : &unchecked_hints;
+        pos %= CLOCK_STORE_POSITIONS;
+        shard = &store->st_shards[pos / CACHE_SHARD_BUCKETS];
+
+        VAL_CACHE_SHARDS_INIT();
+        VAL_CACHE_LOCK_EX(&shard->cs_rwlock);
+        rp = &shard->cs_buckets[pos % CACHE_SHARD_BUCKETS];
+        while ((r = *rp) != NULL) {
+            if (r->rrs_ref && r->rrs_ttl_x > now) {
+                r->rrs_ref = 0;
+                rp = &r->rrs_next;
+                continue;
+            }
+            if (r->rrs_ttl_x > now)
+                (*evicted)++;
+            *rp = r->rrs_next;
+            r->rrs_next = NULL;
+            freed += rrset_rec_size(r);
+            res_sq_free_rrset_recs(&r);
+        }
+        VAL_CACHE_UNLOCK(&shard->cs_rwlock);
+        return freed;
+    }
+
+    pos -= 2 * CLOCK_STORE_POSITIONS;
+    if (pos < NEG_CACHE_BUCKETS) {
+        VAL_CACHE_LOCK_EX(&neg_rwlock);
+        ncp = &negative_answers[pos];
+        while ((nc = *ncp) != NULL) {
+            if (nc->nc_ref && nc->nc_ttl_x > now) {
+                nc->nc_ref = 0;
+                ncp = &nc->nc_next;
+                continue;
+            }
+            if (nc->nc_ttl_x > now)
+                (*evicted)++;
+            *ncp = nc->nc_next;
+            freed += nc->nc_bytes;
+            free_neg_cache_rec(nc);
+        }
+        VAL_CACHE_UNLOCK(&neg_rwlock);
+        return freed;
+    }
+
+    /* span indexes are dropped a zone at a time */
+    pos -= NEG_CACHE_BUCKETS;
+    VAL_CACHE_LOCK_EX(&span_rwlock);
+    szp = &nsec_span_zones[pos];
+    while ((sz = *szp) != NULL) {
+        if (sz->sz_ref) {
+            sz->sz_ref = 0;
+            szp = &sz->sz_next;
+            continue;
+        }
+        (*evicted)++;
+        *szp = sz->sz_next;
+        freed += sz->sz_bytes;
+        free_nsec_span_zone(sz);
+    }
+    VAL_CACHE_UNLOCK(&span_rwlock);
+    return freed;
+}
+
+/*
+ * Evict entries from the caches until we are back within budget.
+ * NOTE: This must be called without any cache locks held.
+ */
+static void
+enforce_cache_budget(void)
+{
+    struct timeval  tv;
+    unsigned long evicted = 0;
+    size_t freed;
+    size_t pos;
+    int scanned;
+
+    if (!cache_over_budget())
+        return;
+
+    /* a single sweeper is enough */
+    if (!VAL_CACHE_ACCT_TRYLOCK(&clock_lock))
+        return;
+
+    gettimeofday(&tv, NULL);
+    for (scanned = 0; scanned < CLOCK_MAX_SCAN && cache_over_budget();
+            scanned++) {
+        pos = clock_hand;
+        clock_hand = (clock_hand + 1) % CLOCK_POSITIONS;
+        freed = clock_sweep(pos, tv.tv_sec, &evicted);
+        if (freed)
+            account_cache_memory(-(long) freed);
+    }
+
+    VAL_CACHE_ACCT_UNLOCK(&clock_lock);
+
+    if (evicted) {
+        count_cache_evictions(evicted);
+        val_log(NULL, LOG_DEBUG, 
+                "enforce_cache_budget(): Evicted %lu cache entries", evicted);
+    }
+}
+
+/*
+ * Release everything held in one of the rrset caches
+ */
+static void
+free_rrset_store(struct rrset_store *store)
+{
+    struct cache_shard *shard;
+    struct rrset_rec *r;
+    size_t freed = 0;
+    int i, j;
+
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        shard = &store->st_shards[i];
+        VAL_CACHE_SHARDS_INIT();
+        VAL_CACHE_LOCK_EX(&shard->cs_rwlock);
+        for (j = 0; j < CACHE_SHARD_BUCKETS; j++) {
+            for (r = shard->cs_buckets[j]; r; r = r->rrs_next)
+                freed += rrset_rec_size(r);
+            res_sq_free_rrset_recs(&shard->cs_buckets[j]);
+            shard->cs_buckets[j] = NULL;
+        }
+        VAL_CACHE_UNLOCK(&shard->cs_rwlock);
+    }
+    account_cache_memory(-(long) freed);
+}
+
 int
 free_validator_cache(void)
 {
-    VAL_CACHE_LOCK_INIT(&ns_rwlock, ns_rwlock_init);
-    VAL_CACHE_LOCK_EX(&ns_rwlock);
-    res_sq_free_rrset_recs(&unchecked_hints);
-    unchecked_hints = NULL;
-    VAL_CACHE_UNLOCK(&ns_rwlock);
-    
-    VAL_CACHE_LOCK_INIT(&ans_rwlock, ans_rwlock_init);
-    VAL_CACHE_LOCK_EX(&ans_rwlock);
-    res_sq_free_rrset_recs(&unchecked_answers);
-    unchecked_answers = NULL;
-    VAL_CACHE_UNLOCK(&ans_rwlock);
+    size_t freed = 0;
+    int i;
+
+    free_rrset_store(&unchecked_hints);
+    free_rrset_store(&unchecked_answers);
+
+    VAL_CACHE_LOCK_EX(&neg_rwlock);
+    for (i = 0; i < NEG_CACHE_BUCKETS; i++) {
+        while (negative_answers[i]) {
+            struct neg_cache_rec *nc = negative_answers[i];
+            negative_answers[i] = nc->nc_next;
+            freed += nc->nc_bytes;
+            free_neg_cache_rec(nc);
+        }
+    }
+    VAL_CACHE_UNLOCK(&neg_rwlock);
+
+    VAL_CACHE_LOCK_EX(&span_rwlock);
+    for (i = 0; i < SPAN_ZONE_BUCKETS; i++) {
+        while (nsec_span_zones[i]) {
+            struct nsec_span_zone *sz = nsec_span_zones[i];
+            nsec_span_zones[i] = sz->sz_next;
+            freed += sz->sz_bytes;
+            free_nsec_span_zone(sz);
+        }
+    }
+    VAL_CACHE_UNLOCK(&span_rwlock);
+
+    account_cache_memory(-(long) freed);
     
     return VAL_NO_ERROR;
 }
@@ -11,7 +11,19 @@ int             stow_key_info(struct rrset_rec **new_info, struct val_query_chai
 int             stow_ds_info(struct rrset_rec **new_info, struct val_query_chain *matched_q);
 int             stow_answers(struct rrset_rec **new_info, struct val_query_chain *matched_q);
 int             get_cached_rrset(struct val_query_chain *matched_q, struct domain_info **response);
+int             stow_negative_answer(struct val_query_chain *matched_q,
+                                     val_status_t status, u_int32_t ttl_x);
+int             get_cached_negative(struct val_query_chain *matched_q,
+                                    struct domain_info **response);
+int             stow_nsec_spans(struct val_query_chain *matched_q,
+                                val_status_t status);
+int             get_synthesized_negative(val_context_t *ctx,
+                                         struct val_query_chain *matched_q,
+                                         struct domain_info **response);
 int             free_validator_cache(void);
+void            account_cache_memory(long delta);
+void            count_cache_evictions(unsigned long count);
+int             cache_over_budget(void);
 int             get_nslist_from_cache(val_context_t *ctx,
                                       struct queries_for_query *matched_qfq,
                                       struct queries_for_query **queries,
@@ -25,6 +25,8 @@
 #include "val_cache.h"
 #include "val_assertion.h"
 #include "val_context.h"
+#include "val_crypto.h"
+#include "val_verify.h"
 
 #define GET_LATEST_TIMESTAMP(ctx, file, cur_ts, new_ts) do { \
     memset(&new_ts, 0, sizeof(struct stat));\
@@ -434,7 +436,7 @@ val_create_context_internal( const char *label,
      *  either label should be NULL, or if label is not NULL, our global policy should
      *  be set so that environment overrides what ever is passed by the app
      */
-    if (the_default_context && 
+    if (the_default_context && !(polflags & CTX_DYN_POL_PRIVATE) &&
         (label == NULL || 
          (the_default_context->g_opt && 
           (the_default_context->g_opt->env_policy == VAL_POL_GOPT_OVERRIDE || 
@@ -558,10 +560,27 @@ val_create_context_internal( const char *label,
     }
     memset(((*newcontext)->e_pol), 0,
            MAX_POL_TOKEN * sizeof(policy_entry_t *));
+    (*newcontext)->e_pol_idx = (struct policy_index **)
+        MALLOC(MAX_POL_TOKEN * sizeof(struct policy_index *));
+    if ((*newcontext)->e_pol_idx == NULL) {
+        retval = VAL_OUT_OF_MEMORY;
+        goto err;
+    }
+    memset(((*newcontext)->e_pol_idx), 0,
+           MAX_POL_TOKEN * sizeof(struct policy_index *));
    
     (*newcontext)->val_log_targets = NULL;
     (*newcontext)->q_list = NULL;
+    (*newcontext)->q_tail = NULL;
+    (*newcontext)->q_hash = NULL;
+    (*newcontext)->q_hash_size = 0;
+    (*newcontext)->q_count = 0;
+    (*newcontext)->q_exp = NULL;
+    (*newcontext)->q_exp_size = 0;
     (*newcontext)->as_list = NULL;
+#if !defined(VAL_NO_ASYNC) && !defined(VAL_NO_THREADS)
+    (*newcontext)->as_thread = NULL;
+#endif
     (*newcontext)->def_cflags = 0; 
     (*newcontext)->def_uflags = flags & VAL_QFLAGS_USERMASK; 
 
@@ -599,7 +618,7 @@ val_create_context_internal( const char *label,
             (*newcontext)->resolv_conf,
             (*newcontext)->root_conf);
 
-    if (label == NULL) {
+    if (label == NULL && !(polflags & CTX_DYN_POL_PRIVATE)) {
         /*
          * Set the default context if this was not set earlier.
          * We do not override a previously set default context,
@@ -726,15 +745,33 @@ val_create_or_refresh_context(val_context_t *ctx)
 void
 val_free_context(val_context_t * context)
 {
-    struct val_query_chain *q;
     int has_refs = 0;
 
     if (context == NULL)
         return;
-    
+
     /*
      * never free context that has multiple users
      */
+#ifdef VAL_REFCOUNTS
+    CTX_LOCK_REFCNT(context);
+    if (--context->refcount > 0)
+        has_refs = 1;
+    CTX_UNLOCK_REFCNT(context);
+
+    if (has_refs)
+        return;
+#endif
+
+#if !defined(VAL_NO_ASYNC) && !defined(VAL_NO_THREADS)
+    /*
+     * the resolver thread holds the policy lock while it has requests,
+     * so it must go before we can tell whether anyone else still does.
+     * Without reference counts, that means it is always stopped.
+     */
+    val_async_thread_stop(context);
+#endif
+
     LOCK_DEFAULT_CONTEXT();
     if (!CTX_LOCK_POL_EX_TRY(context)) {
         has_refs = 1;
@@ -747,13 +784,6 @@ val_free_context(val_context_t * context)
     }
     UNLOCK_DEFAULT_CONTEXT();
 
-#ifdef VAL_REFCOUNTS
-    CTX_LOCK_REFCNT(context);
-    if (--context->refcount > 0)
-        has_refs = 1;
-    CTX_UNLOCK_REFCNT(context);
-#endif
-
     if (has_refs)
         return;
 
@@ -806,12 +836,9 @@ val_free_context(val_context_t * context)
     destroy_respol(context);
     destroy_valpol(context);
     FREE(context->e_pol);
+    FREE(context->e_pol_idx);
 
-    while (NULL != (q = context->q_list)) {
-        context->q_list = q->qc_next;
-        free_query_chain_structure(q);
-        q = NULL;
-    }
+    free_query_chain(context);
     if (context->base_dnsval_conf)
         FREE(context->base_dnsval_conf);
     
@@ -831,6 +858,13 @@ val_free_validator_state()
     val_context_t * saved_ctx = NULL;
 
     free_validator_cache();
+    free_key_cache();
+    free_sig_memo();
+#ifdef LIBVAL_NSEC3
+    free_nsec3_memo();
+#endif
+    free_verify_pool();
+    free_etc_hosts();
 
     LOCK_DEFAULT_CONTEXT();
     if (the_default_context != NULL) {
@@ -1003,7 +1037,7 @@ val_context_store_ns_for_zone(val_context_t *context, char * zone,
     /* Flush queries that match this name */
     for(q=ctx->q_list; q; q=q->qc_next) {
         if (NULL != namename(q->qc_name_n, zone_n)) {
-            q->qc_flags |= VAL_QUERY_MARK_FOR_DELETION;
+            mark_query_chain_for_deletion(ctx, q);
         }
     }
 
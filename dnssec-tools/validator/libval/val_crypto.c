@@ -45,9 +45,36 @@
 #define VAL_EVP_DGST_SHA256  2
 #define VAL_EVP_DGST_SHA384  3
 #define VAL_EVP_DGST_SHA512  4
+#define VAL_EVP_DGST_MD5     5
+
+/*
+ * Feed the signed data into md_ctx piece by piece, straight from
+ * the RRSIG and the RRset; returns 1 on success
+ */
+static int
+sigfield_digest_update(EVP_MD_CTX *md_ctx, const struct val_sigfield *data)
+{
+    struct rrset_rr *rr;
+    u_char          rdlen_n[2];
+
+    if (EVP_DigestUpdate(md_ctx, data->sf_prefix, 
+                         data->sf_prefix_len) != 1)
+        return 0;
+    for (rr = data->sf_rrs; rr; rr = rr->rr_next) {
+        rdlen_n[0] = (rr->rr_rdata_length >> 8) & 0xff;
+        rdlen_n[1] = rr->rr_rdata_length & 0xff;
+        if (EVP_DigestUpdate(md_ctx, data->sf_envelope, 
+                             data->sf_envelope_len) != 1 ||
+            EVP_DigestUpdate(md_ctx, rdlen_n, sizeof(rdlen_n)) != 1 ||
+            EVP_DigestUpdate(md_ctx, rr->rr_rdata, 
+                             rr->rr_rdata_length) != 1)
+            return 0;
+    }
+    return 1;
+}
 
 static unsigned int 
-gen_evp_hash(const int hashtype, const u_char *data, size_t data_len, 
+gen_evp_hash(const int hashtype, const struct val_sigfield *data, 
              u_char *outbuf, size_t outsize)
 {
     const EVP_MD *md = NULL;
@@ -70,6 +97,9 @@ gen_evp_hash(const int hashtype, const u_char *data, size_t data_len,
         case VAL_EVP_DGST_SHA512:
             md = EVP_sha512();
             break;
+        case VAL_EVP_DGST_MD5:
+            md = EVP_md5();
+            break;
         default:
             break;
     }
@@ -78,7 +108,7 @@ gen_evp_hash(const int hashtype, const u_char *data, size_t data_len,
         EVP_MD_CTX *md_ctx;
         md_ctx = EVP_MD_CTX_new();
         EVP_DigestInit_ex(md_ctx, md, NULL);
-        EVP_DigestUpdate(md_ctx, data, data_len);
+        sigfield_digest_update(md_ctx, data);
         EVP_DigestFinal_ex(md_ctx, outbuf, &calcsize);
         EVP_MD_CTX_free(md_ctx);
     }
@@ -131,8 +161,7 @@ dsasha1_parse_public_key(const u_char *buf, size_t buflen, DSA * dsa)
 
 void
 dsasha1_sigverify(val_context_t * ctx,
-                  const u_char *data,
-                  size_t data_len,
+                  const struct val_sigfield *data,
                   const val_dnskey_rdata_t * dnskey,
                   const val_rrsig_rdata_t * rrsig,
                   val_astatus_t * key_status, val_astatus_t * sig_status)
@@ -162,9 +191,10 @@ dsasha1_sigverify(val_context_t * ctx,
         return;
     }
 
-    gen_evp_hash(VAL_EVP_DGST_SHA1, data, data_len, sha1_hash, SHA_DIGEST_LENGTH); 
-    val_log(ctx, LOG_DEBUG, "dsasha1_sigverify(): SHA-1 hash = %s",
-            get_hex_string(sha1_hash, SHA_DIGEST_LENGTH, buf, buflen));
+    gen_evp_hash(VAL_EVP_DGST_SHA1, data, sha1_hash, SHA_DIGEST_LENGTH); 
+    if (VAL_LOG_WOULD_LOG(LOG_DEBUG))
+        val_log(ctx, LOG_DEBUG, "dsasha1_sigverify(): SHA-1 hash = %s",
+                get_hex_string(sha1_hash, SHA_DIGEST_LENGTH, buf, buflen));
 
     val_log(ctx, LOG_DEBUG,
             "dsasha1_sigverify(): verifying DSA signature...");
@@ -305,8 +335,7 @@ rsamd5_keytag(const u_char *pubkey, size_t pubkey_len)
 
 void
 rsamd5_sigverify(val_context_t * ctx,
-                 const u_char *data,
-                 size_t data_len,
+                 const struct val_sigfield *data,
                  const val_dnskey_rdata_t * dnskey,
                  const val_rrsig_rdata_t * rrsig,
                  val_astatus_t * key_status, val_astatus_t * sig_status)
@@ -334,10 +363,10 @@ rsamd5_sigverify(val_context_t * ctx,
         return;
     }
 
-    memset(md5_hash, 0, MD5_DIGEST_LENGTH);
-    MD5(data, data_len, (u_char *) md5_hash);
-    val_log(ctx, LOG_DEBUG, "rsamd5_sigverify(): MD5 hash = %s",
-            get_hex_string(md5_hash, MD5_DIGEST_LENGTH, buf, buflen));
+    gen_evp_hash(VAL_EVP_DGST_MD5, data, md5_hash, MD5_DIGEST_LENGTH);
+    if (VAL_LOG_WOULD_LOG(LOG_DEBUG))
+        val_log(ctx, LOG_DEBUG, "rsamd5_sigverify(): MD5 hash = %s",
+                get_hex_string(md5_hash, MD5_DIGEST_LENGTH, buf, buflen));
 
     val_log(ctx, LOG_DEBUG,
             "rsamd5_sigverify(): verifying RSA signature...");
@@ -408,36 +437,478 @@ rsa_parse_public_key(const u_char *buf, size_t buflen, RSA * rsa)
     return VAL_NO_ERROR;        /* success */
 }
 
+/*
+ * Cache of parsed public keys.
+ * Building an OpenSSL key from the DNSKEY wire format costs more than
+ * the verification itself, while the same few zone keys are used for
+ * a great many signatures. Parsed keys are cached on {owner, key tag,
+ * algorithm, public key} for as long as the DNSKEY RRset that they 
+ * came from remains valid.
+ */
+#define KEY_CACHE_BUCKETS    256
+#define KEY_CACHE_BUCKET_MAX 4      /* entries kept per bucket */
+
+struct key_cache_rec {
+    u_char        *kc_owner_n;
+    u_int16_t      kc_tag;
+    u_char         kc_alg;
+    u_int32_t      kc_hash;     /* hash of the public key bytes */
+    u_char        *kc_key;
+    size_t         kc_keylen;
+    u_int32_t      kc_ttl_x;
+    EVP_PKEY      *kc_pkey;
+    struct key_cache_rec *kc_next;
+};
+
+static struct key_cache_rec *key_cache[KEY_CACHE_BUCKETS];
+
+#ifndef VAL_NO_THREADS
+static pthread_mutex_t key_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#define VAL_KEY_CACHE_LOCK()    pthread_mutex_lock(&key_cache_lock)
+#define VAL_KEY_CACHE_UNLOCK()  pthread_mutex_unlock(&key_cache_lock)
+#else
+#define VAL_KEY_CACHE_LOCK()
+#define VAL_KEY_CACHE_UNLOCK()
+#endif
+
+static u_int32_t
+key_bytes_hash(const u_char *key, size_t keylen)
+{
+    u_int32_t h = 2166136261U;
+    size_t i;
+
+    for (i = 0; i < keylen; i++) {
+        h ^= key[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static void
+free_key_cache_rec(struct key_cache_rec *kc)
+{
+    if (kc->kc_owner_n)
+        FREE(kc->kc_owner_n);
+    if (kc->kc_key)
+        FREE(kc->kc_key);
+    if (kc->kc_pkey)
+        EVP_PKEY_free(kc->kc_pkey);
+    FREE(kc);
+}
+
+/*
+ * Build an OpenSSL public key from the DNSKEY wire format 
+ */
+static EVP_PKEY *
+make_public_key(const val_dnskey_rdata_t * dnskey)
+{
+    EVP_PKEY       *pkey;
+    RSA            *rsa;
+#if defined(HAVE_ECDSA) && defined(HAVE_OPENSSL_ECDSA_H)
+    EC_KEY         *eckey = NULL;
+    BIGNUM         *bn_x, *bn_y;
+    size_t          qlen;
+    int             ok;
+#endif
+
+    if ((pkey = EVP_PKEY_new()) == NULL)
+        return NULL;
+
+    switch (dnskey->algorithm) {
+
+#ifdef LIBVAL_NSEC3
+    case ALG_NSEC3_RSASHA1:
+#endif
+    case ALG_RSASHA1:
+    case ALG_RSASHA256:
+    case ALG_RSASHA512:
+        if ((rsa = RSA_new()) == NULL)
+            break;
+        if (rsa_parse_public_key(dnskey->public_key, 
+                                 (size_t)dnskey->public_key_len,
+                                 rsa) != VAL_NO_ERROR ||
+            !EVP_PKEY_assign_RSA(pkey, rsa)) {
+            RSA_free(rsa);
+            break;
+        }
+        return pkey;
+
+#if defined(HAVE_ECDSA) && defined(HAVE_OPENSSL_ECDSA_H)
+    case ALG_ECDSAP256SHA256:
+    case ALG_ECDSAP384SHA384:
+        /* 
+         * contruct an EC_POINT from the "Q" field in the 
+         * dnskey->public_key, dnskey->public_key_len
+         */
+        if (dnskey->algorithm == ALG_ECDSAP256SHA256) {
+            qlen = SHA256_DIGEST_LENGTH;
+            eckey = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1); /* P-256 */
+        } else {
+            qlen = SHA384_DIGEST_LENGTH;
+            eckey = EC_KEY_new_by_curve_name(NID_secp384r1); /* P-384 */
+        }
+        if (eckey == NULL)
+            break;
+        if (dnskey->public_key_len != 2*qlen) {
+            EC_KEY_free(eckey);
+            break;
+        }
+        bn_x = BN_bin2bn(dnskey->public_key, qlen, NULL);
+        bn_y = BN_bin2bn(&dnskey->public_key[qlen], qlen, NULL);
+        ok = (bn_x != NULL && bn_y != NULL &&
+              1 == EC_KEY_set_public_key_affine_coordinates(eckey, bn_x, bn_y));
+        if (bn_x)
+            BN_free(bn_x);
+        if (bn_y)
+            BN_free(bn_y);
+        if (!ok || !EVP_PKEY_assign_EC_KEY(pkey, eckey)) {
+            EC_KEY_free(eckey);
+            break;
+        }
+        return pkey;
+#endif
+
+    default:
+        break;
+    }
+
+    EVP_PKEY_free(pkey);
+    return NULL;
+}
+
+/*
+ * Return the OpenSSL public key for dnskey, owned by owner_n, from 
+ * the key cache, building and caching it if necessary. key_ttl_x is 
+ * the expiry time of the DNSKEY RRset. 
+ * The caller must release the returned key with EVP_PKEY_free().
+ */
+static EVP_PKEY *
+get_public_key(const u_char *owner_n, u_int32_t key_ttl_x,
+               const val_dnskey_rdata_t * dnskey)
+{
+    struct key_cache_rec *kc, **kcp, *new_kc;
+    struct timeval  tv;
+    EVP_PKEY       *pkey;
+    u_int32_t       h;
+    size_t          b = 0, len;
+    int             n;
+
+    if (dnskey->public_key == NULL || dnskey->public_key_len == 0)
+        return NULL;
+
+    gettimeofday(&tv, NULL);
+    h = key_bytes_hash(dnskey->public_key, dnskey->public_key_len);
+
+    if (owner_n != NULL) {
+        b = (wire_name_hash(owner_n) ^ h) % KEY_CACHE_BUCKETS;
+
+        VAL_KEY_CACHE_LOCK();
+        for (kcp = &key_cache[b]; (kc = *kcp) != NULL; kcp = &kc->kc_next) {
+            if (kc->kc_hash == h &&
+                kc->kc_tag == dnskey->key_tag &&
+                kc->kc_alg == dnskey->algorithm &&
+                kc->kc_keylen == dnskey->public_key_len &&
+                tv.tv_sec < kc->kc_ttl_x &&
+                !memcmp(kc->kc_key, dnskey->public_key, kc->kc_keylen) &&
+                !namecmp(kc->kc_owner_n, owner_n)) {
+
+                /* move to the front of the bucket */
+                *kcp = kc->kc_next;
+                kc->kc_next = key_cache[b];
+                key_cache[b] = kc;
+
+                EVP_PKEY_up_ref(kc->kc_pkey);
+                pkey = kc->kc_pkey;
+                VAL_KEY_CACHE_UNLOCK();
+                return pkey;
+            }
+        }
+        VAL_KEY_CACHE_UNLOCK();
+    }
+
+    if (NULL == (pkey = make_public_key(dnskey)))
+        return NULL;
+
+    if (owner_n == NULL || key_ttl_x <= tv.tv_sec)
+        return pkey;
+
+    new_kc = (struct key_cache_rec *) MALLOC(sizeof(struct key_cache_rec));
+    if (new_kc == NULL)
+        return pkey;
+    memset(new_kc, 0, sizeof(struct key_cache_rec));
+    len = wire_name_length(owner_n);
+    new_kc->kc_owner_n = (u_char *) MALLOC(len * sizeof(u_char));
+    new_kc->kc_key = (u_char *) MALLOC(dnskey->public_key_len * sizeof(u_char));
+    if (new_kc->kc_owner_n == NULL || new_kc->kc_key == NULL) {
+        free_key_cache_rec(new_kc);
+        return pkey;
+    }
+    memcpy(new_kc->kc_owner_n, owner_n, len);
+    memcpy(new_kc->kc_key, dnskey->public_key, dnskey->public_key_len);
+    new_kc->kc_keylen = dnskey->public_key_len;
+    new_kc->kc_tag = dnskey->key_tag;
+    new_kc->kc_alg = dnskey->algorithm;
+    new_kc->kc_hash = h;
+    new_kc->kc_ttl_x = key_ttl_x;
+    EVP_PKEY_up_ref(pkey);
+    new_kc->kc_pkey = pkey;
+
+    VAL_KEY_CACHE_LOCK();
+    new_kc->kc_next = key_cache[b];
+    key_cache[b] = new_kc;
+    /* drop expired and least recently used entries */
+    for (n = 0, kcp = &new_kc->kc_next; (kc = *kcp) != NULL; ) {
+        if (kc->kc_ttl_x <= tv.tv_sec || ++n >= KEY_CACHE_BUCKET_MAX) {
+            *kcp = kc->kc_next;
+            free_key_cache_rec(kc);
+            continue;
+        }
+        kcp = &kc->kc_next;
+    }
+    VAL_KEY_CACHE_UNLOCK();
+
+    return pkey;
+}
+
+/*
+ * Release all cached public keys
+ */
+void
+free_key_cache(void)
+{
+    struct key_cache_rec *kc;
+    int i;
+
+    VAL_KEY_CACHE_LOCK();
+    for (i = 0; i < KEY_CACHE_BUCKETS; i++) {
+        while ((kc = key_cache[i]) != NULL) {
+            key_cache[i] = kc->kc_next;
+            free_key_cache_rec(kc);
+        }
+    }
+    VAL_KEY_CACHE_UNLOCK();
+}
+
+/*
+ * Memo of signature verification results.
+ * The same RRset/RRSIG pair is often verified more than once, for 
+ * instance when a query chain is rebuilt after it has expired or when
+ * the same data is validated in another context. The outcome of the
+ * public key operation only depends on the signed data, the signature
+ * and the key, so it is remembered here under a digest of all three
+ * until the signature expires.
+ */
+#define SIG_MEMO_BUCKETS    1024
+#define SIG_MEMO_BUCKET_MAX 4       /* entries kept per bucket */
+
+struct sig_memo_rec {
+    u_char         sm_digest[SHA256_DIGEST_LENGTH];
+    u_int16_t      sm_tag;
+    u_char         sm_alg;
+    val_astatus_t  sm_status;
+    u_int32_t      sm_expr;
+    struct sig_memo_rec *sm_next;
+};
+
+static struct sig_memo_rec *sig_memo[SIG_MEMO_BUCKETS];
+
+#ifndef VAL_NO_THREADS
+static pthread_mutex_t sig_memo_lock = PTHREAD_MUTEX_INITIALIZER;
+#define VAL_SIG_MEMO_LOCK()    pthread_mutex_lock(&sig_memo_lock)
+#define VAL_SIG_MEMO_UNLOCK()  pthread_mutex_unlock(&sig_memo_lock)
+#else
+#define VAL_SIG_MEMO_LOCK()
+#define VAL_SIG_MEMO_UNLOCK()
+#endif
+
+/*
+ * Compute the memo digest over the signed data, the signature and 
+ * the key. Returns 0 on success, -1 if the digest could not be
+ * computed.
+ */
+int
+sig_memo_digest(const struct val_sigfield *data,
+                const val_dnskey_rdata_t * dnskey,
+                const val_rrsig_rdata_t * rrsig,
+                u_char *digest)
+{
+    EVP_MD_CTX     *md_ctx;
+    u_char          hdr[4];
+    unsigned int    len = 0;
+    int             ret = -1;
+
+    if (data == NULL || dnskey == NULL || rrsig == NULL || digest == NULL ||
+        dnskey->public_key == NULL || rrsig->signature == NULL)
+        return -1;
+
+    hdr[0] = (dnskey->flags >> 8) & 0xff;
+    hdr[1] = dnskey->flags & 0xff;
+    hdr[2] = dnskey->protocol;
+    hdr[3] = dnskey->algorithm;
+
+    if ((md_ctx = EVP_MD_CTX_new()) == NULL)
+        return -1;
+    if (EVP_DigestInit_ex(md_ctx, EVP_sha256(), NULL) == 1 &&
+        sigfield_digest_update(md_ctx, data) == 1 &&
+        EVP_DigestUpdate(md_ctx, rrsig->signature, 
+                         rrsig->signature_len) == 1 &&
+        EVP_DigestUpdate(md_ctx, hdr, sizeof(hdr)) == 1 &&
+        EVP_DigestUpdate(md_ctx, dnskey->public_key, 
+                         dnskey->public_key_len) == 1 &&
+        EVP_DigestFinal_ex(md_ctx, digest, &len) == 1 &&
+        len == SHA256_DIGEST_LENGTH)
+        ret = 0;
+    EVP_MD_CTX_free(md_ctx);
+    return ret;
+}
+
+#define SIG_MEMO_BUCKET(digest) \
+    ((((size_t)(digest)[0] << 8) | (digest)[1]) % SIG_MEMO_BUCKETS)
+
+/*
+ * Look up a previously computed verification result.
+ * Returns 1 and sets *sig_status if one was found, 0 otherwise.
+ */
+int
+sig_memo_lookup(const u_char *digest,
+                const val_dnskey_rdata_t * dnskey,
+                val_astatus_t * sig_status)
+{
+    struct sig_memo_rec *sm, **smp;
+    struct timeval  tv;
+    size_t          b;
+    int             found = 0;
+
+    gettimeofday(&tv, NULL);
+    b = SIG_MEMO_BUCKET(digest);
+
+    VAL_SIG_MEMO_LOCK();
+    for (smp = &sig_memo[b]; (sm = *smp) != NULL; smp = &sm->sm_next) {
+        if (sm->sm_tag == dnskey->key_tag &&
+            sm->sm_alg == dnskey->algorithm &&
+            !memcmp(sm->sm_digest, digest, SHA256_DIGEST_LENGTH)) {
+            if (tv.tv_sec <= sm->sm_expr) {
+                /* move to the front of the bucket */
+                *smp = sm->sm_next;
+                sm->sm_next = sig_memo[b];
+                sig_memo[b] = sm;
+                *sig_status = sm->sm_status;
+                found = 1;
+            }
+            break;
+        }
+    }
+    VAL_SIG_MEMO_UNLOCK();
+    return found;
+}
+
+/*
+ * Remember the result of a signature verification until the
+ * signature expires
+ */
+void
+sig_memo_store(const u_char *digest,
+               const val_dnskey_rdata_t * dnskey,
+               const val_rrsig_rdata_t * rrsig,
+               val_astatus_t sig_status)
+{
+    struct sig_memo_rec *sm, **smp, *new_sm;
+    struct timeval  tv;
+    size_t          b;
+    int             n;
+
+    gettimeofday(&tv, NULL);
+    if (rrsig->sig_expr < tv.tv_sec)
+        return;
+
+    new_sm = (struct sig_memo_rec *) MALLOC(sizeof(struct sig_memo_rec));
+    if (new_sm == NULL)
+        return;
+    memcpy(new_sm->sm_digest, digest, SHA256_DIGEST_LENGTH);
+    new_sm->sm_tag = dnskey->key_tag;
+    new_sm->sm_alg = dnskey->algorithm;
+    new_sm->sm_status = sig_status;
+    new_sm->sm_expr = rrsig->sig_expr;
+
+    b = SIG_MEMO_BUCKET(digest);
+
+    VAL_SIG_MEMO_LOCK();
+    new_sm->sm_next = sig_memo[b];
+    sig_memo[b] = new_sm;
+    /* drop duplicates, expired and least recently used entries */
+    for (n = 0, smp = &new_sm->sm_next; (sm = *smp) != NULL; ) {
+        if (sm->sm_expr < tv.tv_sec || ++n >= SIG_MEMO_BUCKET_MAX ||
+            !memcmp(sm->sm_digest, digest, SHA256_DIGEST_LENGTH)) {
+            *smp = sm->sm_next;
+            FREE(sm);
+            continue;
+        }
+        smp = &sm->sm_next;
+    }
+    VAL_SIG_MEMO_UNLOCK();
+}
+
+/*
+ * Release all remembered verification results
+ */
+void
+free_sig_memo(void)
+{
+    struct sig_memo_rec *sm;
+    int i;
+
+    VAL_SIG_MEMO_LOCK();
+    for (i = 0; i < SIG_MEMO_BUCKETS; i++) {
+        while ((sm = sig_memo[i]) != NULL) {
+            sig_memo[i] = sm->sm_next;
+            FREE(sm);
+        }
+    }
+    VAL_SIG_MEMO_UNLOCK();
+}
+
+/*
+ * Verify sig over the digest hash using pkey
+ */
+static int
+pkey_verify(EVP_PKEY *pkey, const EVP_MD *md, 
+            const u_char *hash, size_t hashlen,
+            const u_char *sig, size_t siglen)
+{
+    EVP_PKEY_CTX   *pctx;
+    int             ret = 0;
+
+    if ((pctx = EVP_PKEY_CTX_new(pkey, NULL)) == NULL)
+        return 0;
+    if (EVP_PKEY_verify_init(pctx) == 1 &&
+        EVP_PKEY_CTX_set_signature_md(pctx, md) == 1 &&
+        EVP_PKEY_verify(pctx, sig, siglen, hash, hashlen) == 1)
+        ret = 1;
+    EVP_PKEY_CTX_free(pctx);
+    return ret;
+}
+
 void
 rsasha_sigverify(val_context_t * ctx,
-                  const u_char *data,
-                  size_t data_len,
+                  const struct val_sigfield *data,
                   const val_dnskey_rdata_t * dnskey,
+                  const u_char *key_owner_n,
+                  u_int32_t key_ttl_x,
                   const val_rrsig_rdata_t * rrsig,
                   val_astatus_t * key_status, val_astatus_t * sig_status)
 {
     char            buf[1028];
     size_t          buflen = 1024;
-    RSA            *rsa = NULL;
+    EVP_PKEY       *pkey = NULL;
+    const EVP_MD   *md = NULL;
     u_char   sha_hash[MAX_DIGEST_LENGTH];
     size_t   hashlen = 0;
-    int nid = 0;
 
     val_log(ctx, LOG_DEBUG,
             "rsasha_sigverify(): parsing the public key...");
-    if ((rsa = RSA_new()) == NULL) {
-        val_log(ctx, LOG_INFO,
-                "rsasha_sigverify(): could not allocate rsa structure.");
-        *key_status = VAL_AC_INVALID_KEY;
-        return;
-    };
-
-    if (rsa_parse_public_key
-        (dnskey->public_key, (size_t)dnskey->public_key_len,
-         rsa) != VAL_NO_ERROR) {
+    if ((pkey = get_public_key(key_owner_n, key_ttl_x, dnskey)) == NULL) {
         val_log(ctx, LOG_INFO,
                 "rsasha_sigverify(): Error in parsing public key.");
-        RSA_free(rsa);
         *key_status = VAL_AC_INVALID_KEY;
         return;
     }
@@ -449,106 +920,89 @@ rsasha_sigverify(val_context_t * ctx,
 #endif
        ) {
         hashlen = SHA_DIGEST_LENGTH; 
-        gen_evp_hash(VAL_EVP_DGST_SHA1, data, data_len, sha_hash, hashlen); 
-        nid = NID_sha1; 
+        gen_evp_hash(VAL_EVP_DGST_SHA1, data, sha_hash, hashlen); 
+        md = EVP_sha1(); 
     } else if (rrsig->algorithm == ALG_RSASHA256) {
         hashlen = SHA256_DIGEST_LENGTH; 
-        gen_evp_hash(VAL_EVP_DGST_SHA256, data, data_len, sha_hash, hashlen); 
-        nid = NID_sha256; 
+        gen_evp_hash(VAL_EVP_DGST_SHA256, data, sha_hash, hashlen); 
+        md = EVP_sha256(); 
     } else if (rrsig->algorithm == ALG_RSASHA512) {
         hashlen = SHA512_DIGEST_LENGTH; 
-        gen_evp_hash(VAL_EVP_DGST_SHA512, data, data_len, sha_hash, hashlen); 
-        nid = NID_sha512; 
+        gen_evp_hash(VAL_EVP_DGST_SHA512, data, sha_hash, hashlen); 
+        md = EVP_sha512(); 
     } else {
         val_log(ctx, LOG_INFO,
                 "rsasha_sigverify(): Unkown algorithm.");
-        RSA_free(rsa);
+        EVP_PKEY_free(pkey);
         *key_status = VAL_AC_INVALID_KEY;
         return;
     } 
 
-    val_log(ctx, LOG_DEBUG, "rsasha_sigverify(): SHA hash = %s",
-            get_hex_string(sha_hash, hashlen, buf, buflen));
+    if (VAL_LOG_WOULD_LOG(LOG_DEBUG))
+        val_log(ctx, LOG_DEBUG, "rsasha_sigverify(): SHA hash = %s",
+                get_hex_string(sha_hash, hashlen, buf, buflen));
     val_log(ctx, LOG_DEBUG,
             "rsasha_sigverify(): verifying RSA signature...");
 
-    if (RSA_verify
-        (nid, sha_hash, hashlen,
-         rrsig->signature, rrsig->signature_len, rsa) == 1) {
+    if (pkey_verify(pkey, md, sha_hash, hashlen,
+                    rrsig->signature, rrsig->signature_len)) {
         val_log(ctx, LOG_INFO, "rsasha_sigverify(): returned SUCCESS");
-        RSA_free(rsa);
         *sig_status = VAL_AC_RRSIG_VERIFIED;
     } else {
         val_log(ctx, LOG_INFO, "rsasha_sigverify(): returned FAILURE");
-        RSA_free(rsa);
         *sig_status = VAL_AC_RRSIG_VERIFY_FAILED;
     }
+    EVP_PKEY_free(pkey);
     return;
 }
 
 #if defined(HAVE_ECDSA) && defined(HAVE_OPENSSL_ECDSA_H)
 void
 ecdsa_sigverify(val_context_t * ctx,
-                const u_char *data,
-                size_t data_len,
+                const struct val_sigfield *data,
                 const val_dnskey_rdata_t * dnskey,
+                const u_char *key_owner_n,
+                u_int32_t key_ttl_x,
                 const val_rrsig_rdata_t * rrsig,
                 val_astatus_t * key_status, val_astatus_t * sig_status)
 {
     char            buf[1028];
     size_t          buflen = 1024;
     u_char   sha_hash[MAX_DIGEST_LENGTH];
-    EC_KEY   *eckey = NULL;
-    BIGNUM *bn_x = NULL;
-    BIGNUM *bn_y = NULL;
+    u_char   *sig_der = NULL;
+    int      sig_derlen;
+    EVP_PKEY *pkey = NULL;
+    const EVP_MD *md = NULL;
     ECDSA_SIG *ecdsa_sig;
     size_t   hashlen = 0;
 
     ecdsa_sig = ECDSA_SIG_new();
     memset(sha_hash, 0, sizeof(sha_hash));
 
-    val_log(ctx, LOG_DEBUG,
-            "ecdsa_sigverify(): parsing the public key...");
-
     if (rrsig->algorithm == ALG_ECDSAP256SHA256) {
         hashlen = SHA256_DIGEST_LENGTH; 
-        gen_evp_hash(VAL_EVP_DGST_SHA256, data, data_len, sha_hash, hashlen); 
-        eckey = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1); /* P-256 */
+        gen_evp_hash(VAL_EVP_DGST_SHA256, data, sha_hash, hashlen); 
+        md = EVP_sha256();
     } else if (rrsig->algorithm == ALG_ECDSAP384SHA384) {
         hashlen = SHA384_DIGEST_LENGTH; 
-        gen_evp_hash(VAL_EVP_DGST_SHA384, data, data_len, sha_hash, hashlen); 
-        eckey = EC_KEY_new_by_curve_name(NID_secp384r1); /* P-384 */
+        gen_evp_hash(VAL_EVP_DGST_SHA384, data, sha_hash, hashlen); 
+        md = EVP_sha384();
     } 
 
-    if (eckey == NULL) {
-        val_log(ctx, LOG_INFO,
-                "ecdsa_sigverify(): could not create key for ECDSA group.");
-        *key_status = VAL_AC_INVALID_KEY;
-        goto err;
-    };
+    val_log(ctx, LOG_DEBUG,
+            "ecdsa_sigverify(): parsing the public key...");
 
-    /* 
-     * contruct an EC_POINT from the "Q" field in the 
-     * dnskey->public_key, dnskey->public_key_len
-     */
-    if (dnskey->public_key_len != 2*hashlen) {
+    if (md == NULL || 
+        (pkey = get_public_key(key_owner_n, key_ttl_x, dnskey)) == NULL) {
         val_log(ctx, LOG_INFO,
-                "ecdsa_sigverify(): dnskey length does not match expected size.");
+                "ecdsa_sigverify(): Error in parsing public key.");
         *key_status = VAL_AC_INVALID_KEY;
         goto err;
     }
-    bn_x = BN_bin2bn(dnskey->public_key, hashlen, NULL);
-    bn_y = BN_bin2bn(&dnskey->public_key[hashlen], hashlen, NULL);
-    if (1 != EC_KEY_set_public_key_affine_coordinates(eckey, bn_x, bn_y)) {
-        val_log(ctx, LOG_INFO,
-                "ecdsa_sigverify(): Error associating ECSA structure with key.");
-        *key_status = VAL_AC_INVALID_KEY;
-        goto err;
-    }
-
 
-    val_log(ctx, LOG_DEBUG, "ecdsa_sigverify(): SHA hash = %s",
-            get_hex_string(sha_hash, hashlen, buf, buflen));
+    if (VAL_LOG_WOULD_LOG(LOG_DEBUG))
+        val_log(ctx, LOG_DEBUG, "ecdsa_sigverify(): SHA hash = %s",
+                get_hex_string(sha_hash, hashlen, buf, buflen));
     val_log(ctx, LOG_DEBUG,
             "ecdsa_sigverify(): verifying ECDSA signature...");
 
@@ -556,7 +1010,7 @@ ecdsa_sigverify(val_context_t * ctx,
      * contruct ECDSA signature from the "r" and "s" fileds in 
      * rrsig->signature, rrsig->signature_len
      */
-    if (rrsig->signature_len != 2*hashlen) {
+    if (ecdsa_sig == NULL || rrsig->signature_len != 2*hashlen) {
         val_log(ctx, LOG_INFO,
                 "ecdsa_sigverify(): Signature length does not match expected size.");
         *sig_status = VAL_AC_RRSIG_VERIFY_FAILED;
@@ -565,8 +1019,10 @@ ecdsa_sigverify(val_context_t * ctx,
 
     ECDSA_SIG_set0(ecdsa_sig, BN_bin2bn(rrsig->signature, hashlen, NULL),
                    BN_bin2bn(&rrsig->signature[hashlen], hashlen, NULL));
+    sig_derlen = i2d_ECDSA_SIG(ecdsa_sig, &sig_der);
 
-    if (ECDSA_do_verify(sha_hash, hashlen, ecdsa_sig, eckey) == 1) {
+    if (sig_derlen > 0 && 
+        pkey_verify(pkey, md, sha_hash, hashlen, sig_der, sig_derlen)) {
         val_log(ctx, LOG_INFO, "ecdsa_sigverify(): returned SUCCESS");
         *sig_status = VAL_AC_RRSIG_VERIFIED;
     } else {
@@ -576,14 +1032,12 @@ ecdsa_sigverify(val_context_t * ctx,
 
     /* Free all structures allocated */
 err:
+    if (sig_der)
+        OPENSSL_free(sig_der);
     if (ecdsa_sig)
         ECDSA_SIG_free(ecdsa_sig);
-    if (bn_x)
-        BN_free(bn_x);
-    if (bn_y)
-        BN_free(bn_y);
-    if (eckey)
-        EC_KEY_free(eckey);
+    if (pkey)
+        EVP_PKEY_free(pkey);
 
     return;
 
@@ -695,6 +1149,154 @@ ds_sha384_hash_is_equal(u_char * name_n,
 #endif
 
 #ifdef LIBVAL_NSEC3
+/*
+ * Memo of NSEC3 owner name hashes.
+ * Proofs for names in the same zone keep hashing the same closest
+ * encloser candidates and wildcards, and with a large iteration
+ * count every one of those costs hundreds of SHA-1 rounds. The hash
+ * only depends on the (lower case) name, the salt and the number of
+ * iterations, so it is remembered here under those. Each bucket is
+ * kept in most recently used order and holds at most
+ * NSEC3_MEMO_BUCKET_MAX entries.
+ */
+#define NSEC3_MEMO_BUCKETS      1024
+#define NSEC3_MEMO_BUCKET_MAX   4
+
+struct nsec3_memo_rec {
+    u_int32_t      nm_key;
+    u_int16_t      nm_iter;
+    u_char         nm_namelen;
+    u_char         nm_saltlen;
+    u_char         nm_hash[SHA_DIGEST_LENGTH];
+    u_char        *nm_name;     /* followed by the salt */
+    struct nsec3_memo_rec *nm_next;
+};
+
+static struct nsec3_memo_rec *nsec3_memo[NSEC3_MEMO_BUCKETS];
+
+#ifndef VAL_NO_THREADS
+static pthread_mutex_t nsec3_memo_lock = PTHREAD_MUTEX_INITIALIZER;
+#define VAL_NSEC3_MEMO_LOCK()    pthread_mutex_lock(&nsec3_memo_lock)
+#define VAL_NSEC3_MEMO_UNLOCK()  pthread_mutex_unlock(&nsec3_memo_lock)
+#else
+#define VAL_NSEC3_MEMO_LOCK()
+#define VAL_NSEC3_MEMO_UNLOCK()
+#endif
+
+/*
+ * FNV-1a over the name, the salt and the iteration count
+ */
+static u_int32_t
+nsec3_memo_key(const u_char *name_n, size_t namelen,
+               const u_char *salt, size_t saltlen, size_t iter)
+{
+    u_int32_t       h = 2166136261U;
+    size_t          i;
+
+    for (i = 0; i < namelen; i++)
+        h = (h ^ name_n[i]) * 16777619U;
+    for (i = 0; i < saltlen; i++)
+        h = (h ^ salt[i]) * 16777619U;
+    h = (h ^ (iter & 0xff)) * 16777619U;
+    h = (h ^ ((iter >> 8) & 0xff)) * 16777619U;
+    return h;
+}
+
+#define NSEC3_MEMO_MATCHES(nm, key, name_n, namelen, salt, saltlen, iter) \
+    ((nm)->nm_key == (key) && (nm)->nm_iter == (iter) &&\
+     (nm)->nm_namelen == (namelen) && (nm)->nm_saltlen == (saltlen) &&\
+     !memcmp((nm)->nm_name, (name_n), (namelen)) &&\
+     !memcmp((nm)->nm_name + (namelen), (salt), (saltlen)))
+
+/*
+ * Look up a previously computed hash; returns 1 and copies it into
+ * hash if one was found, 0 otherwise
+ */
+static int
+nsec3_memo_lookup(u_int32_t key, const u_char *name_n, size_t namelen,
+                  const u_char *salt, size_t saltlen, size_t iter,
+                  u_char *hash)
+{
+    struct nsec3_memo_rec *nm, **nmp;
+    size_t          b = key % NSEC3_MEMO_BUCKETS;
+    int             found = 0;
+
+    VAL_NSEC3_MEMO_LOCK();
+    for (nmp = &nsec3_memo[b]; (nm = *nmp) != NULL; nmp = &nm->nm_next) {
+        if (NSEC3_MEMO_MATCHES(nm, key, name_n, namelen, 
+                               salt, saltlen, iter)) {
+            /* move to the front of the bucket */
+            *nmp = nm->nm_next;
+            nm->nm_next = nsec3_memo[b];
+            nsec3_memo[b] = nm;
+            memcpy(hash, nm->nm_hash, SHA_DIGEST_LENGTH);
+            found = 1;
+            break;
+        }
+    }
+    VAL_NSEC3_MEMO_UNLOCK();
+    return found;
+}
+
+static void
+nsec3_memo_store(u_int32_t key, const u_char *name_n, size_t namelen,
+                 const u_char *salt, size_t saltlen, size_t iter,
+                 const u_char *hash)
+{
+    struct nsec3_memo_rec *nm, **nmp, *new_nm;
+    size_t          b = key % NSEC3_MEMO_BUCKETS;
+    int             n;
+
+    new_nm = (struct nsec3_memo_rec *) 
+        MALLOC(sizeof(struct nsec3_memo_rec) + namelen + saltlen);
+    if (new_nm == NULL)
+        return;
+    new_nm->nm_key = key;
+    new_nm->nm_iter = (u_int16_t) iter;
+    new_nm->nm_namelen = (u_char) namelen;
+    new_nm->nm_saltlen = (u_char) saltlen;
+    memcpy(new_nm->nm_hash, hash, SHA_DIGEST_LENGTH);
+    new_nm->nm_name = (u_char *) (new_nm + 1);
+    memcpy(new_nm->nm_name, name_n, namelen);
+    if (saltlen)
+        memcpy(new_nm->nm_name + namelen, salt, saltlen);
+
+    VAL_NSEC3_MEMO_LOCK();
+    new_nm->nm_next = nsec3_memo[b];
+    nsec3_memo[b] = new_nm;
+    /* drop duplicates and least recently used entries */
+    for (n = 0, nmp = &new_nm->nm_next; (nm = *nmp) != NULL; ) {
+        if (++n >= NSEC3_MEMO_BUCKET_MAX ||
+            NSEC3_MEMO_MATCHES(nm, key, name_n, namelen, 
+                               salt, saltlen, iter)) {
+            *nmp = nm->nm_next;
+            FREE(nm);
+            continue;
+        }
+        nmp = &nm->nm_next;
+    }
+    VAL_NSEC3_MEMO_UNLOCK();
+}
+
+/*
+ * Release all remembered NSEC3 hashes
+ */
+void
+free_nsec3_memo(void)
+{
+    struct nsec3_memo_rec *nm;
+    int i;
+
+    VAL_NSEC3_MEMO_LOCK();
+    for (i = 0; i < NSEC3_MEMO_BUCKETS; i++) {
+        while ((nm = nsec3_memo[i]) != NULL) {
+            nsec3_memo[i] = nm->nm_next;
+            FREE(nm);
+        }
+    }
+    VAL_NSEC3_MEMO_UNLOCK();
+}
+
 u_char       *
 nsec3_sha_hash_compute(u_char * name_n, u_char * salt,
                        size_t saltlen, size_t iter, u_char ** hash,
@@ -708,6 +1310,7 @@ nsec3_sha_hash_compute(u_char * name_n, u_char * salt,
     size_t          l_index;
     int len = wire_name_length(name_n);
     u_char qc_name_n[NS_MAXCDNAME];
+    u_int32_t       key;
 
     memcpy(qc_name_n, name_n, len);
     l_index = 0;
@@ -718,6 +1321,10 @@ nsec3_sha_hash_compute(u_char * name_n, u_char * salt,
         return NULL;
     *hashlen = SHA_DIGEST_LENGTH;
 
+    key = nsec3_memo_key(qc_name_n, len, salt, saltlen, iter);
+    if (nsec3_memo_lookup(key, qc_name_n, len, salt, saltlen, iter, *hash))
+        return *hash;
+
     memset(*hash, 0, SHA_DIGEST_LENGTH);
 
     /*
@@ -737,6 +1344,8 @@ nsec3_sha_hash_compute(u_char * name_n, u_char * salt,
         SHA1_Update(&c, salt, saltlen);
         SHA1_Final(*hash, &c);
     }
+
+    nsec3_memo_store(key, qc_name_n, len, salt, saltlen, iter, *hash);
     return *hash;
 }
 #endif
@@ -9,18 +9,31 @@
 #ifndef VAL_CRYPTO_H
 #define VAL_CRYPTO_H
 
+/*
+ * The data covered by an RRSIG (RFC 4034, section 3.1.8.1), described
+ * in place rather than copied into one buffer: the RRSIG RDATA up to
+ * and including the lower-cased signer name, then, for every RR in the
+ * set, the envelope (owner name, type, class and original TTL), the
+ * RDATA length and the RDATA of the RR itself. 
+ */
+struct val_sigfield {
+    u_char          sf_prefix[SIGNBY + NS_MAXCDNAME];
+    size_t          sf_prefix_len;
+    u_char          sf_envelope[NS_MAXCDNAME + 8];
+    size_t          sf_envelope_len;
+    struct rrset_rr *sf_rrs;
+};
+
 
 void            dsasha1_sigverify(val_context_t * ctx,
-                                  const u_char *data,
-                                  size_t data_len,
+                                  const struct val_sigfield *data,
                                   const val_dnskey_rdata_t * dnskey,
                                   const val_rrsig_rdata_t * rrsig,
                                   val_astatus_t * key_status,
                                   val_astatus_t * sig_status);
 
 void            rsamd5_sigverify(val_context_t * ctx,
-                                 const u_char *data,
-                                 size_t data_len,
+                                 const struct val_sigfield *data,
                                  const val_dnskey_rdata_t * dnskey,
                                  const val_rrsig_rdata_t * rrsig,
                                  val_astatus_t * key_status,
@@ -29,18 +42,20 @@ void            rsamd5_sigverify(val_context_t * ctx,
 u_int16_t       rsamd5_keytag(const u_char *pubkey, size_t pubkey_len);
 
 void            rsasha_sigverify(val_context_t * ctx,
-                                  const u_char *data,
-                                  size_t data_len,
+                                  const struct val_sigfield *data,
                                   const val_dnskey_rdata_t * dnskey,
+                                  const u_char *key_owner_n,
+                                  u_int32_t key_ttl_x,
                                   const val_rrsig_rdata_t * rrsig,
                                   val_astatus_t * key_status,
                                   val_astatus_t * sig_status);
 
 #ifdef HAVE_SHA_2
 void            ecdsa_sigverify(val_context_t * ctx,
-                                const u_char *data,
-                                size_t data_len,
+                                const struct val_sigfield *data,
                                 const val_dnskey_rdata_t * dnskey,
+                                const u_char *key_owner_n,
+                                u_int32_t key_ttl_x,
                                 const val_rrsig_rdata_t * rrsig,
                                 val_astatus_t * key_status,
                                 val_astatus_t * sig_status);
@@ -71,6 +86,7 @@ u_char       *nsec3_sha_hash_compute(u_char * qc_name_n,
                                        u_char * salt, size_t saltlen,
                                        size_t iter, u_char ** hash,
                                        size_t * hashlen);
+void            free_nsec3_memo(void);
 #endif
 
 char           *get_base64_string(u_char *message, size_t message_len,
@@ -79,4 +95,19 @@ char           *get_base64_string(u_char *message, size_t message_len,
 int             decode_base64_key(char *keyptr, u_char * public_key,
                                   size_t keysize);
 
+void            free_key_cache(void);
+
+int             sig_memo_digest(const struct val_sigfield *data,
+                                const val_dnskey_rdata_t * dnskey,
+                                const val_rrsig_rdata_t * rrsig,
+                                u_char *digest);
+int             sig_memo_lookup(const u_char *digest,
+                                const val_dnskey_rdata_t * dnskey,
+                                val_astatus_t * sig_status);
+void            sig_memo_store(const u_char *digest,
+                               const val_dnskey_rdata_t * dnskey,
+                               const val_rrsig_rdata_t * rrsig,
+                               val_astatus_t sig_status);
+void            free_sig_memo(void);
+
 #endif
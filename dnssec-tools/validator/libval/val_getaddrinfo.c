@@ -464,6 +464,9 @@ get_addrinfo_from_etc_hosts(val_context_t * ctx,
             val_log(ctx, LOG_WARNING, 
                     "get_addrinfo_from_etc_hosts(): Unkown address type");
             val_freeaddrinfo(ainfo);
+            ainfo = NULL;
+            hs = hs->next;
+            FREE_HOSTS(h_prev);
             continue;
         }
 
@@ -702,12 +705,134 @@ get_addrinfo_from_result(const val_context_t * ctx,
     return retval;
 }                               /* get_addrinfo_from_result() */
 
+#ifndef VAL_NO_ASYNC
+/*
+ * Answer collected for one of the A and AAAA requests that
+ * get_addrinfo_from_dns() has in flight at the same time.
+ */
+struct gai_dns_answer {
+    int                      done;
+    int                      retval;
+    struct val_answer_chain *answers;
+};
+
+static int
+_gai_dns_callback(val_async_status *as, int event,
+                  val_context_t *ctx, void *cb_data, val_cb_params_t *cbp)
+{
+    struct gai_dns_answer *ans = (struct gai_dns_answer *)cb_data;
+
+    ans->done = 1;
+    if (VAL_AS_EVENT_COMPLETED != event) {
+        ans->retval = VAL_INTERNAL_ERROR;
+        return VAL_NO_ERROR;
+    }
+
+    ans->retval = val_get_answer_from_result(ctx, cbp->name, cbp->class_h,
+                                             cbp->type_h, &cbp->results,
+                                             &ans->answers, 0);
+    return VAL_NO_ERROR;
+}
+
+/*
+ * Function: get_rrsets_together
+ *
+ * Purpose: Look up the A and AAAA records for nodename through the
+ *          asynchronous interface, so that both are resolved and
+ *          validated at the same time, and wait for both to complete.
+ *          Other asynchronous requests of this thread in ctx are
+ *          processed while waiting.
+ *
+ * Parameters:
+ *              ctx -- The validation context.
+ *         nodename -- The name of the node.
+ *         answers4 -- Set to the A answers.
+ *              rc4 -- Set to the val_get_rrset()-style return code for the
+ *                     A records.
+ *         answers6 -- Set to the AAAA answers.
+ *              rc6 -- Set to the return code for the AAAA records.
+ *
+ * Returns: VAL_NO_ERROR if both requests ran to completion; otherwise
+ *          nothing is returned in answers4/answers6, and the caller should
+ *          look up the records one after the other.
+ */
+static int
+get_rrsets_together(val_context_t *ctx, const char *nodename,
+                    struct val_answer_chain **answers4, int *rc4,
+                    struct val_answer_chain **answers6, int *rc6)
+{
+    struct gai_dns_answer ans4, ans6;
+    val_async_status *as4 = NULL, *as6 = NULL;
+    struct timeval   tv;
+    int              retval;
+#ifndef VAL_NO_THREADS
+    int              other_thread;
+
+    /*
+     * another thread could run our callbacks while we wait, by which
+     * time ans4 and ans6 may be gone; a resolver thread also owns the
+     * requests, so they could not be waited for here anyway
+     */
+    CTX_LOCK_ACACHE(ctx);
+    other_thread = ((ctx->ctx_flags & CTX_PROCESS_ALL_THREADS) ||
+                    (NULL != ctx->as_thread));
+    CTX_UNLOCK_ACACHE(ctx);
+    if (other_thread)
+        return VAL_NOT_IMPLEMENTED;
+#endif
+
+    memset(&ans4, 0, sizeof(ans4));
+    memset(&ans6, 0, sizeof(ans6));
+
+    retval = val_async_submit(ctx, nodename, ns_c_in, ns_t_a, 0,
+                              &_gai_dns_callback, &ans4, &as4);
+    if (VAL_NO_ERROR != retval)
+        return retval;
+
+    retval = val_async_submit(ctx, nodename, ns_c_in, ns_t_aaaa, 0,
+                              &_gai_dns_callback, &ans6, &as6);
+    if (VAL_NO_ERROR != retval) {
+        val_async_cancel(ctx, as4, VAL_AS_CANCEL_NO_CALLBACKS);
+        return retval;
+    }
+
+    while (!ans4.done || !ans6.done) {
+        tv.tv_sec = 1;
+        tv.tv_usec = 0;
+        if (val_async_check_wait(ctx, NULL, NULL, &tv, 0) > 0)
+            continue;
+
+        /*
+         * error, or our requests are no longer pending without having
+         * completed
+         */
+        if (!ans4.done || !ans6.done) {
+            if (!ans4.done)
+                val_async_cancel(ctx, as4, VAL_AS_CANCEL_NO_CALLBACKS);
+            if (!ans6.done)
+                val_async_cancel(ctx, as6, VAL_AS_CANCEL_NO_CALLBACKS);
+            val_free_answer_chain(ans4.answers);
+            val_free_answer_chain(ans6.answers);
+            return VAL_INTERNAL_ERROR;
+        }
+    }
+
+    *answers4 = ans4.answers;
+    *rc4 = ans4.retval;
+    *answers6 = ans6.answers;
+    *rc6 = ans6.retval;
+    return VAL_NO_ERROR;
+}
+#endif /* VAL_NO_ASYNC */
+
 /*
  * Function: get_addrinfo_from_dns
  *
  * Purpose: Resolve the nodename from DNS and fill in the addrinfo
  *          return value.  The scope of this function is limited to this
- *          file, and is called from val_getaddrinfo().
+ *          file, and is called from val_getaddrinfo().  When both IPv4
+ *          and IPv6 addresses are wanted, the A and AAAA records are
+ *          looked up at the same time.
  *
  * Parameters:
  *              ctx -- The validation context.
@@ -731,11 +856,13 @@ get_addrinfo_from_dns(val_context_t * ctx,
                       struct addrinfo **res,
                       val_status_t *val_status)
 {
-    struct val_answer_chain *results = NULL;
+    struct val_answer_chain *answers4 = NULL, *answers6 = NULL;
     struct addrinfo *ainfo = NULL;
     const struct addrinfo *hints;
     struct addrinfo default_hints;
     int    ret = EAI_FAIL, have4 = 1, have6 = 1;
+    int    want4 = 0, want6 = 0, rc4 = VAL_NO_ERROR, rc6 = VAL_NO_ERROR;
+    int    together = 0;
 
     val_log(ctx, LOG_DEBUG, "get_addrinfo_from_dns() called");
 
@@ -779,24 +906,8 @@ get_addrinfo_from_dns(val_context_t * ctx,
         && (have4 != 0)
 #endif
         ) {
-        val_log(ctx, LOG_DEBUG,
-                "get_addrinfo_from_dns(): checking for A records");
-
-        if ((VAL_NO_ERROR == 
-                    val_get_rrset(ctx, nodename, ns_c_in, ns_t_a, 0, &results)) 
-                && results) {
-            
-            ret = get_addrinfo_from_result(ctx, results, servname,
-                                         hints, &ainfo, val_status);
-
-            val_log(ctx, LOG_DEBUG, "get_addrinfo_from_dns(): "
-                    "get_addrinfo_from_result() returned=%d with val_status=%d",
-                    ret, *val_status);
-
-            val_free_answer_chain(results);
-            results = NULL;
-        } 
-    } 
+        want4 = 1;
+    }
 
 #ifdef VAL_IPV6
     /*
@@ -807,25 +918,60 @@ get_addrinfo_from_dns(val_context_t * ctx,
         && (have6 != 0)
 #endif
         ) {
+        want6 = 1;
+    }
+#endif
 
+#ifndef VAL_NO_ASYNC
+    if (want4 && want6) {
         val_log(ctx, LOG_DEBUG,
-                "get_addrinfo_from_dns(): checking for AAAA records");
-        
-        if ((VAL_NO_ERROR == 
-             val_get_rrset(ctx, nodename, ns_c_in, ns_t_aaaa, 0, &results)) 
-            && results) {
-            ret = get_addrinfo_from_result(ctx, results, servname,
+                "get_addrinfo_from_dns(): checking for A and AAAA records");
+        together = (VAL_NO_ERROR ==
+                    get_rrsets_together(ctx, nodename, &answers4, &rc4,
+                                        &answers6, &rc6));
+    }
+#endif
+
+    if (want4) {
+        if (!together) {
+            val_log(ctx, LOG_DEBUG,
+                    "get_addrinfo_from_dns(): checking for A records");
+            rc4 = val_get_rrset(ctx, nodename, ns_c_in, ns_t_a, 0,
+                                &answers4);
+        }
+
+        if ((VAL_NO_ERROR == rc4) && answers4) {
+            
+            ret = get_addrinfo_from_result(ctx, answers4, servname,
                                          hints, &ainfo, val_status);
 
             val_log(ctx, LOG_DEBUG, "get_addrinfo_from_dns(): "
                     "get_addrinfo_from_result() returned=%d with val_status=%d",
                     ret, *val_status);
+        } 
+        val_free_answer_chain(answers4);
+        answers4 = NULL;
+    } 
+
+    if (want6) {
+        if (!together) {
+            val_log(ctx, LOG_DEBUG,
+                    "get_addrinfo_from_dns(): checking for AAAA records");
+            rc6 = val_get_rrset(ctx, nodename, ns_c_in, ns_t_aaaa, 0,
+                                &answers6);
+        }
+        
+        if ((VAL_NO_ERROR == rc6) && answers6) {
+            ret = get_addrinfo_from_result(ctx, answers6, servname,
+                                         hints, &ainfo, val_status);
 
-            val_free_answer_chain(results);
-            results = NULL;
+            val_log(ctx, LOG_DEBUG, "get_addrinfo_from_dns(): "
+                    "get_addrinfo_from_result() returned=%d with val_status=%d",
+                    ret, *val_status);
         } 
+        val_free_answer_chain(answers6);
+        answers6 = NULL;
     } 
-#endif
 
     *res = ainfo;
     
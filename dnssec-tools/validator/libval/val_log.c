@@ -17,6 +17,13 @@
 static int      debug_level = LOG_INFO;
 static val_log_t *default_log_head = NULL;
 
+/*
+ * The highest level of any log target, default or per-context, that was
+ * ever added. Messages above this level cannot be logged anywhere, so
+ * callers can use VAL_LOG_WOULD_LOG() to skip formatting their arguments.
+ */
+int             val_log_max_level = 0;
+
 int
 val_log_debug_level(void)
 {
@@ -721,6 +728,9 @@ val_log_insert(val_log_t **log_head, val_log_t * logp)
     if (log_head == NULL)
         log_head = &default_log_head;
 
+    if (logp->level > val_log_max_level)
+        val_log_max_level = logp->level;
+
     for (tmp_log = *log_head; tmp_log && tmp_log->next;
          tmp_log = tmp_log->next);
 
@@ -230,6 +230,300 @@ int free_policy_entry(policy_entry_t *pol_entry, int index)
 
 }
 
+/*
+ ***************************************************************
+ * Reverse-label index over the zone-scoped policies, so that
+ * the longest matching zone for a name is found with one walk
+ * down its labels instead of a namecmp() per candidate zone.
+ * The index holds copies of the values that the lookups need,
+ * so expired entries that RETRIEVE_POLICY frees from the policy
+ * list never leave it pointing at freed memory.
+ ***************************************************************
+ */
+
+#define POL_IDX_LOWER(c) (((c) >= 'A' && (c) <= 'Z') ? ((c) - 'A' + 'a') : (c))
+
+/*
+ * Compare a label against the (lower case) label of an index
+ * node: shorter labels sort first, then byte by byte
+ */
+static int
+pol_idx_label_cmp(const u_char *label, const u_char *node_label)
+{
+    int             i;
+    int             c;
+
+    if (label[0] != node_label[0])
+        return (label[0] < node_label[0]) ? -1 : 1;
+    for (i = 1; i <= label[0]; i++) {
+        c = POL_IDX_LOWER(label[i]);
+        if (c != node_label[i])
+            return (c < node_label[i]) ? -1 : 1;
+    }
+    return 0;
+}
+
+static struct policy_index *
+pol_idx_new_node(const u_char *label)
+{
+    struct policy_index *node;
+    int             i;
+
+    node = (struct policy_index *)
+        MALLOC(sizeof(struct policy_index) + label[0] + 1);
+    if (node == NULL)
+        return NULL;
+    node->label = (u_char *) (node + 1);
+    node->label[0] = label[0];
+    for (i = 1; i <= label[0]; i++)
+        node->label[i] = POL_IDX_LOWER(label[i]);
+    node->children = NULL;
+    node->nchildren = 0;
+    node->vals = NULL;
+    return node;
+}
+
+/*
+ * Find the child of node for label; if there is none, *pos is
+ * where it would go
+ */
+static struct policy_index *
+pol_idx_find_child(struct policy_index *node, const u_char *label,
+                   size_t *pos)
+{
+    size_t          lo, hi, mid;
+    int             cmp;
+
+    lo = 0;
+    hi = node->nchildren;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        cmp = pol_idx_label_cmp(label, node->children[mid]->label);
+        if (cmp == 0)
+            return node->children[mid];
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    if (pos)
+        *pos = lo;
+    return NULL;
+}
+
+/*
+ * Record the offsets of the labels of name_n; returns the
+ * number of labels, not counting the root
+ */
+static int
+pol_idx_label_offsets(const u_char *name_n, size_t *offsets)
+{
+    int             count = 0;
+    size_t          off = 0;
+
+    while (name_n[off] != 0 && count < NS_MAXCDNAME / 2) {
+        offsets[count++] = off;
+        off += name_n[off] + 1;
+    }
+    return count;
+}
+
+/*
+ * What a policy entry says, for the kinds of policy that are
+ * indexed; returns 0 if the entry carries nothing to look up
+ */
+static int
+pol_idx_value(int index, policy_entry_t *pe, int *value)
+{
+    *value = 0;
+    switch (index) {
+    case P_TRUST_ANCHOR:
+        return 1;
+    case P_CLOCK_SKEW:
+        if (pe->pol == NULL)
+            return 0;
+        *value = ((struct clock_skew_policy *) (pe->pol))->clock_skew;
+        return 1;
+    case P_ZONE_SECURITY_EXPECTATION:
+        if (pe->pol == NULL)
+            return 0;
+        *value = ((struct zone_se_policy *) (pe->pol))->trusted;
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static int
+pol_idx_insert(struct policy_index *root, policy_entry_t *pe, int value)
+{
+    size_t          offsets[NS_MAXCDNAME / 2];
+    struct policy_index *node, *child, **children;
+    struct policy_index_val *val, **vpp;
+    size_t          pos;
+    int             i;
+
+    node = root;
+    for (i = pol_idx_label_offsets(pe->zone_n, offsets) - 1; i >= 0; i--) {
+        u_char *label = &pe->zone_n[offsets[i]];
+        child = pol_idx_find_child(node, label, &pos);
+        if (child == NULL) {
+            child = pol_idx_new_node(label);
+            if (child == NULL)
+                return VAL_OUT_OF_MEMORY;
+            children = (struct policy_index **)
+                MALLOC((node->nchildren + 1) * sizeof(struct policy_index *));
+            if (children == NULL) {
+                FREE(child);
+                return VAL_OUT_OF_MEMORY;
+            }
+            if (pos > 0)
+                memcpy(children, node->children,
+                       pos * sizeof(struct policy_index *));
+            children[pos] = child;
+            if (pos < node->nchildren)
+                memcpy(&children[pos + 1], &node->children[pos],
+                       (node->nchildren - pos) *
+                       sizeof(struct policy_index *));
+            if (node->children)
+                FREE(node->children);
+            node->children = children;
+            node->nchildren++;
+        }
+        node = child;
+    }
+
+    val = (struct policy_index_val *)
+        MALLOC(sizeof(struct policy_index_val));
+    if (val == NULL)
+        return VAL_OUT_OF_MEMORY;
+    val->exp_ttl = pe->exp_ttl;
+    val->value = value;
+    val->next = NULL;
+    /* keep the order of the policy list */
+    for (vpp = &node->vals; *vpp; vpp = &(*vpp)->next);
+    *vpp = val;
+
+    return VAL_NO_ERROR;
+}
+
+void
+free_policy_index(struct policy_index *idx)
+{
+    struct policy_index_val *val;
+    size_t          i;
+
+    if (idx == NULL)
+        return;
+
+    for (i = 0; i < idx->nchildren; i++)
+        free_policy_index(idx->children[i]);
+    if (idx->children)
+        FREE(idx->children);
+    while (idx->vals) {
+        val = idx->vals->next;
+        FREE(idx->vals);
+        idx->vals = val;
+    }
+    FREE(idx);
+}
+
+/*
+ * Rebuild the index for e_pol[index] from the policy list,
+ * leaving out skip (an entry about to be unlinked), and swap it
+ * in. The caller holds the context exclusively, so lookups see
+ * either the old index or the new one. The old index is kept if
+ * a new one cannot be built.
+ */
+int
+update_policy_index(val_context_t * ctx, int index, policy_entry_t *skip)
+{
+    struct policy_index *idx;
+    policy_entry_t *pe;
+    int             value;
+    int             retval;
+
+    if (ctx == NULL || ctx->e_pol_idx == NULL || index >= MAX_POL_TOKEN)
+        return VAL_BAD_ARGUMENT;
+
+    if (!POLICY_IS_INDEXED(index))
+        return VAL_NO_ERROR;
+
+    idx = NULL;
+    for (pe = ctx->e_pol[index]; pe; pe = pe->next) {
+        if (pe == skip || !pol_idx_value(index, pe, &value))
+            continue;
+        if (idx == NULL) {
+            idx = pol_idx_new_node((const u_char *) "");
+            if (idx == NULL)
+                return VAL_OUT_OF_MEMORY;
+        }
+        if (VAL_NO_ERROR != (retval = pol_idx_insert(idx, pe, value))) {
+            free_policy_index(idx);
+            return retval;
+        }
+    }
+
+    free_policy_index(ctx->e_pol_idx[index]);
+    ctx->e_pol_idx[index] = idx;
+
+    return VAL_NO_ERROR;
+}
+
+/*
+ * Return what the policy for the longest zone that name_n is in
+ * says, skipping entries that have expired; match_ptr, if given,
+ * is set to that zone's name within name_n
+ */
+struct policy_index_val *
+lookup_policy_index(val_context_t * ctx, int index, u_char * name_n,
+                    u_char ** match_ptr)
+{
+    size_t          offsets[NS_MAXCDNAME / 2];
+    struct policy_index *node;
+    struct policy_index_val *val, *best;
+    struct timeval  tv;
+    int             have_time = 0;
+    int             i, count;
+
+    if (match_ptr)
+        *match_ptr = NULL;
+
+    if (ctx == NULL || ctx->e_pol_idx == NULL || name_n == NULL ||
+        index >= MAX_POL_TOKEN)
+        return NULL;
+
+    node = ctx->e_pol_idx[index];
+    if (node == NULL)
+        return NULL;
+
+    best = NULL;
+    count = pol_idx_label_offsets(name_n, offsets);
+    for (i = count; node; ) {
+        for (val = node->vals; val; val = val->next) {
+            if (val->exp_ttl > 0) {
+                if (!have_time) {
+                    gettimeofday(&tv, NULL);
+                    have_time = 1;
+                }
+                if (val->exp_ttl <= tv.tv_sec)
+                    continue;
+            }
+            best = val;
+            if (match_ptr)
+                *match_ptr = (i == count) ?
+                    &name_n[wire_name_length(name_n) - 1] :
+                    &name_n[offsets[i]];
+            break;
+        }
+        if (--i < 0)
+            break;
+        node = pol_idx_find_child(node, &name_n[offsets[i]], NULL);
+    }
+
+    return best;
+}
+
 static void
 set_global_opt_defaults(val_global_opt_t *gopt)
 {
@@ -247,6 +541,8 @@ set_global_opt_defaults(val_global_opt_t *gopt)
     gopt->proto = VAL_POL_GOPT_PROTO_ANY;
     gopt->timeout = RES_TIMEOUT;
     gopt->retry = RES_RETRY;
+    gopt->cache_max_size = VAL_POL_GOPT_UNSET;
+    gopt->verify_threads = 0;
 }
 
 int 
@@ -285,6 +581,10 @@ update_dynamic_gopt(val_global_opt_t **g_new, val_global_opt_t *g)
         (*g_new)->timeout = g->timeout;        
     if (g->retry != VAL_POL_GOPT_UNSET)
         (*g_new)->retry = g->retry;        
+    if (g->cache_max_size != VAL_POL_GOPT_UNSET)
+        (*g_new)->cache_max_size = g->cache_max_size;        
+    if (g->verify_threads != VAL_POL_GOPT_UNSET)
+        (*g_new)->verify_threads = g->verify_threads;        
 
     return VAL_NO_ERROR;
 }
@@ -1165,6 +1465,102 @@ parse_retry(char **buf_ptr, char *end_ptr, int *line_number,
     return VAL_NO_ERROR;
 }
 
+static int
+parse_cache_max_size(char **buf_ptr, char *end_ptr, int *line_number,
+                     int *endst, val_global_opt_t *g_opt)
+{
+    char            token[TOKEN_MAX];
+    char           *unit;
+    long            size;
+    long            mult;
+    long            max;
+    int retval;
+
+    if ((buf_ptr == NULL) || (*buf_ptr == NULL) || (end_ptr == NULL) || 
+        (g_opt == NULL) || (endst == NULL) || (line_number == NULL))
+        return VAL_BAD_ARGUMENT;
+
+    /* read the next token */
+    if (VAL_NO_ERROR != (retval = 
+        val_get_token(buf_ptr, end_ptr, line_number, 
+                      token, sizeof(token), endst,
+                      CONF_COMMENT, CONF_END_STMT, 0))) {
+        return retval;
+    }
+    if ((endst && (strlen(token) == 0)) ||
+        (*buf_ptr >= end_ptr)) { 
+        return VAL_CONF_PARSE_ERROR;
+    }
+
+    /* the size may have a K, M or G suffix */
+    errno = 0;
+    size = strtol(token, &unit, 10);
+    if (unit == token || errno == ERANGE || size < 0)
+        return VAL_CONF_PARSE_ERROR;
+    switch (*unit) {
+    case '\0':
+        mult = 1;
+        break;
+    case 'k':
+    case 'K':
+        mult = 1024L;
+        break;
+    case 'm':
+    case 'M':
+        mult = 1024L * 1024;
+        break;
+    case 'g':
+    case 'G':
+        mult = 1024L * 1024 * 1024;
+        break;
+    default:
+        return VAL_CONF_PARSE_ERROR;
+    }
+    if (unit[0] != '\0' && unit[1] != '\0')
+        return VAL_CONF_PARSE_ERROR;
+
+    /* the result must fit both in a long and in a size_t */
+    max = LONG_MAX;
+    if ((unsigned long) max > (size_t) -1)
+        max = (long) ((size_t) -1);
+    if (size > max / mult)
+        return VAL_CONF_PARSE_ERROR;
+    size *= mult;
+    g_opt->cache_max_size = size;
+
+    return VAL_NO_ERROR;
+}
+
+static int
+parse_verify_threads(char **buf_ptr, char *end_ptr, int *line_number,
+                     int *endst, val_global_opt_t *g_opt)
+{
+    char            token[TOKEN_MAX];
+    int retval;
+
+    if ((buf_ptr == NULL) || (*buf_ptr == NULL) || (end_ptr == NULL) || 
+        (g_opt == NULL) || (endst == NULL) || (line_number == NULL))
+        return VAL_BAD_ARGUMENT;
+
+    /* read the next token */
+    if (VAL_NO_ERROR != (retval = 
+        val_get_token(buf_ptr, end_ptr, line_number, 
+                      token, sizeof(token), endst,
+                      CONF_COMMENT, CONF_END_STMT, 0))) {
+        return retval;
+    }
+    if ((endst && (strlen(token) == 0)) ||
+        (*buf_ptr >= end_ptr)) { 
+        return VAL_CONF_PARSE_ERROR;
+    }
+
+    g_opt->verify_threads = strtol(token, (char **)NULL, 10);
+    if (g_opt->verify_threads < 0)
+        return VAL_CONF_PARSE_ERROR;
+
+    return VAL_NO_ERROR;
+}
+
 static int
 get_global_options(char **buf_ptr, char *end_ptr, 
                    int *line_number, val_global_opt_t **g_opt) 
@@ -1273,6 +1669,20 @@ get_global_options(char **buf_ptr, char *end_ptr,
                 goto err;
             }
 
+        } else if (!strcmp(token, GOPT_CACHE_MAX_SIZE_STR)) {
+            if (VAL_NO_ERROR != 
+                    (retval = parse_cache_max_size(buf_ptr, end_ptr,
+                                                   line_number, &endst, *g_opt))) {
+                goto err;
+            }
+
+        } else if (!strcmp(token, GOPT_VERIFY_THREADS_STR)) {
+            if (VAL_NO_ERROR != 
+                    (retval = parse_verify_threads(buf_ptr, end_ptr,
+                                                   line_number, &endst, *g_opt))) {
+                goto err;
+            }
+
         } else {
             retval = VAL_CONF_PARSE_ERROR;
             goto err;
@@ -1607,6 +2017,10 @@ destroy_valpol(val_context_t * ctx)
             free_policy_entry(ctx->e_pol[i], i);
         }
         ctx->e_pol[i] = NULL;
+        if (ctx->e_pol_idx) {
+            free_policy_index(ctx->e_pol_idx[i]);
+            ctx->e_pol_idx[i] = NULL;
+        }
     }
 
     if (ctx->g_opt) {
@@ -2008,9 +2422,9 @@ read_val_config_file(val_context_t * ctx, const char *scope)
     struct policy_overrides *t;
     struct dnsval_list *dnsval_c;
     int             retval;
+    int             i;
     const char *label;
     char *newctxlab;
-    struct val_query_chain *q;
     char *logtarget = NULL;
     val_global_opt_t *g_opt = NULL;
     struct dnsval_list *dlist = NULL;
@@ -2124,6 +2538,12 @@ skipfileread:
         }
     }
 
+    /* Index the zone-scoped policies */
+    for (i = 0; i < MAX_POL_TOKEN; i++) {
+        if (VAL_NO_ERROR != (retval = update_policy_index(ctx, i, NULL)))
+            goto err;
+    }
+
     /* if there are no global options defined set defaults here */
     if (g_opt == NULL) {
         g_opt = (val_global_opt_t *) MALLOC (sizeof (val_global_opt_t));
@@ -2169,14 +2589,19 @@ skipfileread:
             goto err;
     }
 
+    /* 
+     * The cache is shared by all contexts; the most recently 
+     * configured limit applies. Leave the limit alone if this
+     * configuration doesn't set one, since it may have been set
+     * through val_cache_set_budget() or by another context.
+     */
+    if (ctx->g_opt->cache_max_size >= 0)
+        val_cache_set_budget((size_t) ctx->g_opt->cache_max_size);
+
     /* 
      * Free the query cache 
      */
-    while (NULL != (q = ctx->q_list)) {
-        ctx->q_list = q->qc_next;
-        free_query_chain_structure(q);
-        q = NULL;
-    }
+    free_query_chain(ctx);
 
     ctx->dnsval_l = dlist;
 
@@ -2898,24 +3323,152 @@ read_root_hints_file(val_context_t * ctx)
 }
 
 /*
- * Read ETC_HOSTS and return matching records
+ * ETC_HOSTS is parsed once into a table of its entries, indexed by
+ * (lower-case) host name and shared by all contexts.  The table is
+ * rebuilt when the modification time or the size of the file changes.
  */
-struct hosts   *
-parse_etc_hosts(const char *name)
+#define HOSTS_INDEX_MIN_BUCKETS 64
+
+struct hosts_name {
+    char               *hn_name;        /* lower case */
+    u_int32_t           hn_hash;
+    struct hosts       *hn_entry;
+    struct hosts_name  *hn_next;
+};
+
+static struct hosts       *hosts_entries = NULL;  /* in file order */
+static struct hosts_name **hosts_index = NULL;
+static size_t              hosts_buckets = 0;
+static int                 hosts_loaded = 0;
+static time_t              hosts_mtime = 0;
+static off_t               hosts_size = 0;
+
+#ifndef VAL_NO_THREADS
+static pthread_mutex_t hosts_lock = PTHREAD_MUTEX_INITIALIZER;
+#define VAL_HOSTS_LOCK()    pthread_mutex_lock(&hosts_lock)
+#define VAL_HOSTS_UNLOCK()  pthread_mutex_unlock(&hosts_lock)
+#else
+#define VAL_HOSTS_LOCK()
+#define VAL_HOSTS_UNLOCK()
+#endif
+
+/*
+ * Length of a host name, not counting a trailing dot
+ */
+static size_t
+hosts_name_len(const char *name)
+{
+    size_t len = strlen(name);
+
+    if (len > 1 && name[len - 1] == '.')
+        len--;
+    return len;
+}
+
+static u_int32_t
+hosts_name_hash(const char *name, size_t len)
+{
+    u_int32_t h = 2166136261U;
+    size_t    i;
+
+    for (i = 0; i < len; i++)
+        h = (h ^ (u_char) tolower((u_char) name[i])) * 16777619U;
+    return h;
+}
+
+/*
+ * Caller holds hosts_lock
+ */
+static void
+free_hosts_table(void)
+{
+    struct hosts_name *hn;
+    struct hosts   *hentry;
+    size_t          i;
+
+    if (hosts_index != NULL) {
+        for (i = 0; i < hosts_buckets; i++) {
+            while ((hn = hosts_index[i]) != NULL) {
+                hosts_index[i] = hn->hn_next;
+                FREE(hn->hn_name);
+                FREE(hn);
+            }
+        }
+        FREE(hosts_index);
+        hosts_index = NULL;
+    }
+    hosts_buckets = 0;
+
+    while ((hentry = hosts_entries) != NULL) {
+        hosts_entries = hentry->next;
+        FREE_HOSTS(hentry);
+    }
+    hosts_loaded = 0;
+}
+
+/*
+ * Add name to the index, unless hentry is already listed under it
+ */
+static int
+hosts_index_add(const char *name, struct hosts *hentry)
+{
+    struct hosts_name *hn, *last = NULL;
+    size_t          len = hosts_name_len(name);
+    u_int32_t       h = hosts_name_hash(name, len);
+    size_t          b = h & (hosts_buckets - 1);
+    size_t          i;
+
+    for (hn = hosts_index[b]; hn; last = hn, hn = hn->hn_next) {
+        if (hn->hn_entry == hentry && hn->hn_hash == h &&
+            strlen(hn->hn_name) == len &&
+            strncasecmp(hn->hn_name, name, len) == 0)
+            return VAL_NO_ERROR;
+    }
+
+    hn = (struct hosts_name *) MALLOC(sizeof(struct hosts_name));
+    if (hn == NULL)
+        return VAL_OUT_OF_MEMORY;
+    hn->hn_name = (char *) MALLOC(len + 1);
+    if (hn->hn_name == NULL) {
+        FREE(hn);
+        return VAL_OUT_OF_MEMORY;
+    }
+    for (i = 0; i < len; i++)
+        hn->hn_name[i] = tolower((u_char) name[i]);
+    hn->hn_name[len] = '\0';
+    hn->hn_hash = h;
+    hn->hn_entry = hentry;
+    hn->hn_next = NULL;
+
+    /*
+     * keep entries for the same name in file order 
+     */
+    if (last)
+        last->hn_next = hn;
+    else
+        hosts_index[b] = hn;
+    return VAL_NO_ERROR;
+}
+
+/*
+ * Read ETC_HOSTS into hosts_entries and index its names.
+ * Caller holds hosts_lock.
+ */
+static int
+load_etc_hosts(void)
 {
     FILE           *fp;
     char            line[MAX_LINE_SIZE + 1];
     char            white[] = " \t\n";
     char            fileentry[MAXLINE];
-    struct hosts   *retval = NULL;
-    struct hosts   *retval_tail = NULL;
-
-    if (name == NULL)
-        return NULL;
+    struct hosts   *tail = NULL;
+    struct hosts   *hentry;
+    size_t          names = 0;
+    int             i;
 
     fp = fopen(ETC_HOSTS, "r");
     if (fp == NULL) {
-        return NULL;
+        return VAL_CONF_NOT_FOUND;
     }
 
     while (fgets(line, MAX_LINE_SIZE, fp) != NULL) {
@@ -2925,11 +3478,8 @@ parse_etc_hosts(const char *name)
         char           *cp = NULL;
         char            addr_buf[INET6_ADDRSTRLEN];
         char           *domain_name = NULL;
-        int             matchfound = 0;
         char           *alias_list[MAX_ALIAS_COUNT];
         int             alias_index = 0;
-        int             i;
-        struct hosts   *hentry;
 
         if (line[0] == '#')
             continue;
@@ -2976,77 +3526,175 @@ parse_etc_hosts(const char *name)
 
         domain_name = cp;
 
-        if (strncasecmp(name, cp, strlen(cp)) == 0) {
-            matchfound = 1;
-        }
-
         /*
          * read the aliases 
          */
-        memset(alias_list, 0, MAX_ALIAS_COUNT);
         alias_index = 0;
 #ifdef HAVE_STRTOK_R
         while ((cp = (char *) strtok_r(NULL, white, &buf)) != NULL) {
 #else
         while ((cp = (char *) strtok(NULL, white)) != NULL) {
 #endif
-            alias_list[alias_index++] = cp;
-            if ((!matchfound) && (strncasecmp(name, cp, strlen(cp)) == 0)) {
-                matchfound = 1;
-            }
+            if (alias_index < MAX_ALIAS_COUNT)
+                alias_list[alias_index++] = cp;
         }
 
-        if (!matchfound)
-            continue;
-
-        /*
-         * match input name with the full domain name and aliases 
-         */
         hentry = (struct hosts *) MALLOC(sizeof(struct hosts));
         if (hentry == NULL)
-            break;              /* return results so far */
+            goto err;
 
         memset(hentry, 0, sizeof(struct hosts));
         hentry->address = (char *) strdup(addr_buf);
         hentry->canonical_hostname = (char *) strdup(domain_name);
         hentry->aliases =
             (char **) MALLOC((alias_index + 1) * sizeof(char *));
+        if (hentry->aliases != NULL)
+            memset(hentry->aliases, 0, (alias_index + 1) * sizeof(char *));
+        if (tail)
+            tail->next = hentry;
+        else
+            hosts_entries = hentry;
+        tail = hentry;
         if ((hentry->aliases == NULL) || (hentry->address == NULL)
-            || (hentry->canonical_hostname == NULL)) {
-            if (hentry->address != NULL)
-                free(hentry->address);
-            if (hentry->canonical_hostname != NULL)
-                free(hentry->canonical_hostname);
-            if (hentry->aliases != NULL)
-                free(hentry->aliases);
-            free(hentry);
-            break;              /* return results so far */
-        }
+            || (hentry->canonical_hostname == NULL))
+            goto err;
 
         for (i = 0; i < alias_index; i++) {
             hentry->aliases[i] = (char *) strdup(alias_list[i]);
             if (hentry->aliases[i] == NULL)
-                break;          /* return results so far */
+                goto err;
         }
-        for (; i <= alias_index; i++) {
-            hentry->aliases[i] = NULL;
+        names += alias_index + 1;
+    }
+
+    fclose(fp);
+    fp = NULL;
+
+    hosts_buckets = HOSTS_INDEX_MIN_BUCKETS;
+    while (hosts_buckets < 2 * names)
+        hosts_buckets <<= 1;
+    hosts_index = (struct hosts_name **)
+        MALLOC(hosts_buckets * sizeof(struct hosts_name *));
+    if (hosts_index == NULL)
+        goto err;
+    memset(hosts_index, 0, hosts_buckets * sizeof(struct hosts_name *));
+
+    for (hentry = hosts_entries; hentry; hentry = hentry->next) {
+        if (VAL_NO_ERROR !=
+            hosts_index_add(hentry->canonical_hostname, hentry))
+            goto err;
+        for (i = 0; hentry->aliases[i] != NULL; i++) {
+            if (VAL_NO_ERROR != hosts_index_add(hentry->aliases[i], hentry))
+                goto err;
         }
-        hentry->next = NULL;
+    }
 
-        if (retval) {
-            retval_tail->next = hentry;
-            retval_tail = hentry;
-        } else {
-            retval = hentry;
+    return VAL_NO_ERROR;
+
+  err:
+    if (fp != NULL)
+        fclose(fp);
+    free_hosts_table();
+    return VAL_OUT_OF_MEMORY;
+}
+
+static struct hosts *
+copy_hosts_entry(const struct hosts *src)
+{
+    struct hosts   *hentry;
+    int             i, n;
+
+    for (n = 0; src->aliases[n] != NULL; n++);
+
+    hentry = (struct hosts *) MALLOC(sizeof(struct hosts));
+    if (hentry == NULL)
+        return NULL;
+    memset(hentry, 0, sizeof(struct hosts));
+    hentry->address = (char *) strdup(src->address);
+    hentry->canonical_hostname = (char *) strdup(src->canonical_hostname);
+    hentry->aliases = (char **) MALLOC((n + 1) * sizeof(char *));
+    if (hentry->aliases != NULL)
+        memset(hentry->aliases, 0, (n + 1) * sizeof(char *));
+    if ((hentry->aliases == NULL) || (hentry->address == NULL)
+        || (hentry->canonical_hostname == NULL)) {
+        FREE_HOSTS(hentry);
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        hentry->aliases[i] = (char *) strdup(src->aliases[i]);
+        if (hentry->aliases[i] == NULL)
+            break;
+    }
+    return hentry;
+}
+
+/*
+ * Return copies of the ETC_HOSTS entries for name, in file order
+ */
+struct hosts   *
+parse_etc_hosts(const char *name)
+{
+    struct stat     sb;
+    struct hosts_name *hn;
+    struct hosts   *retval = NULL;
+    struct hosts   *retval_tail = NULL;
+    struct hosts   *hentry;
+    size_t          len;
+    u_int32_t       h;
+
+    if (name == NULL)
+        return NULL;
+
+    VAL_HOSTS_LOCK();
+
+    if (0 != stat(ETC_HOSTS, &sb)) {
+        free_hosts_table();
+        VAL_HOSTS_UNLOCK();
+        return NULL;
+    }
+
+    if (!hosts_loaded || sb.st_mtime != hosts_mtime ||
+        sb.st_size != hosts_size) {
+        free_hosts_table();
+        if (VAL_NO_ERROR == load_etc_hosts()) {
+            hosts_loaded = 1;
+            hosts_mtime = sb.st_mtime;
+            hosts_size = sb.st_size;
+        }
+    }
+
+    if (hosts_index != NULL) {
+        len = hosts_name_len(name);
+        h = hosts_name_hash(name, len);
+        for (hn = hosts_index[h & (hosts_buckets - 1)]; hn;
+             hn = hn->hn_next) {
+            if (hn->hn_hash != h || strlen(hn->hn_name) != len ||
+                strncasecmp(hn->hn_name, name, len) != 0)
+                continue;
+            hentry = copy_hosts_entry(hn->hn_entry);
+            if (hentry == NULL)
+                break;          /* return results so far */
+            if (retval)
+                retval_tail->next = hentry;
+            else
+                retval = hentry;
             retval_tail = hentry;
         }
     }
 
-    fclose(fp);
+    VAL_HOSTS_UNLOCK();
 
     return retval;
 }
 
+void
+free_etc_hosts(void)
+{
+    VAL_HOSTS_LOCK();
+    free_hosts_table();
+    VAL_HOSTS_UNLOCK();
+}
+
 
 int 
 val_add_valpolicy(val_context_t *context, 
@@ -3140,11 +3788,29 @@ val_add_valpolicy(val_context_t *context,
 
     /* Merge this policy into the context */
     STORE_POLICY_ENTRY_IN_LIST(pol_entry, ctx->e_pol[index]);
+    pol_entry = (*pol)->pe;
+    if (VAL_NO_ERROR != update_policy_index(ctx, index, NULL)) {
+        /* take it out again */
+        policy_entry_t *p, *prev = NULL;
+        for (p = ctx->e_pol[index]; p && p != pol_entry; p = p->next)
+            prev = p;
+        if (prev)
+            prev->next = pol_entry->next;
+        else
+            ctx->e_pol[index] = pol_entry->next;
+        CTX_UNLOCK_ACACHE(ctx);
+        CTX_UNLOCK_POL(ctx);
+        conf_elem_array[index].free(pol_entry);
+        FREE(pol_entry);
+        FREE(*pol);
+        *pol = NULL;
+        return VAL_OUT_OF_MEMORY;
+    }
 
     /* Flush queries that match this name */
     for(q=ctx->q_list; q; q=q->qc_next) {
         if (NULL != namename(q->qc_name_n, zone_n)) {
-            q->qc_flags |= VAL_QUERY_MARK_FOR_DELETION;
+            mark_query_chain_for_deletion(ctx, q);
         }
     }
     
@@ -3185,6 +3851,11 @@ val_remove_valpolicy(val_context_t *context, val_policy_handle_t *pol)
         goto err; 
     }
 
+    /* index what is left before letting go of it */
+    if (VAL_NO_ERROR != 
+            (retval = update_policy_index(ctx, pol->index, p)))
+        goto err;
+
     /* unlink the policy */
     if (prev) {
         prev->next = p->next;
@@ -3199,7 +3870,7 @@ val_remove_valpolicy(val_context_t *context, val_policy_handle_t *pol)
     /* Flush queries that match this name */
     for(q=ctx->q_list; q; q=q->qc_next) {
         if (NULL != namename(q->qc_name_n, p->zone_n)) {
-            q->qc_flags |= VAL_QUERY_MARK_FOR_DELETION;
+            mark_query_chain_for_deletion(ctx, q);
         }
     }
 
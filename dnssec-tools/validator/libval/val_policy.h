@@ -78,16 +78,33 @@
                 cur = cur->next;\
             }\
         }\
+        ctx->e_pol[index] = pol;\
     }\
 } while(0)
+
+/*
+ * Policies whose longest matching zone is looked up through
+ * ctx->e_pol_idx rather than by walking ctx->e_pol
+ */
+#define POLICY_IS_INDEXED(index) \
+    ((index) == P_TRUST_ANCHOR ||\
+     (index) == P_CLOCK_SKEW ||\
+     (index) == P_ZONE_SECURITY_EXPECTATION)
     
 int             free_policy_entry(policy_entry_t *pol_entry, int index);
+int             update_policy_index(val_context_t * ctx, int index,
+                                    policy_entry_t *skip);
+void            free_policy_index(struct policy_index *idx);
+struct policy_index_val *lookup_policy_index(val_context_t * ctx, int index,
+                                             u_char * name_n,
+                                             u_char ** match_ptr);
 int             read_root_hints_file(val_context_t * ctx);
 int             read_res_config_file(val_context_t * ctx);
 int             read_val_config_file(val_context_t * ctx, const char *scope);
 void            destroy_valpol(val_context_t * ctx);
 void            destroy_respol(val_context_t * ctx);
 struct hosts   *parse_etc_hosts(const char *name);
+void            free_etc_hosts(void);
 
 int             parse_trust_anchor(char **, char *, policy_entry_t *, int *, int *);
 int             free_trust_anchor(policy_entry_t *);
@@ -155,10 +155,8 @@ find_matching_glue(val_context_t *context,
         pc->qc_referral && pc->qc_referral->cur_pending_glue_ns) {
 
         pending_ns = pc->qc_referral->cur_pending_glue_ns;
-        if (ns_name_ntop(pending_ns->ns_name_n, name_p,
-                     sizeof(name_p)) < 0) {
-            strncpy(name_p, "unknown/error", sizeof(name_p)-1); 
-        }
+        VAL_LOG_NTOP(LOG_DEBUG, pending_ns->ns_name_n, name_p,
+                     sizeof(name_p));
 
         /*
          * Identify the query in the query chain 
@@ -316,10 +314,8 @@ merge_glue_in_referral(val_context_t *context,
          * If we reach here we've processed both A and AAAA glue.
          * check if we have at least some data to work with 
          */
-        if (ns_name_ntop(pending_ns->ns_name_n, name_p,
-                     sizeof(name_p)) < 0) {
-            strncpy(name_p, "unknown/error", sizeof(name_p)-1); 
-        }
+        VAL_LOG_NTOP(LOG_DEBUG, pending_ns->ns_name_n, name_p,
+                     sizeof(name_p));
 
         if (pending_ns->ns_number_of_addresses > 0) {
 
@@ -444,8 +440,8 @@ fix_glue(val_context_t * context,
         if ((next_q->qfq_query->qc_state & Q_WAIT_FOR_GLUE) ||
             next_q->qfq_query->qc_state >= Q_ERROR_BASE) {
 
-            if (-1 == ns_name_ntop(next_q->qfq_query->qc_name_n, name_p, sizeof(name_p)))
-                snprintf(name_p, sizeof(name_p), "unknown/error");
+            VAL_LOG_NTOP(LOG_DEBUG, next_q->qfq_query->qc_name_n, name_p,
+                         sizeof(name_p));
 
             /* 
              * next, check if the glue for this query is already in the bucket 
@@ -1124,7 +1120,7 @@ follow_referral_or_alias_link(val_context_t * context,
     res_sq_free_rrset_recs(proofs);
     *proofs = NULL;
 
-    if (referral_zone_n) {
+    if (referral_zone_n && VAL_LOG_WOULD_LOG(LOG_DEBUG)) {
         char            debug_name1[NS_MAXDNAME];
         char            debug_name2[NS_MAXDNAME];
         memset(debug_name1, 0, 1024);
@@ -1292,7 +1288,7 @@ follow_referral_or_alias_link(val_context_t * context,
         }                                                               \
         if (ret_val != VAL_NO_ERROR) {                                  \
             res_sq_free_rrset_recs(&learned_zones);                     \
-            FREE(rdata);                                                \
+            val_arena_free(&rdata_arena);                               \
             return ret_val;                                             \
         }                                                               \
     } while (0)
@@ -1463,49 +1459,30 @@ prepare_empty_nonexistence(struct rrset_rec **answers,
     if (answers == NULL || length == 0)
         return VAL_BAD_ARGUMENT;
 
-    *answers = (struct rrset_rec *) MALLOC(sizeof(struct rrset_rec));
+    *answers = new_rrset_rec(query_name_n,
+                             ((respondent_server) &&
+                              (respondent_server->ns_number_of_addresses > 0)) ?
+                             respondent_server->ns_address[0] : NULL);
     if (*answers == NULL)
         return VAL_OUT_OF_MEMORY;
 
     (*answers)->rrs_zonecut_n = NULL;
-    (*answers)->rrs_name_n = (u_char *) MALLOC(length * sizeof(u_char));
-
-    if ((*answers)->rrs_name_n == NULL) {
-        FREE(*answers);
-        *answers = NULL;
-        return VAL_OUT_OF_MEMORY;
-    }
 
     if (hptr) {
         (*answers)->rrs_rcode = ((HEADER *)hptr)->rcode;
     } else {
         (*answers)->rrs_rcode = 0; 
     }
-    memcpy((*answers)->rrs_name_n, query_name_n, length);
     (*answers)->rrs_type_h = query_type_h;
     (*answers)->rrs_class_h = query_class_h;
     (*answers)->rrs_ttl_h = 0;/* don't have any basis to set the TTL value */
     (*answers)->rrs_ttl_x = 0;
     (*answers)->rrs_cred = SR_CRED_UNSET;
     (*answers)->rrs_section = VAL_FROM_UNSET;
-    if ((respondent_server) &&
-        (respondent_server->ns_number_of_addresses > 0)) {
-        (*answers)->rrs_server =
-            (struct sockaddr *) MALLOC(sizeof(struct sockaddr_storage));
-        if ((*answers)->rrs_server == NULL) {
-            FREE((*answers)->rrs_name_n);
-            FREE(*answers);
-            *answers = NULL;
-            return VAL_OUT_OF_MEMORY;
-        }
-        memcpy((*answers)->rrs_server,
-               respondent_server->ns_address[0],
-               sizeof(struct sockaddr_storage));
+    if ((*answers)->rrs_server)
         (*answers)->rrs_ns_options = respondent_server->ns_options;
-    } else {
-        (*answers)->rrs_server = NULL;
+    else
         (*answers)->rrs_ns_options = 0;
-    }
     (*answers)->rrs_data = NULL;
     (*answers)->rrs_sig = NULL;
     (*answers)->rrs_next = NULL;
@@ -1590,6 +1567,7 @@ digest_response(val_context_t * context,
     int             authoritive = 0;
     int             iterative = 0;
     u_char         *rdata;
+    struct val_arena rdata_arena = VAL_ARENA_INITIALIZER;
     u_char         *hptr;
     int             ret_val;
     int             nothing_other_than_alias;
@@ -1772,8 +1750,8 @@ digest_response(val_context_t * context,
          * so they need to be expanded.  This is type-dependent...
          */
         if ((ret_val =
-             decompress(&rdata, response_data, rdata_index, end, type_h,
-                        &rdata_len_h)) != VAL_NO_ERROR) {
+             decompress(&rdata_arena, &rdata, response_data, rdata_index,
+                        end, type_h, &rdata_len_h)) != VAL_NO_ERROR) {
             matched_q->qc_state = Q_RESPONSE_ERROR;
             ret_val = VAL_NO_ERROR;
             goto done;
@@ -1992,6 +1970,7 @@ digest_response(val_context_t * context,
                 val_log(context, LOG_DEBUG, "digest_response(): {%s %s(%d) %s(%d)} appears to lead to a lame server",
                         query_name_p, p_class(query_class_h), query_class_h,
                         p_type(query_type_h), query_type_h);
+                res_infra_lame_server(matched_q->qc_respondent_server);
                 matched_q->qc_state = Q_REFERRAL_ERROR;
                 ret_val = VAL_NO_ERROR;
                 goto done;
@@ -2080,12 +2059,11 @@ digest_response(val_context_t * context,
                 goto done;
             }
         }
-
-        FREE(rdata);
-        rdata = NULL;
-
     } 
 
+    /* all rdata worth keeping has been copied into the rrsets */
+    val_arena_free(&rdata_arena);
+
     if (*qnames) {
 
         if (namecmp(matched_q->qc_name_n, (*qnames)->qnc_name_n)) {
@@ -2209,8 +2187,7 @@ digest_response(val_context_t * context,
     return ret_val;
 
   done:
-    if (rdata)
-        FREE(rdata);
+    val_arena_free(&rdata_arena);
     res_sq_free_rrset_recs(&learned_answers);
     res_sq_free_rrset_recs(&learned_proofs);
     res_sq_free_rrset_recs(&learned_zones);
@@ -2255,21 +2232,23 @@ val_resquery_send(val_context_t * context,
     if (ns_name_ntop(matched_q->qc_name_n, name_p, sizeof(name_p)) == -1) {
         return VAL_BAD_ARGUMENT;
     }
-    if (matched_q->qc_zonecut_n == NULL || 
-        ns_name_ntop(matched_q->qc_zonecut_n, zone_p, sizeof(zone_p)) == -1) {
-        strncpy(zone_p, "", sizeof(zone_p)-1); 
-    }
+    if (VAL_LOG_WOULD_LOG(LOG_DEBUG)) {
+        if (matched_q->qc_zonecut_n == NULL || 
+            ns_name_ntop(matched_q->qc_zonecut_n, zone_p, sizeof(zone_p)) == -1) {
+            strncpy(zone_p, "", sizeof(zone_p)-1); 
+        }
 
-    val_log(context, LOG_DEBUG, "val_resquery_send(): Sending query for {%s %s(%d) %s(%d)} to: %s", 
-            name_p, p_class(matched_q->qc_class_h), matched_q->qc_class_h,
-            p_type(matched_q->qc_type_h), matched_q->qc_type_h, zone_p);
-    for (tempns = nslist; tempns; tempns = tempns->ns_next) {
-        int i, addr_count;
-        addr_count = tempns->ns_number_of_addresses;
-        for (i=0; i < addr_count; i++) {
-            val_log(context, LOG_DEBUG, "    %s",
-                val_get_ns_string((struct sockaddr *)tempns->ns_address[i],
-                                  name_buf, sizeof(name_buf)));
+        val_log(context, LOG_DEBUG, "val_resquery_send(): Sending query for {%s %s(%d) %s(%d)} to: %s", 
+                name_p, p_class(matched_q->qc_class_h), matched_q->qc_class_h,
+                p_type(matched_q->qc_type_h), matched_q->qc_type_h, zone_p);
+        for (tempns = nslist; tempns; tempns = tempns->ns_next) {
+            int i, addr_count;
+            addr_count = tempns->ns_number_of_addresses;
+            for (i=0; i < addr_count; i++) {
+                val_log(context, LOG_DEBUG, "    %s",
+                    val_get_ns_string((struct sockaddr *)tempns->ns_address[i],
+                                      name_buf, sizeof(name_buf)));
+            }
         }
     }
 
@@ -2568,8 +2547,7 @@ val_resquery_async_rcv(val_context_t * context,
     struct val_query_chain *matched_q;
     int             ret_val, handled;
 
-    if ((matched_qfq == NULL) || (response == NULL) || (queries == NULL) ||
-        (pending_desc == NULL))
+    if ((matched_qfq == NULL) || (response == NULL) || (queries == NULL))
         return VAL_BAD_ARGUMENT;
 
     val_log(NULL, LOG_DEBUG, __FUNCTION__);
@@ -2577,7 +2555,7 @@ val_resquery_async_rcv(val_context_t * context,
     matched_q = matched_qfq->qfq_query; /* ! NULL if matched_qfq ! NULL */
     *response = NULL;
 
-    /** check for a response */
+    /** check for a response; without pending_desc, it has been read */
     ret_val = res_async_query_handle(matched_q->qc_ea, &handled, pending_desc);
     if (ret_val == SR_NO_ANSWER_YET)
         return VAL_NO_ERROR;
@@ -2675,8 +2653,8 @@ val_async_select_info(val_context_t *ctx, fd_set *activefds,
         for (qfq = as->val_as_queries; qfq; qfq = qfq->qfq_next) {
 
             char         name_p[NS_MAXDNAME];
-            if (-1 == ns_name_ntop(qfq->qfq_query->qc_name_n, name_p, sizeof(name_p)))
-                snprintf(name_p, sizeof(name_p), "unknown/error");
+            VAL_LOG_NTOP(LOG_DEBUG, qfq->qfq_query->qc_name_n, name_p,
+                         sizeof(name_p));
             if (!qfq->qfq_query->qc_ea || (qfq->qfq_query->qc_flags & VAL_QUERY_SKIP_RESOLVER)) {
                 val_log(NULL, LOG_DEBUG+1, " as %p query %p {%s %s(%d) %s(%d)} ea %p", as, qfq,
                         name_p, p_class(qfq->qfq_query->qc_class_h),
@@ -2721,5 +2699,26 @@ val_async_select_info(val_context_t *ctx, fd_set *activefds,
     return VAL_NO_ERROR;
 }
 
+/*
+ * Return a descriptor that becomes readable when responses may have
+ * arrived for the asynchronous requests of the calling thread. It does
+ * not change for the lifetime of the thread, so an application can
+ * add it to its event loop once.
+ */
+int
+val_async_getfd(val_context_t *ctx)
+{
+    int fd;
+
+    fd = res_io_get_pollfd();
+    if (fd < 0) {
+        val_log(ctx, LOG_INFO,
+                "val_async_getfd: no pollable descriptor available");
+        return VAL_NOT_IMPLEMENTED;
+    }
+
+    return fd;
+}
+
 
 #endif /* VAL_NO_ASYNC */
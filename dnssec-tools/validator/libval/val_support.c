@@ -175,19 +175,175 @@ wire_name_labels(const u_char * field)
         return l;
 }
 
+/*
+ * Identify if the type is present in the bitmap
+ * The encoding of the bitmap is a sequence of <block#, len, bitmap> tuples
+ */
+int
+is_type_set(u_char * field, size_t field_len, u_int16_t type)
+{
+    int             block, blen;
+
+    /** The type will be present in the following block */
+    int             t_block = type/256;
+    /** within the bitmap, the type will be present in the following byte */
+    int             t_byte_offset = (type % 256)/8;
+    /** within the bitmap, the type will be present in the following bit */
+    int             t_bm_offset = type%8;
+
+    int             cnt = 0;
+
+    if (type < 1)
+        return 0;
+
+    block = 0;
+
+    /*
+     * ensure that we have at least two bytes and we've not gone past our block 
+     */
+    while ((field_len > cnt + 2) && (block <= t_block)) {
+
+        block = field[cnt];
+        blen = field[cnt + 1];
+        cnt += 2;
+
+        if (block == t_block) {
+            if (blen > t_byte_offset &&  
+                field_len > (cnt + t_byte_offset)) {
+                /*
+                 * see if the bit is set 
+                 */
+                if (field[cnt + t_byte_offset] & (1 << (7 - t_bm_offset)))
+                    return 1;
+            }
+            return 0;
+        }
+        cnt += blen;
+    }
+    return 0;
+}
+
+/*
+ * Hand out len bytes from the arena, starting a new chunk when the
+ * current one is full
+ */
+void           *
+val_arena_alloc(struct val_arena *arena, size_t len)
+{
+    struct val_arena_chunk *chunk;
+    size_t          size;
+    u_char         *p;
+
+    if (arena == NULL)
+        return NULL;
+
+    /* keep everything handed out suitably aligned */
+    len = (len + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    chunk = arena->va_chunks;
+    if (chunk == NULL || chunk->vac_size - chunk->vac_used < len) {
+        size = sizeof(struct val_arena_chunk) + len;
+        if (size < VAL_ARENA_CHUNK_SIZE)
+            size = VAL_ARENA_CHUNK_SIZE;
+        chunk = (struct val_arena_chunk *) MALLOC(size);
+        if (chunk == NULL)
+            return NULL;
+        chunk->vac_size = size;
+        chunk->vac_used = sizeof(struct val_arena_chunk);
+        chunk->vac_next = arena->va_chunks;
+        arena->va_chunks = chunk;
+    }
+
+    p = (u_char *) chunk + chunk->vac_used;
+    chunk->vac_used += len;
+    return p;
+}
+
+/*
+ * Give back everything that was handed out from the arena
+ */
+void
+val_arena_free(struct val_arena *arena)
+{
+    struct val_arena_chunk *chunk;
+
+    if (arena == NULL)
+        return;
+
+    while ((chunk = arena->va_chunks) != NULL) {
+        arena->va_chunks = chunk->vac_next;
+        FREE(chunk);
+    }
+}
+
+/*
+ * An RR and its rdata are allocated together and freed with one call
+ */
+static struct rrset_rr *
+new_rr_rec(size_t rdata_len_h)
+{
+    struct rrset_rr  *rr;
+
+    rr = (struct rrset_rr *) MALLOC(sizeof(struct rrset_rr) + rdata_len_h);
+    if (rr == NULL)
+        return NULL;
+
+    rr->rr_rdata = (u_char *) (rr + 1);
+    rr->rr_rdata_length = rdata_len_h;
+    rr->rr_status = VAL_AC_UNSET;
+    rr->rr_next = NULL;
+    return rr;
+}
+
+/*
+ * Allocate an empty rrset for name_n. The owner name and the address
+ * of the respondent server (if given) live in the same block as the
+ * rrset itself, so that they go away with it.
+ */
+struct rrset_rec *
+new_rrset_rec(const u_char * name_n, struct sockaddr_storage *server)
+{
+    struct rrset_rec *new_set;
+    size_t          name_len, size;
+    u_char         *p;
+
+    if (name_n == NULL)
+        return NULL;
+
+    name_len = wire_name_length(name_n);
+    size = sizeof(struct rrset_rec) + name_len;
+    if (server)
+        size += sizeof(struct sockaddr_storage);
+
+    new_set = (struct rrset_rec *) MALLOC(size);
+    if (new_set == NULL)
+        return NULL;
+    memset(new_set, 0, sizeof(struct rrset_rec));
+
+    p = (u_char *) (new_set + 1);
+    if (server) {
+        new_set->rrs_server = (struct sockaddr *) p;
+        memcpy(p, server, sizeof(struct sockaddr_storage));
+        p += sizeof(struct sockaddr_storage);
+    }
+    new_set->rrs_name_n = p;
+    memcpy(p, name_n, name_len);
+
+    return new_set;
+}
+
 void
 res_sq_free_rr_recs(struct rrset_rr **rr)
 {
+    struct rrset_rr *next;
+
     if (rr == NULL)
         return;
 
-    if (*rr) {
-        if ((*rr)->rr_rdata)
-            FREE((*rr)->rr_rdata);
-        if ((*rr)->rr_next)
-            res_sq_free_rr_recs(&((*rr)->rr_next));
+    while (*rr) {
+        next = (*rr)->rr_next;
         FREE(*rr);
-        *rr = NULL;
+        *rr = next;
     }
 }
 
@@ -195,27 +351,51 @@ res_sq_free_rr_recs(struct rrset_rr **rr)
 void
 res_sq_free_rrset_recs(struct rrset_rec **set)
 {
+    struct rrset_rec *next;
+
     if (set == NULL)
         return;
 
-    if (*set) {
+    while (*set) {
+        next = (*set)->rrs_next;
         if ((*set)->rrs_zonecut_n)
             FREE((*set)->rrs_zonecut_n);
-        if ((*set)->rrs_name_n)
-            FREE((*set)->rrs_name_n);
-        if ((*set)->rrs_server)
-            FREE((*set)->rrs_server);
         if ((*set)->rrs_data)
             res_sq_free_rr_recs(&((*set)->rrs_data));
         if ((*set)->rrs_sig)
             res_sq_free_rr_recs(&((*set)->rrs_sig));
-        if ((*set)->rrs_next)
-            res_sq_free_rrset_recs(&((*set)->rrs_next));
         FREE(*set);
-        *set = NULL;
+        *set = next;
     }
 }
 
+/*
+ * Approximate number of bytes held by a single rrset_rec (not
+ * including anything chained through rrs_next)
+ */
+size_t
+rrset_rec_size(struct rrset_rec *set)
+{
+    struct rrset_rr *rr;
+    size_t size;
+
+    if (set == NULL)
+        return 0;
+
+    size = sizeof(struct rrset_rec);
+    if (set->rrs_name_n)
+        size += wire_name_length(set->rrs_name_n);
+    if (set->rrs_zonecut_n)
+        size += wire_name_length(set->rrs_zonecut_n);
+    if (set->rrs_server)
+        size += sizeof(struct sockaddr_storage);
+    for (rr = set->rrs_data; rr; rr = rr->rr_next)
+        size += sizeof(struct rrset_rr) + rr->rr_rdata_length;
+    for (rr = set->rrs_sig; rr; rr = rr->rr_next)
+        size += sizeof(struct rrset_rr) + rr->rr_rdata_length;
+    return size;
+}
+
 
 int
 add_to_qname_chain(struct qname_chain **qnames, const u_char * name_n)
@@ -331,16 +511,10 @@ add_to_set(struct rrset_rec *rr_set, size_t rdata_len_h,
     /*
      * Make sure we got the memory for it 
      */
-    rr = (struct rrset_rr *) MALLOC(sizeof(struct rrset_rr));
+    rr = new_rr_rec(rdata_len_h);
     if (rr == NULL)
         return VAL_OUT_OF_MEMORY;
 
-    rr->rr_rdata = (u_char *) MALLOC(rdata_len_h * sizeof(u_char));
-    if (rr->rr_rdata == NULL) {
-        FREE(rr);
-        return VAL_OUT_OF_MEMORY;
-    }
-
     /*
      * Add it to the end of the current list of RR's 
      */
@@ -356,12 +530,9 @@ add_to_set(struct rrset_rec *rr_set, size_t rdata_len_h,
 
 
     /*
-     * Insert the data, copying the rdata pointer 
+     * Insert the data
      */
-    rr->rr_rdata_length = rdata_len_h;
     memcpy(rr->rr_rdata, rdata, rdata_len_h);
-    rr->rr_status = VAL_AC_UNSET;
-    rr->rr_next = NULL;
 
     return VAL_NO_ERROR;
 }
@@ -378,16 +549,10 @@ add_as_sig(struct rrset_rec *rr_set, size_t rdata_len_h,
     /*
      * Make sure we got the memory for it 
      */
-    rr = (struct rrset_rr *) MALLOC(sizeof(struct rrset_rr));
+    rr = new_rr_rec(rdata_len_h);
     if (rr == NULL)
         return VAL_OUT_OF_MEMORY;
 
-    rr->rr_rdata = (u_char *) MALLOC(rdata_len_h * sizeof(u_char));
-    if (rr->rr_rdata == NULL) {
-        FREE(rr);
-        return VAL_OUT_OF_MEMORY;
-    }
-
     if (rr_set->rrs_sig == NULL) {
         rr_set->rrs_sig = rr;
     } else {
@@ -403,51 +568,35 @@ add_as_sig(struct rrset_rec *rr_set, size_t rdata_len_h,
     }
 
     /*
-     * Insert the data, copying the rdata pointer 
+     * Insert the data
      */
-    rr->rr_rdata_length = rdata_len_h;
     memcpy(rr->rr_rdata, rdata, rdata_len_h);
-    rr->rr_status = VAL_AC_UNSET;
-    rr->rr_next = NULL;
 
     return VAL_NO_ERROR;
 }
 
+/*
+ * Initialize an rrset freshly allocated by new_rrset_rec()
+ */
 int
-init_rr_set(struct rrset_rec *new_set, u_char * name_n,
+init_rr_set(struct rrset_rec *new_set,
             u_int16_t type_h, u_int16_t set_type_h,
             u_int16_t class_h, u_int32_t ttl_h,
             u_char * hptr, int from_section,
             int authoritive_answer, int iterative_answer,
             struct name_server *respondent_server)
 {
-    size_t name_len = wire_name_length(name_n);
     struct timeval  tv;
 
-    if ((new_set == NULL) || (name_n == NULL))
+    if (new_set == NULL)
         return VAL_BAD_ARGUMENT;
 
-    if (new_set->rrs_name_n != NULL)
-        /*
-         * This has already been initialized 
-         */
-        return VAL_NO_ERROR;
-
-    /*
-     * Initialize it 
-     */
-    new_set->rrs_name_n =
-        (u_char *) MALLOC(name_len * sizeof(u_char));
-    if (new_set->rrs_name_n == NULL)
-        return VAL_OUT_OF_MEMORY;
-
     if (hptr) {
         new_set->rrs_rcode = ((HEADER *)hptr)->rcode;
     } else {
         new_set->rrs_rcode = 0; 
     }
 
-    memcpy(new_set->rrs_name_n, name_n, name_len);
     new_set->rrs_type_h = set_type_h;
     new_set->rrs_class_h = class_h;
     new_set->rrs_ttl_h = ttl_h;
@@ -458,23 +607,10 @@ init_rr_set(struct rrset_rec *new_set, u_char * name_n,
     new_set->rrs_data = NULL;
     new_set->rrs_sig = NULL;
 
-    if ((respondent_server) &&
-        (respondent_server->ns_number_of_addresses > 0)) {
-        new_set->rrs_server =
-            (struct sockaddr *) MALLOC(sizeof(struct sockaddr_storage));
-        if (new_set->rrs_server == NULL) {
-            FREE(new_set->rrs_name_n);
-            new_set->rrs_name_n = NULL;
-            return VAL_OUT_OF_MEMORY;
-        }
-        memcpy(new_set->rrs_server,
-               respondent_server->ns_address[0],
-               sizeof(struct sockaddr_storage));
+    if (new_set->rrs_server)
         new_set->rrs_ns_options = respondent_server->ns_options;
-    } else {
-        new_set->rrs_server = NULL;
+    else
         new_set->rrs_ns_options = 0;
-    }
 
     new_set->rrs_next = NULL;
 
@@ -594,10 +730,12 @@ find_rr_set(struct name_server *respondent_server,
      * If no record matches, then create a new one 
      */
     if (tryit == NULL) {
-        new_one = (struct rrset_rec *) MALLOC(sizeof(struct rrset_rec));
+        new_one = new_rrset_rec(name_n,
+                                ((respondent_server) &&
+                                 (respondent_server->ns_number_of_addresses > 0)) ?
+                                respondent_server->ns_address[0] : NULL);
         if (new_one == NULL)
             return NULL;
-        memset(new_one, 0, sizeof(struct rrset_rec));
 
         /*
          * If this is the first ever record, change *the_list 
@@ -619,7 +757,7 @@ find_rr_set(struct name_server *respondent_server,
         } else
             new_one->rrs_zonecut_n = NULL;
 
-        if ((init_rr_set(new_one, name_n, type_h, set_type_h,
+        if ((init_rr_set(new_one, type_h, set_type_h,
                          class_h, ttl_h, hptr, from_section,
                          authoritive_answer, iterative_answer, 
                          respondent_server))
@@ -642,8 +780,13 @@ find_rr_set(struct name_server *respondent_server,
     return new_one;
 }
 
+/*
+ * Expand any compressed domain names in the rdata at rdata_index. The
+ * expanded rdata is allocated from arena.
+ */
 int
-decompress(u_char ** rdata,
+decompress(struct val_arena *arena,
+           u_char ** rdata,
            u_char * response,
            size_t rdata_index,
            u_char * end, 
@@ -695,7 +838,7 @@ decompress(u_char ** rdata,
         if (new_size == 0)
             return VAL_NO_ERROR;
 
-        *rdata = (u_char *) MALLOC(new_size * sizeof(u_char));
+        *rdata = (u_char *) val_arena_alloc(arena, new_size);
         if (*rdata == NULL)
             return VAL_OUT_OF_MEMORY;
 
@@ -755,7 +898,7 @@ decompress(u_char ** rdata,
 
         new_size = (size_t) (*rdata_len_h + expansion);
 
-        *rdata = (u_char *) MALLOC(new_size * sizeof(u_char));
+        *rdata = (u_char *) val_arena_alloc(arena, new_size);
         if (*rdata == NULL)
             return VAL_OUT_OF_MEMORY;
 
@@ -842,7 +985,7 @@ decompress(u_char ** rdata,
 
         new_size = (size_t) (*rdata_len_h + expansion);
 
-        *rdata = (u_char *) MALLOC(new_size * sizeof(u_char));
+        *rdata = (u_char *) val_arena_alloc(arena, new_size);
         if (*rdata == NULL)
             return VAL_OUT_OF_MEMORY;
 
@@ -889,7 +1032,7 @@ decompress(u_char ** rdata,
 
         new_size = (size_t) (*rdata_len_h + expansion);
 
-        *rdata = (u_char *) MALLOC(new_size * sizeof(u_char));
+        *rdata = (u_char *) val_arena_alloc(arena, new_size);
         if (*rdata == NULL)
             return VAL_OUT_OF_MEMORY;
 
@@ -1153,27 +1296,17 @@ copy_rr_rec(u_int16_t type_h, struct rrset_rr *r, int dolower)
 
     if (r == NULL)
         return NULL;
-    the_copy = (struct rrset_rr *) MALLOC(sizeof(struct rrset_rr));
+    the_copy = new_rr_rec(r->rr_rdata_length);
 
     if (the_copy == NULL)
         return NULL;
 
-    the_copy->rr_rdata_length = r->rr_rdata_length;
-    the_copy->rr_rdata = (u_char *) MALLOC(the_copy->rr_rdata_length * sizeof
-            (u_char));
-
-    if (the_copy->rr_rdata == NULL) {
-        FREE(the_copy);
-        return NULL;
-    }
-
     memcpy(the_copy->rr_rdata, r->rr_rdata, r->rr_rdata_length);
 
     if (dolower)
         lower(type_h, the_copy->rr_rdata, the_copy->rr_rdata_length);
 
     the_copy->rr_status = r->rr_status;
-    the_copy->rr_next = NULL;
 
     return the_copy;
 }
@@ -1274,15 +1407,14 @@ copy_rrset_rec(struct rrset_rec *rr_set)
     struct rrset_rec *copy_set;
     struct rrset_rr  *orig_rr;
     struct rrset_rr  *copy_rr;
-    size_t o_length;
 
     if (rr_set == NULL)
         return NULL;
 
-    copy_set = (struct rrset_rec *) MALLOC(sizeof(struct rrset_rec));
+    copy_set = new_rrset_rec(rr_set->rrs_name_n, 
+                             (struct sockaddr_storage *) rr_set->rrs_server);
     if (copy_set == NULL)
         return NULL;
-    memset(copy_set, 0, sizeof(struct rrset_rec));
 
     if (rr_set->rrs_zonecut_n != NULL) {
         size_t             len = wire_name_length(rr_set->rrs_zonecut_n);
@@ -1304,16 +1436,6 @@ copy_rrset_rec(struct rrset_rec *rr_set)
      */
     copy_set->rrs_rcode = rr_set->rrs_rcode;
 
-    if (rr_set->rrs_name_n) {
-        o_length = wire_name_length(rr_set->rrs_name_n);
-        copy_set->rrs_name_n = (u_char *) MALLOC(o_length * sizeof(u_char));
-        if (copy_set->rrs_name_n == NULL) {
-            goto err;
-        }
-        memcpy(copy_set->rrs_name_n,
-               rr_set->rrs_name_n, o_length);
-    }
-
     copy_set->rrs_class_h = rr_set->rrs_class_h;
     copy_set->rrs_type_h = rr_set->rrs_type_h;
     copy_set->rrs_ttl_h = rr_set->rrs_ttl_h;
@@ -1367,21 +1489,10 @@ copy_rrset_rec(struct rrset_rec *rr_set)
     }
 
     /*
-     * Copy respondent server information 
+     * The respondent server address was copied along with the name 
      */
-    if (rr_set->rrs_server) {
-        copy_set->rrs_server =
-            (struct sockaddr *) MALLOC(sizeof(struct sockaddr_storage));
-        if (copy_set->rrs_server == NULL) {
-            goto err;
-        }
-        memcpy(copy_set->rrs_server, rr_set->rrs_server,
-               sizeof(struct sockaddr_storage));
-        copy_set->rrs_ns_options = rr_set->rrs_ns_options;
-    } else {
-        copy_set->rrs_server = NULL;
-        copy_set->rrs_ns_options = 0;
-    }
+    copy_set->rrs_ns_options = rr_set->rrs_server ? 
+                                    rr_set->rrs_ns_options : 0;
 
     return copy_set;
 
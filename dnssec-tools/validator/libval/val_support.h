@@ -51,6 +51,24 @@
 } while(0)
 
 
+/*
+ * A region of scratch memory, handed out by bumping a pointer and
+ * given back all at once by val_arena_free()
+ */
+#define VAL_ARENA_CHUNK_SIZE    4096
+
+struct val_arena_chunk {
+    struct val_arena_chunk *vac_next;
+    size_t          vac_size;
+    size_t          vac_used;
+};
+
+struct val_arena {
+    struct val_arena_chunk *va_chunks;
+};
+
+#define VAL_ARENA_INITIALIZER   { NULL }
+
 #define ITS_BEEN_DONE   0
 #define IT_HASNT        1
 #define IT_WONT         (-1)
@@ -66,9 +84,18 @@ void            base32hex_encode(u_char * in, size_t inlen,
 #endif
 size_t          wire_name_labels(const u_char * field);
 size_t          wire_name_length(const u_char * field);
+u_int32_t       wire_name_hash(const u_char * field);
+int             is_type_set(u_char * field, size_t field_len,
+                            u_int16_t type);
+
+void           *val_arena_alloc(struct val_arena *arena, size_t len);
+void            val_arena_free(struct val_arena *arena);
 
+struct rrset_rec *new_rrset_rec(const u_char * name_n,
+                                struct sockaddr_storage *server);
 void            res_sq_free_rr_recs(struct rrset_rr **rr);
 void            res_sq_free_rrset_recs(struct rrset_rec **set);
+size_t          rrset_rec_size(struct rrset_rec *set);
 int             add_to_qname_chain(struct qname_chain **qnames,
                                    const u_char * name_n);
 int             name_in_qname_chain(struct qname_chain *qnames,
@@ -82,7 +109,7 @@ int             add_to_set(struct rrset_rec *rr_set, size_t rdata_len_h,
                            u_char * rdata);
 int             add_as_sig(struct rrset_rec *rr_set, size_t rdata_len_h,
                            u_char * rdata);
-int             init_rr_set(struct rrset_rec *new_set, u_char * name_n,
+int             init_rr_set(struct rrset_rec *new_set,
                             u_int16_t type_h, u_int16_t set_type_h,
                             u_int16_t class_h, u_int32_t ttl_h,
                             u_char * hptr, int from_section,
@@ -103,7 +130,8 @@ struct rrset_rec *find_rr_set(struct name_server *respondent_server,
                               int iterative_answer,
                               u_char * zonecut_n);
 
-int             decompress(u_char ** rdata,
+int             decompress(struct val_arena *arena,
+                           u_char ** rdata,
                            u_char * response,
                            size_t rdata_index,
                            u_char * end,
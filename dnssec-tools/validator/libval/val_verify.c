@@ -28,68 +28,112 @@ get_clock_skew(val_context_t *ctx,
                int *skew,
                u_int32_t *ttl_x)
 {
-    policy_entry_t *cs_pol, *cs_cur;
-    u_char       *p;
-    size_t       name_len;
+    struct policy_index_val *cs;
 
     if (ctx == NULL || name_n == NULL || skew == NULL || ttl_x == NULL) {
         val_log(ctx, LOG_DEBUG, "get_clock_skew(): Cannot check for clock skew policy, bad args"); 
         return; 
     }
     
-    RETRIEVE_POLICY(ctx, P_CLOCK_SKEW, cs_pol);
-    if (cs_pol) {
-
-        name_len = wire_name_length(name_n);
-
-        for (cs_cur = cs_pol;
-             cs_cur && (wire_name_length(cs_cur->zone_n) > name_len);
-             cs_cur = cs_cur->next);
-        /*
-         * for all zones which are shorter or as long, do a strstr 
-         */
-        /*
-         * Because of the ordering, the longest match is found first 
-         */
-        for (; cs_cur; cs_cur = cs_cur->next) {
-            int             root_zone = 0;
-            if (!namecmp(cs_cur->zone_n, (const u_char *) ""))
-                root_zone = 1;
-            else {
-                /*
-                 * Find the last occurrence of cs_cur->zone_n in name_n 
-                 */
-                p = name_n;
-                while (p && (*p != '\0')) {
-                    if (!namecmp(p, cs_cur->zone_n))
-                        break;
-                    p = p + *p + 1;
-                }
-            }
-            if (root_zone || (!namecmp(p, cs_cur->zone_n))) {
-                val_log(ctx, LOG_DEBUG, "get_clock_skew(): Found clock skew policy"); 
-                if (cs_cur->pol) {
-                    *skew = ((struct clock_skew_policy *)(cs_cur->pol))->clock_skew;
-                    if (cs_cur->exp_ttl > 0)
-                        *ttl_x = cs_cur->exp_ttl;
-                    return;
-                }
-            }
-        }
+    cs = lookup_policy_index(ctx, P_CLOCK_SKEW, name_n, NULL);
+    if (cs) {
+        val_log(ctx, LOG_DEBUG, "get_clock_skew(): Found clock skew policy"); 
+        *skew = cs->value;
+        if (cs->exp_ttl > 0)
+            *ttl_x = cs->exp_ttl;
+        return;
     }
     val_log(ctx, LOG_DEBUG, "get_clock_skew(): No clock skew policy found"); 
     *skew = 0;
 }
 
+/*
+ * Perform the public key operation for the signature
+ */
+static void
+sigverify_crypto(val_context_t * ctx,
+                 const struct val_sigfield *data,
+                 const val_dnskey_rdata_t * dnskey,
+                 const u_char *key_owner_n,
+                 u_int32_t key_ttl_x,
+                 const val_rrsig_rdata_t * rrsig,
+                 val_astatus_t * dnskey_status, val_astatus_t * sig_status)
+{
+    u_char          digest[SHA256_DIGEST_LENGTH];
+    int             memo;
+
+    /*
+     * Skip the public key operation if we have seen this exact
+     * data, signature and key before 
+     */
+    memo = (sig_memo_digest(data, dnskey, rrsig, digest) == 0);
+    if (memo && sig_memo_lookup(digest, dnskey, sig_status)) {
+        val_log(ctx, LOG_DEBUG,
+                "sigverify_crypto(): Using previous verification result for DNSKEY with tag=%d",
+                dnskey->key_tag);
+        return;
+    }
+
+    switch (rrsig->algorithm) {
+
+    case ALG_RSAMD5:
+        rsamd5_sigverify(ctx, data, dnskey, rrsig, 
+                         dnskey_status, sig_status);
+        break;
+
+#ifdef LIBVAL_NSEC3
+    case ALG_NSEC3_DSASHA1:
+#endif
+    case ALG_DSASHA1:
+        dsasha1_sigverify(ctx, data, dnskey, rrsig,
+                          dnskey_status, sig_status);
+        break;
+
+#ifdef LIBVAL_NSEC3
+    case ALG_NSEC3_RSASHA1:
+#endif
+    case ALG_RSASHA1:
+#ifdef HAVE_SHA_2
+    case ALG_RSASHA256:
+    case ALG_RSASHA512:
+#endif
+        rsasha_sigverify(ctx, data, dnskey, 
+                         key_owner_n, key_ttl_x, rrsig,
+                         dnskey_status, sig_status);
+        break;
+
+#if defined(HAVE_ECDSA) && defined(HAVE_OPENSSL_ECDSA_H)
+    case ALG_ECDSAP256SHA256:
+    case ALG_ECDSAP384SHA384:
+        ecdsa_sigverify(ctx, data, dnskey, 
+                        key_owner_n, key_ttl_x, rrsig,
+                        dnskey_status, sig_status);
+        break;
+#endif
+
+    default:
+        val_log(ctx, LOG_INFO, "sigverify_crypto(): Unsupported algorithm %d.",
+                rrsig->algorithm);
+        *sig_status = VAL_AC_ALGORITHM_NOT_SUPPORTED;
+        *dnskey_status = VAL_AC_ALGORITHM_NOT_SUPPORTED;
+        break;
+    }
+
+    if (memo && (*sig_status == VAL_AC_RRSIG_VERIFIED ||
+                 *sig_status == VAL_AC_RRSIG_VERIFY_FAILED))
+        sig_memo_store(digest, dnskey, rrsig, *sig_status);
+}
+
 /*
  * Verify a signature, given the data and the dnskey 
  */
 static int 
 val_sigverify(val_context_t * ctx,
               int is_a_wildcard,
-              const u_char *data,
-              size_t data_len,
+              const struct val_sigfield *data,
               const val_dnskey_rdata_t * dnskey,
+              const u_char *key_owner_n,
+              u_int32_t key_ttl_x,
               const val_rrsig_rdata_t * rrsig,
               val_astatus_t * dnskey_status, val_astatus_t * sig_status,
               int clock_skew)
@@ -188,48 +232,8 @@ val_sigverify(val_context_t * ctx,
                 "val_sigverify(): Not checking inception and expiration times on signatures.");
     }
 
-    switch (rrsig->algorithm) {
-
-    case ALG_RSAMD5:
-        rsamd5_sigverify(ctx, data, data_len, dnskey, rrsig, 
-                         dnskey_status, sig_status);
-        break;
-
-#ifdef LIBVAL_NSEC3
-    case ALG_NSEC3_DSASHA1:
-#endif
-    case ALG_DSASHA1:
-        dsasha1_sigverify(ctx, data, data_len, dnskey, rrsig,
-                          dnskey_status, sig_status);
-        break;
-
-#ifdef LIBVAL_NSEC3
-    case ALG_NSEC3_RSASHA1:
-#endif
-    case ALG_RSASHA1:
-#ifdef HAVE_SHA_2
-    case ALG_RSASHA256:
-    case ALG_RSASHA512:
-#endif
-        rsasha_sigverify(ctx, data, data_len, dnskey, rrsig,
-                          dnskey_status, sig_status);
-        break;
-
-#if defined(HAVE_ECDSA) && defined(HAVE_OPENSSL_ECDSA_H)
-    case ALG_ECDSAP256SHA256:
-    case ALG_ECDSAP384SHA384:
-        ecdsa_sigverify(ctx, data, data_len, dnskey, rrsig,
-                        dnskey_status, sig_status);
-        break;
-#endif
-
-    default:
-        val_log(ctx, LOG_INFO, "val_sigverify(): Unsupported algorithm %d.",
-                rrsig->algorithm);
-        *sig_status = VAL_AC_ALGORITHM_NOT_SUPPORTED;
-        *dnskey_status = VAL_AC_ALGORITHM_NOT_SUPPORTED;
-        break;
-    }
+    sigverify_crypto(ctx, data, dnskey, key_owner_n, key_ttl_x,
+                     rrsig, dnskey_status, sig_status);
 
     if (*sig_status == VAL_AC_RRSIG_VERIFIED) {
         if (is_a_wildcard) {
@@ -249,73 +253,39 @@ val_sigverify(val_context_t * ctx,
 }
 
 /*
- * Calculate the size of the field over which the verification
- * is done.  This is the sum of
- * the number of bytes through the signer name in the SIG RDATA
- * the length of the signer name (uncompressed)
- * the sum of the fully uncompressed lengths of the RRs in the set
- * *field_length is the field length
- * *signer_length is the length of the signer's name (used externally)
+ * Describe the data over which the signature is to be verified.
+ * Only the RRSIG RDATA through the signer name and the part of the
+ * envelope that all RRs share are copied (into field itself); the
+ * RDATA of each RR is hashed from where it already is.
  */
 static int
-predict_sigbuflength(struct rrset_rec *rr_set,
-                     size_t * field_length, size_t *signer_length)
-{
-    struct rrset_rr  *rr;
-    int             owner_length;
-
-    /** Input has already been NULL-checked **/
-    owner_length = wire_name_length(rr_set->rrs_name_n);
-
-    *signer_length =
-        wire_name_length(&rr_set->rrs_sig->rr_rdata[SIGNBY]);
-
-    if (*signer_length == 0)
-        return VAL_BAD_ARGUMENT;
-
-    *field_length = SIGNBY + (*signer_length);
-
-    for (rr = rr_set->rrs_data; rr; rr = rr->rr_next)
-        *field_length += owner_length + ENVELOPE + rr->rr_rdata_length;
-
-    return VAL_NO_ERROR;
-}
-
-/*
- * Create the buffer over which the signature is to be verified
- */
-static int
-make_sigfield(u_char ** field,
-              size_t * field_length,
+make_sigfield(struct val_sigfield *field,
               struct rrset_rec *rr_set,
               struct rrset_rr *rr_sig, int is_a_wildcard)
 {
     struct rrset_rr  *curr_rr;
-    size_t          index;
     size_t          signer_length;
     size_t          owner_length;
     u_int16_t       type_n;
     u_int16_t       class_n;
     u_int32_t       ttl_n;
-    u_int16_t       rdata_length_n;
-    u_char          lowered_owner_n[NS_MAXCDNAME];
+    u_char         *owner_n;
     size_t          l_index;
-    int             retval;
 
-    if ((field == NULL) || (field_length == NULL) || (rr_set == NULL) ||
+    if ((field == NULL) || (rr_set == NULL) ||
         (rr_sig == NULL) || (rr_set->rrs_name_n == NULL) ||
         (rr_set->rrs_sig == NULL) || 
-        (rr_set->rrs_sig->rr_rdata == NULL))
+        (rr_set->rrs_sig->rr_rdata == NULL) ||
+        (rr_sig->rr_rdata == NULL) ||
+        (rr_sig->rr_rdata_length <= SIGNBY))
         return VAL_BAD_ARGUMENT;
 
-    if ((retval = predict_sigbuflength(rr_set, field_length, &signer_length)) !=
-        VAL_NO_ERROR)
-        return retval;
-
-    *field = (u_char *) MALLOC(*field_length * sizeof(u_char));
-
-    if (*field == NULL)
-        return VAL_OUT_OF_MEMORY;
+    signer_length = wire_name_length(&rr_sig->rr_rdata[SIGNBY]);
+    owner_length = wire_name_length(rr_set->rrs_name_n);
+    if ((signer_length == 0) || (owner_length == 0) ||
+        (SIGNBY + signer_length > rr_sig->rr_rdata_length) ||
+        (owner_length > NS_MAXCDNAME))
+        return VAL_BAD_ARGUMENT;
 
     /*
      * Make sure we are using the correct TTL 
@@ -325,110 +295,61 @@ make_sigfield(u_char ** field,
     rr_set->rrs_ttl_h = ntohl(ttl_n);
 
     /*
-     * While we're at it, we'll gather other common info, specifically
-     * network ordered numbers (type, class) and name length.
+     * The SIG RDATA (up to the signature) 
      */
 
-    owner_length = wire_name_length(rr_set->rrs_name_n);
-
-    if (owner_length == 0)
-        goto err;
-
-    memcpy(lowered_owner_n, rr_set->rrs_name_n, owner_length);
+    memcpy(field->sf_prefix, rr_sig->rr_rdata, SIGNBY + signer_length);
     l_index = 0;
-    lower_name(lowered_owner_n, &l_index);
-
-    type_n = htons(rr_set->rrs_type_h);
-    class_n = htons(rr_set->rrs_class_h);
+    lower_name(&field->sf_prefix[SIGNBY], &l_index);
+    field->sf_prefix_len = SIGNBY + signer_length;
 
     /*
-     * Copy in the SIG RDATA (up to the signature 
+     * The envelope shared by every record: the lower cased owner 
+     * (or the wildcard it was expanded from), type, class and TTL
      */
 
-    index = 0;
-    if ((index + SIGNBY + signer_length) > *field_length)
-        goto err;
-    memcpy(&(*field)[index], rr_sig->rr_rdata, SIGNBY + signer_length);
+    owner_n = field->sf_envelope;
+    memcpy(owner_n, rr_set->rrs_name_n, owner_length);
     l_index = 0;
-    lower_name(&(*field)[index+SIGNBY], &l_index);
-    index += SIGNBY + signer_length;
+    lower_name(owner_n, &l_index);
+
+    if (is_a_wildcard) {
+        /*
+         * Construct the original name 
+         */
+        u_char *np = owner_n;
+        int    i;
+
+        for (i = 0; i < is_a_wildcard; i++)
+            np += np[0] + 1;
+        owner_length = wire_name_length(np);
+        if ((owner_length + 2) > NS_MAXCDNAME)
+            return VAL_BAD_ARGUMENT;
+        memmove(&owner_n[2], np, owner_length);
+        owner_n[0] = (u_char) 1;
+        owner_n[1] = '*';
+        owner_length += 2;
+    }
+
+    type_n = htons(rr_set->rrs_type_h);
+    class_n = htons(rr_set->rrs_class_h);
+    memcpy(&owner_n[owner_length], &type_n, sizeof(u_int16_t));
+    memcpy(&owner_n[owner_length + 2], &class_n, sizeof(u_int16_t));
+    memcpy(&owner_n[owner_length + 4], &ttl_n, sizeof(u_int32_t));
+    field->sf_envelope_len = owner_length + 8;
 
     /*
-     * For each record of data, copy in the envelope & the lower cased rdata 
+     * The records themselves, with their RDATA length
      */
 
     for (curr_rr = rr_set->rrs_data; curr_rr;
          curr_rr = curr_rr->rr_next) {
         if (curr_rr->rr_rdata == NULL)
-            goto err;
-
-        /*
-         * Copy in the envelope information 
-         */
-
-        if (is_a_wildcard) {
-            /*
-             * Construct the original name 
-             */
-            u_char wcard_n[NS_MAXCDNAME];
-            u_char *np = lowered_owner_n;
-            int    i;
-            size_t outer_len;
-
-            for (i = 0; i < is_a_wildcard; i++)
-                np += np[0] + 1;
-            outer_len = wire_name_length(np);
-
-            wcard_n[0] = (u_char) 1;
-            wcard_n[1] = '*';
-            if ((outer_len + 2) > sizeof(wcard_n))
-                goto err;
-            memcpy(&wcard_n[2], np, outer_len);
-            if ((index + outer_len + 2) > *field_length)
-                goto err;
-            memcpy(&(*field)[index], wcard_n, outer_len + 2);
-            index += outer_len + 2;
-        } else {
-            if ((index + owner_length) > *field_length)
-                goto err;
-            memcpy(&(*field)[index], lowered_owner_n, owner_length);
-            index += owner_length;
-        }
-
-        if ((index + sizeof(u_int16_t) + sizeof(u_int16_t) +
-             sizeof(u_int32_t))
-            > *field_length)
-            goto err;
-        memcpy(&(*field)[index], &type_n, sizeof(u_int16_t));
-        index += sizeof(u_int16_t);
-        memcpy(&(*field)[index], &class_n, sizeof(u_int16_t));
-        index += sizeof(u_int16_t);
-        memcpy(&(*field)[index], &ttl_n, sizeof(u_int32_t));
-        index += sizeof(u_int32_t);
-
-        /*
-         * Now the RR-specific info, the length and the data 
-         */
-
-        rdata_length_n = htons(curr_rr->rr_rdata_length);
-        if ((index + sizeof(u_int16_t) + curr_rr->rr_rdata_length)
-            > *field_length)
-            goto err;
-        memcpy(&(*field)[index], &rdata_length_n, sizeof(u_int16_t));
-        index += sizeof(u_int16_t);
-        memcpy(&(*field)[index], curr_rr->rr_rdata,
-               curr_rr->rr_rdata_length);
-        index += curr_rr->rr_rdata_length;
+            return VAL_BAD_ARGUMENT;
     }
+    field->sf_rrs = rr_set->rrs_data;
 
-    *field_length = index;
     return VAL_NO_ERROR;
-
-  err:
-    FREE(*field);
-    *field = NULL;
-    *field_length = 0;
-    return VAL_BAD_ARGUMENT;
 }
 
 /*
@@ -464,15 +385,16 @@ do_verify(val_context_t * ctx,
           val_astatus_t * sig_status,
           struct rrset_rec *the_set,
           struct rrset_rr *the_sig,
-          val_dnskey_rdata_t * the_key, int is_a_wildcard,
+          val_dnskey_rdata_t * the_key, 
+          struct rrset_rec *the_keyset,
+          int is_a_wildcard,
           u_int32_t flags)
 {
     /*
      * Use the crypto routines to verify the signature
      */
 
-    u_char       *ver_field = NULL;
-    size_t          ver_length;
+    struct val_sigfield ver_field;
     int             ret_val;
     val_rrsig_rdata_t rrsig_rdata;
     int clock_skew = 0;
@@ -489,16 +411,12 @@ do_verify(val_context_t * ctx,
         return 0;
     }
 
-    if ((ret_val = make_sigfield(&ver_field, &ver_length, the_set, the_sig,
-                                 is_a_wildcard)) != VAL_NO_ERROR ||
-        ver_field == NULL || 
-        ver_length == 0) {
+    if ((ret_val = make_sigfield(&ver_field, the_set, the_sig,
+                                 is_a_wildcard)) != VAL_NO_ERROR) {
 
         val_log(ctx, LOG_INFO, 
                 "do_verify(): Could not construct signature field for verification: %s", 
                 p_val_err(ret_val));
-        if (ver_field)
-            FREE(ver_field);
         *sig_status = VAL_AC_INVALID_RRSIG;
         return 0;
     }
@@ -510,8 +428,6 @@ do_verify(val_context_t * ctx,
     if (VAL_NO_ERROR != val_parse_rrsig_rdata(the_sig->rr_rdata, 
                                    the_sig->rr_rdata_length,
                                    &rrsig_rdata)) {
-        if (ver_field)
-            FREE(ver_field);
         val_log(ctx, LOG_INFO, 
                 "do_verify(): Could not parse signature field");
         *sig_status = VAL_AC_INVALID_RRSIG;
@@ -532,7 +448,8 @@ do_verify(val_context_t * ctx,
     /*
      * Perform the verification 
      */
-    ret_val = val_sigverify(ctx, is_a_wildcard, ver_field, ver_length, the_key,
+    ret_val = val_sigverify(ctx, is_a_wildcard, &ver_field, the_key,
+                  the_keyset->rrs_name_n, the_keyset->rrs_ttl_x,
                   &rrsig_rdata, dnskey_status, sig_status, clock_skew);
 
     if (rrsig_rdata.signature != NULL) {
@@ -540,7 +457,6 @@ do_verify(val_context_t * ctx,
         rrsig_rdata.signature = NULL;
     }
 
-    FREE(ver_field);
     return ret_val;
 }
 
@@ -609,6 +525,281 @@ check_label_count(struct rrset_rec *the_set,
     return 1;
 }
 
+#ifndef VAL_NO_THREADS
+/*
+ * Verification worker pool.
+ * When the verify-threads option is set, the public key operations for
+ * all (RRSIG, DNSKEY) pairs of an RRset are spread across a pool of
+ * worker threads before the RRset is examined. The outcome of each 
+ * operation lands in the verification memo, from where the normal
+ * sequential pass in verify_next_assertion() picks it up, so the logic
+ * that derives the assertion status is the same in both cases.
+ * The pool is shared by all contexts and grows to the largest number
+ * of workers any context asks for.
+ */
+#define VERIFY_POOL_MAX 32
+
+struct verify_sig {
+    struct val_sigfield vs_field;
+    val_rrsig_rdata_t  vs_rrsig;
+};
+
+struct verify_job {
+    val_context_t      *vj_ctx;
+    struct verify_sig  *vj_sig;
+    val_dnskey_rdata_t  vj_dnskey;
+    const u_char       *vj_key_owner_n;
+    u_int32_t           vj_key_ttl_x;
+    int                *vj_pending;
+    struct verify_job  *vj_next;
+};
+
+static pthread_mutex_t verify_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t verify_pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t verify_pool_done = PTHREAD_COND_INITIALIZER;
+static struct verify_job *verify_queue_head = NULL;
+static struct verify_job *verify_queue_tail = NULL;
+static pthread_t verify_workers[VERIFY_POOL_MAX];
+static int      verify_nworkers = 0;
+static int      verify_pool_shutdown = 0;
+
+/*
+ * Take the next job off the queue; the pool lock must be held
+ */
+static struct verify_job *
+verify_queue_pop(void)
+{
+    struct verify_job *job = verify_queue_head;
+
+    if (job != NULL) {
+        verify_queue_head = job->vj_next;
+        if (verify_queue_head == NULL)
+            verify_queue_tail = NULL;
+        job->vj_next = NULL;
+    }
+    return job;
+}
+
+/*
+ * Run a job without holding the pool lock and account for its
+ * completion
+ */
+static void
+verify_job_run(struct verify_job *job)
+{
+    val_astatus_t   dnskey_status = VAL_AC_UNSET;
+    val_astatus_t   sig_status = VAL_AC_UNSET;
+
+    pthread_mutex_unlock(&verify_pool_lock);
+    sigverify_crypto(job->vj_ctx, &job->vj_sig->vs_field, &job->vj_dnskey,
+                     job->vj_key_owner_n, job->vj_key_ttl_x,
+                     &job->vj_sig->vs_rrsig, &dnskey_status, &sig_status);
+    pthread_mutex_lock(&verify_pool_lock);
+
+    if (--(*job->vj_pending) == 0)
+        pthread_cond_broadcast(&verify_pool_done);
+}
+
+static void *
+verify_worker(void *arg)
+{
+    struct verify_job *job;
+
+    pthread_mutex_lock(&verify_pool_lock);
+    for (;;) {
+        while (verify_queue_head == NULL && !verify_pool_shutdown)
+            pthread_cond_wait(&verify_pool_work, &verify_pool_lock);
+        if ((job = verify_queue_pop()) == NULL)
+            break;
+        verify_job_run(job);
+    }
+    pthread_mutex_unlock(&verify_pool_lock);
+    return NULL;
+}
+
+/*
+ * Hand the jobs to the pool and wait for all of them to complete.
+ * The calling thread works through the queue as well.
+ */
+static void
+verify_jobs_run(struct verify_job *jobs, int njobs, int nthreads)
+{
+    struct verify_job *job;
+    int             pending = njobs;
+    int             i;
+
+    if (nthreads > VERIFY_POOL_MAX)
+        nthreads = VERIFY_POOL_MAX;
+
+    pthread_mutex_lock(&verify_pool_lock);
+
+    while (verify_nworkers < nthreads) {
+        if (0 != pthread_create(&verify_workers[verify_nworkers], NULL,
+                                verify_worker, NULL))
+            break;
+        verify_nworkers++;
+    }
+
+    for (i = 0; i < njobs; i++) {
+        jobs[i].vj_pending = &pending;
+        jobs[i].vj_next = NULL;
+        if (verify_queue_tail)
+            verify_queue_tail->vj_next = &jobs[i];
+        else
+            verify_queue_head = &jobs[i];
+        verify_queue_tail = &jobs[i];
+    }
+    pthread_cond_broadcast(&verify_pool_work);
+
+    while (pending > 0) {
+        if ((job = verify_queue_pop()) != NULL)
+            verify_job_run(job);
+        else
+            pthread_cond_wait(&verify_pool_done, &verify_pool_lock);
+    }
+
+    pthread_mutex_unlock(&verify_pool_lock);
+}
+
+/*
+ * Stop and reap all verification workers
+ */
+void
+free_verify_pool(void)
+{
+    int             i;
+
+    pthread_mutex_lock(&verify_pool_lock);
+    verify_pool_shutdown = 1;
+    pthread_cond_broadcast(&verify_pool_work);
+    pthread_mutex_unlock(&verify_pool_lock);
+
+    for (i = 0; i < verify_nworkers; i++)
+        pthread_join(verify_workers[i], NULL);
+
+    pthread_mutex_lock(&verify_pool_lock);
+    verify_nworkers = 0;
+    verify_pool_shutdown = 0;
+    pthread_mutex_unlock(&verify_pool_lock);
+}
+
+/*
+ * Check all signatures of the_set against all candidate keys in 
+ * keyset in parallel. Nothing is recorded in the RRset itself; 
+ * the results are left in the verification memo.
+ */
+static void
+verify_in_parallel(val_context_t * ctx,
+                   struct rrset_rec *the_set,
+                   struct rrset_rec *keyset,
+                   int nthreads)
+{
+    struct verify_sig *sigs = NULL;
+    struct verify_job *jobs = NULL;
+    struct rrset_rr  *the_sig;
+    struct rrset_rr  *keyrr;
+    u_char           *signby_name_n;
+    u_int16_t         signby_footprint_n;
+    u_int16_t         tag_h;
+    int               is_a_wildcard;
+    int               nsigs = 0, nkeys = 0, njobs = 0;
+    int               i;
+
+    for (the_sig = the_set->rrs_sig; the_sig; the_sig = the_sig->rr_next)
+        nsigs++;
+    for (keyrr = keyset->rrs_data; keyrr; keyrr = keyrr->rr_next)
+        nkeys++;
+    if (nsigs * nkeys < 2)
+        return;
+
+    sigs = (struct verify_sig *) MALLOC(nsigs * sizeof(struct verify_sig));
+    jobs = (struct verify_job *) 
+        MALLOC(nsigs * nkeys * sizeof(struct verify_job));
+    if (sigs == NULL || jobs == NULL)
+        goto done;
+    memset(sigs, 0, nsigs * sizeof(struct verify_sig));
+
+    for (i = 0, the_sig = the_set->rrs_sig; the_sig; 
+            i++, the_sig = the_sig->rr_next) {
+
+        if (!check_label_count(the_set, the_sig, &is_a_wildcard) ||
+            (is_a_wildcard &&
+             (the_set->rrs_type_h == ns_t_ds ||
+              the_set->rrs_type_h == ns_t_dnskey)))
+            continue;
+        if (VAL_NO_ERROR != identify_key_from_sig(the_sig, &signby_name_n,
+                                                  &signby_footprint_n))
+            continue;
+        tag_h = ntohs(signby_footprint_n);
+
+        if (VAL_NO_ERROR != make_sigfield(&sigs[i].vs_field, 
+                                          the_set, the_sig, is_a_wildcard))
+            continue;
+        if (VAL_NO_ERROR != val_parse_rrsig_rdata(the_sig->rr_rdata,
+                                                  the_sig->rr_rdata_length,
+                                                  &sigs[i].vs_rrsig))
+            continue;
+        sigs[i].vs_rrsig.next = NULL;
+
+        for (keyrr = keyset->rrs_data; keyrr; keyrr = keyrr->rr_next) {
+            struct verify_job *job = &jobs[njobs];
+
+            memset(job, 0, sizeof(struct verify_job));
+            if (VAL_NO_ERROR != val_parse_dnskey_rdata(keyrr->rr_rdata,
+                                                       keyrr->rr_rdata_length,
+                                                       &job->vj_dnskey)) {
+                if (job->vj_dnskey.public_key != NULL)
+                    FREE(job->vj_dnskey.public_key);
+                continue;
+            }
+            job->vj_dnskey.next = NULL;
+            /* only pairs that val_sigverify() would hand to the crypto */
+            if (job->vj_dnskey.key_tag != tag_h ||
+                (job->vj_dnskey.flags & ZONE_KEY_FLAG) == 0 ||
+                job->vj_dnskey.protocol != 3 ||
+                job->vj_dnskey.algorithm != sigs[i].vs_rrsig.algorithm) {
+                if (job->vj_dnskey.public_key != NULL)
+                    FREE(job->vj_dnskey.public_key);
+                continue;
+            }
+            job->vj_ctx = ctx;
+            job->vj_sig = &sigs[i];
+            job->vj_key_owner_n = keyset->rrs_name_n;
+            job->vj_key_ttl_x = keyset->rrs_ttl_x;
+            njobs++;
+        }
+    }
+
+    if (njobs > 1) {
+        val_log(ctx, LOG_DEBUG, 
+                "verify_in_parallel(): Checking %d signature/key pairs in parallel",
+                njobs);
+        verify_jobs_run(jobs, njobs, nthreads);
+    }
+
+  done:
+    if (jobs) {
+        for (i = 0; i < njobs; i++) {
+            if (jobs[i].vj_dnskey.public_key != NULL)
+                FREE(jobs[i].vj_dnskey.public_key);
+        }
+        FREE(jobs);
+    }
+    if (sigs) {
+        for (i = 0; i < nsigs; i++) {
+            if (sigs[i].vs_rrsig.signature != NULL)
+                FREE(sigs[i].vs_rrsig.signature);
+        }
+        FREE(sigs);
+    }
+}
+#else
+void
+free_verify_pool(void)
+{
+}
+#endif /* VAL_NO_THREADS */
+
 /*
  * State returned in as->val_ac_status is one of:
  * VAL_AC_VERIFIED : at least one sig passed
@@ -659,6 +850,7 @@ verify_next_assertion(val_context_t * ctx,
     val_dnskey_rdata_t dnskey;
     int             is_a_wildcard;
     struct rrset_rr  *nextrr;
+    struct rrset_rec *keyset;
     struct rrset_rr  *keyrr;
     u_int16_t       tag_h;
     char            name_p[NS_MAXDNAME];
@@ -673,8 +865,7 @@ verify_next_assertion(val_context_t * ctx,
     dnskey.public_key = NULL;
 
 
-    if (-1 == ns_name_ntop(the_set->rrs_name_n, name_p, sizeof(name_p)))
-        snprintf(name_p, sizeof(name_p), "unknown/error");
+    VAL_LOG_NTOP(LOG_INFO, the_set->rrs_name_n, name_p, sizeof(name_p));
 
     if (the_set->rrs_sig == NULL) {
         val_log(ctx, LOG_INFO, "verify_next_assertion(): RRSIG is missing");
@@ -691,7 +882,7 @@ verify_next_assertion(val_context_t * ctx,
             as->val_ac_status = VAL_AC_DNSKEY_MISSING;
             return;
         }
-        keyrr = the_trust->val_ac_rrset.ac_data->rrs_data;
+        keyset = the_trust->val_ac_rrset.ac_data;
     } else {
         /*
          * data itself contains the key 
@@ -701,8 +892,14 @@ verify_next_assertion(val_context_t * ctx,
             as->val_ac_status = VAL_AC_DNSKEY_MISSING;
             return;
         }
-        keyrr = the_set->rrs_data;
+        keyset = the_set;
     }
+    keyrr = keyset->rrs_data;
+
+#ifndef VAL_NO_THREADS
+    if (ctx->g_opt && ctx->g_opt->verify_threads > 0)
+        verify_in_parallel(ctx, the_set, keyset, ctx->g_opt->verify_threads);
+#endif
 
     for (the_sig = the_set->rrs_sig;
          the_sig; the_sig = the_sig->rr_next) {
@@ -756,7 +953,8 @@ verify_next_assertion(val_context_t * ctx,
             is_verified = do_verify(ctx, signby_name_n,
                       &nextrr->rr_status,
                       &the_sig->rr_status,
-                      the_set, the_sig, &dnskey, is_a_wildcard, flags);
+                      the_set, the_sig, &dnskey, keyset,
+                      is_a_wildcard, flags);
 
             /*
              * There might be multiple keys with the same key tag; set this as
@@ -56,4 +56,9 @@ void            verify_next_assertion(val_context_t * ctx,
                                       struct val_digested_auth_chain *the_trust,
                                       u_int flags);
 
+/*
+ * Stop the signature verification workers
+ */
+void            free_verify_pool(void);
+
 #endif
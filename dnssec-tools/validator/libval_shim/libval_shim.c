@@ -10,23 +10,77 @@
 
 typedef struct libval_context ValContext;
 
+#ifndef VAL_NO_THREADS
+#include <pthread.h>
+
+/*
+ * Threads are handed contexts from a small pool rather than all
+ * sharing one, so that they do not queue up behind the locks of a
+ * single context. The contexts still share the validator cache.
+ */
+#define LIBVAL_SHIM_POOL_SIZE 8
+
+static ValContext *libval_shim_pool[LIBVAL_SHIM_POOL_SIZE];
+static unsigned int libval_shim_next = 0;
+static pthread_mutex_t libval_shim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t libval_shim_once = PTHREAD_ONCE_INIT;
+static pthread_key_t libval_shim_key;
+static int libval_shim_have_key = 0;
+
+static void
+libval_shim_key_init(void)
+{
+  if (pthread_key_create(&libval_shim_key, NULL) == 0)
+    libval_shim_have_key = 1;
+}
+
+static ValContext *
+libval_shim_context(void)
+{
+  ValContext *ctx;
+  val_context_opt_t opt;
+  unsigned int slot;
+
+  pthread_once(&libval_shim_once, libval_shim_key_init);
+  if (libval_shim_have_key &&
+      (ctx = pthread_getspecific(libval_shim_key)) != NULL)
+    return ctx;
+
+  pthread_mutex_lock(&libval_shim_lock);
+  slot = libval_shim_next++ % LIBVAL_SHIM_POOL_SIZE;
+  if (libval_shim_pool[slot] == NULL) {
+      memset(&opt, 0, sizeof(opt));
+      opt.vc_polflags = CTX_DYN_POL_PRIVATE;
+      if (val_create_context_ex(NULL, &opt, &libval_shim_pool[slot]) !=
+          VAL_NO_ERROR)
+        libval_shim_pool[slot] = NULL;
+  }
+  ctx = libval_shim_pool[slot];
+  pthread_mutex_unlock(&libval_shim_lock);
+
+  if (ctx != NULL && libval_shim_have_key)
+    pthread_setspecific(libval_shim_key, ctx);
+  return ctx;
+}
+#else
 static ValContext *libval_shim_ctx = NULL;
 
-static int
+static ValContext *
 libval_shim_context(void)
 {
   if (libval_shim_ctx == NULL) {
       if (val_create_context(NULL, &libval_shim_ctx) != VAL_NO_ERROR)
-	return -1;
+	return NULL;
   }
-  return 0;
+  return libval_shim_ctx;
 }
+#endif
 
 static int 
 libval_shim_init(void)
 {
 
-  return (libval_shim_context());
+  return (libval_shim_context() == NULL ? -1 : 0);
 }
 
 
@@ -35,13 +89,14 @@ gethostbyname(const char *name)
 {
   val_status_t          val_status;
   struct hostent *      res;
+  ValContext *          ctx;
 
-  if (libval_shim_init())
+  if ((ctx = libval_shim_context()) == NULL)
     return NULL;
 
   val_log(NULL, LOG_DEBUG, "libval_shim: gethostbyname(%s) called: wrapper\n", name);
   
-  res = val_gethostbyname(libval_shim_ctx, name, &val_status);
+  res = val_gethostbyname(ctx, name, &val_status);
 
   if (val_istrusted(val_status) && !val_does_not_exist(val_status)) {
       return res;
@@ -59,14 +114,15 @@ gethostbyname_r(const char * name,struct hostent * result_buf, char * buf,
   val_status_t          val_status;
   int                   ret;
   struct hostent *result = NULL;
+  ValContext *          ctx;
   
-  if (libval_shim_init())
+  if ((ctx = libval_shim_context()) == NULL)
       return NULL;
 
   val_log(NULL, LOG_DEBUG, "libval_shim: gethostbyname_r(%s) called: wrapper\n", name);
 
   ret = 
-    val_gethostbyname_r(libval_shim_ctx, name, result_buf, buf, buflen, 
+    val_gethostbyname_r(ctx, name, result_buf, buf, buflen, 
 			&result, h_errnop,
 			&val_status);
 
@@ -84,14 +140,15 @@ gethostbyname_r(__const char * name,struct hostent * result_buf, char * buf,
 {
   val_status_t          val_status;
   int                   ret;
+  ValContext *          ctx;
 
-  if (libval_shim_init())
+  if ((ctx = libval_shim_context()) == NULL)
     return NO_RECOVERY;
 
   val_log(NULL, LOG_DEBUG, "libval_shim: gethostbyname_r(%s) called: wrapper\n", name);
 
   ret = 
-    val_gethostbyname_r(libval_shim_ctx, name, result_buf, buf, buflen, 
+    val_gethostbyname_r(ctx, name, result_buf, buf, buflen, 
 			result, h_errnop,
 			&val_status);
 
@@ -158,14 +215,15 @@ getaddrinfo(const char *node, const char *service, const struct addrinfo *hints,
 {
   val_status_t          val_status;
   int                   ret;
+  ValContext *          ctx;
 
-  if (libval_shim_init())
+  if ((ctx = libval_shim_context()) == NULL)
     return EAI_FAIL;
 
   val_log(NULL, LOG_DEBUG, "libval_shim: getaddrinfo(%s, %s) called: wrapper\n",
 	  node, service);
 
-  ret = val_getaddrinfo(libval_shim_ctx, node, service, hints, res, &val_status);
+  ret = val_getaddrinfo(ctx, node, service, hints, res, &val_status);
 
   if (val_istrusted(val_status) && !val_does_not_exist(val_status)) {
       return ret;
@@ -199,8 +257,9 @@ getnameinfo(const struct sockaddr * sa, socklen_t salen, char * host,
   char addrbuf[INET6_ADDRSTRLEN + 1];
   const char *addr;
   int ret;
+  ValContext *ctx;
 
-  if (libval_shim_init())
+  if ((ctx = libval_shim_context()) == NULL)
     return EAI_FAIL;
 
   if (sa->sa_family == AF_INET) {
@@ -215,7 +274,7 @@ getnameinfo(const struct sockaddr * sa, socklen_t salen, char * host,
   val_log(NULL, LOG_DEBUG, "libval_shim: getnameinfo(%s) called: wrapper\n", 
           addr);
 
-  ret = val_getnameinfo(libval_shim_ctx, sa, salen, host, hostlen, 
+  ret = val_getnameinfo(ctx, sa, salen, host, hostlen, 
 			            serv, servlen, flags,
 			            &val_status);
 
@@ -247,14 +306,15 @@ res_query(const char *dname, int class_h, int type_h,
 {
   val_status_t          val_status;
   int ret;
+  ValContext *          ctx;
 
-  if (libval_shim_init())
+  if ((ctx = libval_shim_context()) == NULL)
     return -1;
 
   val_log(NULL, LOG_DEBUG, "libval_shim: res_query(%s,%d,%d) called: wrapper\n",
 	  dname, class_h, type_h);
 
-  ret = val_res_query(libval_shim_ctx, dname, class_h, type_h, answer, anslen,
+  ret = val_res_query(ctx, dname, class_h, type_h, answer, anslen,
 			&val_status);
 
   if (val_istrusted(val_status) && !val_does_not_exist(val_status)) {
@@ -269,9 +329,40 @@ int
 res_querydomain(const char *name, const char *domain, int class_h, int type_h, 
 		u_char * answer, int anslen)
 {
-  val_log(NULL, LOG_DEBUG, "libval_shim: res_querydomain called: not-available\n");
+  val_status_t          val_status;
+  char                  fullname[NS_MAXDNAME];
+  int ret;
+  ValContext *          ctx;
+
+  if ((ctx = libval_shim_context()) == NULL)
+    return -1;
+
+  val_status = VAL_DONT_KNOW;
+
+  val_log(NULL, LOG_DEBUG, "libval_shim: res_querydomain(%s,%s,%d,%d) called: wrapper\n",
+	  name, domain ? domain : "", class_h, type_h);
+
+  if (name == NULL)
+    return -1;
+
+  if (domain == NULL) {
+    /* name is already fully qualified */
+    if (strlen(name) >= sizeof(fullname))
+      return -1;
+    strcpy(fullname, name);
+  } else if (snprintf(fullname, sizeof(fullname), "%s.%s", name, domain) >=
+             (int) sizeof(fullname)) {
+    return -1;
+  }
+
+  ret = val_res_query(ctx, fullname, class_h, type_h, answer, anslen,
+			&val_status);
+
+  if (val_istrusted(val_status) && !val_does_not_exist(val_status)) {
+    return ret;
+  }
 
-  return -1;
+  return (-1); 
 }
 
 
@@ -279,18 +370,71 @@ int
 res_search(const char *dname, int class_h, int type_h, 
 	   unsigned char *answer, int anslen)
 {
-  val_log(NULL, LOG_DEBUG, "libval_shim: res_search called: not-available\n");
+  val_status_t          val_status;
+  int ret;
+  ValContext *          ctx;
+
+  if ((ctx = libval_shim_context()) == NULL)
+    return -1;
+
+  val_status = VAL_DONT_KNOW;
+
+  val_log(NULL, LOG_DEBUG, "libval_shim: res_search(%s,%d,%d) called: wrapper\n",
+	  dname, class_h, type_h);
+
+  ret = val_res_search(ctx, dname, class_h, type_h, answer, anslen,
+			&val_status);
+
+  if (val_istrusted(val_status) && !val_does_not_exist(val_status)) {
+    return ret;
+  }
 
-  return -1;
+  return (-1); 
 }
 
 
 int
-res_send(const u_char * msg, int msglin, u_char *answer, int anslen)
+res_send(const u_char * msg, int msglen, u_char *answer, int anslen)
 {
-  val_log(NULL, LOG_DEBUG, "libval_shim: res_send called: not-available\n");
+  val_status_t          val_status;
+  ns_msg                handle;
+  ns_rr                 rr;
+  int ret;
+  ValContext *          ctx;
+
+  if ((ctx = libval_shim_context()) == NULL)
+    return -1;
+
+  val_status = VAL_DONT_KNOW;
+
+  /*
+   * Only a plain query for a single question can be answered
+   * by the validator
+   */
+  if (msg == NULL || answer == NULL || anslen < HFIXEDSZ ||
+      ns_initparse(msg, msglen, &handle) < 0 ||
+      ns_msg_getflag(handle, ns_f_opcode) != ns_o_query ||
+      ns_msg_count(handle, ns_s_qd) != 1 ||
+      ns_parserr(&handle, ns_s_qd, 0, &rr) < 0) {
+    val_log(NULL, LOG_DEBUG, "libval_shim: res_send called: unsupported message\n");
+    return -1;
+  }
+
+  val_log(NULL, LOG_DEBUG, "libval_shim: res_send(%s,%d,%d) called: wrapper\n",
+	  ns_rr_name(rr), ns_rr_class(rr), ns_rr_type(rr));
+
+  ret = val_res_query(ctx, ns_rr_name(rr), ns_rr_class(rr), ns_rr_type(rr),
+			answer, anslen, &val_status);
+
+  if (!val_istrusted(val_status) || val_does_not_exist(val_status) ||
+      ret < 0) {
+    return (-1); 
+  }
+
+  /* the caller matches the response to its query by id */
+  ((HEADER *) answer)->id = ((const HEADER *) msg)->id;
 
-  return -1;
+  return ret;
 }
 
 
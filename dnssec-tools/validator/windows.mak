@@ -35,6 +35,7 @@ LIBSRES_OBJS = $(TMP_LIBSRES_D)\base64.obj \
 	$(TMP_LIBSRES_D)\nsap_addr.obj \
 	$(TMP_LIBSRES_D)\res_comp.obj \
 	$(TMP_LIBSRES_D)\res_debug.obj \
+	$(TMP_LIBSRES_D)\res_infra.obj \
 	$(TMP_LIBSRES_D)\res_io_manager.obj \
 	$(TMP_LIBSRES_D)\res_mkquery.obj \
 	$(TMP_LIBSRES_D)\res_query.obj \